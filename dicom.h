@@ -74,12 +74,17 @@
 #endif
 
 #include <string.h>
+#include <math.h>
 
 #include <istream>
+#include <sstream>
+#include <algorithm>
+#include <limits>
 #include <map>
 #include <vector>
 #include <string>
 #include <utility>
+#include <typeinfo>
 #include <exception>
 #include <stdexcept>
 
@@ -87,9 +92,12 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/trim.hpp>
 #include <boost/algorithm/string/classification.hpp>
-#include <boost/algorithm/string/split.hpp>
+#include <boost/type_traits/is_integral.hpp>
 
 #include <opencv2/core/core.hpp>
+#ifndef VVV_DICOM_NO_JPEG
+#include <opencv2/highgui/highgui.hpp>
+#endif
 
 #ifdef DEBUG
 #include <stdio.h>
@@ -152,6 +160,64 @@ namespace VVV
             char raw[2];
         } TypeVR;
 
+        ///
+        /// element header found in a byte sequence
+        ///
+        struct ElementHeader
+        {
+            TypeTag tag;
+            TypeVR vr;           ///< 0 for implicit VR and Item tags
+            uint32_t length;     ///< value length; 0xFFFFFFFF if undefined
+            size_t header_size;  ///< bytes of tag, VR and length
+
+            bool is_undefined() const { return this->length==0xFFFFFFFF; }
+        };
+
+        ///
+        /// read-only std::streambuf over a memory block without copy
+        ///
+        /// The memory block must outlive the buffer.
+        ///
+        class MemoryStreamBuf
+            :public std::streambuf
+        {
+        public:
+            MemoryStreamBuf(const void *data,size_t len)
+            {
+                char *p=const_cast<char *>((const char *)data);
+                this->setg(p,p,p+len);
+            }
+
+        protected:
+            pos_type seekoff(off_type off,
+                             std::ios_base::seekdir dir,
+                             std::ios_base::openmode which=std::ios_base::in)
+            {
+                char *p;
+                if(dir==std::ios_base::beg)
+                    p=this->eback()+off;
+                else if(dir==std::ios_base::cur)
+                    p=this->gptr()+off;
+                else
+                    p=this->egptr()+off;
+
+                if(p<this->eback() || p>this->egptr())
+                    return pos_type(off_type(-1));
+
+                this->setg(this->eback(),p,this->egptr());
+
+                return pos_type(p-this->eback());
+            }
+
+            pos_type seekpos(pos_type pos,
+                             std::ios_base::openmode which=std::ios_base::in)
+            {
+                return this->seekoff(off_type(pos),std::ios_base::beg,which);
+            }
+        };
+
+        class Item;
+
 
         ///
         /// reading each DICOM Element class
@@ -195,6 +261,7 @@ namespace VVV
                 this->_vr=e._vr;
                 this->_value=e._value;
                 this->_is_vector=e._is_vector;
+                this->_items=e._items;
             }
             
             ///
@@ -215,7 +282,7 @@ namespace VVV
             ///
             /// @return Element tag
             ///
-            inline TypeTag tag(){ return this->_tag; }
+            inline TypeTag tag() const { return this->_tag; }
 
             ///
             /// reader accessor: VR
@@ -223,7 +290,7 @@ namespace VVV
             ///
             /// @return Element VR
             ///
-            inline TypeVR vr(){ return this->_vr; }
+            inline TypeVR vr() const { return this->_vr; }
 
             ///
             /// value is a vector or not
@@ -231,7 +298,7 @@ namespace VVV
             ///
             /// @return value is a vector: true || false
             ///
-            inline bool is_vector(){ return this->_is_vector; }
+            inline bool is_vector() const { return this->_is_vector; }
 
             ///
             /// value is empty or not
@@ -239,7 +306,7 @@ namespace VVV
             ///
             /// @return true if value is empty; false
             ///
-            inline bool empty(){ return this->_value.empty(); }
+            inline bool empty() const { return this->_value.empty(); }
 
             ///
             /// type_info of value
@@ -247,7 +314,7 @@ namespace VVV
             ///
             /// @return type_info of value
             ///
-            inline const std::type_info &type(){ return this->_value.type(); }
+            inline const std::type_info &type() const { return this->_value.type(); }
 
 
             ///
@@ -256,7 +323,7 @@ namespace VVV
             ///
             /// @return any type of element value
             ///
-            inline boost::any value(){ return this->_value; }
+            inline boost::any value() const { return this->_value; }
 
             ///
             /// reader accessor: element value
@@ -266,11 +333,107 @@ namespace VVV
             ///
             /// throw boost::bad_any_cast
             ///
-            template <class T> T as()
+            template <class T> T as() const
             {
                 return boost::any_cast<T>(this->_value);
             }
 
+            ///
+            /// reader accessor: numbers of a DS value
+            ///
+            /// @param dst buffer of numbers
+            /// @param n size of dst
+            ///
+            /// @return number of values written to dst, or -1 when the
+            ///         value is not a decimal string
+            ///
+            /// See Dicom::parse_decimals().
+            ///
+            int as_doubles(double *dst,size_t n) const
+            {
+                const std::string *s=
+                    boost::any_cast<std::string>(&this->_value);
+                if(!s)
+                    return -1;
+
+                return parse_decimals(s->data(),s->size(),dst,n);
+            }
+
+            ///
+            /// reader accessor: numbers of an IS value
+            ///
+            /// @param dst buffer of numbers
+            /// @param n size of dst
+            ///
+            /// @return number of values written to dst, or -1 when the
+            ///         value is not an integer string
+            ///
+            /// See Dicom::parse_integers().
+            ///
+            int as_ints(int *dst,size_t n) const
+            {
+                const std::string *s=
+                    boost::any_cast<std::string>(&this->_value);
+                if(!s)
+                    return -1;
+
+                return parse_integers(s->data(),s->size(),dst,n);
+            }
+
+            ///
+            /// number of Items in a sequence (SQ or encapsulated) value
+            ///
+            /// @return number of Items, or 0 when the value is not a
+            ///         sequence or its Items are broken
+            ///
+            /// Items are scanned when the value is parsed, so threads
+            /// may read them at the same time.
+            ///
+            size_t item_count() const
+            {
+                return this->_items.size();
+            }
+
+            ///
+            /// reader accessor: an Item of a sequence value
+            ///
+            /// @param index Item index
+            ///
+            /// @return view of the Item
+            ///
+            /// The Item refers to the value of this element without
+            /// copy; its elements are decoded only when accessed.
+            ///
+            Item item(size_t index) const
+            {
+                if(index>=this->_items.size())
+                    throw std::out_of_range("Bad Item index");
+
+                const std::vector<unsigned char> *v=
+                    boost::any_cast<std::vector<unsigned char> >(
+                        &this->_value);
+
+                return Item(this->_parent,
+                            &(*v)[0]+this->_items[index].first,
+                            this->_items[index].second);
+            }
+
+            ///
+            /// reader accessor: all Items of a sequence value
+            ///
+            /// @return views of the Items
+            ///
+            std::vector<Item> items() const
+            {
+                std::vector<Item> r;
+                size_t n=this->item_count();
+                r.reserve(n);
+                for(size_t i=0;i<n;i++)
+                    r.push_back(this->item(i));
+
+                return r;
+            }
+
             ///
             /// stream parser
             ///
@@ -361,13 +524,46 @@ namespace VVV
             boost::any _value;
             bool _is_vector;
 
+            // offset and length of each Item value in _value;
+            // scanned on first access
+            std::vector<std::pair<size_t,size_t> > _items;
+
+            //
+            // Items of a defined length value; implicit VR has no SQ,
+            // so a value beginning with an Item is scanned
+            //
+            void _scan_items(const std::vector<unsigned char> &v)
+            {
+                this->_items.clear();
+                if(v.size()<8 || this->_tag.number==TAG_FRAME_DATA.number)
+                    return;
+
+                ElementHeader h;
+                if(!parse_header(&v[0],v.size(),
+                                 this->_need_byte_swap(),false,h) ||
+                   h.tag.id[0]!=0xFFFE || h.tag.id[1]!=0xE000)
+                    return;
+
+                try{
+                    scan_sequence(&v[0],
+                                  v.size(),
+                                  this->_need_byte_swap(),
+                                  this->_format_as_explicit(),
+                                  this->_items);
+                }
+                catch(ParseError &){
+                    // broken Items; no Items
+                    this->_items.clear();
+                }
+            }
+
             Element &_set_parent(Dicom *parent)
             {
                 this->_parent=parent;
                 return *this;
             }
 
-            bool _need_byte_swap()
+            bool _need_byte_swap() const
             {
                 if(this->_parent)
                     return this->_parent->_need_byte_swap();
@@ -375,7 +571,7 @@ namespace VVV
                     return false;
             }
 
-            bool _architecture_as_little_endian()
+            bool _architecture_as_little_endian() const
             {
                 if(this->_parent)
                     return this->_parent->_architecture_as_little_endian;
@@ -383,7 +579,7 @@ namespace VVV
                     return true;
             }
 
-            bool _format_as_explicit()
+            bool _format_as_explicit() const
             {
                 if(this->_parent)
                     return this->_parent->_format_as_explicit;
@@ -391,6 +587,115 @@ namespace VVV
                     return true;
             }
 
+            //
+            // Frame Data of known length is left on a seekable stream
+            // when the parent asked so (see Dicom::parse_reduced()),
+            // and encapsulated one by Dicom::parse_deferred(ist,true)
+            //
+            bool _need_defer(uint64_t len)
+            {
+                if(!this->_parent ||
+                   this->_tag.number!=TAG_FRAME_DATA.number)
+                    return false;
+                if(len==0xFFFFFFFF)
+                    return this->_parent->_defer_fragments;
+
+                return this->_parent->_defer_frame_data ||
+                    this->_parent->_stop_frame_data;
+            }
+
+            Element &_skip_element_data(std::istream &ist,uint64_t len)
+            {
+                this->_parent->_frame_data_offset=ist.tellg();
+                this->_parent->_frame_data_length=len;
+                if(len==0xFFFFFFFF)
+                    return this->_skip_fragments(ist);
+
+                this->_value=boost::any();
+                this->_is_vector=false;
+
+                // stream is left at the value; see
+                // Dicom::parse_until_frame_data()
+                if(this->_parent->_stop_frame_data){
+                    this->_parent->_frame_data_left=true;
+                    return *this;
+                }
+
+                ist.seekg((std::streamoff)len,std::ios_base::cur);
+                if(ist.eof() || !ist.good())
+                    throw StreamError("");
+
+                return *this;
+            }
+
+            //
+            // walk Items of encapsulated Frame Data and keep where
+            // the fragments are; only the Basic Offset Table and
+            // first 2 bytes of fragments are read
+            //
+            Element &_skip_fragments(std::istream &ist)
+            {
+                Dicom *d=this->_parent;
+                d->_fragments.clear();
+                d->_basic_offset_table.clear();
+
+                while(true){
+                    uint16_t tag[2];
+                    uint32_t len;
+                    ist.read((char *)tag,4);
+                    ist.read((char *)&len,4);
+                    if(ist.eof() || !ist.good())
+                        throw StreamError("");
+                    if(this->_need_byte_swap()){
+                        tag[0]=bswap_16(tag[0]);
+                        tag[1]=bswap_16(tag[1]);
+                        len=bswap_32(len);
+                    }
+                    if(tag[0]==0xFFFE && tag[1]==0xE0DD)
+                        break;
+                    if(tag[0]!=0xFFFE || tag[1]!=0xE000 ||
+                       len==0xFFFFFFFF)
+                        throw ParseError("Broken Frame Data");
+
+                    _Fragment f;
+                    f.offset=ist.tellg();
+                    f.length=len;
+                    f.soi=false;
+
+                    size_t head=0;
+                    if(d->_fragments.empty()){
+                        d->_basic_offset_table.resize(len/4);
+                        head=len/4*4;
+                        if(head)
+                            ist.read((char *)&d->_basic_offset_table[0],
+                                     head);
+                    }
+                    else if(len>=2){
+                        unsigned char soi[2];
+                        ist.read((char *)soi,2);
+                        f.soi=(soi[0]==0xFF && soi[1]==0xD8);
+                        head=2;
+                    }
+                    ist.seekg((std::streamoff)(len-head),std::ios_base::cur);
+                    if(ist.eof() || !ist.good())
+                        throw StreamError("");
+                    d->_fragments.push_back(f);
+                }
+
+                if(this->_need_byte_swap()){
+                    for(size_t i=0;i<d->_basic_offset_table.size();i++)
+                        d->_basic_offset_table[i]=
+                            bswap_32(d->_basic_offset_table[i]);
+                }
+                d->_frame_data_length=
+                    (uint64_t)(ist.tellg()-d->_frame_data_offset);
+
+                this->_value=boost::any();
+                this->_is_vector=false;
+
+                return *this;
+            }
+
             Element &_parse_value_implicit(std::istream &ist)
             {
 #ifdef DEBUG
@@ -412,6 +717,9 @@ namespace VVV
 #ifdef DEBUG
                 fprintf(stderr,"%u\n",size.numeric);
 #endif
+                if(this->_need_defer(size.numeric))
+                    return this->_skip_element_data(ist,size.numeric);
+
                 return this->_read_element_data_sequence(ist,size.numeric);
             }
 
@@ -436,14 +744,8 @@ namespace VVV
                 //
                 // get data length
                 //
-                size_t sz;
-                switch(this->_vr.number){
-                case 0x4f42:  // OB
-                case 0x4f57:  // OW
-                case 0x4f46:  // OF
-                case 0x5351:  // SQ
-                case 0x5554:  // UT
-                case 0x554e:  // UN
+                uint64_t sz;
+                if(is_long_vr(this->_vr.number)){
                     ist.seekg(2,std::ios_base::cur); // skip 2byte
 
                     uint32_t ui32;
@@ -451,29 +753,37 @@ namespace VVV
                     if(this->_need_byte_swap())
                         ui32=bswap_32(ui32);
                     
-                    sz=(size_t)ui32;
-                    break;
-                default:
+                    sz=ui32;
+                }
+                else{
                     uint16_t ui16;
                     ist.read((char *)&ui16,2);
                     if(this->_need_byte_swap())
                         ui16=bswap_16(ui16);
                     
-                    sz=(size_t)ui16;
-                    break;
+                    sz=ui16;
                 }
 
                 if(ist.eof() || !ist.good())
                         throw StreamError("");
                 
 #ifdef DEBUG
-                fprintf(stderr,"%u\n",(uint16_t)sz);
+                fprintf(stderr,"%llu\n",(unsigned long long)sz);
 #endif
+
+                if(this->_need_defer(sz))
+                    return this->_skip_element_data(ist,sz);
+
+                // undefined length value consists of Items
+                if(sz==0xFFFFFFFF)
+                    return this->_read_element_data_sequence(ist,sz);
                 
                 //
                 // get data body
                 //
                 switch(this->_vr.number){
+                case 0x4145:  // AE
+                case 0x4153:  // AS
                 case 0x4353:  // CS
                 case 0x4441:  // DA
                 case 0x4453:  // DS
@@ -485,7 +795,9 @@ namespace VVV
                 case 0x5348:  // SH
                 case 0x5354:  // ST
                 case 0x544d:  // TM
+                case 0x5543:  // UC
                 case 0x5549:  // UI
+                case 0x5552:  // UR
                 case 0x5554:  // UT
                     return this->_read_element_data_string(ist,sz);
                     break;
@@ -505,13 +817,22 @@ namespace VVV
                     return this->_read_element_data<uint16_t>(ist,sz);
                     break;
                 case 0x554c:  // UL
+                case 0x4f4c:  // OL
                     return this->_read_element_data<uint32_t>(ist,sz);
                     break;
+                case 0x5356:  // SV
+                    return this->_read_element_data<int64_t>(ist,sz);
+                    break;
+                case 0x5556:  // UV
+                case 0x4f56:  // OV
+                    return this->_read_element_data<uint64_t>(ist,sz);
+                    break;
                 case 0x464c:  // FL
                 case 0x4f46:  // OF
                     return this->_read_element_data<float>(ist,sz);
                     break;
                 case 0x4644:  // FD
+                case 0x4f44:  // OD
                     return this->_read_element_data<double>(ist,sz);
                     break;
                 case 0x5351:  // SQ
@@ -550,733 +871,4554 @@ namespace VVV
             }
             
             template <class T>
-            Element &_read_element_data(std::istream &ist,size_t len)
+            Element &_read_element_data(std::istream &ist,uint64_t len)
             {
                 size_t s=sizeof(T);
-                int n=len/s;
+                size_t n=_value_size(len)/s;
                 
                 if(n==1){
                     this->_value=this->_read_element_data_single<T>(ist,s);
                     this->_is_vector=false;
                 }
                 else{
-                    std::vector<T> buf;
-                    for(int i=0;i<n;i++)
-                        buf.push_back(this->_read_element_data_single<T>(ist,s));
+                    //
+                    // read at once and swap in place
+                    //
+                    std::vector<T> buf(n);
+                    if(n){
+                        ist.read((char *)&buf[0],n*s);
+                        if(ist.eof() || !ist.good())
+                            throw StreamError("");
+                    }
+                    if(s>1 && this->_need_byte_swap()){
+                        unsigned char *p=(unsigned char *)&buf[0];
+                        for(size_t i=0;i<n;i++,p+=s)
+                            std::reverse(p,p+s);
+                    }
                     
-                    this->_value=buf;
+                    this->_value=std::vector<T>();
+                    boost::any_cast<std::vector<T> >(&this->_value)->swap(buf);
                     this->_is_vector=true;
                 }
 
+                // odd bytes not filling a value
+                if(len%s){
+                    ist.ignore((std::streamsize)(len%s));
+                    if(ist.eof() || !ist.good())
+                        throw StreamError("");
+                }
+
                 return *this;
             }
             
-            Element &_read_element_data_string(std::istream &ist,size_t len)
+            Element &_read_element_data_string(std::istream &ist,uint64_t len)
             {
-                char buf[len];
-                ist.read(buf,len);
-
-                if(ist.eof() || !ist.good())
+                std::string buf(_value_size(len),'\0');
+                if(len){
+                    ist.read(&buf[0],buf.size());
+                    if(ist.eof() || !ist.good())
                         throw StreamError("");
+                }
             
-                this->_value=std::string(buf,len);
+                this->_value=std::string();
+                boost::any_cast<std::string>(&this->_value)->swap(buf);
                 this->_is_vector=false;
 
                 return *this;
             }
 
-            Element &_read_element_data_sequence(std::istream &ist,size_t len)
+            //
+            // value length in memory; 32bit size_t can not hold all
+            //
+            static size_t _value_size(uint64_t len)
             {
-                //
-                // when size was known
-                //
-                if(len!=0xFFFFFFFF)
-                    return this->_read_element_data<unsigned char>(ist,len);
+                if(len>(uint64_t)(size_t)-1)
+                    throw ParseError("Too long value");
 
-                //
-                // when unknown size gaven
-                //
-                unsigned char eos[8]={0,0,0,0,0,0,0,0};
+                return (size_t)len;
+            }
 
+            Element &_read_element_data_sequence(std::istream &ist,uint64_t len)
+            {
                 std::vector<unsigned char> value;
-                unsigned char c;
-                while(true){
-                    ist.read((char *)&c,1);
-                    if(ist.eof() || !ist.good())
-                        throw StreamError("");
-
-                    value.push_back(c);
-                
-                    //for(int i=0;i<7;i++)
-                    //    eos[i]=eos[i+1];
-                    memmove(eos,eos+1,7);
-                    eos[7]=c;
-
-                    // check end of sequence 0xFF FE E0 DD 00 00 00 00
-                    if(eos[0]==0xFF &&
-                       eos[1]==0xFE &&
-                       eos[2]==0xE0 &&
-                       eos[3]==0xDD &&
-                       eos[4]==0x00 &&
-                       eos[5]==0x00 &&
-                       eos[6]==0x00 &&
-                       eos[7]==0x00)
-                        break;
-                }
+                this->_items.clear();
 
-                // erase end of sequence
-                if(value.size()>=8){
-                    for(int i=0;i<8;i++)
-                        value.pop_back();
+                if(len!=0xFFFFFFFF){
+                    //
+                    // when size was known
+                    //
+                    value.resize(_value_size(len));
+                    if(len){
+                        ist.read((char *)&value[0],len);
+                        if(ist.eof() || !ist.good())
+                            throw StreamError("");
+                    }
+                    this->_scan_items(value);
                 }
-
-                // erase start of sequence 0xFE FF E0 00
-                if(value.size()>=4 && 
-                   value[0]==0xFE &&
-                   value[1]==0xFF &&
-                   value[2]==0xE0 &&
-                   value[3]==0x00){
-                    std::vector<unsigned char>::iterator itr=value.begin();
-                    value.erase(itr,itr+4);
+                else{
+                    //
+                    // when unknown size gaven, walk Items until
+                    // Sequence Delimitation Item
+                    //
+                    this->_read_undefined(ist,value,&this->_items,false);
                 }
 
-                this->_value=value;
+                this->_value=std::vector<unsigned char>();
+                boost::any_cast<std::vector<unsigned char> >(
+                    &this->_value)->swap(value);
                 this->_is_vector=true;
 
                 return *this;
             }
-        };
-        //
-        // end of Dicom::Element
-        //
 
-    public:
-        const static uint16_t TAG_GROUP_META;//=0x0002;
-        const static uint16_t TAG_GROUP_DIRECTORY;//=0x0004;
+            //
+            // append n bytes from stream
+            //
+            static void _append(std::istream &ist,
+                                std::vector<unsigned char> &value,
+                                size_t n)
+            {
+                if(!n)
+                    return;
 
-        const static TypeTag TAG_TRANSFER_SYNTAX_UID;//={{0x0002,0x0010}};
-        const static TypeTag TAG_IMG_POSITION;//={{0x0020,0x0032}};
-        const static TypeTag TAG_PHOTO_INTERPRET;//={{0x0028,0x0004}};
-        const static TypeTag TAG_ROWS;//={{0x0028,0x0010}};
-        const static TypeTag TAG_COLS;//={{0x0028,0x0011}};
-        const static TypeTag TAG_PX_SPACING;//={{0x0028,0x0030}};
-        const static TypeTag TAG_BIT_ALLOC;//={{0x0028,0x0100}};
-        const static TypeTag TAG_BIT_STORED;//={{0x0028,0x0101}};
-        const static TypeTag TAG_HI_BIT;//={{0x0028,0x0102}};
-        const static TypeTag TAG_PX_REP;//={{0x0028,0x0103}};
-        const static TypeTag TAG_RESCALE_INT;//={{0x0028,0x1052}};
-        const static TypeTag TAG_RESCALE_SLP;//={{0x0028,0x1053}};
-        const static TypeTag TAG_FRAME_DATA;//={{0x7fe0,0x0010}};
+                size_t off=value.size();
+                value.resize(off+n);
+                ist.read((char *)&value[off],n);
+                if(ist.eof() || !ist.good())
+                    throw StreamError("");
+            }
 
+            uint32_t _get_u32(const unsigned char *p)
+            {
+                uint32_t v;
+                memcpy(&v,p,4);
+                return this->_need_byte_swap() ? bswap_32(v) : v;
+            }
 
-        ///
-        /// default constructor
-        ///
-        Dicom()
-            :_cols(0),
-             _rows(0),
-             _bits(0),
-             _chs(0)
-        {
-            // nop
+            //
+            // Items of undefined length value; Item values are appended
+            // with their tags, Sequence Delimitation Item is appended
+            // only when keep_delimiter is true
+            //
+            void _read_undefined(std::istream &ist,
+                                 std::vector<unsigned char> &value,
+                                 std::vector<std::pair<size_t,size_t> > *items,
+                                 bool keep_delimiter)
+            {
+                while(true){
+                    size_t head=value.size();
+                    _append(ist,value,8);
+
+                    TypeTag tag;
+                    memcpy(tag.raw,&value[head],4);
+                    if(this->_need_byte_swap()){
+                        tag.id[0]=bswap_16(tag.id[0]);
+                        tag.id[1]=bswap_16(tag.id[1]);
+                    }
+                    uint32_t len=this->_get_u32(&value[head+4]);
+
+                    if(tag.id[0]==0xFFFE && tag.id[1]==0xE0DD){
+                        if(!keep_delimiter)
+                            value.resize(head);
+                        return;
+                    }
+                    if(tag.id[0]!=0xFFFE || tag.id[1]!=0xE000)
+                        throw ParseError("Item expected in Sequence");
+
+                    size_t start=value.size();
+                    if(len!=0xFFFFFFFF)
+                        _append(ist,value,len);
+                    else
+                        this->_read_undefined_item(ist,value);
+
+                    if(items){
+                        size_t end=value.size();
+                        if(len==0xFFFFFFFF)
+                            end-=8; // Item Delimitation Item
+                        items->push_back(std::make_pair(start,end-start));
+                    }
+                }
+            }
+
+            //
+            // elements of undefined length Item until Item Delimitation
+            //
+            void _read_undefined_item(std::istream &ist,
+                                      std::vector<unsigned char> &value)
+            {
+                while(true){
+                    size_t head=value.size();
+                    _append(ist,value,4);
+
+                    TypeTag tag;
+                    memcpy(tag.raw,&value[head],4);
+                    if(this->_need_byte_swap()){
+                        tag.id[0]=bswap_16(tag.id[0]);
+                        tag.id[1]=bswap_16(tag.id[1]);
+                    }
+
+                    uint32_t len;
+                    if(tag.id[0]==0xFFFE || !this->_format_as_explicit()){
+                        _append(ist,value,4);
+                        len=this->_get_u32(&value[head+4]);
+                    }
+                    else{
+                        _append(ist,value,4);
+                        uint16_t vr=(uint16_t)((value[head+4]<<8)|
+                                               value[head+5]);
+                        if(is_long_vr(vr)){
+                            _append(ist,value,4);
+                            len=this->_get_u32(&value[head+8]);
+                        }
+                        else{
+                            uint16_t ui16;
+                            memcpy(&ui16,&value[head+6],2);
+                            len=this->_need_byte_swap() ?
+                                bswap_16(ui16) : ui16;
+                        }
+                    }
+
+                    if(tag.id[0]==0xFFFE){
+                        if(tag.id[1]==0xE00D)
+                            return;
+                        throw ParseError("Unexpected Item in Item");
+                    }
+
+                    if(len==0xFFFFFFFF)
+                        this->_read_undefined(ist,value,NULL,true);
+                    else
+                        _append(ist,value,len);
+                }
+            }
         };
+        //
+        // end of Dicom::Element
+        //
 
         ///
-        /// copy constructor
+        /// view of an Item (nested data set) in a sequence value
         ///
-        /// @param d 
+        /// Item refers to the value of its sequence element without copy,
+        /// and should not outlive the element.
         ///
-        Dicom(const Dicom &d,bool compact=false)
+        class Item
         {
-            this->_image=d._image.clone();
-            this->_cols=d._cols;
-            this->_rows=d._rows;
-            this->_bits=d._bits;
-            this->_chs=d._chs;
-            this->_is_signed=d._is_signed;
-            
-            this->_px_spacing_row=d._px_spacing_row;
-            this->_px_spacing_col=d._px_spacing_col;
-            this->_image_pos_x=d._image_pos_x;
-            this->_image_pos_y=d._image_pos_y;
-            this->_image_pos_z=d._image_pos_z;
+        public:
+            Item()
+                :_parent(NULL),
+                 _data(NULL),
+                 _len(0)
+            {}
 
-            this->_architecture_as_little_endian=d._architecture_as_little_endian;
-            this->_format_as_little_endian=d._format_as_little_endian;
-            this->_format_as_explicit=d._format_as_explicit;
-            this->_format_as_deflate=d._format_as_deflate;
+            Item(Dicom *parent,const unsigned char *data,size_t len)
+                :_parent(parent),
+                 _data(data),
+                 _len(len)
+            {}
 
-            if(!compact){
-                this->_element=std::map<uint32_t,Element>(d._element);
+            ///
+            /// reader accessor: raw bytes of the Item value
+            ///
+            /// @return pointer to the Item value
+            ///
+            /// e.g. a fragment of encapsulated Frame Data
+            ///
+            const unsigned char *data() const { return this->_data; }
 
-                std::map<uint32_t,Element>::iterator itr=
-                    this->_element.begin();
-                std::map<uint32_t,Element>::iterator itrEnd=
-                    this->_element.end();
-                for(;itr!=itrEnd;itr++)
-                    itr->second._set_parent(this);
+            ///
+            /// reader accessor: length of the Item value
+            ///
+            /// @return bytes of the Item value
+            ///
+            size_t length() const { return this->_len; }
+
+            ///
+            /// query method that specify element exists or not
+            ///
+            /// @param group DICOM element tag group ID
+            /// @param id   DICOM element tag ID
+            ///
+            /// @return true or false
+            ///
+            bool has_element(const uint16_t group,const uint16_t id) const
+            {
+                TypeTag tag={{group,id}};
+
+                return this->has_element(tag);
+            }
+            bool has_element(const TypeTag tag) const
+            {
+                ElementHeader h;
+                size_t off,len;
+
+                return this->_find(tag,h,off,len);
+            }
+
+            ///
+            /// decode an element in the Item
+            ///
+            /// @param group DICOM element tag group ID
+            /// @param id   DICOM element tag ID
+            ///
+            /// @return decoded Element
+            ///
+            /// throw MissingTagError when not found
+            ///
+            Element element(const uint16_t group,const uint16_t id) const
+            {
+                TypeTag tag={{group,id}};
+
+                return this->element(tag);
+            }
+            Element element(const TypeTag tag) const
+            {
+                ElementHeader h;
+                size_t off,len;
+                if(!this->_find(tag,h,off,len))
+                    throw MissingTagError("Could not found tag in Item");
+
+                MemoryStreamBuf buf(this->_data+off,h.header_size+len);
+                std::istream ist(&buf);
+
+                return Element(this->_parent,ist);
+            }
+
+            ///
+            /// number of Items of a nested sequence
+            ///
+            /// @param tag nested sequence tag
+            ///
+            /// @return number of Items or 0
+            ///
+            size_t item_count(const TypeTag tag) const
+            {
+                return this->items(tag).size();
+            }
+
+            ///
+            /// reader accessor: an Item of a nested sequence
+            ///
+            /// @param tag nested sequence tag
+            /// @param index Item index
+            ///
+            /// @return view of the Item
+            ///
+            Item item(const TypeTag tag,size_t index) const
+            {
+                std::vector<Item> r=this->items(tag);
+                if(index>=r.size())
+                    throw std::out_of_range("Bad Item index");
+
+                return r[index];
+            }
+
+            ///
+            /// reader accessor: all Items of a nested sequence
+            ///
+            /// @param tag nested sequence tag
+            ///
+            /// @return views of the Items; empty when not found
+            ///
+            std::vector<Item> items(const TypeTag tag) const
+            {
+                std::vector<Item> r;
+
+                ElementHeader h;
+                size_t off,len;
+                if(!this->_find(tag,h,off,len))
+                    return r;
+
+                const unsigned char *value=this->_data+off+h.header_size;
+                std::vector<std::pair<size_t,size_t> > pos;
+                scan_sequence(value,len,this->_swap(),this->_explicit(),pos);
+
+                r.reserve(pos.size());
+                for(size_t i=0;i<pos.size();i++)
+                    r.push_back(Item(this->_parent,
+                                     value+pos[i].first,
+                                     pos[i].second));
+
+                return r;
+            }
+
+            ///
+            /// reader accessor: tags of all elements in the Item
+            ///
+            /// @return element tags in stored order
+            ///
+            std::vector<TypeTag> tags() const
+            {
+                std::vector<TypeTag> r;
+
+                ElementHeader h;
+                size_t off=0,len;
+                while(this->_next(off,h,len)){
+                    r.push_back(h.tag);
+                    off+=h.header_size+len;
+                }
+
+                return r;
+            }
+
+        private:
+            Dicom *_parent;
+            const unsigned char *_data;
+            size_t _len;
+
+            bool _swap() const
+            {
+                return this->_parent ? this->_parent->_need_byte_swap() : false;
+            }
+
+            bool _explicit() const
+            {
+                return this->_parent ? this->_parent->_format_as_explicit : true;
+            }
+
+            //
+            // header at off and length of its value
+            //
+            bool _next(size_t off,ElementHeader &h,size_t &len) const
+            {
+                if(off>=this->_len)
+                    return false;
+                if(!parse_header(this->_data+off,
+                                 this->_len-off,
+                                 this->_swap(),
+                                 this->_explicit(),
+                                 h))
+                    throw ParseError("Broken Item");
+
+                size_t avail=this->_len-off-h.header_size;
+                if(h.is_undefined()){
+                    bool swap=this->_swap(),explicit_vr=this->_explicit();
+                    nested_syntax(h,swap,explicit_vr);
+                    len=undefined_value_size(this->_data+off+h.header_size,
+                                             avail,swap,explicit_vr);
+                }
+                else if(h.length>avail)
+                    throw ParseError("Broken Item");
+                else
+                    len=h.length;
+
+                return true;
+            }
+
+            bool _find(const TypeTag tag,
+                       ElementHeader &h,
+                       size_t &off,
+                       size_t &len) const
+            {
+                off=0;
+                while(this->_next(off,h,len)){
+                    if(h.tag.number==tag.number)
+                        return true;
+
+                    // elements are sorted by tag
+                    if(h.tag.id[0]>tag.id[0] ||
+                       (h.tag.id[0]==tag.id[0] && h.tag.id[1]>tag.id[1]))
+                        return false;
+
+                    off+=h.header_size+len;
+                }
+
+                return false;
             }
         };
+        //
+        // end of Dicom::Item
+        //
+
+        //
+        // element walker over memory
+        //
 
         ///
-        /// constructor with parse
-        ///
-        /// @param ist input stream
+        /// query method that VR has 2 reserved bytes and 4 bytes length
         ///
-        Dicom(std::istream &ist,bool parse_all=true)
-        {
-            this->parse(ist,parse_all);
-        };
-        
+        /// @param vr VR as TypeVR::number
         ///
-        /// destructor
+        /// @return true or false
         ///
-        ~Dicom()
+        static bool is_long_vr(uint16_t vr)
         {
-            this->_element.clear();
+            switch(vr){
+            case 0x4f42:  // OB
+            case 0x4f44:  // OD
+            case 0x4f46:  // OF
+            case 0x4f4c:  // OL
+            case 0x4f56:  // OV
+            case 0x4f57:  // OW
+            case 0x5351:  // SQ
+            case 0x5356:  // SV
+            case 0x5543:  // UC
+            case 0x554e:  // UN
+            case 0x5552:  // UR
+            case 0x5554:  // UT
+            case 0x5556:  // UV
+                return true;
+            }
+
+            return false;
         }
 
         ///
-        /// a reader accessor
+        /// byte order and VR encoding of the Items of an undefined
+        /// length element; UN is Implicit VR Little Endian (PS3.5
+        /// 6.2.2), others are encoded as the data set
         ///
-        /// @return parsed DICOM image as cv::mat (8bit/16bit 1ch)
+        /// @param h element header
+        /// @param swap need byte swap or not; updated
+        /// @param explicit_vr explicit VR or implicit VR; updated
         ///
-        cv::Mat &image(bool need_rescale=true){
-            if(this->_image.empty())
-                this->parse_image(need_rescale);
+        static void nested_syntax(const ElementHeader &h,
+                                  bool &swap,
+                                  bool &explicit_vr)
+        {
+            if(!explicit_vr || h.vr.number!=0x554e || !h.is_undefined())
+                return;
 
-            return this->_image;
+            uint16_t endian_test=1;
+            swap=!*(char *)&endian_test;
+            explicit_vr=false;
         }
 
         ///
-        ///  a reader accessor
-        ///
-        /// @return image rows or 0
-        ///
-        int rows(){ return this->_rows; }
-
+        /// parse an element header in memory
         ///
-        ///  a reader accessor
+        /// @param p head of the element
+        /// @param avail available bytes from p
+        /// @param swap need byte swap or not
+        /// @param explicit_vr explicit VR or implicit VR
+        /// @param h parsed header
         ///
-        /// @return image cols or 0
+        /// @return false when truncated
         ///
-        int cols(){ return this->_cols; }
+        static bool parse_header(const unsigned char *p,
+                                 size_t avail,
+                                 bool swap,
+                                 bool explicit_vr,
+                                 ElementHeader &h)
+        {
+            if(avail<8)
+                return false;
 
-        ///
-        ///  a reader accessor
-        ///
-        /// @return bit par pixel or 0
-        ///
-        int bit_par_pixel(){ return this->_bits; }
+            memcpy(h.tag.raw,p,4);
+            if(swap){
+                h.tag.id[0]=bswap_16(h.tag.id[0]);
+                h.tag.id[1]=bswap_16(h.tag.id[1]);
+            }
+            h.vr.number=0;
 
-        ///
-        ///  a reader accessor
-        ///
-        /// @return image channels or 0
-        ///
-        int channels(){ return this->_chs; }
+            uint32_t ui32;
+            if(h.tag.id[0]==0xFFFE || !explicit_vr){
+                memcpy(&ui32,p+4,4);
+                h.length=swap ? bswap_32(ui32) : ui32;
+                h.header_size=8;
+                return true;
+            }
 
-        ///
-        ///  a reader accessor
-        ///
-        /// @return true (pixel format is signed) or false
-        ///
-        bool is_signed(){ return this->_is_signed; }
+            h.vr.number=(uint16_t)((p[4]<<8)|p[5]);
+            if(is_long_vr(h.vr.number)){
+                if(avail<12)
+                    return false;
+                memcpy(&ui32,p+8,4);
+                h.length=swap ? bswap_32(ui32) : ui32;
+                h.header_size=12;
+            }
+            else{
+                uint16_t ui16;
+                memcpy(&ui16,p+6,2);
+                h.length=swap ? bswap_16(ui16) : ui16;
+                h.header_size=8;
+            }
 
-        ///
-        /// a reader accessor
-        ///
-        /// @return row dir. pixel spacing or 0.0
-        ///
-        float px_spacing_row(){ return this->_px_spacing_row; }
+            return true;
+        }
 
         ///
-        /// a reader accessor
-        ///
-        /// @return column dir. pixel spacing or 0.0
+        /// bytes of elements in an undefined length Item
         ///
-        float px_spacing_col(){ return this->_px_spacing_col; }
-
+        /// @param p head of the Item value
+        /// @param avail available bytes from p
+        /// @param swap need byte swap or not
+        /// @param explicit_vr explicit VR or implicit VR
+        /// @param content bytes without Item Delimitation Item
         ///
-        /// a reader accessor
+        /// @return bytes including Item Delimitation Item
         ///
-        /// @return image x position or NaN
+        /// throw ParseError
         ///
-        float image_pos_x(){ return this->_image_pos_x; }
+        static size_t undefined_item_size(const unsigned char *p,
+                                          size_t avail,
+                                          bool swap,
+                                          bool explicit_vr,
+                                          size_t &content)
+        {
+            size_t off=0;
+            ElementHeader h;
+            while(true){
+                if(!parse_header(p+off,avail-off,swap,explicit_vr,h))
+                    throw ParseError("Broken Item");
+                if(h.tag.id[0]==0xFFFE && h.tag.id[1]==0xE00D){
+                    content=off;
+                    return off+h.header_size;
+                }
+
+                off+=h.header_size;
+                if(h.is_undefined()){
+                    bool nswap=swap,nexplicit=explicit_vr;
+                    nested_syntax(h,nswap,nexplicit);
+                    off+=undefined_value_size(p+off,avail-off,
+                                              nswap,nexplicit);
+                }
+                else if(h.length>avail-off)
+                    throw ParseError("Broken Item");
+                else
+                    off+=h.length;
+            }
+        }
 
         ///
-        /// a reader accessor
-        ///
-        /// @return image y position or NaN
+        /// bytes of an undefined length value
         ///
-        float image_pos_y(){ return this->_image_pos_y; }
-
+        /// @param p head of the value
+        /// @param avail available bytes from p
+        /// @param swap need byte swap or not
+        /// @param explicit_vr explicit VR or implicit VR
         ///
-        /// a reader accessor
+        /// @return bytes including Sequence Delimitation Item
         ///
-        /// @return image z position or NaN
+        /// throw ParseError
         ///
-        float image_pos_z(){ return this->_image_pos_z; }
+        static size_t undefined_value_size(const unsigned char *p,
+                                           size_t avail,
+                                           bool swap,
+                                           bool explicit_vr)
+        {
+            size_t off=0;
+            ElementHeader h;
+            while(true){
+                if(!parse_header(p+off,avail-off,swap,explicit_vr,h))
+                    throw ParseError("Broken Sequence");
+                off+=h.header_size;
+                if(h.tag.id[0]==0xFFFE && h.tag.id[1]==0xE0DD)
+                    return off;
+                if(h.tag.id[0]!=0xFFFE || h.tag.id[1]!=0xE000)
+                    throw ParseError("Item expected in Sequence");
+
+                size_t content;
+                if(h.is_undefined())
+                    off+=undefined_item_size(p+off,avail-off,
+                                             swap,explicit_vr,content);
+                else if(h.length>avail-off)
+                    throw ParseError("Broken Sequence");
+                else
+                    off+=h.length;
+            }
+        }
 
-        
         ///
-        /// query method that specify element exists or not
+        /// offset and length of each Item value in a sequence value
         ///
-        /// @param group DICOM element tag group ID
-        /// @param id   DICOM element tag ID
+        /// @param p head of the sequence value
+        /// @param len bytes of the sequence value
+        /// @param swap need byte swap or not
+        /// @param explicit_vr explicit VR or implicit VR
+        /// @param items offsets and lengths from p
         ///
-        /// @return true or false
+        /// throw ParseError
         ///
-        bool has_element(const uint16_t group,const uint16_t id)
-        {
-            TypeTag tag={{group,id}};
-
-            return this->has_element(tag.number);
-        }
-        bool has_element(const TypeTag tag)
-        {
-            return this->has_element(tag.number);
-        }
-        bool has_element(const uint32_t number)
+        static void scan_sequence(const unsigned char *p,
+                                  size_t len,
+                                  bool swap,
+                                  bool explicit_vr,
+                                  std::vector<std::pair<size_t,size_t> > &items)
         {
-            if(this->_element.find(number)==this->_element.end())
-                return false;
-            else
-                return true;
+            size_t off=0;
+            ElementHeader h;
+            while(off<len){
+                if(!parse_header(p+off,len-off,swap,explicit_vr,h))
+                    throw ParseError("Broken Sequence");
+                if(h.tag.id[0]==0xFFFE && h.tag.id[1]==0xE0DD)
+                    break;
+                if(h.tag.id[0]!=0xFFFE || h.tag.id[1]!=0xE000)
+                    throw ParseError("Item expected in Sequence");
+
+                off+=h.header_size;
+                if(h.is_undefined()){
+                    size_t content;
+                    size_t consumed=undefined_item_size(p+off,len-off,
+                                                        swap,explicit_vr,
+                                                        content);
+                    items.push_back(std::make_pair(off,content));
+                    off+=consumed;
+                }
+                else{
+                    if(h.length>len-off)
+                        throw ParseError("Broken Sequence");
+                    items.push_back(std::make_pair(off,(size_t)h.length));
+                    off+=h.length;
+                }
+            }
         }
-        
+
+        //
+        // numbers of DS/IS values
+        //
+
         ///
-        /// reader accessor for specify element
+        /// parse backslash separated decimal strings (DS) in place
         ///
-        /// @param group DICOM element tag group ID
-        /// @param id   DICOM element tag ID
+        /// @param p head of the value
+        /// @param len bytes of the value
+        /// @param dst buffer of numbers
+        /// @param n size of dst
         ///
-        /// @return Element object which has specified tag
+        /// @return number of values written to dst, or -1 when a value
+        ///         is not a decimal string
         ///
-        Element &element(const uint16_t group,const uint16_t id)
+        /// Leading/trailing spaces and NUL padding are allowed. Values
+        /// after the n-th are not parsed. Nothing is allocated and
+        /// the result does not depend on locale.
+        ///
+        static int parse_decimals(const char *p,size_t len,double *dst,size_t n)
         {
-            TypeTag tag={{group,id}};
+            static const double exact[]={
+                1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,
+                1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,
+                1e21,1e22
+            };
+
+            const char *end=p+len;
+            size_t count=0;
+            while(count<n){
+                const char *q=_skip_blank(p,end);
+                if(q==end && count==0)
+                    return 0;
+
+                bool negative=false;
+                if(q<end && (*q=='+' || *q=='-'))
+                    negative=(*q++=='-');
+
+                uint64_t mantissa=0;
+                int exponent=0;
+                int digits=0;
+                bool point=false;
+                for(;q<end;q++){
+                    if(*q=='.' && !point)
+                        point=true;
+                    else if(*q>='0' && *q<='9'){
+                        digits++;
+                        if(mantissa<100000000000000000ULL){
+                            mantissa=mantissa*10+(*q-'0');
+                            if(point)
+                                exponent--;
+                        }
+                        else if(!point)
+                            exponent++;
+                    }
+                    else
+                        break;
+                }
+                if(!digits)
+                    return -1;
+
+                if(q<end && (*q=='e' || *q=='E')){
+                    q++;
+                    bool e_negative=false;
+                    if(q<end && (*q=='+' || *q=='-'))
+                        e_negative=(*q++=='-');
+                    if(q>=end || *q<'0' || *q>'9')
+                        return -1;
+                    int e=0;
+                    for(;q<end && *q>='0' && *q<='9';q++)
+                        if(e<10000)
+                            e=e*10+(*q-'0');
+                    exponent+=e_negative ? -e : e;
+                }
 
-            return this->_element[tag.number];
-        }
-        Element &element(const TypeTag tag)
-        {
-            return this->_element[tag.number];
-        }
-        Element &element(const uint32_t number)
-        {
-            return this->_element[number];
-        }
-        Element &operator[](const TypeTag tag)
-        {
-            return this->_element[tag.number];
+                double v=(double)mantissa;
+                if(exponent>=0 && exponent<=22)
+                    v*=exact[exponent];
+                else if(exponent<0 && exponent>=-22)
+                    v/=exact[-exponent];
+                else
+                    v*=pow(10.0,exponent);
+                dst[count++]=negative ? -v : v;
+
+                q=_skip_blank(q,end);
+                if(q==end)
+                    break;
+                if(*q!='\\')
+                    return -1;
+                p=q+1;
+            }
+
+            return (int)count;
         }
 
         ///
-        /// parse DICOM stream
+        /// parse backslash separated integer strings (IS) in place
         ///
-        /// @param ist input stream
-        /// @param parse_all parse with image or only summary
-        /// @param need_rescale rescale or not when image parsing
+        /// @param p head of the value
+        /// @param len bytes of the value
+        /// @param dst buffer of numbers
+        /// @param n size of dst
         ///
-        /// @return self
+        /// @return number of values written to dst, or -1 when a value
+        ///         is not an integer string or out of range of int
         ///
-        Dicom &parse(std::istream &ist,
-                     bool parse_all=true,
-                     bool need_rescale=true)
+        static int parse_integers(const char *p,size_t len,int *dst,size_t n)
         {
-            if(!ist)
+            const char *end=p+len;
+            size_t count=0;
+            while(count<n){
+                const char *q=_skip_blank(p,end);
+                if(q==end && count==0)
+                    return 0;
+
+                bool negative=false;
+                if(q<end && (*q=='+' || *q=='-'))
+                    negative=(*q++=='-');
+
+                if(q>=end || *q<'0' || *q>'9')
+                    return -1;
+                int64_t v=0;
+                for(;q<end && *q>='0' && *q<='9';q++){
+                    v=v*10+(*q-'0');
+                    if(v>(int64_t)std::numeric_limits<int>::max()+1)
+                        return -1;
+                }
+                if(negative)
+                    v=-v;
+                if(v>std::numeric_limits<int>::max())
+                    return -1;
+                dst[count++]=(int)v;
+
+                q=_skip_blank(q,end);
+                if(q==end)
+                    break;
+                if(*q!='\\')
+                    return -1;
+                p=q+1;
+            }
+
+            return (int)count;
+        }
+
+    public:
+        const static uint16_t TAG_GROUP_META;//=0x0002;
+        const static uint16_t TAG_GROUP_DIRECTORY;//=0x0004;
+
+        const static TypeTag TAG_TRANSFER_SYNTAX_UID;//={{0x0002,0x0010}};
+        const static TypeTag TAG_IMG_POSITION;//={{0x0020,0x0032}};
+        const static TypeTag TAG_PLANE_POSITION_SEQ;//={{0x0020,0x9113}};
+        const static TypeTag TAG_PLANE_ORIENTATION_SEQ;//={{0x0020,0x9116}};
+        const static TypeTag TAG_SAMPLES_PER_PX;//={{0x0028,0x0002}};
+        const static TypeTag TAG_PHOTO_INTERPRET;//={{0x0028,0x0004}};
+        const static TypeTag TAG_PLANAR_CONF;//={{0x0028,0x0006}};
+        const static TypeTag TAG_NUM_FRAMES;//={{0x0028,0x0008}};
+        const static TypeTag TAG_ROWS;//={{0x0028,0x0010}};
+        const static TypeTag TAG_COLS;//={{0x0028,0x0011}};
+        const static TypeTag TAG_PX_SPACING;//={{0x0028,0x0030}};
+        const static TypeTag TAG_BIT_ALLOC;//={{0x0028,0x0100}};
+        const static TypeTag TAG_BIT_STORED;//={{0x0028,0x0101}};
+        const static TypeTag TAG_HI_BIT;//={{0x0028,0x0102}};
+        const static TypeTag TAG_PX_REP;//={{0x0028,0x0103}};
+        const static TypeTag TAG_WINDOW_CENTER;//={{0x0028,0x1050}};
+        const static TypeTag TAG_WINDOW_WIDTH;//={{0x0028,0x1051}};
+        const static TypeTag TAG_RESCALE_INT;//={{0x0028,0x1052}};
+        const static TypeTag TAG_RESCALE_SLP;//={{0x0028,0x1053}};
+        const static TypeTag TAG_VOI_LUT_FUNCTION;//={{0x0028,0x1056}};
+        const static TypeTag TAG_PALETTE_DESC_R;//={{0x0028,0x1101}};
+        const static TypeTag TAG_PALETTE_DESC_G;//={{0x0028,0x1102}};
+        const static TypeTag TAG_PALETTE_DESC_B;//={{0x0028,0x1103}};
+        const static TypeTag TAG_PALETTE_DATA_R;//={{0x0028,0x1201}};
+        const static TypeTag TAG_PALETTE_DATA_G;//={{0x0028,0x1202}};
+        const static TypeTag TAG_PALETTE_DATA_B;//={{0x0028,0x1203}};
+        const static TypeTag TAG_LUT_DESCRIPTOR;//={{0x0028,0x3002}};
+        const static TypeTag TAG_LUT_DATA;//={{0x0028,0x3006}};
+        const static TypeTag TAG_VOI_LUT_SEQ;//={{0x0028,0x3010}};
+        const static TypeTag TAG_PIXEL_MEASURES_SEQ;//={{0x0028,0x9110}};
+        const static TypeTag TAG_SHARED_FRAME_SEQ;//={{0x5200,0x9229}};
+        const static TypeTag TAG_PER_FRAME_SEQ;//={{0x5200,0x9230}};
+        const static TypeTag TAG_FLOAT_FRAME_DATA;//={{0x7fe0,0x0008}};
+        const static TypeTag TAG_DOUBLE_FRAME_DATA;//={{0x7fe0,0x0009}};
+        const static TypeTag TAG_FRAME_DATA;//={{0x7fe0,0x0010}};
+
+        ///
+        /// pixel reduction methods for parse_reduced() and image_reduced()
+        ///
+        enum ReduceMode{
+            REDUCE_SUBSAMPLE=0, ///< pick top-left pixel of each block
+            REDUCE_BOX=1        ///< average all pixels of each block
+        };
+
+        ///
+        /// supported Photometric Interpretations
+        ///
+        enum Photometric{
+            PHOTO_MONOCHROME1=0,  ///< MONOCHROME1 (minimum is white)
+            PHOTO_MONOCHROME2=1,  ///< MONOCHROME2
+            PHOTO_PALETTE_COLOR=2,///< PALETTE COLOR
+            PHOTO_RGB=3,          ///< RGB
+            PHOTO_YBR_FULL=4,     ///< YBR_FULL
+            PHOTO_YBR_FULL_422=5  ///< YBR_FULL_422
+        };
+
+        ///
+        /// VOI LUT Functions for display_image()
+        ///
+        enum VoiFunction{
+            VOI_LINEAR=0,       ///< LINEAR
+            VOI_LINEAR_EXACT=1, ///< LINEAR_EXACT
+            VOI_SIGMOID=2,      ///< SIGMOID
+            VOI_TABLE=3         ///< VOI LUT Sequence
+        };
+
+        ///
+        /// pixel statistics and histogram, see collect_stats()
+        ///
+        /// Histogram has equal width bins over [lo, hi]; values out of
+        /// the range are counted in the first or the last bin.
+        ///
+        class PixelStats
+        {
+        public:
+            PixelStats()
+                :count(0),
+                 min(0.0),
+                 max(0.0),
+                 sum(0.0),
+                 sum_sq(0.0),
+                 lo(0.0),
+                 hi(0.0)
+            {}
+
+            ///
+            /// empty statistics with fixed histogram bins
+            ///
+            /// @param bins histogram bins
+            /// @param lower lower edge of histogram
+            /// @param upper upper edge of histogram
+            ///
+            /// e.g. an accumulator to merge() slices of a series
+            ///
+            PixelStats(int bins,double lower,double upper)
+                :count(0),
+                 min(0.0),
+                 max(0.0),
+                 sum(0.0),
+                 sum_sq(0.0),
+                 lo(lower),
+                 hi(upper),
+                 histogram(bins>0 ? bins : 0,0)
+            {}
+
+            uint64_t count;  ///< number of pixels
+            double min;      ///< minimum value
+            double max;      ///< maximum value
+            double sum;      ///< sum of values
+            double sum_sq;   ///< sum of squared values
+            double lo;       ///< lower edge of histogram
+            double hi;       ///< upper edge of histogram
+            std::vector<uint64_t> histogram; ///< counts of each bin
+
+            bool empty() const { return !this->count; }
+
+            double mean() const
+            {
+                return this->count ? this->sum/this->count : 0.0;
+            }
+
+            double variance() const
+            {
+                if(!this->count)
+                    return 0.0;
+
+                double m=this->mean();
+                return std::max(this->sum_sq/this->count-m*m,0.0);
+            }
+
+            double stddev() const { return sqrt(this->variance()); }
+
+            ///
+            /// histogram bin of a value
+            ///
+            /// @param v value
+            ///
+            /// @return bin index
+            ///
+            size_t bin(double v) const
+            {
+                size_t n=this->histogram.size();
+                if(!n || this->hi<=this->lo)
+                    return 0;
+
+                double f=(v-this->lo)/(this->hi-this->lo)*n;
+                if(!(f>0.0))
+                    return 0;
+                if(f>=(double)n)
+                    return n-1;
+
+                return (size_t)f;
+            }
+
+            ///
+            /// percentile from the histogram
+            ///
+            /// @param p fraction (0.0 - 1.0)
+            ///
+            /// @return value interpolated linearly within a bin
+            ///
+            double percentile(double p) const
+            {
+                if(!this->count)
+                    return 0.0;
+
+                p=std::min(std::max(p,0.0),1.0);
+                size_t n=this->histogram.size();
+                if(!n || this->hi<=this->lo)
+                    return this->min+(this->max-this->min)*p;
+
+                double w=(this->hi-this->lo)/n;
+                double target=p*this->count;
+                double acc=0.0;
+                for(size_t b=0;b<n;b++){
+                    double c=(double)this->histogram[b];
+                    if(c>0.0 && acc+c>=target){
+                        double v=this->lo+(b+(target-acc)/c)*w;
+                        return std::min(std::max(v,this->min),this->max);
+                    }
+                    acc+=c;
+                }
+
+                return this->max;
+            }
+
+            ///
+            /// window which covers values between two percentiles
+            ///
+            /// @param center window center
+            /// @param width window width
+            /// @param lower lower percentile
+            /// @param upper upper percentile
+            ///
+            /// The window can be passed to display_image().
+            ///
+            void auto_window(float &center,
+                             float &width,
+                             double lower=0.005,
+                             double upper=0.995) const
+            {
+                double a=this->percentile(lower);
+                double b=this->percentile(upper);
+                if(b<=a)
+                    b=a+1.0;
+
+                center=(float)((a+b)*0.5);
+                width=(float)(b-a);
+            }
+
+            ///
+            /// aggregate statistics of another image
+            ///
+            /// @param s statistics in the same unit
+            ///
+            /// @return self
+            ///
+            /// Histograms of different bins are merged by bin centers;
+            /// use the same fixed range to aggregate a series exactly.
+            ///
+            PixelStats &merge(const PixelStats &s)
+            {
+                if(!s.count)
+                    return *this;
+                if(!this->count && this->histogram.empty()){
+                    *this=s;
+                    return *this;
+                }
+
+                if(!this->count){
+                    this->min=s.min;
+                    this->max=s.max;
+                }
+                else{
+                    this->min=std::min(this->min,s.min);
+                    this->max=std::max(this->max,s.max);
+                }
+                this->count+=s.count;
+                this->sum+=s.sum;
+                this->sum_sq+=s.sum_sq;
+
+                if(this->histogram.empty() || s.histogram.empty())
+                    return *this;
+
+                size_t n=s.histogram.size();
+                if(n==this->histogram.size() &&
+                   s.lo==this->lo &&
+                   s.hi==this->hi){
+                    for(size_t b=0;b<n;b++)
+                        this->histogram[b]+=s.histogram[b];
+                    return *this;
+                }
+
+                double w=(s.hi-s.lo)/n;
+                for(size_t b=0;b<n;b++)
+                    this->histogram[this->bin(s.lo+(b+0.5)*w)]+=
+                        s.histogram[b];
+
+                return *this;
+            }
+        };
+
+        ///
+        /// default constructor
+        ///
+        Dicom()
+            :_cols(0),
+             _rows(0),
+             _bits(0),
+             _chs(0),
+             _frames(0),
+             _samples(0),
+             _planar(0),
+             _photometric(PHOTO_MONOCHROME2),
+             _format_as_encapsulated(false),
+             _format_as_jpeg(false),
+             _defer_frame_data(false),
+             _stop_frame_data(false),
+             _frame_data_left(false),
+             _frame_data_offset(-1),
+             _frame_data_length(0),
+             _defer_fragments(false),
+             _collect_stats(false),
+             _stats_bins(256),
+             _stats_rescaled(true),
+             _stats_lo(0.0),
+             _stats_hi(0.0)
+        {
+            // nop
+        };
+
+        ///
+        /// copy constructor
+        ///
+        /// @param d 
+        ///
+        Dicom(const Dicom &d,bool compact=false)
+        {
+            this->_image=d._image.clone();
+            this->_cols=d._cols;
+            this->_rows=d._rows;
+            this->_bits=d._bits;
+            this->_chs=d._chs;
+            this->_frames=d._frames;
+            this->_samples=d._samples;
+            this->_planar=d._planar;
+            this->_photometric=d._photometric;
+            this->_is_signed=d._is_signed;
+            
+            this->_px_spacing_row=d._px_spacing_row;
+            this->_px_spacing_col=d._px_spacing_col;
+            this->_image_pos_x=d._image_pos_x;
+            this->_image_pos_y=d._image_pos_y;
+            this->_image_pos_z=d._image_pos_z;
+
+            this->_architecture_as_little_endian=d._architecture_as_little_endian;
+            this->_format_as_little_endian=d._format_as_little_endian;
+            this->_format_as_explicit=d._format_as_explicit;
+            this->_format_as_deflate=d._format_as_deflate;
+            this->_format_as_encapsulated=d._format_as_encapsulated;
+            this->_format_as_jpeg=d._format_as_jpeg;
+
+            this->_defer_frame_data=false;
+            this->_stop_frame_data=false;
+            this->_frame_data_left=d._frame_data_left;
+            this->_frame_data_offset=d._frame_data_offset;
+            this->_frame_data_length=d._frame_data_length;
+            this->_defer_fragments=false;
+            this->_fragments=d._fragments;
+            this->_basic_offset_table=d._basic_offset_table;
+
+            this->_collect_stats=d._collect_stats;
+            this->_stats_bins=d._stats_bins;
+            this->_stats_rescaled=d._stats_rescaled;
+            this->_stats_lo=d._stats_lo;
+            this->_stats_hi=d._stats_hi;
+            this->_stats=d._stats;
+
+            if(!compact){
+                this->_element=std::map<uint32_t,Element>(d._element);
+
+                std::map<uint32_t,Element>::iterator itr=
+                    this->_element.begin();
+                std::map<uint32_t,Element>::iterator itrEnd=
+                    this->_element.end();
+                for(;itr!=itrEnd;itr++)
+                    itr->second._set_parent(this);
+            }
+        };
+
+        ///
+        /// constructor with parse
+        ///
+        /// @param ist input stream
+        ///
+        Dicom(std::istream &ist,bool parse_all=true)
+            :_defer_frame_data(false),
+             _stop_frame_data(false),
+             _frame_data_left(false),
+             _defer_fragments(false),
+             _collect_stats(false),
+             _stats_bins(256),
+             _stats_rescaled(true),
+             _stats_lo(0.0),
+             _stats_hi(0.0)
+        {
+            this->parse(ist,parse_all);
+        };
+        
+        ///
+        /// destructor
+        ///
+        ~Dicom()
+        {
+            this->_element.clear();
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return parsed DICOM image as cv::mat
+        ///         (1ch of stored depth, or BGR 3ch for color images;
+        ///          frames are stacked vertically, see frame())
+        ///
+        cv::Mat &image(bool need_rescale=true){
+            if(this->_image.empty())
+                this->parse_image(need_rescale);
+
+            return this->_image;
+        }
+
+        ///
+        /// a reader accessor for multi-frame image
+        ///
+        /// @param index frame index
+        /// @param need_rescale rescale or not when image parsing
+        ///
+        /// @return index-th frame of image() without copy
+        ///
+        /// Frames of multi-frame image are stacked vertically in image();
+        /// image() has rows() x frames() rows.
+        ///
+        cv::Mat frame(int index,bool need_rescale=true)
+        {
+            cv::Mat &img=this->image(need_rescale);
+            if(index<0 || index>=this->_frames)
+                throw std::out_of_range("Bad frame index");
+
+            return img.rowRange(index*this->_rows,(index+1)*this->_rows);
+        }
+
+        ///
+        ///  a reader accessor
+        ///
+        /// @return number of frames or 0
+        ///
+        int frames() const { return this->_frames; }
+
+        ///
+        ///  a reader accessor
+        ///
+        /// @return image rows or 0
+        ///
+        int rows() const { return this->_rows; }
+
+        ///
+        ///  a reader accessor
+        ///
+        /// @return image cols or 0
+        ///
+        int cols() const { return this->_cols; }
+
+        ///
+        ///  a reader accessor
+        ///
+        /// @return bit par pixel or 0
+        ///
+        int bit_par_pixel() const { return this->_bits; }
+
+        ///
+        ///  a reader accessor
+        ///
+        /// @return image channels (1: gray, 3: BGR) or 0
+        ///
+        int channels() const { return this->_chs; }
+
+        ///
+        ///  a reader accessor
+        ///
+        /// @return Photometric Interpretation as PHOTO_* constant
+        ///
+        int photometric() const { return this->_photometric; }
+
+        ///
+        ///  a reader accessor
+        ///
+        /// @return true (pixel format is signed) or false
+        ///
+        bool is_signed() const { return this->_is_signed; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return row dir. pixel spacing or 0.0
+        ///
+        float px_spacing_row() const { return this->_px_spacing_row; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return column dir. pixel spacing or 0.0
+        ///
+        float px_spacing_col() const { return this->_px_spacing_col; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return image x position or NaN
+        ///
+        float image_pos_x() const { return this->_image_pos_x; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return image y position or NaN
+        ///
+        float image_pos_y() const { return this->_image_pos_y; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return image z position or NaN
+        ///
+        float image_pos_z() const { return this->_image_pos_z; }
+
+        
+        ///
+        /// query method that specify element exists or not
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        ///
+        /// @return true or false
+        ///
+        bool has_element(const uint16_t group,const uint16_t id) const
+        {
+            TypeTag tag={{group,id}};
+
+            return this->has_element(tag.number);
+        }
+        bool has_element(const TypeTag tag) const
+        {
+            return this->has_element(tag.number);
+        }
+        bool has_element(const uint32_t number) const
+        {
+            if(this->_element.find(number)==this->_element.end())
+                return false;
+            else
+                return true;
+        }
+        
+        ///
+        /// reader accessor for specify element
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        ///
+        /// @return Element object which has specified tag
+        ///
+        Element &element(const uint16_t group,const uint16_t id)
+        {
+            TypeTag tag={{group,id}};
+
+            return this->_element[tag.number];
+        }
+        Element &element(const TypeTag tag)
+        {
+            return this->_element[tag.number];
+        }
+        Element &element(const uint32_t number)
+        {
+            return this->_element[number];
+        }
+        Element &operator[](const TypeTag tag)
+        {
+            return this->_element[tag.number];
+        }
+
+        ///
+        /// lookup of specify element without insertion
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        ///
+        /// @return Element object which has specified tag, or NULL
+        ///
+        /// Unlike element(), a missing tag is not added, so find()
+        /// may be called from many threads while nothing modifies
+        /// the object.
+        ///
+        const Element *find(const uint16_t group,const uint16_t id) const
+        {
+            TypeTag tag={{group,id}};
+
+            return this->find(tag.number);
+        }
+        const Element *find(const TypeTag tag) const
+        {
+            return this->find(tag.number);
+        }
+        const Element *find(const uint32_t number) const
+        {
+            std::map<uint32_t,Element>::const_iterator itr=
+                this->_element.find(number);
+
+            return (itr==this->_element.end()) ? NULL : &itr->second;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return tags of all elements in tag order
+        ///
+        std::vector<TypeTag> tags() const
+        {
+            std::vector<TypeTag> r;
+            r.reserve(this->_element.size());
+
+            std::map<uint32_t,Element>::const_iterator itr=
+                this->_element.begin();
+            for(;itr!=this->_element.end();itr++)
+                r.push_back(itr->second._tag);
+            std::sort(r.begin(),r.end(),_tag_less);
+
+            return r;
+        }
+
+        ///
+        /// parse DICOM stream
+        ///
+        /// @param ist input stream
+        /// @param parse_all parse with image or only summary
+        /// @param need_rescale rescale or not when image parsing
+        ///
+        /// @return self
+        ///
+        Dicom &parse(std::istream &ist,
+                     bool parse_all=true,
+                     bool need_rescale=true)
+        {
+            if(!ist)
+                throw StreamError("Bad stream gaven");
+
+            // test this machine's endian
+            uint16_t endian_test=1;
+            if(*(char*)&endian_test)
+                this->_architecture_as_little_endian=true;
+            else
+                this->_architecture_as_little_endian=false;
+
+            this->_cols=0;
+            this->_rows=0;
+            this->_bits=0;
+            this->_chs=0;
+            this->_frames=0;
+            this->_is_signed=false;
+
+            this->_px_spacing_row=0.0f;
+            this->_px_spacing_col=0.0f;
+            this->_image_pos_x=nanf("");
+            this->_image_pos_y=nanf("");
+            this->_image_pos_z=nanf("");
+
+
+            this->_element.clear();
+
+            this->_frame_data_offset=-1;
+            this->_frame_data_length=0;
+            this->_frame_data_left=false;
+            this->_fragments.clear();
+            this->_basic_offset_table.clear();
+            this->_display_lut.clear();
+            this->_stats=PixelStats();
+
+            //ist.seekg(0); // rewind stream
+            ist.seekg(128); // skip null header
+
+            //
+            // check DICOM header
+            //
+            char dicom_id_str[4];
+            ist.read(dicom_id_str,4);
+
+            if(ist.eof() ||
+               !ist.good() ||
+               dicom_id_str[0]!='D' ||
+               dicom_id_str[1]!='I' ||
+               dicom_id_str[2]!='C' ||
+               dicom_id_str[3]!='M')
+                throw ParseError("not DICOM format");
+
+            //
+            // read meta data (group 0x0002)
+            // as LEE (Little Endian Explicit VR)
+            //
+            this->_format_as_little_endian=true;
+            this->_format_as_explicit=true;
+            this->_format_as_deflate=false;
+            this->_format_as_encapsulated=false;
+            this->_format_as_jpeg=false;
+
+            while(true){
+                Element e(this);
+                TypeTag tag=e.parse_tag(ist);
+                if(tag.id[0]!=TAG_GROUP_META){
+                    e.rewind_tag(ist);
+                    break;
+                }
+                e.parse_value(ist);
+                this->_element[e.tag().number]=e;
+            }
+
+
+            //
+            // get format info.
+            //
+            if(this->has_element(TAG_TRANSFER_SYNTAX_UID)){
+                std::string s=
+                    this->element(TAG_TRANSFER_SYNTAX_UID).as<std::string>();
+                if(s.find("1.2.840.10008.1.2.2")!=std::string::npos){
+                    // BEE
+                    this->_format_as_little_endian=false;
+                    this->_format_as_explicit=true;
+                    this->_format_as_deflate=false;
+                }
+                else if(s.find("1.2.840.10008.1.2.1.99")!=std::string::npos){
+                    // Deflated LEE
+                    this->_format_as_little_endian=true;
+                    this->_format_as_explicit=true;
+                    this->_format_as_deflate=true;
+                }
+                else if(s.find("1.2.840.10008.1.2.1")!=std::string::npos){
+                    // LEE
+                    this->_format_as_little_endian=true;
+                    this->_format_as_explicit=true;
+                    this->_format_as_deflate=false;
+                }
+                else if(s.find("1.2.840.10008.1.2.4.")!=std::string::npos ||
+                        s.find("1.2.840.10008.1.2.5")!=std::string::npos){
+                    // encapsulated Frame Data in LEE;
+                    // JPEG Baseline (.50) and Extended (.51) are decoded
+                    this->_format_as_little_endian=true;
+                    this->_format_as_explicit=true;
+                    this->_format_as_deflate=false;
+                    this->_format_as_encapsulated=true;
+                    this->_format_as_jpeg=
+                        (s.find("1.2.840.10008.1.2.4.50")!=std::string::npos ||
+                         s.find("1.2.840.10008.1.2.4.51")!=std::string::npos);
+                }
+                else if(s.find("1.2.840.10008.1.2")!=std::string::npos){
+                    // LEI
+                    this->_format_as_little_endian=true;
+                    this->_format_as_explicit=false;
+                    this->_format_as_deflate=false;
+                }
+            }
+            if(this->_format_as_deflate)
+                throw std::runtime_error("Deflated LEE has not been supported");
+
+            while(true){
+                try{
+                    Element e(this,ist);
+                    this->_element[e.tag().number]=e;
+                }
+                catch(StreamError &e){
+                    break;
+                }
+                if(this->_frame_data_left)
+                    break;
+            }
+
+            if(parse_all)
+                this->parse_image(need_rescale);
+            else
+                this->parse_summary();
+
+            return *this;
+        }
+
+        ///
+        /// parse DICOM tags
+        ///
+        /// @return self
+        ///
+        Dicom &parse_summary()
+        {
+            this->_cols=0;
+            this->_rows=0;
+            this->_bits=0;
+            this->_chs=0;
+            this->_frames=0;
+            this->_is_signed=false;
+
+            this->_px_spacing_row=0.0f;
+            this->_px_spacing_col=0.0f;
+            this->_image_pos_x=nanf("");
+            this->_image_pos_y=nanf("");
+            this->_image_pos_z=nanf("");
+
+            if(!this->has_element(TAG_PHOTO_INTERPRET))
+                throw MissingTagError(
+                    "Could not found Photometric Interpretation Tag");
+            std::string p_int=
+                this->element(TAG_PHOTO_INTERPRET).as<std::string>();
+#ifdef DEBUG
+            fprintf(stderr,"\nPhotometric Interpretation: %s\n",p_int.c_str());
+#endif
+
+            boost::algorithm::trim_right_if(p_int,
+                                            boost::is_any_of(std::string(" \0",2)));
+            if(p_int=="MONOCHROME2")
+                this->_photometric=PHOTO_MONOCHROME2;
+            else if(p_int=="MONOCHROME1")
+                this->_photometric=PHOTO_MONOCHROME1;
+            else if(p_int=="RGB")
+                this->_photometric=PHOTO_RGB;
+            else if(p_int=="YBR_FULL")
+                this->_photometric=PHOTO_YBR_FULL;
+            else if(p_int=="YBR_FULL_422")
+                this->_photometric=PHOTO_YBR_FULL_422;
+            else if(p_int=="PALETTE COLOR")
+                this->_photometric=PHOTO_PALETTE_COLOR;
+            else
+                throw std::runtime_error("Unsupported Photometric Interpretation");
+
+            //
+            // samples per pixel and its arrangement
+            //
+            if(this->has_element(TAG_SAMPLES_PER_PX))
+                this->_samples=
+                    (int)this->element(TAG_SAMPLES_PER_PX).as<uint16_t>();
+            else
+                this->_samples=(this->_photometric==PHOTO_RGB ||
+                                this->_photometric==PHOTO_YBR_FULL ||
+                                this->_photometric==PHOTO_YBR_FULL_422) ?
+                    3 : 1;
+            if((this->_samples==3)!=(this->_photometric==PHOTO_RGB ||
+                                     this->_photometric==PHOTO_YBR_FULL ||
+                                     this->_photometric==PHOTO_YBR_FULL_422))
+                throw ParseError("Samples per Pixel mismatches "
+                                 "Photometric Interpretation");
+
+            this->_planar=0;
+            if(this->_samples>1 && this->has_element(TAG_PLANAR_CONF))
+                this->_planar=
+                    (int)this->element(TAG_PLANAR_CONF).as<uint16_t>();
+            if(this->_photometric==PHOTO_YBR_FULL_422)
+                this->_planar=0;
+
+            this->_chs=(this->_photometric==PHOTO_PALETTE_COLOR) ?
+                3 : this->_samples;
+#ifdef DEBUG
+            fprintf(stderr,"Samples per Pixel: %d (planar %d)\n",
+                    this->_samples,
+                    this->_planar);
+#endif
+
+
+            //
+            // signed or unsigned
+            //
+            int px_rep;
+            if(this->has_element(TAG_PX_REP))
+                px_rep=(int)this->element(TAG_PX_REP).as<uint16_t>();
+            else if(this->_is_float_pixel())
+                px_rep=1;
+            else
+                throw MissingTagError(
+                    "Could not found Pixel Representation Tag");
+#ifdef DEBUG
+            fprintf(stderr,"Pixel Representation: %d\n",px_rep);
+#endif
+            if(px_rep==0)
+                this->_is_signed=false;
+            else
+                this->_is_signed=true;
+
+
+            if(!this->has_element(TAG_BIT_ALLOC))
+                throw MissingTagError(
+                    "Could not found Bit Allocation Tag");
+            this->_bits=(int)this->element(TAG_BIT_ALLOC).as<uint16_t>();
+#ifdef DEBUG
+            fprintf(stderr,"Bit Allocation: %d\n",this->_bits);
+#endif
+
+            if(!this->has_element(TAG_ROWS) || 
+                !this->has_element(TAG_COLS))
+                throw MissingTagError(
+                    "Could not found Cols and/or Rows Tag");
+            this->_rows=(int)this->element(TAG_ROWS).as<uint16_t>();
+            this->_cols=(int)this->element(TAG_COLS).as<uint16_t>();
+#ifdef DEBUG
+            fprintf(stderr,"%d x %d\n",this->_cols,this->_rows);
+#endif
+
+            this->_frames=1;
+            if(this->has_element(TAG_NUM_FRAMES)){
+                int frames;
+                if(this->element(TAG_NUM_FRAMES).as_ints(&frames,1)==1)
+                    this->_frames=std::max(1,frames);
+#ifdef DEBUG
+                fprintf(stderr,"Number of Frames: %d\n",this->_frames);
+#endif
+            }
+
+
+            //
+            // misc information
+            //
+            double v[3];
+            //
+            // pixel spacing
+            //
+            if(this->has_element(TAG_PX_SPACING) &&
+               this->element(TAG_PX_SPACING).as_doubles(v,2)==2){
+                this->_px_spacing_row=(float)v[0];
+                this->_px_spacing_col=(float)v[1];
+
+#ifdef DEBUG
+                fprintf(stderr,"Pixel Spacing: %f, %f\n",
+                        this->_px_spacing_row,
+                        this->_px_spacing_col);
+#endif
+            }
+
+            //
+            // image position
+            //
+            if(this->has_element(TAG_IMG_POSITION) &&
+               this->element(TAG_IMG_POSITION).as_doubles(v,3)==3){
+                this->_image_pos_x=(float)v[0];
+                this->_image_pos_y=(float)v[1];
+                this->_image_pos_z=(float)v[2];
+
+#ifdef DEBUG
+                fprintf(stderr,"Image Position: %f, %f, %f\n",
+                        this->_image_pos_x,
+                        this->_image_pos_y,
+                        this->_image_pos_z);
+#endif
+            }
+
+            return *this;
+        }
+
+        Dicom &parse_image(bool need_rescale=true)
+        {
+            if(!this->_cols ||
+               !this->_rows ||
+               !this->_bits ||
+               !this->_chs)
+            this->parse_summary();
+
+            //
+            // encapsulated frames are decoded one by one into planes
+            //
+            if(this->_format_as_encapsulated){
+                _FrameJob job(this,need_rescale,this->_image);
+                try{
+                    for(int i=0;i<this->_frames;i++)
+                        job(i);
+                }
+                catch(...){
+                    this->_image.release();
+                    throw;
+                }
+                if(this->_collect_stats && !this->_is_color())
+                    this->_stats_from_mat(this->_image);
+
+                return *this;
+            }
+
+            //
+            // convert Frame Data (0x7fe0,0x0010) to cv::Mat
+            //
+            const unsigned char *src;
+            size_t len;
+            bool swap;
+            this->_frame_data_bytes(src,len,swap);
+
+            //
+            // statistics are counted by the kernel
+            //
+            _StatsCounter counter;
+            _StatsCounter *pc=NULL;
+            if(this->_collect_stats &&
+               !this->_is_color() &&
+               !this->_is_float_pixel()){
+                this->_init_counter(counter);
+                pc=&counter;
+            }
+
+            this->_decode_native_frames(src,len,swap,need_rescale,
+                                        this->_image,pc);
+
+            if(pc)
+                this->_stats_from_counter(counter);
+            else if(this->_collect_stats && !this->_is_color())
+                this->_stats_from_mat(this->_image);
+            
+            return *this;
+        }
+
+        ///
+        /// decode all frames without modifying image()
+        ///
+        /// @param need_rescale rescale or not
+        ///
+        /// @return decoded image as image(); statistics are not collected
+        ///
+        /// Threads may decode a parsed object at the same time. Frame
+        /// Data must have been loaded; Frame Data left on the stream
+        /// by parse_deferred() can be read by the caller and given to
+        /// decode_image(src,len).
+        ///
+        /// throw ParseError, MissingTagError, std::runtime_error
+        ///
+        cv::Mat decode_image(bool need_rescale=true)
+        {
+            if(!this->_cols || !this->_rows || !this->_bits || !this->_chs)
+                throw ParseError("Image attributes have not been parsed");
+
+            cv::Mat dst;
+            if(this->_format_as_encapsulated){
+                _FrameJob job(this,need_rescale,dst);
+                for(int i=0;i<this->_frames;i++)
+                    job(i);
+
+                return dst;
+            }
+
+            const unsigned char *src;
+            size_t len;
+            bool swap;
+            this->_frame_data_bytes(src,len,swap);
+            this->_decode_native_frames(src,len,swap,need_rescale,dst);
+
+            return dst;
+        }
+
+        ///
+        /// decode all frames from native Frame Data
+        ///
+        /// @param src Frame Data in the byte order of the stream
+        /// @param len length of src
+        /// @param need_rescale rescale or not
+        ///
+        /// @return decoded image as image(); statistics are not collected
+        ///
+        /// throw ParseError, std::invalid_argument for encapsulated
+        ///       Frame Data, std::runtime_error
+        ///
+        cv::Mat decode_image(const unsigned char *src,
+                             size_t len,
+                             bool need_rescale=true)
+        {
+            if(!this->_cols || !this->_rows || !this->_bits || !this->_chs)
+                throw ParseError("Image attributes have not been parsed");
+            if(this->_format_as_encapsulated)
+                throw std::invalid_argument("Frame Data is encapsulated");
+
+            cv::Mat dst;
+            this->_decode_native_frames(src,len,this->_need_byte_swap(),
+                                        need_rescale,dst);
+
+            return dst;
+        }
+
+        ///
+        /// parse DICOM stream and decode a reduced resolution image
+        ///
+        /// @param ist input stream
+        /// @param factor reduction factor (1, 2, 4 or 8)
+        /// @param mode REDUCE_SUBSAMPLE or REDUCE_BOX
+        /// @param need_rescale rescale or not
+        /// @param need_window window to 8bit or not
+        ///
+        /// @return self
+        ///
+        /// The reduced image can be obtained via image(). When the
+        /// stream is seekable, Frame Data is not loaded into memory;
+        /// only the rows needed for the output are read from the
+        /// stream (all rows for REDUCE_BOX, every factor-th row for
+        /// REDUCE_SUBSAMPLE). Only the first frame is decoded.
+        ///
+        Dicom &parse_reduced(std::istream &ist,
+                             int factor,
+                             int mode=REDUCE_BOX,
+                             bool need_rescale=true,
+                             bool need_window=false)
+        {
+            if(!ist)
+                throw StreamError("Bad stream gaven");
+
+            this->_defer_frame_data=(ist.tellg()!=std::streampos(-1));
+            try{
+                this->parse(ist,false);
+            }
+            catch(...){
+                this->_defer_frame_data=false;
+                throw;
+            }
+            this->_defer_frame_data=false;
+
+            if(this->_frame_data_offset<0){
+                // Frame Data has been loaded (non-seekable stream
+                // or encapsulated Frame Data)
+                this->_image=this->image_reduced(factor,
+                                                 mode,
+                                                 need_rescale,
+                                                 need_window);
+                return *this;
+            }
+
+            ist.clear();
+            this->_decode_reduced(NULL,
+                                  (size_t)this->_frame_data_length,
+                                  &ist,
+                                  this->_need_byte_swap(),
+                                  factor,
+                                  mode,
+                                  need_rescale,
+                                  need_window,
+                                  this->_image);
+
+            return *this;
+        }
+
+        ///
+        /// parse DICOM stream without loading Frame Data
+        ///
+        /// @param ist input stream
+        /// @param defer_encapsulated leave encapsulated Frame Data on
+        ///        the stream too
+        ///
+        /// @return this object
+        ///
+        /// When the stream is seekable, Frame Data of known length is
+        /// left on the stream and its position is kept; frames can be
+        /// read from frame_data_offset() and decoded by
+        /// decode_frame(). Otherwise Frame Data is loaded as parse().
+        ///
+        /// With defer_encapsulated, only Item headers of encapsulated
+        /// Frame Data are read; frame_fragments() tells where the
+        /// fragments of a frame are, and their joined bytes are
+        /// decoded by decode_frame().
+        ///
+        /// throw StreamError, ParseError, MissingTagError
+        ///
+        Dicom &parse_deferred(std::istream &ist,bool defer_encapsulated=false)
+        {
+            if(!ist)
+                throw StreamError("Bad stream gaven");
+
+            this->_defer_frame_data=(ist.tellg()!=std::streampos(-1));
+            this->_defer_fragments=
+                this->_defer_frame_data && defer_encapsulated;
+            try{
+                this->parse(ist,false);
+            }
+            catch(...){
+                this->_defer_frame_data=false;
+                this->_defer_fragments=false;
+                throw;
+            }
+            this->_defer_frame_data=false;
+            this->_defer_fragments=false;
+
+            return *this;
+        }
+
+        ///
+        /// fragments of a frame of encapsulated Frame Data left on
+        /// the stream by parse_deferred(ist,true)
+        ///
+        /// @param index frame index
+        /// @param ranges stream positions and lengths of the fragments
+        ///
+        /// throw ParseError, std::out_of_range
+        ///
+        void frame_fragments(int index,
+                             std::vector<std::pair<std::streamoff,size_t> >
+                             &ranges) const
+        {
+            if(index<0 || index>=std::max(1,this->_frames))
+                throw std::out_of_range("Bad frame index");
+
+            const std::vector<_Fragment> &f=this->_fragments;
+            size_t n=f.size();
+            if(n<2)
+                throw ParseError("Frame Data has no fragment");
+
+            size_t first,last;
+            if(n-1==(size_t)std::max(1,this->_frames)){
+                first=index+1;
+                last=first+1;
+            }
+            else if(this->_frames<=1){
+                first=1;
+                last=n;
+            }
+            else{
+                this->_deferred_fragments(index,first,last);
+            }
+
+            ranges.clear();
+            for(size_t i=first;i<last;i++)
+                ranges.push_back(std::make_pair(f[i].offset,
+                                                (size_t)f[i].length));
+        }
+
+        ///
+        /// parse DICOM stream until Frame Data
+        ///
+        /// @param ist input stream
+        ///
+        /// @return this object
+        ///
+        /// Parsing stops at native Frame Data of known length and the
+        /// stream is left at its value, which is frame_data_length()
+        /// bytes of frames to be read by the caller; see
+        /// is_frame_data_left(). Elements after Frame Data are not
+        /// parsed. Encapsulated Frame Data is loaded as parse().
+        ///
+        /// The stream must support seeking back in the file meta
+        /// information; StripReader of dicom_strip.h wraps
+        /// non-seekable streams for it.
+        ///
+        /// throw StreamError, ParseError, MissingTagError
+        ///
+        Dicom &parse_until_frame_data(std::istream &ist)
+        {
+            if(!ist)
                 throw StreamError("Bad stream gaven");
 
-            // test this machine's endian
-            uint16_t endian_test=1;
-            if(*(char*)&endian_test)
-                this->_architecture_as_little_endian=true;
-            else
-                this->_architecture_as_little_endian=false;
+            this->_stop_frame_data=true;
+            try{
+                this->parse(ist,false);
+            }
+            catch(...){
+                this->_stop_frame_data=false;
+                throw;
+            }
+            this->_stop_frame_data=false;
+
+            return *this;
+        }
+
+        ///
+        /// query method that Frame Data is left on the stream by
+        /// parse_until_frame_data() or not
+        ///
+        /// @return true or false
+        ///
+        bool is_frame_data_left() const { return this->_frame_data_left; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return stream position of Frame Data left by
+        ///         parse_deferred(), or -1 when it has been loaded
+        ///
+        std::streamoff frame_data_offset() const
+        {
+            return this->_frame_data_offset;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return bytes of Frame Data left by parse_deferred()
+        ///
+        uint64_t frame_data_length() const
+        {
+            return this->_frame_data_length;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return bytes of a native frame
+        ///
+        size_t frame_bytes() const { return this->_frame_bytes(); }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return bytes of a native row, or 0 when rows can not be
+        ///         decoded separately (planar color, or rows not
+        ///         aligned to byte)
+        ///
+        size_t row_bytes() const
+        {
+            if(this->_planar && this->_samples>1)
+                return 0;
+
+            size_t bits=(size_t)this->_cols*this->_bits;
+            if(this->_photometric==PHOTO_YBR_FULL_422){
+                if(this->_cols%2)
+                    return 0; // pairs of pixels over rows
+                bits*=2;
+            }
+            else
+                bits*=this->_samples;
+
+            return (bits%8) ? 0 : bits/8;
+        }
+
+        ///
+        /// decode native rows
+        ///
+        /// @param src rows x row_bytes() bytes in the byte order of
+        ///        the stream
+        /// @param rows number of rows
+        /// @param need_rescale rescale or not
+        /// @param dst rows of frame() are set; its buffer is reused
+        ///        when the size and type match
+        ///
+        /// Statistics are not collected.
+        ///
+        /// throw ParseError, std::runtime_error when row_bytes() is 0
+        ///
+        void decode_rows(const unsigned char *src,
+                         int rows,
+                         bool need_rescale,
+                         cv::Mat &dst)
+        {
+            if(!this->_cols || !this->_rows || !this->_bits || !this->_chs)
+                throw ParseError("Image attributes have not been parsed");
+            if(!this->row_bytes())
+                throw std::runtime_error(
+                    "Decoding rows of this image has not been supported");
+
+            size_t n=(size_t)rows*this->_cols;
+            if(this->_is_color()){
+                this->_color_check();
+                dst.create(rows,
+                           this->_cols,
+                           (this->_bits==8) ? CV_8UC3 : CV_16UC3);
+                this->_color_pixels(src,this->_need_byte_swap(),n,dst.ptr());
+
+                return;
+            }
+
+            float slope=1.0,interception=0.0;
+            bool rescaled=need_rescale &&
+                this->_rescale_params(slope,interception);
+
+            dst.create(rows,this->_cols,this->_image_type());
+            this->_unpack_mat(src,this->_need_byte_swap(),
+                              rescaled,slope,interception,dst);
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @param slope Rescale Slope (0028,1053)
+        /// @param interception Rescale Intercept (0028,1052)
+        ///
+        /// @return true when both are specified; otherwise slope is 1,
+        ///         interception is 0 and image() is not rescaled
+        ///
+        bool rescale_params(float &slope,float &interception)
+        {
+            if(this->_rescale_params(slope,interception))
+                return true;
+
+            slope=1.0;
+            interception=0.0;
+
+            return false;
+        }
+
+        ///
+        /// decode a frame
+        ///
+        /// @param src bytes of a native frame in the byte order of the
+        ///        stream, or a JPEG bitstream of encapsulated Frame Data
+        /// @param len length of src
+        /// @param need_rescale rescale or not
+        ///
+        /// @return decoded frame as frame()
+        ///
+        /// Neither image() nor other states are modified, so threads
+        /// may decode frames of a parsed object at the same time.
+        ///
+        /// throw ParseError, std::runtime_error
+        ///
+        cv::Mat decode_frame(const unsigned char *src,
+                             size_t len,
+                             bool need_rescale=true)
+        {
+            if(!this->_cols || !this->_rows || !this->_bits || !this->_chs)
+                throw ParseError("Image attributes have not been parsed");
+
+            if(this->_format_as_encapsulated)
+                return this->_decode_bitstream(src,len,need_rescale);
+
+            return this->_decode_native(src,len,this->_need_byte_swap(),
+                                        need_rescale);
+        }
+
+        ///
+        /// decode a frame of loaded Frame Data
+        ///
+        /// @param index frame index
+        /// @param need_rescale rescale or not
+        ///
+        /// @return decoded frame as frame()
+        ///
+        /// Only the frame is decoded; image() is not modified, and
+        /// threads may decode frames at the same time.
+        ///
+        /// throw ParseError, MissingTagError, std::out_of_range,
+        ///       std::runtime_error
+        ///
+        cv::Mat decode_frame(int index,bool need_rescale=true)
+        {
+            if(!this->_cols || !this->_rows || !this->_bits || !this->_chs)
+                throw ParseError("Image attributes have not been parsed");
+            if(index<0 || index>=this->_frames)
+                throw std::out_of_range("Bad frame index");
+
+            if(this->_format_as_encapsulated){
+                std::vector<unsigned char> joined;
+                const unsigned char *src;
+                size_t len;
+                this->_frame_bitstream(index,joined,src,len);
+
+                return this->_decode_bitstream(src,len,need_rescale);
+            }
+
+            const unsigned char *src;
+            size_t len;
+            bool swap;
+            this->_frame_data_bytes(src,len,swap);
+
+            size_t frame_bytes=this->_frame_bytes();
+            if(this->_bits==1 && index &&
+               ((size_t)this->_rows*this->_cols)%8)
+                throw std::runtime_error(
+                    "1bit multi-frame has not been supported");
+            if(len<frame_bytes*(index+1))
+                throw ParseError("Frame Data is too short");
+
+            return this->_decode_native(src+frame_bytes*index,
+                                        frame_bytes,
+                                        swap,
+                                        need_rescale);
+        }
+
+        ///
+        /// query method that Frame Data is encapsulated or not
+        ///
+        /// @return true or false
+        ///
+        bool is_encapsulated() const { return this->_format_as_encapsulated; }
+
+        ///
+        /// parse image with a thread pool
+        ///
+        /// @param pool object which has parallel_for(begin,end,f),
+        ///        e.g. ThreadPool of dicom_pool.h
+        /// @param need_rescale rescale or not
+        ///
+        /// @return this object
+        ///
+        /// Encapsulated frames are decoded in parallel into their
+        /// planes of image(); other Frame Data is parsed as
+        /// parse_image(). The image can be obtained via image() and
+        /// frame().
+        ///
+        template <class Pool>
+        Dicom &parse_image_parallel(Pool &pool,bool need_rescale=true)
+        {
+            if(!this->_format_as_encapsulated)
+                return this->parse_image(need_rescale);
+
+            if(!this->_cols ||
+               !this->_rows ||
+               !this->_bits ||
+               !this->_chs)
+                this->parse_summary();
+
+            this->_image=this->decode_image_parallel(pool,need_rescale);
+            if(this->_collect_stats && !this->_is_color())
+                this->_stats_from_mat(this->_image);
+
+            return *this;
+        }
+
+        ///
+        /// decode all frames with a thread pool without modifying image()
+        ///
+        /// @param pool object which has parallel_for(begin,end,f)
+        /// @param need_rescale rescale or not
+        ///
+        /// @return decoded image as decode_image()
+        ///
+        template <class Pool>
+        cv::Mat decode_image_parallel(Pool &pool,bool need_rescale=true)
+        {
+            if(!this->_format_as_encapsulated)
+                return this->decode_image(need_rescale);
+            if(!this->_cols || !this->_rows || !this->_bits || !this->_chs)
+                throw ParseError("Image attributes have not been parsed");
+
+            cv::Mat dst;
+            _FrameJob job(this,need_rescale,dst);
+            pool.parallel_for(0,(size_t)this->_frames,job);
+
+            return dst;
+        }
+
+        ///
+        /// a reader accessor with a thread pool
+        ///
+        /// @param pool object which has parallel_for(begin,end,f)
+        /// @param need_rescale rescale or not when image parsing
+        ///
+        /// @return image as image(); see parse_image_parallel()
+        ///
+        template <class Pool>
+        cv::Mat &image_parallel(Pool &pool,bool need_rescale=true)
+        {
+            if(this->_image.empty())
+                this->parse_image_parallel(pool,need_rescale);
+
+            return this->_image;
+        }
+
+        ///
+        /// decode a reduced resolution image from loaded Frame Data
+        ///
+        /// @param factor reduction factor (1, 2, 4 or 8)
+        /// @param mode REDUCE_SUBSAMPLE or REDUCE_BOX
+        /// @param need_rescale rescale or not
+        /// @param need_window window to 8bit or not
+        ///
+        /// @return reduced image of first frame;
+        ///         BGR for color images,
+        ///         CV_8UC1 when windowed,
+        ///         CV_32FC1 when rescaled,
+        ///         otherwise same depth as stored pixels
+        ///
+        /// Rescale and windowing are applied only to output pixels.
+        /// Window Center/Width (0028,1050/1051) are used for windowing;
+        /// the range of output pixels is used when they are missing.
+        ///
+        cv::Mat image_reduced(int factor,
+                              int mode=REDUCE_BOX,
+                              bool need_rescale=true,
+                              bool need_window=false)
+        {
+            if(!this->_cols ||
+               !this->_rows ||
+               !this->_bits ||
+               !this->_chs)
+                this->parse_summary();
+
+            const unsigned char *src;
+            size_t len;
+            bool swap;
+            this->_frame_data_bytes(src,len,swap);
+
+            cv::Mat dst;
+            this->_decode_reduced(src,
+                                  len,
+                                  NULL,
+                                  swap,
+                                  factor,
+                                  mode,
+                                  need_rescale,
+                                  need_window,
+                                  dst);
+
+            return dst;
+        }
+
+        ///
+        /// 8bit display image using VOI attributes of this object
+        ///
+        /// @return windowed first frame as CV_8UC1 (CV_8UC3 for color)
+        ///
+        /// MONOCHROME1 images are inverted so that minimum is white.
+        /// VOI LUT Sequence (0028,3010) is used when present, then
+        /// Window Center/Width (0028,1050/1051) with VOI LUT Function
+        /// (0028,1056). Otherwise whole range of pixels is displayed.
+        ///
+        cv::Mat display_image()
+        {
+            VoiTransform voi;
+            return this->_display_image(voi,true);
+        }
+
+        ///
+        /// 8bit display image with specified window
+        ///
+        /// @param center window center in rescaled unit
+        /// @param width window width in rescaled unit
+        /// @param function VOI_LINEAR, VOI_LINEAR_EXACT or VOI_SIGMOID
+        ///
+        /// @return windowed first frame as CV_8UC1 (CV_8UC3 for color)
+        ///
+        /// Stored pixels are mapped to 8bit in one table lookup pass
+        /// straight from Frame Data. The table is kept while the same
+        /// window is requested again.
+        ///
+        cv::Mat display_image(float center,
+                              float width,
+                              int function=VOI_LINEAR)
+        {
+            if(function!=VOI_LINEAR &&
+               function!=VOI_LINEAR_EXACT &&
+               function!=VOI_SIGMOID)
+                throw std::invalid_argument("Unsupported VOI LUT Function");
+            if(width<=0.0)
+                throw std::invalid_argument("Bad window width");
+
+            VoiTransform voi;
+            voi.function=function;
+            voi.center=center;
+            voi.width=width;
+
+            return this->_display_image(voi,false);
+        }
+
+        ///
+        /// UID under 2.25 (UUID derived UID)
+        ///
+        /// @param bytes 128bit number in big endian
+        ///
+        /// @return "2.25." followed by the number in decimal
+        ///
+        static std::string uid_from_bytes(const unsigned char *bytes)
+        {
+            uint32_t w[4];
+            for(int i=0;i<4;i++)
+                w[i]=((uint32_t)bytes[i*4]<<24)|
+                    ((uint32_t)bytes[i*4+1]<<16)|
+                    ((uint32_t)bytes[i*4+2]<<8)|
+                    bytes[i*4+3];
+
+            std::string digits;
+            while(w[0] || w[1] || w[2] || w[3]){
+                uint64_t rem=0;
+                for(int i=0;i<4;i++){
+                    uint64_t cur=(rem<<32)|w[i];
+                    w[i]=(uint32_t)(cur/10);
+                    rem=cur%10;
+                }
+                digits+=(char)('0'+rem);
+            }
+            if(digits.empty())
+                digits="0";
+            std::reverse(digits.begin(),digits.end());
+
+            return "2.25."+digits;
+        }
+
+        ///
+        /// collect pixel statistics while decoding image
+        ///
+        /// @param bins histogram bins (0: no histogram)
+        /// @param rescaled in rescaled unit or stored unit
+        /// @param lo lower edge of histogram
+        /// @param hi upper edge of histogram;
+        ///           range of pixels is used when hi<=lo
+        ///
+        /// @return self
+        ///
+        /// Statistics are gathered inside the unpacking kernel of the
+        /// following parse_image() as counts of stored values, so no
+        /// extra pass over the image is needed. Use a fixed range to
+        /// aggregate a series with PixelStats::merge().
+        ///
+        Dicom &collect_stats(int bins=256,
+                             bool rescaled=true,
+                             double lo=0.0,
+                             double hi=0.0)
+        {
+            if(bins<0)
+                throw std::invalid_argument("Bad histogram bins");
+
+            this->_collect_stats=true;
+            this->_stats_bins=bins;
+            this->_stats_rescaled=rescaled;
+            this->_stats_lo=lo;
+            this->_stats_hi=hi;
+            this->_stats=PixelStats();
+
+            return *this;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return pixel statistics of all frames
+        ///
+        /// Options of collect_stats() are used. When image has been
+        /// decoded without collection, stored values are counted
+        /// straight from Frame Data without decoding image. Float
+        /// pixel data is measured on image() in an extra pass.
+        ///
+        /// throw std::runtime_error for color images
+        ///
+        const PixelStats &stats()
+        {
+            if(!this->_stats.empty())
+                return this->_stats;
+
+            if(!this->_cols ||
+               !this->_rows ||
+               !this->_bits ||
+               !this->_chs)
+                this->parse_summary();
+            if(this->_is_color())
+                throw std::runtime_error(
+                    "Pixel statistics are not supported for color images");
+
+            if(this->_is_float_pixel()){
+                this->_stats_from_mat(this->image());
+                return this->_stats;
+            }
+
+            const unsigned char *src;
+            size_t len;
+            bool swap;
+            this->_frame_data_bytes(src,len,swap);
+
+            size_t n=(size_t)this->_rows*this->_cols*this->_frames;
+            if(len<this->_frames_bytes(this->_frames))
+                throw ParseError("Frame Data is too short");
+
+            //
+            // count through a small buffer
+            //
+            _StatsCounter counter;
+            this->_init_counter(counter);
+
+            const size_t chunk=4096;  // multiple of 8 pixels
+            int32_t buf[chunk];
+            for(size_t i=0;i<n;i+=chunk){
+                size_t m=std::min(chunk,n-i);
+                size_t offset=(this->_bits==1) ? i/8 :
+                    (this->_bits==12) ? i/2*3 : i*(this->_bits/8);
+                this->_unpack(src+offset,swap,m,false,1.0,0.0,buf,&counter);
+            }
+            this->_stats_from_counter(counter);
+
+            return this->_stats;
+        }
+        
+
+    private:
+        cv::Mat _image;
+
+        int _cols;
+        int _rows;
+        int _bits;
+        int _chs;
+        int _frames;
+        int _samples;
+        int _planar;
+        int _photometric;
+        bool _is_signed;
+
+        float _px_spacing_row;
+        float _px_spacing_col;
+        float _image_pos_x;
+        float _image_pos_y;
+        float _image_pos_z;
+
+        std::map<uint32_t,Element> _element;
+
+        bool _architecture_as_little_endian;
+        bool _format_as_little_endian;
+        bool _format_as_explicit;
+        bool _format_as_deflate;
+        bool _format_as_encapsulated;
+        bool _format_as_jpeg;
+
+        inline bool _need_byte_swap() const
+        { 
+            return this->_architecture_as_little_endian!=
+                this->_format_as_little_endian;
+        }
+
+        //
+        // Frame Data is left on stream by parse_reduced()
+        //
+        bool _defer_frame_data;
+        bool _stop_frame_data;      // parse_until_frame_data() in progress
+        bool _frame_data_left;      // stream is at Frame Data value
+        std::streamoff _frame_data_offset;
+        uint64_t _frame_data_length;
+
+        //
+        // fragments of encapsulated Frame Data left on stream by
+        // parse_deferred(ist,true); Item 0 is Basic Offset Table
+        //
+        struct _Fragment
+        {
+            std::streamoff offset;  // stream position of the value
+            uint32_t length;
+            bool soi;               // begins with JPEG SOI marker
+        };
+        bool _defer_fragments;
+        std::vector<_Fragment> _fragments;
+        std::vector<uint32_t> _basic_offset_table;
+
+        //
+        // tag order; TypeTag::number is not ordered on little endian
+        //
+        static bool _tag_less(const TypeTag a,const TypeTag b)
+        {
+            return a.id[0]<b.id[0] || (a.id[0]==b.id[0] && a.id[1]<b.id[1]);
+        }
+
+        //
+        // spaces and NUL padding of DS/IS values
+        //
+        static const char *_skip_blank(const char *p,const char *end)
+        {
+            while(p<end && (*p==' ' || *p=='\0'))
+                p++;
+
+            return p;
+        }
+
+        //
+        // first value of multi-valued DS element
+        //
+        bool _first_float(const TypeTag tag,float &value)
+        {
+            if(!this->has_element(tag))
+                return false;
+
+            double v;
+            if(this->element(tag).as_doubles(&v,1)!=1)
+                return false;
+            value=(float)v;
+
+            return true;
+        }
+
+        //
+        // Rescale Slope/Intercept; false when not specified
+        //
+        bool _rescale_params(float &slope,float &interception)
+        {
+            if(!this->has_element(TAG_RESCALE_INT) ||
+               !this->has_element(TAG_RESCALE_SLP))
+                return false;
+
+            if(!this->_first_float(TAG_RESCALE_INT,interception))
+                interception=0.0;
+            if(!this->_first_float(TAG_RESCALE_SLP,slope))
+                slope=1.0;
+
+#ifdef DEBUG
+            fprintf(stderr,"Rescale Interception: %f\n",interception);
+            fprintf(stderr,"Rescale Slope: %f\n",slope);
+#endif
+
+            return true;
+        }
+
+        //
+        // bit shift and width to unpad stored pixels
+        //
+        void _unpad_params(int &shift,int &bit_stored)
+        {
+            if(!this->has_element(TAG_BIT_STORED))
+                throw MissingTagError(
+                    "Could not found Bit Stored Tag");
+            bit_stored=(int)this->element(TAG_BIT_STORED).as<uint16_t>();
+
+            if(!this->has_element(TAG_HI_BIT))
+                throw MissingTagError(
+                    "Could not found Hi Bit Tag");
+            int hi_bit=(int)this->element(TAG_HI_BIT).as<uint16_t>();
+
+            shift=hi_bit-bit_stored+1;
+            if(shift<0 || bit_stored<1 || hi_bit>=this->_bits)
+                throw ParseError("Bad Bit Stored and/or Hi Bit");
+        }
+
+        void _unpad_masks(int &shift,uint32_t &mask,uint32_t &sign)
+        {
+            int bit_stored;
+            this->_unpad_params(shift,bit_stored);
+
+            mask=(bit_stored>=32) ?
+                0xFFFFFFFF : (((uint32_t)1<<bit_stored)-1);
+            sign=this->_is_signed ?
+                ((uint32_t)1<<(bit_stored-1)) : 0;
+        }
+
+        //
+        // raw bytes of loaded Frame Data without copy
+        //
+        template <class T>
+        static bool _vector_bytes(boost::any &value,
+                                  const unsigned char *&ptr,
+                                  size_t &len)
+        {
+            std::vector<T> *v=boost::any_cast<std::vector<T> >(&value);
+            if(!v)
+                return false;
+
+            ptr=v->empty() ? NULL : (const unsigned char *)&(*v)[0];
+            len=v->size()*sizeof(T);
+
+            return true;
+        }
+
+        void _frame_data_bytes(const unsigned char *&ptr,
+                               size_t &len,
+                               bool &swap)
+        {
+            if(!this->has_element(this->_pixel_tag()))
+                throw MissingTagError(
+                    "Could not found Frame Data Tag");
+
+            Element &e=this->element(this->_pixel_tag());
+            if(e.empty())
+                throw ParseError("Frame Data has not been loaded");
+
+            // byte vectors keep the order of the stream
+            swap=this->_need_byte_swap();
+            if(_vector_bytes<char>(e._value,ptr,len) ||
+               _vector_bytes<unsigned char>(e._value,ptr,len))
+                return;
+
+            // word vectors have been swapped by Element
+            swap=false;
+            if(_vector_bytes<uint16_t>(e._value,ptr,len) ||
+               _vector_bytes<int16_t>(e._value,ptr,len) ||
+               _vector_bytes<uint32_t>(e._value,ptr,len) ||
+               _vector_bytes<float>(e._value,ptr,len) ||
+               _vector_bytes<double>(e._value,ptr,len))
+                return;
+
+            throw ParseError("Unsupported Frame Data type");
+        }
+
+        //
+        // unpadded stored value of index-th pixel in a row
+        //
+        template <class T>
+        static inline int64_t _stored_value(const unsigned char *row,
+                                            size_t index,
+                                            bool swap,
+                                            int shift,
+                                            uint32_t mask,
+                                            uint32_t sign)
+        {
+            T raw;
+            memcpy(&raw,row+index*sizeof(T),sizeof(T));
+            if(sizeof(T)==2 && swap)
+                raw=(T)bswap_16((uint16_t)raw);
+            else if(sizeof(T)==4 && swap)
+                raw=(T)bswap_32((uint32_t)raw);
+
+            uint32_t v=((uint32_t)raw>>shift)&mask;
+            if(v&sign)
+                return (int64_t)(int32_t)(v|~mask);
+
+            return (int64_t)v;
+        }
+
+        //
+        // accumulate one stored row into output columns
+        //
+        template <class T>
+        static void _reduce_row(const unsigned char *row,
+                                int cols,
+                                bool swap,
+                                int shift,
+                                uint32_t mask,
+                                uint32_t sign,
+                                int factor,
+                                int mode,
+                                float *acc)
+        {
+            int out_cols=(cols+factor-1)/factor;
+
+            if(mode==REDUCE_SUBSAMPLE){
+                for(int x=0;x<out_cols;x++)
+                    acc[x]+=(float)_stored_value<T>(row,x*factor,swap,
+                                                    shift,mask,sign);
+                return;
+            }
+
+            for(int x=0,ox=0;ox<out_cols;ox++){
+                int64_t sum=0;
+                int end=std::min(x+factor,cols);
+                for(;x<end;x++)
+                    sum+=_stored_value<T>(row,x,swap,shift,mask,sign);
+                acc[ox]+=(float)sum;
+            }
+        }
+
+        //
+        // decode reduced first frame from memory (src) or stream (ist)
+        //
+        void _decode_reduced(const unsigned char *src,
+                             size_t len,
+                             std::istream *ist,
+                             bool swap,
+                             int factor,
+                             int mode,
+                             bool need_rescale,
+                             bool need_window,
+                             cv::Mat &dst)
+        {
+            if(factor!=1 && factor!=2 && factor!=4 && factor!=8)
+                throw std::invalid_argument("Unsupported reduction factor");
+            if(mode!=REDUCE_SUBSAMPLE && mode!=REDUCE_BOX)
+                throw std::invalid_argument("Unsupported reduction mode");
+            //
+            // decode whole first frame and reduce it for color images
+            // and pixels not in 8/16bit
+            //
+            if(this->_is_color() ||
+               this->_is_float_pixel() ||
+               (this->_bits!=8 && this->_bits!=16)){
+                std::vector<unsigned char> frame;
+                if(!src){
+                    frame.resize(this->_frame_bytes());
+                    ist->seekg(this->_frame_data_offset);
+                    ist->read((char *)&frame[0],frame.size());
+                    if(ist->eof() || !ist->good())
+                        throw StreamError("Frame Data is too short");
+                    src=&frame[0];
+                    len=frame.size();
+                }
+
+                if(!this->_is_color()){
+                    cv::Mat full,out;
+                    this->_unpack_float_frame(src,len,swap,
+                                              need_rescale || need_window,
+                                              full);
+                    _reduce_mat<float>(full,factor,mode,out);
+                    if(need_window)
+                        this->_window_to_8bit(out.ptr<float>(),
+                                              out.rows,
+                                              out.cols,
+                                              dst);
+                    else
+                        dst=out;
+
+                    return;
+                }
+
+                cv::Mat bgr;
+                this->_decode_color(src,len,swap,1,bgr);
+                if(need_window)
+                    this->_color_to_8bit(bgr);
+
+                if(bgr.depth()==CV_8U)
+                    _reduce_mat<uint8_t>(bgr,factor,mode,dst);
+                else
+                    _reduce_mat<uint16_t>(bgr,factor,mode,dst);
+
+                return;
+            }
+
+            int shift;
+            uint32_t mask,sign;
+            this->_unpad_masks(shift,mask,sign);
+
+            size_t row_bytes=(size_t)this->_cols*(this->_bits/8);
+            if(len<row_bytes*this->_rows)
+                throw ParseError("Frame Data is too short");
+
+            int out_rows=(this->_rows+factor-1)/factor;
+            int out_cols=(this->_cols+factor-1)/factor;
+            int block=(mode==REDUCE_BOX) ? factor : 1;
+
+            std::vector<float> out((size_t)out_rows*out_cols);
+            std::vector<unsigned char> buf(ist ? row_bytes : 0);
+            int next_row=-1;
+
+            for(int oy=0;oy<out_rows;oy++){
+                float *acc=&out[(size_t)oy*out_cols];
+                int y0=oy*factor;
+                int y1=std::min(y0+block,this->_rows);
+                for(int y=y0;y<y1;y++){
+                    const unsigned char *row;
+                    if(src)
+                        row=src+row_bytes*y;
+                    else{
+                        // skip unneeded rows by seeking
+                        if(y!=next_row)
+                            ist->seekg(this->_frame_data_offset+
+                                       (std::streamoff)(row_bytes*y));
+                        ist->read((char *)&buf[0],row_bytes);
+                        if(ist->eof() || !ist->good())
+                            throw StreamError("Frame Data is too short");
+                        next_row=y+1;
+                        row=&buf[0];
+                    }
+
+                    if(this->_bits==8)
+                        _reduce_row<uint8_t>(row,this->_cols,swap,
+                                             shift,mask,sign,
+                                             factor,mode,acc);
+                    else
+                        _reduce_row<uint16_t>(row,this->_cols,swap,
+                                              shift,mask,sign,
+                                              factor,mode,acc);
+                }
+
+                //
+                // average
+                //
+                if(mode==REDUCE_BOX){
+                    int n_rows=y1-y0;
+                    for(int ox=0;ox<out_cols;ox++){
+                        int n_cols=std::min(factor,
+                                            this->_cols-ox*factor);
+                        acc[ox]/=(float)(n_rows*n_cols);
+                    }
+                }
+            }
+
+            //
+            // rescale output pixels only
+            //
+            float slope=1.0,interception=0.0;
+            bool rescaled=(need_rescale || need_window) &&
+                this->_rescale_params(slope,interception);
+            if(rescaled){
+                for(size_t i=0;i<out.size();i++)
+                    out[i]=out[i]*slope+interception;
+            }
+
+            if(need_window){
+                this->_window_to_8bit(&out[0],out_rows,out_cols,dst);
+                return;
+            }
+
+            if(rescaled){
+                cv::Mat(out_rows,out_cols,CV_32FC1,&out[0]).copyTo(dst);
+                return;
+            }
+
+            int depth;
+            if(this->_bits==8)
+                depth=this->_is_signed ? CV_8S : CV_8U;
+            else
+                depth=this->_is_signed ? CV_16S : CV_16U;
+            cv::Mat(out_rows,out_cols,CV_32FC1,&out[0]).convertTo(dst,depth);
+        }
+
+        //
+        // Pixel Data, Float Pixel Data or Double Float Pixel Data
+        //
+        TypeTag _pixel_tag()
+        {
+            if(this->has_element(TAG_FLOAT_FRAME_DATA))
+                return TAG_FLOAT_FRAME_DATA;
+            if(this->has_element(TAG_DOUBLE_FRAME_DATA))
+                return TAG_DOUBLE_FRAME_DATA;
+
+            return TAG_FRAME_DATA;
+        }
+
+        inline bool _is_float_pixel()
+        {
+            return this->has_element(TAG_FLOAT_FRAME_DATA) ||
+                this->has_element(TAG_DOUBLE_FRAME_DATA);
+        }
+
+        //
+        // cv::Mat type of unpacked monochrome pixels
+        //
+        int _image_type()
+        {
+            if(this->has_element(TAG_FLOAT_FRAME_DATA))
+                return CV_32FC1;
+            if(this->has_element(TAG_DOUBLE_FRAME_DATA))
+                return CV_64FC1;
+
+            switch(this->_bits){
+            case 1:
+                return CV_8UC1;
+            case 8:
+                return this->_is_signed ? CV_8SC1 : CV_8UC1;
+            case 12:
+            case 16:
+                return this->_is_signed ? CV_16SC1 : CV_16UC1;
+            case 32:
+                {
+                    int shift;
+                    uint32_t mask,sign;
+                    this->_unpad_masks(shift,mask,sign);
+                    // no 32bit unsigned type in OpenCV
+                    if(!this->_is_signed && (mask&0x80000000))
+                        return CV_64FC1;
+                }
+                return CV_32SC1;
+            }
+
+            throw std::runtime_error("Unsupported Bit Allocation");
+        }
+
+        //
+        // stored value to output pixel
+        //
+        template <class D>
+        static inline D _rescaled_value(int64_t v,
+                                        bool rescaled,
+                                        double slope,
+                                        double interception)
+        {
+            if(rescaled)
+                return cv::saturate_cast<D>((double)v*slope+interception);
+            else
+                return (D)v;
+        }
+
+        //
+        // counts of stored values taken by unpacking kernels
+        //
+        struct _StatsCounter
+        {
+            int64_t base;  // stored value of counts[0]
+            int shift;     // 1<<shift stored values for each count
+            std::vector<uint32_t> counts;
+
+            // exact moments when shift>0
+            int64_t min;
+            int64_t max;
+            double sum;
+            double sum_sq;
+
+            inline void add(int64_t v)
+            {
+                this->counts[(size_t)((uint64_t)(v-this->base)>>this->shift)]++;
+                if(this->shift){
+                    this->min=std::min(this->min,v);
+                    this->max=std::max(this->max,v);
+                    this->sum+=(double)v;
+                    this->sum_sq+=(double)v*v;
+                }
+            }
+
+            inline void add(int64_t v,uint64_t n)
+            {
+                this->counts[(size_t)((uint64_t)(v-this->base)>>this->shift)]+=
+                    (uint32_t)n;
+                if(this->shift && n){
+                    this->min=std::min(this->min,v);
+                    this->max=std::max(this->max,v);
+                    this->sum+=(double)v*n;
+                    this->sum_sq+=(double)v*v*n;
+                }
+            }
+        };
+
+        //
+        // dense table over the range of stored values
+        // (up to 65536 entries)
+        //
+        void _init_counter(_StatsCounter &c)
+        {
+            int bit_stored=1;
+            if(this->_bits!=1){
+                int shift;
+                this->_unpad_params(shift,bit_stored);
+            }
+
+            c.base=this->_is_signed && bit_stored>1 ?
+                -((int64_t)1<<(bit_stored-1)) : 0;
+            c.shift=std::max(bit_stored-16,0);
+            c.counts.assign((size_t)1<<(bit_stored-c.shift),0);
+            c.min=std::numeric_limits<int64_t>::max();
+            c.max=std::numeric_limits<int64_t>::min();
+            c.sum=0.0;
+            c.sum_sq=0.0;
+        }
+
+        //
+        // _stats from counts of stored values
+        //
+        void _stats_from_counter(const _StatsCounter &c)
+        {
+            PixelStats &st=this->_stats;
+            st=PixelStats();
+
+            //
+            // moments in stored unit
+            //
+            double sum=c.sum,sum_sq=c.sum_sq;
+            int64_t min=c.min,max=c.max;
+            uint64_t count=0;
+            if(!c.shift){
+                sum=sum_sq=0.0;
+                min=std::numeric_limits<int64_t>::max();
+                max=std::numeric_limits<int64_t>::min();
+            }
+            for(size_t k=0;k<c.counts.size();k++){
+                uint32_t m=c.counts[k];
+                if(!m)
+                    continue;
+                count+=m;
+                if(!c.shift){
+                    int64_t v=c.base+(int64_t)k;
+                    min=std::min(min,v);
+                    max=std::max(max,v);
+                    sum+=(double)v*m;
+                    sum_sq+=(double)v*v*m;
+                }
+            }
+            if(!count)
+                return;
+
+            //
+            // to output unit
+            //
+            float slope=1.0,interception=0.0;
+            if(!this->_stats_rescaled ||
+               !this->_rescale_params(slope,interception)){
+                slope=1.0;
+                interception=0.0;
+            }
+            double a=slope,b=interception;
+
+            st.count=count;
+            st.min=(double)min*a+b;
+            st.max=(double)max*a+b;
+            if(st.min>st.max)
+                std::swap(st.min,st.max);
+            st.sum=a*sum+b*count;
+            st.sum_sq=a*a*sum_sq+2.0*a*b*sum+b*b*count;
+
+            if(!this->_stats_bins)
+                return;
+
+            st.lo=this->_stats_lo;
+            st.hi=this->_stats_hi;
+            if(st.hi<=st.lo){
+                st.lo=st.min;
+                st.hi=(st.max>st.min) ? st.max : st.min+1.0;
+            }
+            st.histogram.assign(this->_stats_bins,0);
+
+            double center=(((int64_t)1<<c.shift)-1)*0.5;
+            for(size_t k=0;k<c.counts.size();k++){
+                if(c.counts[k]){
+                    double v=(double)(c.base+((int64_t)k<<c.shift))+center;
+                    st.histogram[st.bin(v*a+b)]+=c.counts[k];
+                }
+            }
+        }
+
+        //
+        // _stats from decoded float pixels (two passes)
+        //
+        void _stats_from_mat(const cv::Mat &m)
+        {
+            PixelStats &st=this->_stats;
+            st=PixelStats();
+
+            cv::Mat f;
+            m.convertTo(f,CV_64F);
+            const double *p=f.ptr<double>();
+            size_t n=f.total();
+            if(!n)
+                return;
+
+            st.count=n;
+            st.min=st.max=p[0];
+            for(size_t i=0;i<n;i++){
+                st.min=std::min(st.min,p[i]);
+                st.max=std::max(st.max,p[i]);
+                st.sum+=p[i];
+                st.sum_sq+=p[i]*p[i];
+            }
+
+            if(!this->_stats_bins)
+                return;
+
+            st.lo=this->_stats_lo;
+            st.hi=this->_stats_hi;
+            if(st.hi<=st.lo){
+                st.lo=st.min;
+                st.hi=(st.max>st.min) ? st.max : st.min+1.0;
+            }
+            st.histogram.assign(this->_stats_bins,0);
+            for(size_t i=0;i<n;i++)
+                st.histogram[st.bin(p[i])]++;
+        }
+
+        //
+        // 1bit pixels packed from LSB, table-driven
+        //
+        struct _BitTable
+        {
+            uint64_t bytes[256];
+
+            _BitTable()
+            {
+                for(int b=0;b<256;b++){
+                    unsigned char v[8];
+                    for(int k=0;k<8;k++)
+                        v[k]=(unsigned char)((b>>k)&1);
+                    memcpy(&this->bytes[b],v,8);
+                }
+            }
+        };
+
+        template <class D>
+        static void _unpack_1bit(const unsigned char *src,
+                                 size_t n,
+                                 bool rescaled,
+                                 double slope,
+                                 double interception,
+                                 D *dst,
+                                 _StatsCounter *counter=NULL)
+        {
+            static const _BitTable table;
+
+            D v[2]={_rescaled_value<D>(0,rescaled,slope,interception),
+                    _rescaled_value<D>(1,rescaled,slope,interception)};
+
+            size_t i=0;
+            uint64_t ones=0;
+            if(sizeof(D)==1 && v[0]==0 && v[1]==1){
+                // 8 pixels for each byte
+                for(;i+8<=n;i+=8){
+                    memcpy(dst+i,&table.bytes[src[i>>3]],8);
+                    if(counter)
+                        ones+=(table.bytes[src[i>>3]]*
+                               0x0101010101010101ULL)>>56;
+                }
+            }
+            else{
+                for(;i+8<=n;i+=8){
+                    unsigned char b=src[i>>3];
+                    for(int k=0;k<8;k++)
+                        dst[i+k]=v[(b>>k)&1];
+                    if(counter)
+                        ones+=(table.bytes[b]*0x0101010101010101ULL)>>56;
+                }
+            }
+            for(;i<n;i++){
+                int b=(src[i>>3]>>(i&7))&1;
+                dst[i]=v[b];
+                ones+=b;
+            }
+
+            if(counter){
+                counter->add(0,n-ones);
+                counter->add(1,ones);
+            }
+        }
+
+        //
+        // 2 pixels packed in 3 bytes (ACR-NEMA 12bit)
+        //
+        template <class D>
+        static void _unpack_12bit(const unsigned char *src,
+                                  size_t n,
+                                  int shift,
+                                  uint32_t mask,
+                                  uint32_t sign,
+                                  bool rescaled,
+                                  double slope,
+                                  double interception,
+                                  D *dst,
+                                  _StatsCounter *counter=NULL)
+        {
+            for(size_t i=0;i<n;i+=2,src+=3){
+                uint16_t w[2];
+                w[0]=(uint16_t)(src[0]|((src[1]&0x0F)<<8));
+                w[1]=(uint16_t)((src[1]>>4)|(src[2]<<4));
+                for(size_t k=0;k<2 && i+k<n;k++){
+                    int64_t v=_stored_value<uint16_t>(
+                        (const unsigned char *)w,k,false,shift,mask,sign);
+                    if(counter)
+                        counter->add(v);
+                    dst[i+k]=_rescaled_value<D>(v,rescaled,
+                                                slope,interception);
+                }
+            }
+        }
+
+        //
+        // 8/16/32bit words
+        //
+        template <class T,class D>
+        static void _unpack_words(const unsigned char *src,
+                                  bool swap,
+                                  size_t n,
+                                  int shift,
+                                  uint32_t mask,
+                                  uint32_t sign,
+                                  bool rescaled,
+                                  double slope,
+                                  double interception,
+                                  D *dst,
+                                  _StatsCounter *counter=NULL)
+        {
+            bool full=(shift==0 &&
+                       (uint64_t)mask==(((uint64_t)1<<(8*sizeof(T)))-1));
+
+            // integer words only; bit patterns are not float values
+            if(!rescaled && full && !swap && sizeof(T)==sizeof(D) &&
+               boost::is_integral<D>::value && !counter){
+                memcpy(dst,src,n*sizeof(T));
+                return;
+            }
 
-            this->_cols=0;
-            this->_rows=0;
-            this->_bits=0;
-            this->_chs=0;
-            this->_is_signed=false;
+            //
+            // table for 8bit words
+            //
+            if(sizeof(T)==1){
+                D lut[256];
+                int64_t stored[256];
+                for(int r=0;r<256;r++){
+                    uint8_t raw=(uint8_t)r;
+                    stored[r]=_stored_value<uint8_t>(&raw,0,false,
+                                                     shift,mask,sign);
+                    lut[r]=_rescaled_value<D>(stored[r],
+                                              rescaled,slope,interception);
+                }
+                if(!counter){
+                    for(size_t i=0;i<n;i++)
+                        dst[i]=lut[src[i]];
+                    return;
+                }
 
-            this->_px_spacing_row=0.0f;
-            this->_px_spacing_col=0.0f;
-            this->_image_pos_x=nanf("");
-            this->_image_pos_y=nanf("");
-            this->_image_pos_z=nanf("");
+                // raw bytes are counted, then folded to stored values
+                uint64_t raw_counts[256]={0};
+                for(size_t i=0;i<n;i++){
+                    dst[i]=lut[src[i]];
+                    raw_counts[src[i]]++;
+                }
+                for(int r=0;r<256;r++){
+                    if(raw_counts[r])
+                        counter->add(stored[r],raw_counts[r]);
+                }
+                return;
+            }
+
+            if(rescaled && sizeof(T)==2){
+                // single precision is enough for 16bit
+                float a=(float)slope;
+                float b=(float)interception;
+                for(size_t i=0;i<n;i++){
+                    int64_t v=_stored_value<T>(src,i,swap,shift,mask,sign);
+                    if(counter)
+                        counter->add(v);
+                    dst[i]=cv::saturate_cast<D>((float)v*a+b);
+                }
+                return;
+            }
 
+            for(size_t i=0;i<n;i++){
+                int64_t v=_stored_value<T>(src,i,swap,shift,mask,sign);
+                if(counter)
+                    counter->add(v);
+                dst[i]=_rescaled_value<D>(v,rescaled,slope,interception);
+            }
+        }
 
-            this->_element.clear();
+        template <class S,class D>
+        static void _unpack_float(const unsigned char *src,
+                                  bool swap,
+                                  size_t n,
+                                  D *dst)
+        {
+            for(size_t i=0;i<n;i++){
+                unsigned char b[sizeof(S)];
+                memcpy(b,src+i*sizeof(S),sizeof(S));
+                if(swap)
+                    std::reverse(b,b+sizeof(S));
+                S v;
+                memcpy(&v,b,sizeof(S));
+                dst[i]=(D)v;
+            }
+        }
 
-            //ist.seekg(0); // rewind stream
-            ist.seekg(128); // skip null header
+        //
+        // unpack n monochrome pixels with unpad and rescale
+        //
+        template <class D>
+        void _unpack(const unsigned char *src,
+                     bool swap,
+                     size_t n,
+                     bool rescaled,
+                     double slope,
+                     double interception,
+                     D *dst,
+                     _StatsCounter *counter=NULL)
+        {
+            if(this->has_element(TAG_FLOAT_FRAME_DATA)){
+                _unpack_float<float>(src,swap,n,dst);
+                return;
+            }
+            if(this->has_element(TAG_DOUBLE_FRAME_DATA)){
+                _unpack_float<double>(src,swap,n,dst);
+                return;
+            }
+
+            int shift=0;
+            uint32_t mask=1,sign=0;
+            if(this->_bits!=1)
+                this->_unpad_masks(shift,mask,sign);
+
+            switch(this->_bits){
+            case 1:
+                _unpack_1bit(src,n,rescaled,slope,interception,dst,counter);
+                break;
+            case 8:
+                _unpack_words<uint8_t>(src,false,n,shift,mask,sign,
+                                       rescaled,slope,interception,dst,
+                                       counter);
+                break;
+            case 12:
+                _unpack_12bit(src,n,shift,mask,sign,
+                              rescaled,slope,interception,dst,counter);
+                break;
+            case 16:
+                _unpack_words<uint16_t>(src,swap,n,shift,mask,sign,
+                                        rescaled,slope,interception,dst,
+                                        counter);
+                break;
+            case 32:
+                _unpack_words<uint32_t>(src,swap,n,shift,mask,sign,
+                                        rescaled,slope,interception,dst,
+                                        counter);
+                break;
+            default:
+                throw std::runtime_error("Unsupported Bit Allocation");
+            }
+        }
+
+        //
+        // unpack monochrome pixels into dst created by _image_type()
+        //
+        void _unpack_mat(const unsigned char *src,
+                         bool swap,
+                         bool rescaled,
+                         float slope,
+                         float interception,
+                         cv::Mat &dst,
+                         _StatsCounter *pc=NULL)
+        {
+            size_t n=dst.total();
+            switch(dst.depth()){
+            case CV_8U:
+                this->_unpack(src,swap,n,rescaled,slope,interception,
+                              dst.ptr<uint8_t>(),pc);
+                break;
+            case CV_8S:
+                this->_unpack(src,swap,n,rescaled,slope,interception,
+                              dst.ptr<int8_t>(),pc);
+                break;
+            case CV_16U:
+                this->_unpack(src,swap,n,rescaled,slope,interception,
+                              dst.ptr<uint16_t>(),pc);
+                break;
+            case CV_16S:
+                this->_unpack(src,swap,n,rescaled,slope,interception,
+                              dst.ptr<int16_t>(),pc);
+                break;
+            case CV_32S:
+                this->_unpack(src,swap,n,rescaled,slope,interception,
+                              dst.ptr<int32_t>(),pc);
+                break;
+            case CV_32F:
+                this->_unpack(src,swap,n,rescaled,slope,interception,
+                              dst.ptr<float>(),pc);
+                break;
+            default:
+                this->_unpack(src,swap,n,rescaled,slope,interception,
+                              dst.ptr<double>(),pc);
+                break;
+            }
+        }
 
+        //
+        // all native frames to dst
+        //
+        void _decode_native_frames(const unsigned char *src,
+                                   size_t len,
+                                   bool swap,
+                                   bool need_rescale,
+                                   cv::Mat &dst,
+                                   _StatsCounter *pc=NULL)
+        {
             //
-            // check DICOM header
+            // color images are converted to BGR in one pass
             //
-            char dicom_id_str[4];
-            ist.read(dicom_id_str,4);
-
-            if(ist.eof() ||
-               !ist.good() ||
-               dicom_id_str[0]!='D' ||
-               dicom_id_str[1]!='I' ||
-               dicom_id_str[2]!='C' ||
-               dicom_id_str[3]!='M')
-                throw ParseError("not DICOM format");
+            if(this->_is_color()){
+                this->_decode_color(src,len,swap,this->_frames,dst);
+                return;
+            }
 
             //
-            // read meta data (group 0x0002)
-            // as LEE (Little Endian Explicit VR)
+            // unpadding and rescale are fused into unpacking
             //
-            this->_format_as_little_endian=true;
-            this->_format_as_explicit=true;
-            this->_format_as_deflate=false;
+            float slope=1.0,interception=0.0;
+            bool rescaled=need_rescale &&
+                this->_rescale_params(slope,interception);
 
-            while(true){
-                Element e(this);
-                TypeTag tag=e.parse_tag(ist);
-                if(tag.id[0]!=TAG_GROUP_META){
-                    e.rewind_tag(ist);
-                    break;
+            if(len<this->_frames_bytes(this->_frames))
+                throw ParseError("Frame Data is too short");
+
+            dst.create(this->_rows*this->_frames,
+                       this->_cols,
+                       this->_image_type());
+            this->_unpack_mat(src,swap,rescaled,slope,interception,dst,pc);
+        }
+
+        //
+        // a native frame to a new cv::Mat
+        //
+        cv::Mat _decode_native(const unsigned char *src,
+                               size_t len,
+                               bool swap,
+                               bool need_rescale)
+        {
+            cv::Mat dst;
+            if(this->_is_color()){
+                this->_decode_color(src,len,swap,1,dst);
+
+                return dst;
+            }
+
+            if(len<this->_frame_bytes())
+                throw ParseError("Frame Data is too short");
+
+            float slope=1.0,interception=0.0;
+            bool rescaled=need_rescale &&
+                this->_rescale_params(slope,interception);
+
+            dst.create(this->_rows,this->_cols,this->_image_type());
+            this->_unpack_mat(src,swap,rescaled,slope,interception,dst);
+
+            return dst;
+        }
+
+        //
+        // a bitstream of encapsulated frame to a new cv::Mat
+        //
+        cv::Mat _decode_bitstream(const unsigned char *src,
+                                  size_t len,
+                                  bool need_rescale)
+        {
+            if(!this->_format_as_jpeg)
+                throw std::runtime_error(
+                    "Compressed Frame Data has not been supported");
+
+            float slope=1.0,interception=0.0;
+            bool rescaled=need_rescale &&
+                !this->_is_color() &&
+                this->_rescale_params(slope,interception);
+
+            cv::Mat dst(this->_rows,
+                        this->_cols,
+                        this->_is_color() ? CV_8UC3 : this->_image_type());
+            this->_decode_jpeg(src,len,rescaled,slope,interception,dst);
+
+            return dst;
+        }
+
+        //
+        // decode JPEG into preallocated dst (rows x cols of
+        // _image_type(), or CV_8UC3 for color images)
+        //
+        // The bitstream is wrapped without copy. Color frames are
+        // decoded directly into dst as BGR; monochrome frames are
+        // unpadded and rescaled from 8 or 16bit samples of the codec,
+        // so 12bit Extended samples keep Pixel Representation.
+        //
+        void _decode_jpeg(const unsigned char *src,
+                          size_t len,
+                          bool rescaled,
+                          float slope,
+                          float interception,
+                          cv::Mat dst)
+        {
+#ifdef VVV_DICOM_NO_JPEG
+            throw std::runtime_error("JPEG has not been supported");
+#else
+            if(!src || !len)
+                throw ParseError("Empty JPEG frame");
+            cv::Mat stream(1,(int)len,CV_8UC1,(void *)src);
+
+            if(this->_is_color()){
+                if(this->_bits!=8)
+                    throw std::runtime_error("Unsupported Bit Allocation");
+                cv::Mat out=dst;
+                cv::imdecode(stream,cv::IMREAD_COLOR,&out);
+                if(out.rows!=this->_rows || out.cols!=this->_cols)
+                    throw ParseError("Bad size of JPEG frame");
+                if(out.data!=dst.data)
+                    out.copyTo(dst);
+
+                return;
+            }
+
+            cv::Mat m=cv::imdecode(stream,cv::IMREAD_UNCHANGED);
+            if(m.empty())
+                throw ParseError("Could not decode JPEG frame");
+            if(m.channels()!=1 ||
+               m.rows!=this->_rows ||
+               m.cols!=this->_cols)
+                throw ParseError("Bad size of JPEG frame");
+            if(m.depth()!=((this->_bits==8) ? CV_8U : CV_16U)){
+                if(this->_bits!=8 && m.depth()==CV_8U)
+                    throw std::runtime_error(
+                        "12bit JPEG has not been supported by OpenCV");
+                throw std::runtime_error("Unsupported Bit Allocation");
+            }
+            if(!m.isContinuous())
+                m=m.clone();
+
+            // samples are in host order
+            this->_unpack_mat(m.data,false,rescaled,slope,interception,dst);
+#endif
+        }
+
+        //
+        // Item range [first,last) of fragments of index-th frame
+        //
+        void _frame_fragments(const Element &e,
+                              int index,
+                              size_t &first,
+                              size_t &last)
+        {
+            size_t n=e.item_count();
+            if(n<2)
+                throw ParseError("Frame Data has no fragment");
+
+            if(n-1==(size_t)this->_frames){
+                first=index+1;
+                last=first+1;
+                return;
+            }
+            if(this->_frames==1){
+                first=1;
+                last=n;
+                return;
+            }
+
+            //
+            // offsets of frames from the first fragment by Extended
+            // Offset Table, or Basic Offset Table (Item 0)
+            //
+            std::vector<uint64_t> offsets;
+            const Element *eot=this->find(0x7fe0,0x0001);
+            if(eot && eot->type()==typeid(std::vector<uint64_t>))
+                offsets=eot->as<std::vector<uint64_t> >();
+            else{
+                Item bot=e.item(0);
+                for(size_t i=0;i+4<=bot.length();i+=4){
+                    uint32_t v;
+                    memcpy(&v,bot.data()+i,4);
+                    offsets.push_back(this->_need_byte_swap() ?
+                                      bswap_32(v) : v);
                 }
-                e.parse_value(ist);
-                this->_element[e.tag().number]=e;
             }
 
+            if(offsets.size()>=(size_t)this->_frames){
+                const unsigned char *base=e.item(1).data();
+                first=this->_fragment_at(e,base,offsets[index]);
+                last=(index+1<this->_frames) ?
+                    this->_fragment_at(e,base,offsets[index+1]) : n;
+                if(first>=last)
+                    throw ParseError("Bad offset table");
+                return;
+            }
 
             //
-            // get format info.
+            // no table; each JPEG frame starts with SOI marker
             //
-            if(this->has_element(TAG_TRANSFER_SYNTAX_UID)){
-                std::string s=
-                    this->element(TAG_TRANSFER_SYNTAX_UID).as<std::string>();
-                if(s.find("1.2.840.10008.1.2.2")!=std::string::npos){
-                    // BEE
-                    this->_format_as_little_endian=false;
-                    this->_format_as_explicit=true;
-                    this->_format_as_deflate=false;
+            int f=-1;
+            for(size_t i=1;i<n;i++){
+                Item it=e.item(i);
+                if(it.length()<2 || it.data()[0]!=0xFF || it.data()[1]!=0xD8)
+                    continue;
+                f++;
+                if(f==index)
+                    first=i;
+                else if(f==index+1){
+                    last=i;
+                    return;
                 }
-                else if(s.find("1.2.840.10008.1.2.1.99")!=std::string::npos){
-                    // Deflated LEE
-                    this->_format_as_little_endian=true;
-                    this->_format_as_explicit=true;
-                    this->_format_as_deflate=true;
+            }
+            if(f<index)
+                throw ParseError("Frame Data is too short");
+            last=n;
+        }
+
+        //
+        // fragment range [first,last) of index-th frame of deferred
+        // Frame Data by offset table, or by JPEG SOI markers
+        //
+        void _deferred_fragments(int index,size_t &first,size_t &last) const
+        {
+            const std::vector<_Fragment> &f=this->_fragments;
+            size_t n=f.size();
+
+            std::vector<uint64_t> offsets;
+            const Element *eot=this->find(0x7fe0,0x0001);
+            if(eot && eot->type()==typeid(std::vector<uint64_t>))
+                offsets=eot->as<std::vector<uint64_t> >();
+            else
+                offsets.assign(this->_basic_offset_table.begin(),
+                               this->_basic_offset_table.end());
+
+            if(offsets.size()>=(size_t)this->_frames){
+                first=this->_deferred_fragment_at(offsets[index]);
+                last=(index+1<this->_frames) ?
+                    this->_deferred_fragment_at(offsets[index+1]) : n;
+                if(first>=last)
+                    throw ParseError("Bad offset table");
+                return;
+            }
+
+            int k=-1;
+            for(size_t i=1;i<n;i++){
+                if(!f[i].soi)
+                    continue;
+                k++;
+                if(k==index)
+                    first=i;
+                else if(k==index+1){
+                    last=i;
+                    return;
                 }
-                else if(s.find("1.2.840.10008.1.2.1")!=std::string::npos){
-                    // LEE
-                    this->_format_as_little_endian=true;
-                    this->_format_as_explicit=true;
-                    this->_format_as_deflate=false;
+            }
+            if(k<index)
+                throw ParseError("Frame Data is too short");
+            last=n;
+        }
+
+        size_t _deferred_fragment_at(uint64_t offset) const
+        {
+            const std::vector<_Fragment> &f=this->_fragments;
+            std::streamoff base=f[1].offset;
+            size_t lo=1,hi=f.size();
+            while(lo<hi){
+                size_t mid=(lo+hi)/2;
+                uint64_t pos=(uint64_t)(f[mid].offset-base);
+                if(pos==offset)
+                    return mid;
+                if(pos<offset)
+                    lo=mid+1;
+                else
+                    hi=mid;
+            }
+
+            throw ParseError("Bad offset table");
+        }
+
+        //
+        // Item index of the fragment at offset from the first fragment
+        //
+        size_t _fragment_at(const Element &e,
+                            const unsigned char *base,
+                            uint64_t offset)
+        {
+            // Items are in order; offsets count 8 bytes of Item tags
+            size_t lo=1,hi=e.item_count();
+            while(lo<hi){
+                size_t mid=(lo+hi)/2;
+                uint64_t pos=(uint64_t)(e.item(mid).data()-base);
+                if(pos==offset)
+                    return mid;
+                if(pos<offset)
+                    lo=mid+1;
+                else
+                    hi=mid;
+            }
+
+            throw ParseError("Bad offset table");
+        }
+
+        //
+        // bitstream of index-th encapsulated frame; fragments are
+        // joined only when the frame has more than one
+        //
+        void _frame_bitstream(int index,
+                              std::vector<unsigned char> &joined,
+                              const unsigned char *&src,
+                              size_t &len)
+        {
+            const Element *e=this->find(this->_pixel_tag());
+            if(!e)
+                throw MissingTagError("Could not found Frame Data Tag");
+
+            size_t first,last;
+            this->_frame_fragments(*e,index,first,last);
+            if(last-first==1){
+                Item it=e->item(first);
+                src=it.data();
+                len=it.length();
+                return;
+            }
+
+            joined.clear();
+            for(size_t i=first;i<last;i++){
+                Item it=e->item(i);
+                joined.insert(joined.end(),it.data(),it.data()+it.length());
+            }
+            src=joined.empty() ? NULL : &joined[0];
+            len=joined.size();
+        }
+
+        //
+        // decodes encapsulated frames into their planes of dst
+        //
+        class _FrameJob
+        {
+        public:
+            _FrameJob(Dicom *d,bool need_rescale,cv::Mat &dst)
+                :_d(d),
+                 _dst(&dst),
+                 _slope(1.0),
+                 _interception(0.0)
+            {
+                if(!d->_format_as_jpeg)
+                    throw std::runtime_error(
+                        "Compressed Frame Data has not been supported");
+
+                this->_rescaled=need_rescale &&
+                    !d->_is_color() &&
+                    d->_rescale_params(this->_slope,this->_interception);
+
+                dst.create(d->_rows*d->_frames,
+                           d->_cols,
+                           d->_is_color() ? CV_8UC3 : d->_image_type());
+            }
+
+            void operator()(size_t index) const
+            {
+                std::vector<unsigned char> joined;
+                const unsigned char *src;
+                size_t len;
+                this->_d->_frame_bitstream((int)index,joined,src,len);
+
+                int rows=this->_d->_rows;
+                this->_d->_decode_jpeg(src,len,
+                                       this->_rescaled,
+                                       this->_slope,
+                                       this->_interception,
+                                       this->_dst->rowRange(
+                                           (int)index*rows,
+                                           ((int)index+1)*rows));
+            }
+
+        private:
+            Dicom *_d;
+            cv::Mat *_dst;
+            bool _rescaled;
+            float _slope;
+            float _interception;
+        };
+
+        //
+        // first monochrome frame as CV_32FC1
+        //
+        void _unpack_float_frame(const unsigned char *src,
+                                 size_t len,
+                                 bool swap,
+                                 bool need_rescale,
+                                 cv::Mat &dst)
+        {
+            if(len<this->_frame_bytes())
+                throw ParseError("Frame Data is too short");
+
+            float slope=1.0,interception=0.0;
+            bool rescaled=need_rescale &&
+                !this->_is_float_pixel() &&
+                this->_rescale_params(slope,interception);
+
+            dst.create(this->_rows,this->_cols,CV_32FC1);
+            this->_unpack(src,swap,(size_t)this->_rows*this->_cols,
+                          rescaled,slope,interception,dst.ptr<float>());
+        }
+
+        inline bool _is_color()
+        {
+            return this->_photometric==PHOTO_PALETTE_COLOR ||
+                this->_photometric==PHOTO_RGB ||
+                this->_photometric==PHOTO_YBR_FULL ||
+                this->_photometric==PHOTO_YBR_FULL_422;
+        }
+
+        //
+        // bytes of one frame
+        //
+        size_t _frame_bytes() const
+        {
+            return this->_frames_bytes(1);
+        }
+
+        //
+        // bytes of frames packed back to back; 1bit frames are not
+        // aligned to byte
+        //
+        size_t _frames_bytes(int frames) const
+        {
+            size_t n=(size_t)this->_rows*this->_cols;
+            if(this->_photometric==PHOTO_YBR_FULL_422)
+                n*=2; // Y Y Cb Cr for each 2 pixels
+            else
+                n*=this->_samples;
+
+            return (n*frames*this->_bits+7)/8;
+        }
+
+        static inline unsigned char _clip8(int v)
+        {
+            return (unsigned char)((v<0) ? 0 : (v>255) ? 255 : v);
+        }
+
+        //
+        // YBR_FULL to BGR (PS3.3 C.7.6.3.1.2) in 16bit fixed point
+        //
+        static inline void _ybr_pixel(int y,int cb,int cr,unsigned char *bgr)
+        {
+            cb-=128;
+            cr-=128;
+            bgr[0]=_clip8(y+((116130*cb+32768)>>16));
+            bgr[1]=_clip8(y-((22554*cb+46802*cr+32768)>>16));
+            bgr[2]=_clip8(y+((91881*cr+32768)>>16));
+        }
+
+        //
+        // RGB (interleaved or planar) to BGR
+        //
+        template <class T>
+        static void _rgb_to_bgr(const unsigned char *src,
+                                int planar,
+                                size_t n,
+                                bool swap,
+                                T *dst)
+        {
+            const T *s=(const T *)src;
+            if(planar){
+                const T *r=s;
+                const T *g=s+n;
+                const T *b=s+2*n;
+                for(size_t i=0;i<n;i++){
+                    dst[3*i]=b[i];
+                    dst[3*i+1]=g[i];
+                    dst[3*i+2]=r[i];
                 }
-                else if(s.find("1.2.840.10008.1.2")!=std::string::npos){
-                    // LEI
-                    this->_format_as_little_endian=true;
-                    this->_format_as_explicit=false;
-                    this->_format_as_deflate=false;
+            }
+            else{
+                for(size_t i=0;i<n;i++){
+                    dst[3*i]=s[3*i+2];
+                    dst[3*i+1]=s[3*i+1];
+                    dst[3*i+2]=s[3*i];
+                }
+            }
+
+            if(sizeof(T)==2 && swap){
+                for(size_t i=0;i<3*n;i++)
+                    dst[i]=(T)bswap_16((uint16_t)dst[i]);
+            }
+        }
+
+        static void _ybr_to_bgr(const unsigned char *src,
+                                int planar,
+                                size_t n,
+                                unsigned char *dst)
+        {
+            if(planar){
+                const unsigned char *y=src;
+                const unsigned char *cb=src+n;
+                const unsigned char *cr=src+2*n;
+                for(size_t i=0;i<n;i++)
+                    _ybr_pixel(y[i],cb[i],cr[i],dst+3*i);
+            }
+            else{
+                for(size_t i=0;i<n;i++)
+                    _ybr_pixel(src[3*i],src[3*i+1],src[3*i+2],dst+3*i);
+            }
+        }
+
+        static void _ybr422_to_bgr(const unsigned char *src,
+                                   size_t n,
+                                   unsigned char *dst)
+        {
+            // Y1 Y2 Cb Cr
+            for(size_t i=0;i+1<n;i+=2,src+=4,dst+=6){
+                _ybr_pixel(src[0],src[2],src[3],dst);
+                _ybr_pixel(src[1],src[2],src[3],dst+3);
+            }
+        }
+
+        //
+        // entries of a Palette Color Lookup Table scaled to 8bit
+        //
+        void _palette_table(const TypeTag desc_tag,
+                            const TypeTag data_tag,
+                            std::vector<unsigned char> &table,
+                            int &first)
+        {
+            if(!this->has_element(desc_tag) || !this->has_element(data_tag))
+                throw MissingTagError(
+                    "Could not found Palette Color Lookup Table");
+
+            Element &desc=this->element(desc_tag);
+            Element &data=this->element(data_tag);
+
+            const unsigned char *d_ptr,*t_ptr;
+            size_t d_len,t_len;
+            bool desc_signed=_vector_bytes<int16_t>(desc._value,d_ptr,d_len);
+            if(!(desc_signed ||
+                 _vector_bytes<uint16_t>(desc._value,d_ptr,d_len)) ||
+               d_len<6)
+                throw ParseError("Bad Palette Color Lookup Table Descriptor");
+
+            uint16_t d[3];
+            memcpy(d,d_ptr,6);
+            size_t n=d[0] ? d[0] : 65536;
+            first=(desc_signed || this->_is_signed) ?
+                (int)(int16_t)d[1] : (int)d[1];
+            int bits=d[2];
+
+            if(!(_vector_bytes<uint16_t>(data._value,t_ptr,t_len) ||
+                 _vector_bytes<char>(data._value,t_ptr,t_len) ||
+                 _vector_bytes<unsigned char>(data._value,t_ptr,t_len)) ||
+               !t_len)
+                throw ParseError("Bad Palette Color Lookup Table Data");
+
+            table.resize(n);
+            if(bits==8 && t_len<2*n){
+                // 8bit entries packed in words
+                for(size_t i=0;i<n;i++)
+                    table[i]=t_ptr[std::min(i,t_len-1)];
+            }
+            else{
+                const uint16_t *t=(const uint16_t *)t_ptr;
+                size_t t_n=t_len/2;
+                for(size_t i=0;i<n;i++){
+                    uint16_t v=t[std::min(i,t_n-1)];
+                    table[i]=(unsigned char)((bits==8) ? v : v>>8);
                 }
             }
-            if(this->_format_as_deflate)
-                throw std::runtime_error("Deflated LEE has not been supported");
+        }
 
-            while(true){
-                try{
-                    Element e(this,ist);
-                    this->_element[e.tag().number]=e;
+        //
+        // PALETTE COLOR to BGR through a table indexed by raw word
+        //
+        void _decode_palette(const unsigned char *src,
+                             bool swap,
+                             size_t n,
+                             unsigned char *dst)
+        {
+            std::vector<unsigned char> lut[3];
+            int first[3];
+            this->_palette_table(TAG_PALETTE_DESC_B,TAG_PALETTE_DATA_B,
+                                 lut[0],first[0]);
+            this->_palette_table(TAG_PALETTE_DESC_G,TAG_PALETTE_DATA_G,
+                                 lut[1],first[1]);
+            this->_palette_table(TAG_PALETTE_DESC_R,TAG_PALETTE_DATA_R,
+                                 lut[2],first[2]);
+
+            int shift;
+            uint32_t mask,sign;
+            this->_unpad_masks(shift,mask,sign);
+
+            size_t lut_size=(size_t)1<<this->_bits;
+            std::vector<unsigned char> bgr(lut_size*3);
+            for(size_t r=0;r<lut_size;r++){
+                uint16_t raw=(uint16_t)r;
+                int64_t v=(this->_bits==8) ?
+                    _stored_value<uint8_t>((unsigned char *)&raw,0,
+                                           false,shift,mask,sign) :
+                    _stored_value<uint16_t>((unsigned char *)&raw,0,
+                                            swap,shift,mask,sign);
+                for(int c=0;c<3;c++){
+                    int i=(int)v-first[c];
+                    i=std::max(0,std::min(i,(int)lut[c].size()-1));
+                    bgr[r*3+c]=lut[c][i];
                 }
-                catch(StreamError &e){
-                    break;
+            }
+
+            if(this->_bits==8){
+                for(size_t i=0;i<n;i++)
+                    memcpy(dst+3*i,&bgr[src[i]*3],3);
+            }
+            else{
+                for(size_t i=0;i<n;i++){
+                    uint16_t w;
+                    memcpy(&w,src+2*i,2);
+                    memcpy(dst+3*i,&bgr[w*3],3);
                 }
             }
+        }
 
-            if(parse_all)
-                this->parse_image(need_rescale);
-            else
-                this->parse_summary();
+        //
+        // first frame of color image to BGR cv::Mat in one pass
+        //
+        void _decode_color(const unsigned char *src,
+                           size_t len,
+                           bool swap,
+                           int frames,
+                           cv::Mat &dst)
+        {
+            this->_color_check();
 
-            return *this;
+            size_t frame_bytes=this->_frame_bytes();
+            if(len<frame_bytes*frames)
+                throw ParseError("Frame Data is too short");
+
+            dst.create(this->_rows*frames,
+                       this->_cols,
+                       (this->_bits==8) ? CV_8UC3 : CV_16UC3);
+
+            size_t n=(size_t)this->_rows*this->_cols;
+            for(int f=0;f<frames;f++,src+=frame_bytes)
+                this->_color_pixels(src,swap,n,dst.ptr(f*this->_rows));
         }
 
-        ///
-        /// parse DICOM tags
-        ///
-        /// @return self
-        ///
-        Dicom &parse_summary()
+        void _color_check()
         {
-            this->_cols=0;
-            this->_rows=0;
-            this->_bits=0;
-            this->_chs=0;
-            this->_is_signed=false;
-
-            this->_px_spacing_row=0.0f;
-            this->_px_spacing_col=0.0f;
-            this->_image_pos_x=nanf("");
-            this->_image_pos_y=nanf("");
-            this->_image_pos_z=nanf("");
+            if(this->_bits!=8 && this->_bits!=16)
+                throw std::runtime_error("Unsupported Bit Allocation");
+            if(this->_bits!=8 && this->_photometric!=PHOTO_RGB)
+                throw std::runtime_error("Unsupported Bit Allocation");
+        }
 
-            if(!this->has_element(TAG_PHOTO_INTERPRET))
-                throw MissingTagError(
-                    "Could not found Photometric Interpretation Tag");
-            std::string p_int=
-                this->element(TAG_PHOTO_INTERPRET).as<std::string>();
-#ifdef DEBUG
-            fprintf(stderr,"\nPhotometric Interpretation: %s\n",p_int.c_str());
-#endif
+        //
+        // n color pixels of a frame, or of rows when not planar, to BGR
+        //
+        void _color_pixels(const unsigned char *src,
+                           bool swap,
+                           size_t n,
+                           unsigned char *d)
+        {
+            switch(this->_photometric){
+            case PHOTO_PALETTE_COLOR:
+                this->_decode_palette(src,swap,n,d);
+                break;
+            case PHOTO_RGB:
+                if(this->_bits==8)
+                    _rgb_to_bgr<uint8_t>(src,this->_planar,n,false,
+                                         (uint8_t *)d);
+                else
+                    _rgb_to_bgr<uint16_t>(src,this->_planar,n,swap,
+                                          (uint16_t *)d);
+                break;
+            case PHOTO_YBR_FULL:
+                _ybr_to_bgr(src,this->_planar,n,d);
+                break;
+            case PHOTO_YBR_FULL_422:
+                _ybr422_to_bgr(src,n,d);
+                break;
+            default:
+                throw std::runtime_error(
+                    "Unsupported Photometric Interpretation");
+            }
+        }
 
-            if(p_int.find("MONOCHROME2")==std::string::npos)
-                throw std::runtime_error("Unsupported Photometric Interpretation");
+        //
+        // 8bit BGR for display
+        //
+        void _color_to_8bit(cv::Mat &bgr)
+        {
+            if(bgr.depth()==CV_8U)
+                return;
+
+            int shift,bit_stored;
+            this->_unpad_params(shift,bit_stored);
+            bgr.convertTo(bgr,CV_8UC3,
+                          255.0/(double)(((uint32_t)1<<bit_stored)-1),
+                          0.0);
+        }
 
-            this->_chs=1;
+        //
+        // reduce decoded image
+        //
+        template <class T>
+        static void _reduce_mat(const cv::Mat &src,
+                                int factor,
+                                int mode,
+                                cv::Mat &dst)
+        {
+            int cn=src.channels();
+            int out_rows=(src.rows+factor-1)/factor;
+            int out_cols=(src.cols+factor-1)/factor;
+            int block=(mode==REDUCE_BOX) ? factor : 1;
+
+            dst.create(out_rows,out_cols,src.type());
+            for(int oy=0;oy<out_rows;oy++){
+                int y0=oy*factor;
+                int y1=std::min(y0+block,src.rows);
+                T *d=dst.ptr<T>(oy);
+                for(int ox=0;ox<out_cols;ox++){
+                    int x0=ox*factor;
+                    int x1=std::min(x0+block,src.cols);
+                    for(int c=0;c<cn;c++){
+                        double sum=0.0;
+                        for(int y=y0;y<y1;y++){
+                            const T *s=src.ptr<T>(y);
+                            for(int x=x0;x<x1;x++)
+                                sum+=s[x*cn+c];
+                        }
+                        d[ox*cn+c]=cv::saturate_cast<T>(
+                            sum/((y1-y0)*(x1-x0)));
+                    }
+                }
+            }
+        }
 
+        //
+        // VOI transform to 8bit (PS3.3 C.11.2.1.2)
+        //
+        class VoiTransform
+        {
+        public:
+            int function;
+            float center;
+            float width;
+
+            // VOI LUT Sequence
+            std::vector<uint16_t> table;
+            int table_first;
+            int table_bits;
+
+            VoiTransform()
+                :function(VOI_LINEAR),
+                 center(0.0),
+                 width(1.0),
+                 table_first(0),
+                 table_bits(8)
+            {}
 
             //
-            // signed or unsigned
+            // window over [lo,hi]
             //
-            if(!this->has_element(TAG_PX_REP))
-                throw MissingTagError(
-                    "Could not found Pixel Representation Tag");
-            int px_rep=(int)this->element(TAG_PX_REP).as<uint16_t>();
-#ifdef DEBUG
-            fprintf(stderr,"Pixel Representation: %d\n",px_rep);
-#endif
-            if(px_rep==0)
-                this->_is_signed=false;
-            else
-                this->_is_signed=true;
+            void set_range(float lo,float hi)
+            {
+                this->function=VOI_LINEAR;
+                this->width=hi-lo+1.0;
+                this->center=lo+this->width/2.0;
+            }
 
+            inline unsigned char map(float x) const
+            {
+                float v;
+                switch(this->function){
+                case VOI_LINEAR_EXACT:
+                    v=((x-this->center)/this->width+0.5)*255.0;
+                    break;
+                case VOI_SIGMOID:
+                    v=255.0/(1.0+expf(-4.0*(x-this->center)/this->width));
+                    break;
+                case VOI_TABLE:
+                    {
+                        int i=(int)floorf(x+0.5)-this->table_first;
+                        i=std::max(0,std::min(i,(int)this->table.size()-1));
+                        v=(float)this->table[i]*255.0/
+                            (float)((1<<this->table_bits)-1);
+                    }
+                    break;
+                default: // VOI_LINEAR
+                    if(this->width<=1.0)
+                        return (x<=this->center-0.5) ? 0 : 255;
+                    v=((x-(this->center-0.5))/(this->width-1.0)+0.5)*255.0;
+                    break;
+                }
 
-            if(!this->has_element(TAG_BIT_ALLOC))
-                throw MissingTagError(
-                    "Could not found Bit Allocation Tag");
-            this->_bits=(int)this->element(TAG_BIT_ALLOC).as<uint16_t>();
-#ifdef DEBUG
-            fprintf(stderr,"Bit Allocation: %d\n",this->_bits);
-#endif
+                return (v<=0.0) ? 0 :
+                    (v>=255.0) ? 255 : (unsigned char)(v+0.5);
+            }
+        };
 
-            if(!this->has_element(TAG_ROWS) || 
-                !this->has_element(TAG_COLS))
-                throw MissingTagError(
-                    "Could not found Cols and/or Rows Tag");
-            this->_rows=(int)this->element(TAG_ROWS).as<uint16_t>();
-            this->_cols=(int)this->element(TAG_COLS).as<uint16_t>();
-#ifdef DEBUG
-            fprintf(stderr,"%d x %d\n",this->_cols,this->_rows);
-#endif
+        //
+        // cached raw word to display value table of display_image()
+        //
+        std::vector<unsigned char> _display_lut;
+        int _display_lut_function;
+        float _display_lut_center;
+        float _display_lut_width;
 
+        //
+        // options of collect_stats() and collected statistics
+        //
+        bool _collect_stats;
+        int _stats_bins;
+        bool _stats_rescaled;
+        double _stats_lo;
+        double _stats_hi;
+        PixelStats _stats;
 
-            //
-            // misc information
-            //
-            std::string str;
-            std::vector<std::string> s_vec;
-            //
-            // pixel spacing
-            //
-            if(this->has_element(TAG_PX_SPACING)){
-                str=this->element(TAG_PX_SPACING).as<std::string>();
-                boost::algorithm::trim(str);
-                boost::algorithm::split(s_vec,str,boost::is_any_of("\\"));
-                if(s_vec.size()>=2){
-                    try{
-                        this->_px_spacing_row=
-                            boost::lexical_cast<float>(s_vec[0]);
-                        this->_px_spacing_col=
-                            boost::lexical_cast<float>(s_vec[1]);
+        //
+        // VOI LUT Sequence, or Window Center/Width with VOI LUT Function
+        //
+        bool _voi_from_tags(VoiTransform &voi)
+        {
+            Item item;
+            if(this->has_element(TAG_VOI_LUT_SEQ) &&
+               this->element(TAG_VOI_LUT_SEQ).item_count())
+                item=this->element(TAG_VOI_LUT_SEQ).item(0);
+            if(item.has_element(TAG_LUT_DESCRIPTOR) &&
+               item.has_element(TAG_LUT_DATA)){
+                Element desc=item.element(TAG_LUT_DESCRIPTOR);
+                Element data=item.element(TAG_LUT_DATA);
+
+                const unsigned char *d_ptr,*t_ptr;
+                size_t d_len,t_len;
+                bool desc_signed=
+                    _vector_bytes<int16_t>(desc._value,d_ptr,d_len);
+                if((desc_signed ||
+                    _vector_bytes<uint16_t>(desc._value,d_ptr,d_len)) &&
+                   d_len>=6){
+                    uint16_t d[3];
+                    memcpy(d,d_ptr,6);
+                    size_t n=d[0] ? d[0] : 65536;
+                    voi.table_first=(desc_signed || this->_is_signed) ?
+                        (int)(int16_t)d[1] : (int)d[1];
+                    voi.table_bits=std::max(1,std::min((int)d[2],16));
+
+                    voi.table.clear();
+                    if(_vector_bytes<uint16_t>(data._value,t_ptr,t_len)){
+                        const uint16_t *t=(const uint16_t *)t_ptr;
+                        voi.table.assign(t,t+std::min(n,t_len/2));
+                    }
+                    else if(_vector_bytes<char>(data._value,t_ptr,t_len) ||
+                            _vector_bytes<unsigned char>(data._value,
+                                                         t_ptr,
+                                                         t_len)){
+                        for(size_t i=0;i<n && i<t_len;i++)
+                            voi.table.push_back(t_ptr[i]);
+                    }
 
-#ifdef DEBUG
-                        fprintf(stderr,"Pixel Spacing: %f, %f\n",
-                                this->_px_spacing_row,
-                                this->_px_spacing_col);
-#endif
+                    if(!voi.table.empty()){
+                        voi.function=VOI_TABLE;
+                        return true;
                     }
-                    catch(boost::bad_lexical_cast &e){}
-       
                 }
             }
 
-            //
-            // image position
-            //
-            if(this->has_element(TAG_IMG_POSITION)){
-                s_vec.clear();
-                str=this->element(TAG_IMG_POSITION).as<std::string>();
-                boost::algorithm::trim(str);
-                boost::algorithm::split(s_vec,str,boost::is_any_of("\\"));
-                if(s_vec.size()>=3){
-                    try{
-                        this->_image_pos_x=
-                            boost::lexical_cast<float>(s_vec[0]);
-                        this->_image_pos_y=
-                            boost::lexical_cast<float>(s_vec[1]);
-                        this->_image_pos_z=
-                            boost::lexical_cast<float>(s_vec[2]);
- 
+            if(!this->_first_float(TAG_WINDOW_CENTER,voi.center) ||
+               !this->_first_float(TAG_WINDOW_WIDTH,voi.width) ||
+               voi.width<=0.0)
+                return false;
+
+            voi.function=VOI_LINEAR;
+            if(this->has_element(TAG_VOI_LUT_FUNCTION)){
+                std::string f=
+                    this->element(TAG_VOI_LUT_FUNCTION).as<std::string>();
+                if(f.find("SIGMOID")!=std::string::npos)
+                    voi.function=VOI_SIGMOID;
+                else if(f.find("LINEAR_EXACT")!=std::string::npos)
+                    voi.function=VOI_LINEAR_EXACT;
+            }
 #ifdef DEBUG
-                        fprintf(stderr,"Image Position: %f, %f, %f\n",
-                                this->_image_pos_x,
-                                this->_image_pos_y,
-                                this->_image_pos_z);
+            fprintf(stderr,"Window: %f / %f (%d)\n",
+                    voi.center,voi.width,voi.function);
 #endif
-                    }
-                    catch(boost::bad_lexical_cast &e){}
+
+            return true;
+        }
+
+        //
+        // VOI windowing of rescaled pixels to 8bit
+        //
+        void _window_to_8bit(const float *src,
+                             int rows,
+                             int cols,
+                             cv::Mat &dst)
+        {
+            VoiTransform voi;
+            this->_window_to_8bit(src,rows,cols,voi,true,dst);
+        }
+
+        void _window_to_8bit(const float *src,
+                             int rows,
+                             int cols,
+                             VoiTransform &voi,
+                             bool from_tags,
+                             cv::Mat &dst)
+        {
+            size_t n=(size_t)rows*cols;
+            if(from_tags && !this->_voi_from_tags(voi)){
+                // window over the range of pixels
+                float lo=n ? src[0] : 0.0;
+                float hi=lo;
+                for(size_t i=1;i<n;i++){
+                    lo=std::min(lo,src[i]);
+                    hi=std::max(hi,src[i]);
                 }
+                voi.set_range(lo,hi);
             }
 
-            return *this;
+            unsigned char inv=
+                (this->_photometric==PHOTO_MONOCHROME1) ? 255 : 0;
+
+            dst.create(rows,cols,CV_8UC1);
+            for(int y=0;y<rows;y++){
+                const float *s=&src[(size_t)y*cols];
+                unsigned char *d=dst.ptr<unsigned char>(y);
+                for(int x=0;x<cols;x++)
+                    d[x]=voi.map(s[x])^inv;
+            }
         }
 
-        Dicom &parse_image(bool need_rescale=true)
+        //
+        // map raw Frame Data words through a table in one pass
+        //
+        template <class T>
+        static void _lut_pass(const unsigned char *src,
+                              size_t n,
+                              const unsigned char *lut,
+                              unsigned char *dst)
+        {
+            T w[4];
+            size_t i=0;
+            for(;i+4<=n;i+=4){
+                memcpy(w,src+i*sizeof(T),sizeof(w));
+                dst[i]=lut[w[0]];
+                dst[i+1]=lut[w[1]];
+                dst[i+2]=lut[w[2]];
+                dst[i+3]=lut[w[3]];
+            }
+            for(;i<n;i++){
+                memcpy(w,src+i*sizeof(T),sizeof(T));
+                dst[i]=lut[w[0]];
+            }
+        }
+
+        cv::Mat _display_image(VoiTransform &voi,bool from_tags)
         {
             if(!this->_cols ||
                !this->_rows ||
                !this->_bits ||
                !this->_chs)
-            this->parse_summary();
+                this->parse_summary();
 
-            //
-            // convert Frame Data (0x7fe0,0x0010) to cv::Mat
-            //
-            if(!this->has_element(TAG_FRAME_DATA))
-                throw MissingTagError(
-                    "Could not found Frame Data Tag");
-            switch(this->_bits){
-            case 8:
-                if(this->_is_signed)
-                    this->_image=
-                        cv::Mat(this->element(TAG_FRAME_DATA).as<
-                                    std::vector<char>
-                                    >(),
-                                true);
-                else
-                    this->_image=
-                        cv::Mat(this->element(TAG_FRAME_DATA).as<
-                                    std::vector<unsigned char>
-                                    >(),
-                                true);
-                break;
-            case 16:
-                if(this->_is_signed)
-                    this->_image=
-                        cv::Mat(this->element(TAG_FRAME_DATA).as<
-                                    std::vector<int16_t>
-                                    >(),
-                                true);
-                else
-                    this->_image=
-                        cv::Mat(this->element(TAG_FRAME_DATA).as<
-                                    std::vector<uint16_t>
-                                    >(),
-                                true);
-                break;
-            default:
-                throw std::runtime_error("Unsupported Bit Allocation");
-            }
+            const unsigned char *src;
+            size_t len;
+            bool swap;
+            this->_frame_data_bytes(src,len,swap);
 
-            this->_image=this->_image.reshape(1,this->_rows);
+            // no VOI for color images
+            if(this->_is_color()){
+                cv::Mat bgr;
+                this->_decode_color(src,len,swap,1,bgr);
+                this->_color_to_8bit(bgr);
 
+                return bgr;
+            }
 
-            //
-            // unpadding for each pixel
-            //
-            if(!this->has_element(TAG_BIT_STORED))
-                throw MissingTagError(
-                    "Could not found Bit Stored Tag");
-            int bit_stored=(int)this->element(TAG_BIT_STORED).as<uint16_t>();
-#ifdef DEBUG
-            fprintf(stderr,"Bit Stored: %d\n",bit_stored);
-#endif
+            // no raw word table for pixels not in 8/16bit
+            if(this->_is_float_pixel() ||
+               (this->_bits!=8 && this->_bits!=16)){
+                cv::Mat full,dst;
+                this->_unpack_float_frame(src,len,swap,true,full);
+                this->_window_to_8bit(full.ptr<float>(),
+                                      full.rows,
+                                      full.cols,
+                                      voi,
+                                      from_tags,
+                                      dst);
+
+                return dst;
+            }
 
-            if(!this->has_element(TAG_HI_BIT))
-                throw MissingTagError(
-                    "Could not found Hi Bit Tag");
-            int hi_bit=(int)this->element(TAG_HI_BIT).as<uint16_t>();
-#ifdef DEBUG
-            fprintf(stderr,"Hi Bit: %d\n",hi_bit);
-#endif
-            if(this->_bits!=bit_stored){
-                int d=hi_bit-bit_stored+1;
-                for(int i=0;i<d;i++)
-                    this->_image/=2;
+            size_t n=(size_t)this->_rows*this->_cols;
+            if(len<n*(this->_bits/8))
+                throw ParseError("Frame Data is too short");
+
+            int shift;
+            uint32_t mask,sign;
+            this->_unpad_masks(shift,mask,sign);
+
+            float slope=1.0,interception=0.0;
+            this->_rescale_params(slope,interception);
+
+            if(from_tags && !this->_voi_from_tags(voi)){
+                // window over the range of stored pixels
+                int64_t lo=0,hi=0;
+                for(size_t i=0;i<n;i++){
+                    int64_t v=(this->_bits==8) ?
+                        _stored_value<uint8_t>(src,i,swap,shift,mask,sign) :
+                        _stored_value<uint16_t>(src,i,swap,shift,mask,sign);
+                    if(!i || v<lo)
+                        lo=v;
+                    if(!i || v>hi)
+                        hi=v;
+                }
+                float a=lo*slope+interception;
+                float b=hi*slope+interception;
+                voi.set_range(std::min(a,b),std::max(a,b));
             }
 
-            std::string str;
             //
-            // rescale
+            // (re)build table indexed by raw word; unpad, rescale
+            // and VOI are folded into it
             //
-            if(need_rescale &&
-               this->has_element(TAG_RESCALE_INT) &&
-                this->has_element(TAG_RESCALE_SLP)){
-                float rescale_interception=0.0;
-                float rescale_slope=1.0;
-
-                str=this->element(TAG_RESCALE_INT).as<std::string>();
-                boost::algorithm::trim(str);
-                try{
-                    rescale_interception=boost::lexical_cast<float>(str);
-#ifdef DEBUG
-                    fprintf(stderr,"Rescale Interception: %f\n",
-                            rescale_interception);
-#endif
-                }
-                catch(boost::bad_lexical_cast &e){
-                    rescale_interception=0.0;
-                }
-
-                str=this->element(TAG_RESCALE_SLP).as<std::string>();
-                boost::algorithm::trim(str);
-                try{
-                    rescale_slope=boost::lexical_cast<float>(str);
-#ifdef DEBUG
-                    fprintf(stderr,"Rescale Slope: %f\n",
-                            rescale_slope);
-#endif
-                }
-                catch(boost::bad_lexical_cast &e){
-                    rescale_slope=1.0;
+            if(this->_display_lut.empty() ||
+               this->_display_lut_function!=voi.function ||
+               this->_display_lut_center!=voi.center ||
+               this->_display_lut_width!=voi.width){
+                unsigned char inv=
+                    (this->_photometric==PHOTO_MONOCHROME1) ? 255 : 0;
+                size_t lut_size=(size_t)1<<this->_bits;
+                this->_display_lut.resize(lut_size);
+                for(size_t r=0;r<lut_size;r++){
+                    uint16_t raw=(uint16_t)r;
+                    int64_t v=(this->_bits==8) ?
+                        _stored_value<uint8_t>((unsigned char *)&raw,0,
+                                               false,shift,mask,sign) :
+                        _stored_value<uint16_t>((unsigned char *)&raw,0,
+                                                swap,shift,mask,sign);
+                    this->_display_lut[r]=voi.map(v*slope+interception)^inv;
                 }
-
-                this->_image*=rescale_slope;
-                this->_image+=rescale_interception;
+                this->_display_lut_function=voi.function;
+                this->_display_lut_center=voi.center;
+                this->_display_lut_width=voi.width;
             }
 
-            
-            return *this;
-        }
-        
-
-    private:
-        cv::Mat _image;
-
-        int _cols;
-        int _rows;
-        int _bits;
-        int _chs;
-        bool _is_signed;
-
-        float _px_spacing_row;
-        float _px_spacing_col;
-        float _image_pos_x;
-        float _image_pos_y;
-        float _image_pos_z;
-
-        std::map<uint32_t,Element> _element;
-
-        bool _architecture_as_little_endian;
-        bool _format_as_little_endian;
-        bool _format_as_explicit;
-        bool _format_as_deflate;
+            cv::Mat dst(this->_rows,this->_cols,CV_8UC1);
+            if(this->_bits==8)
+                _lut_pass<uint8_t>(src,n,&this->_display_lut[0],dst.data);
+            else
+                _lut_pass<uint16_t>(src,n,&this->_display_lut[0],dst.data);
 
-        inline bool _need_byte_swap()
-        { 
-            return this->_architecture_as_little_endian!=
-                this->_format_as_little_endian;
+            return dst;
         }
 
-
     };
 };
 
@@ -1298,7 +5440,12 @@ VVV::Dicom::TAG_GROUP_META=0x0002,
 const VVV::Dicom::TypeTag
 VVV::Dicom::TAG_TRANSFER_SYNTAX_UID={{0x0002,0x0010}},
     VVV::Dicom::TAG_IMG_POSITION={{0x0020,0x0032}},
+    VVV::Dicom::TAG_PLANE_POSITION_SEQ={{0x0020,0x9113}},
+    VVV::Dicom::TAG_PLANE_ORIENTATION_SEQ={{0x0020,0x9116}},
+    VVV::Dicom::TAG_SAMPLES_PER_PX={{0x0028,0x0002}},
     VVV::Dicom::TAG_PHOTO_INTERPRET={{0x0028,0x0004}},
+    VVV::Dicom::TAG_PLANAR_CONF={{0x0028,0x0006}},
+    VVV::Dicom::TAG_NUM_FRAMES={{0x0028,0x0008}},
     VVV::Dicom::TAG_ROWS={{0x0028,0x0010}},
     VVV::Dicom::TAG_COLS={{0x0028,0x0011}},
     VVV::Dicom::TAG_PX_SPACING={{0x0028,0x0030}},
@@ -1306,8 +5453,25 @@ VVV::Dicom::TAG_TRANSFER_SYNTAX_UID={{0x0002,0x0010}},
     VVV::Dicom::TAG_BIT_STORED={{0x0028,0x0101}},
     VVV::Dicom::TAG_HI_BIT={{0x0028,0x0102}},
     VVV::Dicom::TAG_PX_REP={{0x0028,0x0103}},
+    VVV::Dicom::TAG_WINDOW_CENTER={{0x0028,0x1050}},
+    VVV::Dicom::TAG_WINDOW_WIDTH={{0x0028,0x1051}},
     VVV::Dicom::TAG_RESCALE_INT={{0x0028,0x1052}},
     VVV::Dicom::TAG_RESCALE_SLP={{0x0028,0x1053}},
+    VVV::Dicom::TAG_VOI_LUT_FUNCTION={{0x0028,0x1056}},
+    VVV::Dicom::TAG_PALETTE_DESC_R={{0x0028,0x1101}},
+    VVV::Dicom::TAG_PALETTE_DESC_G={{0x0028,0x1102}},
+    VVV::Dicom::TAG_PALETTE_DESC_B={{0x0028,0x1103}},
+    VVV::Dicom::TAG_PALETTE_DATA_R={{0x0028,0x1201}},
+    VVV::Dicom::TAG_PALETTE_DATA_G={{0x0028,0x1202}},
+    VVV::Dicom::TAG_PALETTE_DATA_B={{0x0028,0x1203}},
+    VVV::Dicom::TAG_LUT_DESCRIPTOR={{0x0028,0x3002}},
+    VVV::Dicom::TAG_LUT_DATA={{0x0028,0x3006}},
+    VVV::Dicom::TAG_VOI_LUT_SEQ={{0x0028,0x3010}},
+    VVV::Dicom::TAG_PIXEL_MEASURES_SEQ={{0x0028,0x9110}},
+    VVV::Dicom::TAG_SHARED_FRAME_SEQ={{0x5200,0x9229}},
+    VVV::Dicom::TAG_PER_FRAME_SEQ={{0x5200,0x9230}},
+    VVV::Dicom::TAG_FLOAT_FRAME_DATA={{0x7fe0,0x0008}},
+    VVV::Dicom::TAG_DOUBLE_FRAME_DATA={{0x7fe0,0x0009}},
     VVV::Dicom::TAG_FRAME_DATA={{0x7fe0,0x0010}};
 //
 //
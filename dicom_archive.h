@@ -0,0 +1,774 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_archive.h
+///
+/// @brief  read DICOM files in ZIP and tar(.gz) archives (POSIX, zlib)
+///
+
+#ifndef __VVV_DICOM_ARCHIVE_H__
+
+#define __VVV_DICOM_ARCHIVE_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <future>
+#include <memory>
+#include <algorithm>
+#include <exception>
+
+namespace VVV
+{
+    ///
+    /// common part of archive readers
+    ///
+    class Archive
+    {
+    public:
+        ///
+        /// query method that bytes are a DICOM file or not
+        ///
+        /// @param data head of the file
+        /// @param len bytes of data
+        ///
+        /// @return true when "DICM" follows the 128 bytes preamble
+        ///
+        static bool is_dicom(const unsigned char *data,size_t len)
+        {
+            return len>=132 && memcmp(data+128,"DICM",4)==0;
+        }
+
+        ///
+        /// parse a DICOM file in memory
+        ///
+        /// @param data the file
+        /// @param dst parsed object
+        /// @param parse_all parse with image or only summary
+        ///
+        /// @return dst
+        ///
+        static Dicom &parse(const std::vector<unsigned char> &data,
+                            Dicom &dst,
+                            bool parse_all=true)
+        {
+            Dicom::MemoryStreamBuf buf(data.empty() ? NULL : &data[0],
+                                       data.size());
+            std::istream ist(&buf);
+
+            return dst.parse(ist,parse_all);
+        }
+
+    protected:
+        static uint16_t _u16(const unsigned char *p)
+        {
+            return (uint16_t)(p[0]|(p[1]<<8));
+        }
+
+        static uint32_t _u32(const unsigned char *p)
+        {
+            return (uint32_t)_u16(p)|((uint32_t)_u16(p+2)<<16);
+        }
+
+        static uint64_t _u64(const unsigned char *p)
+        {
+            return (uint64_t)_u32(p)|((uint64_t)_u32(p+4)<<32);
+        }
+    };
+
+    ///
+    /// ZIP archive reader
+    ///
+    /// Members are listed from the central directory (ZIP64 too)
+    /// and read by pread(), so any number of threads may read
+    /// members at once. Stored and deflated members are supported.
+    ///
+    class ZipArchive : public Archive
+    {
+    public:
+        ///
+        /// a member of archive
+        ///
+        struct Member
+        {
+            std::string name;          ///< path in archive
+            uint64_t size;             ///< uncompressed bytes
+            uint64_t compressed_size;  ///< stored bytes
+            uint64_t offset;           ///< offset of local header
+            uint32_t crc;              ///< CRC-32 of uncompressed bytes
+            uint16_t method;           ///< 0: stored, 8: deflated
+            uint16_t flags;            ///< general purpose bit flag
+
+            ///
+            /// query method that member is a directory or not
+            ///
+            bool is_directory() const
+            {
+                return !this->name.empty() &&
+                    this->name[this->name.size()-1]=='/';
+            }
+        };
+
+        ///
+        /// constructor
+        ///
+        /// @param path path of archive
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError
+        ///
+        ZipArchive(const std::string &path)
+        {
+            this->_fd=open(path.c_str(),O_RDONLY);
+            if(this->_fd<0)
+                throw Dicom::StreamError("Could not open archive");
+
+            try{
+                this->_read_directory();
+            }
+            catch(...){
+                close(this->_fd);
+                throw;
+            }
+        }
+
+        ///
+        /// destructor
+        ///
+        ~ZipArchive()
+        {
+            close(this->_fd);
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return members in central directory order
+        ///
+        const std::vector<Member> &members() const { return this->_members; }
+
+        ///
+        /// read a member
+        ///
+        /// @param index member index
+        /// @param dst uncompressed bytes
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError,
+        ///       std::runtime_error for unsupported member
+        ///
+        void read(size_t index,std::vector<unsigned char> &dst) const
+        {
+            const Member &m=this->_member(index);
+
+            std::vector<unsigned char> raw;
+            this->_pread(this->_data_offset(m),
+                         (size_t)m.compressed_size,
+                         raw);
+
+            if(m.method==0){
+                dst.swap(raw);
+            }
+            else{
+                dst.resize((size_t)m.size);
+                _inflate(raw,dst,true);
+            }
+
+            if(_crc(dst)!=m.crc)
+                throw Dicom::ParseError("CRC mismatch in archive member");
+        }
+
+        using Archive::is_dicom;
+
+        ///
+        /// query method that a member is a DICOM file or not
+        ///
+        /// @param index member index
+        ///
+        /// @return true or false
+        ///
+        /// Only the head of the member is read. Members which can not
+        /// be read are not DICOM files.
+        ///
+        bool is_dicom(size_t index) const
+        {
+            const Member &m=this->_member(index);
+            if(m.is_directory() || m.size<132 ||
+               (m.flags&0x0001) || (m.method!=0 && m.method!=8))
+                return false;
+
+            size_t n=(size_t)std::min<uint64_t>(m.compressed_size,
+                                                m.method==0 ? 132 : 4096);
+            std::vector<unsigned char> raw,head;
+            this->_pread(this->_data_offset(m),n,raw);
+            if(m.method==0){
+                head.swap(raw);
+            }
+            else{
+                head.resize(132);
+                _inflate(raw,head,false);
+            }
+
+            return Archive::is_dicom(head.empty() ? NULL : &head[0],
+                                     head.size());
+        }
+
+        ///
+        /// parse a member
+        ///
+        /// @param index member index
+        /// @param dst parsed object
+        /// @param parse_all parse with image or only summary
+        ///
+        /// @return dst
+        ///
+        Dicom &parse(size_t index,Dicom &dst,bool parse_all=true) const
+        {
+            std::vector<unsigned char> data;
+            this->read(index,data);
+
+            return Archive::parse(data,dst,parse_all);
+        }
+
+        ///
+        /// parse all DICOM members in parallel
+        ///
+        /// @param pool thread pool
+        /// @param dst parsed objects in order of members
+        /// @param names member names of dst
+        /// @param parse_all parse with image or only summary
+        ///
+        /// Members which are not DICOM files are skipped. The first
+        /// exception is rethrown after all members.
+        ///
+        void load(ThreadPool &pool,
+                  std::vector<Dicom> &dst,
+                  std::vector<std::string> &names,
+                  bool parse_all=true) const
+        {
+            std::vector<char> dicom(this->_members.size());
+            pool.parallel_for(0,this->_members.size(),[&](size_t i){
+                    dicom[i]=this->is_dicom(i);
+                });
+
+            std::vector<size_t> index;
+            names.clear();
+            for(size_t i=0;i<this->_members.size();i++){
+                if(dicom[i]){
+                    index.push_back(i);
+                    names.push_back(this->_members[i].name);
+                }
+            }
+
+            dst.clear();
+            dst.resize(index.size());
+            pool.parallel_for(0,index.size(),[&](size_t i){
+                    this->parse(index[i],dst[i],parse_all);
+                });
+        }
+
+    private:
+        int _fd;
+        std::vector<Member> _members;
+
+        ZipArchive(const ZipArchive &);
+        ZipArchive &operator=(const ZipArchive &);
+
+        const Member &_member(size_t index) const
+        {
+            if(index>=this->_members.size())
+                throw std::out_of_range("Bad member index");
+
+            return this->_members[index];
+        }
+
+        void _pread(uint64_t pos,size_t n,std::vector<unsigned char> &dst) const
+        {
+            dst.resize(n);
+            size_t done=0;
+            while(done<n){
+                ssize_t r=pread(this->_fd,&dst[done],n-done,
+                                (off_t)(pos+done));
+                if(r<0 && errno==EINTR)
+                    continue;
+                if(r<=0)
+                    throw Dicom::StreamError("Could not read archive");
+                done+=(size_t)r;
+            }
+        }
+
+        void _read_directory()
+        {
+            struct stat st;
+            if(fstat(this->_fd,&st)<0)
+                throw Dicom::StreamError("Could not stat archive");
+            uint64_t size=(uint64_t)st.st_size;
+            if(size<22)
+                throw Dicom::ParseError("not ZIP format");
+
+            //
+            // End of Central Directory record is in the last 64KiB
+            //
+            size_t tail_len=(size_t)std::min<uint64_t>(size,65535+22);
+            uint64_t tail_pos=size-tail_len;
+            std::vector<unsigned char> tail;
+            this->_pread(tail_pos,tail_len,tail);
+
+            size_t eocd=tail_len-22+1;
+            while(eocd-->0){
+                if(_u32(&tail[eocd])==0x06054b50)
+                    break;
+            }
+            if(eocd==(size_t)-1)
+                throw Dicom::ParseError("not ZIP format");
+
+            const unsigned char *p=&tail[eocd];
+            uint64_t entries=_u16(p+10);
+            uint64_t cd_size=_u32(p+12);
+            uint64_t cd_offset=_u32(p+16);
+
+            // ZIP64 End of Central Directory locator
+            if(eocd>=20 && _u32(&tail[eocd-20])==0x07064b50){
+                uint64_t eocd64=_u64(&tail[eocd-20+8]);
+                std::vector<unsigned char> r;
+                this->_pread(eocd64,56,r);
+                if(_u32(&r[0])!=0x06064b50)
+                    throw Dicom::ParseError("Broken ZIP64 record");
+                entries=_u64(&r[32]);
+                cd_size=_u64(&r[40]);
+                cd_offset=_u64(&r[48]);
+            }
+
+            if(cd_offset+cd_size>size)
+                throw Dicom::ParseError("Broken central directory");
+
+            std::vector<unsigned char> cd;
+            this->_pread(cd_offset,(size_t)cd_size,cd);
+
+            this->_members.clear();
+            this->_members.reserve((size_t)entries);
+            size_t off=0;
+            for(uint64_t i=0;i<entries;i++){
+                if(off+46>cd.size() || _u32(&cd[off])!=0x02014b50)
+                    throw Dicom::ParseError("Broken central directory");
+                p=&cd[off];
+
+                Member m;
+                m.flags=_u16(p+8);
+                m.method=_u16(p+10);
+                m.crc=_u32(p+16);
+                m.compressed_size=_u32(p+20);
+                m.size=_u32(p+24);
+                size_t name_len=_u16(p+28);
+                size_t extra_len=_u16(p+30);
+                size_t comment_len=_u16(p+32);
+                m.offset=_u32(p+42);
+                if(off+46+name_len+extra_len+comment_len>cd.size())
+                    throw Dicom::ParseError("Broken central directory");
+                m.name.assign((const char *)p+46,name_len);
+
+                // ZIP64 extended information replaces saturated fields
+                const unsigned char *x=p+46+name_len;
+                const unsigned char *x_end=x+extra_len;
+                while(x+4<=x_end){
+                    uint16_t id=_u16(x);
+                    uint16_t len=_u16(x+2);
+                    const unsigned char *v=x+4;
+                    if(v+len>x_end)
+                        break;
+                    if(id==0x0001){
+                        const unsigned char *v_end=v+len;
+                        if(m.size==0xFFFFFFFF && v+8<=v_end){
+                            m.size=_u64(v);
+                            v+=8;
+                        }
+                        if(m.compressed_size==0xFFFFFFFF && v+8<=v_end){
+                            m.compressed_size=_u64(v);
+                            v+=8;
+                        }
+                        if(m.offset==0xFFFFFFFF && v+8<=v_end)
+                            m.offset=_u64(v);
+                    }
+                    x=v+len;
+                }
+
+                this->_members.push_back(m);
+                off+=46+name_len+extra_len+comment_len;
+            }
+        }
+
+        //
+        // offset of member data after its local header
+        //
+        uint64_t _data_offset(const Member &m) const
+        {
+            if(m.flags&0x0001)
+                throw std::runtime_error(
+                    "Encrypted archive member has not been supported");
+            if(m.method!=0 && m.method!=8)
+                throw std::runtime_error(
+                    "Compression method has not been supported");
+
+            std::vector<unsigned char> h;
+            this->_pread(m.offset,30,h);
+            if(_u32(&h[0])!=0x04034b50)
+                throw Dicom::ParseError("Broken local header");
+
+            return m.offset+30+_u16(&h[26])+_u16(&h[28]);
+        }
+
+        //
+        // raw deflate; all of dst is filled when whole is true,
+        // otherwise dst is shrunk to the produced bytes
+        //
+        static void _inflate(std::vector<unsigned char> &src,
+                             std::vector<unsigned char> &dst,
+                             bool whole)
+        {
+            z_stream z;
+            memset(&z,0,sizeof(z));
+            if(inflateInit2(&z,-MAX_WBITS)!=Z_OK)
+                throw std::runtime_error("Could not initialize zlib");
+
+            size_t in=0,out=0;
+            int ret=Z_OK;
+            while(out<dst.size() && ret==Z_OK){
+                size_t in_n=std::min<size_t>(src.size()-in,1u<<30);
+                size_t out_n=std::min<size_t>(dst.size()-out,1u<<30);
+                z.next_in=src.empty() ? NULL : &src[in];
+                z.avail_in=(uInt)in_n;
+                z.next_out=&dst[out];
+                z.avail_out=(uInt)out_n;
+                ret=inflate(&z,Z_NO_FLUSH);
+                in+=in_n-z.avail_in;
+                out+=out_n-z.avail_out;
+                if(ret==Z_BUF_ERROR && in<src.size())
+                    ret=Z_OK;
+            }
+            inflateEnd(&z);
+
+            if(ret!=Z_OK && ret!=Z_STREAM_END && !(ret==Z_BUF_ERROR && !whole))
+                throw Dicom::ParseError("Broken deflated member");
+            if(whole && out!=dst.size())
+                throw Dicom::ParseError("Broken deflated member");
+            if(!whole)
+                dst.resize(out);
+        }
+
+        static uint32_t _crc(const std::vector<unsigned char> &data)
+        {
+            uLong crc=crc32(0L,Z_NULL,0);
+            size_t off=0;
+            while(off<data.size()){
+                size_t n=std::min<size_t>(data.size()-off,1u<<30);
+                crc=crc32(crc,&data[off],(uInt)n);
+                off+=n;
+            }
+
+            return (uint32_t)crc;
+        }
+    };
+
+    ///
+    /// tar archive reader
+    ///
+    /// Members are read in stored order from a plain or gzipped
+    /// (auto-detected) tar file. Decompression is sequential;
+    /// load() parses members on a thread pool while reading the
+    /// next ones.
+    ///
+    class TarArchive : public Archive
+    {
+    public:
+        ///
+        /// a member of archive
+        ///
+        struct Member
+        {
+            std::string name;  ///< path in archive
+            uint64_t size;     ///< bytes
+        };
+
+        ///
+        /// constructor
+        ///
+        /// @param path path of archive (.tar, .tar.gz or .tgz)
+        ///
+        /// throw Dicom::StreamError
+        ///
+        TarArchive(const std::string &path)
+        {
+            this->_gz=gzopen(path.c_str(),"rb");
+            if(!this->_gz)
+                throw Dicom::StreamError("Could not open archive");
+            gzbuffer(this->_gz,1<<17);
+        }
+
+        ///
+        /// destructor
+        ///
+        ~TarArchive()
+        {
+            gzclose(this->_gz);
+        }
+
+        ///
+        /// read the next regular file
+        ///
+        /// @param m member information
+        /// @param data bytes of the member
+        ///
+        /// @return false at the end of archive
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError
+        ///
+        bool next(Member &m,std::vector<unsigned char> &data)
+        {
+            std::string long_name;
+            unsigned char h[512];
+            while(true){
+                if(!this->_read(h,512,true))
+                    return false;
+
+                bool zero=true;
+                for(size_t i=0;i<512 && zero;i++)
+                    zero=(h[i]==0);
+                if(zero)
+                    return false;
+
+                unsigned int sum=0;
+                for(size_t i=0;i<512;i++)
+                    sum+=(i>=148 && i<156) ? ' ' : h[i];
+                if(_octal(h+148,8)!=sum)
+                    throw Dicom::ParseError("Broken tar header");
+
+                uint64_t size=_number(h+124,12);
+                char type=(char)h[156];
+
+                if(type=='L' || type=='x'){
+                    std::vector<unsigned char> v;
+                    this->_data(size,v);
+                    if(type=='L' && !v.empty())
+                        long_name.assign((const char *)&v[0],
+                                         strnlen((const char *)&v[0],
+                                                 v.size()));
+                    else if(type=='x')
+                        _pax_path(v,long_name);
+                    continue;
+                }
+                if(type!='0' && type!='\0' && type!='7'){
+                    this->_skip(size);
+                    long_name.clear();
+                    continue;
+                }
+
+                if(!long_name.empty()){
+                    m.name=long_name;
+                }
+                else{
+                    m.name.assign((const char *)h,
+                                  strnlen((const char *)h,100));
+                    if(memcmp(h+257,"ustar",5)==0 && h[345]){
+                        m.name=std::string((const char *)h+345,
+                                           strnlen((const char *)h+345,
+                                                   155))+"/"+m.name;
+                    }
+                }
+                m.size=size;
+                this->_data(size,data);
+
+                return true;
+            }
+        }
+
+        ///
+        /// parse all DICOM members
+        ///
+        /// @param pool thread pool
+        /// @param dst parsed objects in order of members
+        /// @param names member names of dst
+        /// @param parse_all parse with image or only summary
+        /// @param in_flight members read ahead; twice of pool size when 0
+        ///
+        /// Members which are not DICOM files are skipped. The first
+        /// exception of parsing is rethrown after all members; an
+        /// exception of reading the archive is rethrown after running
+        /// parses finish.
+        ///
+        void load(ThreadPool &pool,
+                  std::vector<Dicom> &dst,
+                  std::vector<std::string> &names,
+                  bool parse_all=true,
+                  size_t in_flight=0)
+        {
+            if(!in_flight)
+                in_flight=2*pool.size();
+
+            dst.clear();
+            names.clear();
+
+            std::deque<std::future<void> > jobs;
+            std::exception_ptr error;
+
+            Member m;
+            std::shared_ptr<std::vector<unsigned char> > data;
+            try{
+                while(true){
+                    data.reset(new std::vector<unsigned char>());
+                    if(!this->next(m,*data))
+                        break;
+                    if(!Archive::is_dicom(data->empty() ? NULL : &(*data)[0],
+                                          data->size()))
+                        continue;
+
+                    if(jobs.size()>=in_flight)
+                        _wait(jobs,1,error);
+
+                    // parsed objects may move only while no job runs
+                    if(dst.size()==dst.capacity()){
+                        _wait(jobs,jobs.size(),error);
+                        dst.reserve(std::max<size_t>(64,2*dst.size()));
+                    }
+                    dst.resize(dst.size()+1);
+                    names.push_back(m.name);
+
+                    Dicom *d=&dst.back();
+                    jobs.push_back(pool.submit([d,data,parse_all](){
+                                Archive::parse(*data,*d,parse_all);
+                            }));
+                }
+            }
+            catch(...){
+                // running jobs write into dst, which the caller frees
+                _wait(jobs,jobs.size(),error);
+                throw;
+            }
+            _wait(jobs,jobs.size(),error);
+
+            if(error)
+                std::rethrow_exception(error);
+        }
+
+    private:
+        gzFile _gz;
+
+        TarArchive(const TarArchive &);
+        TarArchive &operator=(const TarArchive &);
+
+        bool _read(unsigned char *p,size_t n,bool allow_eof)
+        {
+            size_t done=0;
+            while(done<n){
+                unsigned int chunk=(unsigned int)std::min<size_t>(n-done,
+                                                                  1u<<30);
+                int r=gzread(this->_gz,p+done,chunk);
+                if(r<0)
+                    throw Dicom::StreamError("Could not read archive");
+                if(r==0){
+                    if(done==0 && allow_eof)
+                        return false;
+                    throw Dicom::StreamError("Unexpected end of archive");
+                }
+                done+=(size_t)r;
+            }
+
+            return true;
+        }
+
+        //
+        // member data and padding to 512 bytes
+        //
+        void _data(uint64_t size,std::vector<unsigned char> &data)
+        {
+            data.resize((size_t)size);
+            if(size)
+                this->_read(&data[0],(size_t)size,false);
+            this->_skip((512-size%512)%512);
+        }
+
+        void _skip(uint64_t n)
+        {
+            unsigned char buf[4096];
+            while(n){
+                size_t chunk=(size_t)std::min<uint64_t>(n,sizeof(buf));
+                this->_read(buf,chunk,false);
+                n-=chunk;
+            }
+        }
+
+        static uint64_t _octal(const unsigned char *p,size_t n)
+        {
+            uint64_t v=0;
+            for(size_t i=0;i<n && p[i];i++){
+                if(p[i]>='0' && p[i]<='7')
+                    v=v*8+(p[i]-'0');
+            }
+
+            return v;
+        }
+
+        //
+        // octal, or base-256 when the high bit is set (GNU)
+        //
+        static uint64_t _number(const unsigned char *p,size_t n)
+        {
+            if(!(p[0]&0x80))
+                return _octal(p,n);
+
+            uint64_t v=p[0]&0x7f;
+            for(size_t i=1;i<n;i++)
+                v=(v<<8)|p[i];
+
+            return v;
+        }
+
+        //
+        // "path" record of pax extended header
+        //
+        static void _pax_path(const std::vector<unsigned char> &v,
+                              std::string &path)
+        {
+            size_t off=0;
+            while(off<v.size()){
+                size_t sp=off;
+                while(sp<v.size() && v[sp]!=' ')
+                    sp++;
+                size_t len=(size_t)strtoul(
+                    std::string((const char *)&v[off],sp-off).c_str(),
+                    NULL,10);
+                if(!len || off+len>v.size() || sp>=off+len)
+                    return;
+
+                std::string record((const char *)&v[sp+1],off+len-sp-2);
+                if(record.compare(0,5,"path=")==0)
+                    path=record.substr(5);
+                off+=len;
+            }
+        }
+
+        static void _wait(std::deque<std::future<void> > &jobs,
+                          size_t n,
+                          std::exception_ptr &error)
+        {
+            for(size_t i=0;i<n && !jobs.empty();i++){
+                try{
+                    jobs.front().get();
+                }
+                catch(...){
+                    if(!error)
+                        error=std::current_exception();
+                }
+                jobs.pop_front();
+            }
+        }
+    };
+}
+
+#endif // __VVV_DICOM_ARCHIVE_H__
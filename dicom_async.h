@@ -0,0 +1,601 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_async.h
+///
+/// @brief  asynchronous parse and decode with futures and coroutines
+///
+
+#ifndef __VVV_DICOM_ASYNC_H__
+
+#define __VVV_DICOM_ASYNC_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+
+#include <fstream>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define VVV_DICOM_COROUTINE
+#endif
+#endif
+
+namespace VVV
+{
+    ///
+    /// loader which parses and decodes files on an executor
+    ///
+    /// A request resolves in two stages: metadata as soon as the
+    /// header is parsed, then pixels decoded in the background.
+    /// Native Frame Data of seekable streams is not read until the
+    /// pixel stage, so metadata does not wait for it. The stages have
+    /// their own limits of running jobs; waiting headers are dispatched
+    /// before waiting pixels, so metadata latency does not depend on
+    /// pixel decode.
+    ///
+    /// Results can be waited by futures, callbacks or, with C++20,
+    /// co_await.
+    ///
+    class AsyncLoader
+    {
+    private:
+        struct _State;
+
+    public:
+        ///
+        /// executor which runs a job some time later
+        ///
+        typedef std::function<void(std::function<void()>)> Executor;
+
+        ///
+        /// opener of an input stream
+        ///
+        typedef std::function<std::unique_ptr<std::istream>()> Opener;
+
+        ///
+        /// exception of a cancelled request
+        ///
+        class Cancelled : public std::runtime_error
+        {
+        public:
+            Cancelled()
+                :std::runtime_error("Request has been cancelled")
+            {}
+        };
+
+#ifdef VVV_DICOM_COROUTINE
+        ///
+        /// awaitable of a stage; the coroutine is resumed on the
+        /// thread which completes the stage
+        ///
+        template <class T>
+        class Awaiter
+        {
+        public:
+            Awaiter(std::shared_ptr<_State> state,
+                    std::shared_future<T> future,
+                    bool pixels)
+                :_state(state),
+                 _future(future),
+                 _pixels(pixels)
+            {}
+
+            bool await_ready() const
+            {
+                return this->_future.wait_for(std::chrono::seconds(0))==
+                    std::future_status::ready;
+            }
+
+            bool await_suspend(std::coroutine_handle<> h)
+            {
+                return this->_state->then(this->_pixels,[h](){ h.resume(); });
+            }
+
+            T await_resume() const { return this->_future.get(); }
+
+        private:
+            std::shared_ptr<_State> _state;
+            std::shared_future<T> _future;
+            bool _pixels;
+        };
+#endif
+
+        ///
+        /// a request
+        ///
+        /// Copies refer to the same request.
+        ///
+        class Request
+        {
+        public:
+            ///
+            /// a reader accessor
+            ///
+            /// @return future of the parsed object; it must be used
+            ///         only by const methods. Exceptions of parse and
+            ///         Cancelled are rethrown by get().
+            ///
+            std::shared_future<std::shared_ptr<const Dicom> >
+            metadata() const
+            {
+                return this->_state->metadata;
+            }
+
+            ///
+            /// a reader accessor
+            ///
+            /// @return future of the image as Dicom::image(); empty
+            ///         when pixels were not requested
+            ///
+            std::shared_future<cv::Mat> pixels() const
+            {
+                return this->_state->pixels;
+            }
+
+            ///
+            /// cancel the request
+            ///
+            /// Stages not started yet are resolved with Cancelled and
+            /// dropped without work; a running stage completes.
+            ///
+            void cancel() { this->_state->cancelled=true; }
+
+            ///
+            /// query method that the request was cancelled or not
+            ///
+            /// @return true or false
+            ///
+            bool is_cancelled() const { return this->_state->cancelled; }
+
+            ///
+            /// register a callback of metadata
+            ///
+            /// @param f called once metadata resolves, on the thread
+            ///        which resolves it, or at once if it has resolved
+            ///
+            void on_metadata(std::function<void()> f)
+            {
+                if(!this->_state->then(false,f))
+                    f();
+            }
+
+            ///
+            /// register a callback of pixels
+            ///
+            /// @param f called once pixels resolve, as on_metadata()
+            ///
+            void on_pixels(std::function<void()> f)
+            {
+                if(!this->_state->then(true,f))
+                    f();
+            }
+
+#ifdef VVV_DICOM_COROUTINE
+            ///
+            /// awaitable of metadata
+            ///
+            /// @return Awaiter; co_await gives the parsed object
+            ///
+            Awaiter<std::shared_ptr<const Dicom> > async_metadata() const
+            {
+                return Awaiter<std::shared_ptr<const Dicom> >(
+                    this->_state,this->_state->metadata,false);
+            }
+
+            ///
+            /// awaitable of pixels
+            ///
+            /// @return Awaiter; co_await gives the image
+            ///
+            Awaiter<cv::Mat> async_pixels() const
+            {
+                return Awaiter<cv::Mat>(this->_state,
+                                        this->_state->pixels,
+                                        true);
+            }
+#endif
+
+        private:
+            friend class AsyncLoader;
+
+            std::shared_ptr<_State> _state;
+
+            Request(std::shared_ptr<_State> state)
+                :_state(state)
+            {}
+        };
+
+        ///
+        /// constructor with a thread pool
+        ///
+        /// @param pool pool which runs jobs; encapsulated frames of a
+        ///        file are also decoded in parallel on it
+        /// @param max_parse headers parsed at the same time;
+        ///        size of pool when 0
+        /// @param max_decode images decoded at the same time;
+        ///        size of pool when 0
+        ///
+        AsyncLoader(ThreadPool &pool,size_t max_parse=0,size_t max_decode=0)
+            :_pool(&pool),
+             _executor([&pool](std::function<void()> f){ pool.submit(f); }),
+             _max_parse(max_parse ? max_parse : pool.size()),
+             _max_decode(max_decode ? max_decode : pool.size()),
+             _parsing(0),
+             _decoding(0),
+             _closing(false)
+        {}
+
+        ///
+        /// constructor with an executor
+        ///
+        /// @param executor runs jobs; e.g. posts them to an event loop
+        ///        or a thread pool of the application. It must run
+        ///        every job it is given, or the destructor waits
+        ///        forever.
+        /// @param max_parse headers parsed at the same time
+        /// @param max_decode images decoded at the same time
+        ///
+        AsyncLoader(Executor executor,size_t max_parse,size_t max_decode)
+            :_pool(NULL),
+             _executor(executor),
+             _max_parse(max_parse),
+             _max_decode(max_decode),
+             _parsing(0),
+             _decoding(0),
+             _closing(false)
+        {
+            if(!max_parse || !max_decode)
+                throw std::invalid_argument("Bad concurrency limit");
+        }
+
+        ///
+        /// destructor
+        ///
+        /// Waiting requests are cancelled; running jobs are waited.
+        ///
+        ~AsyncLoader()
+        {
+            std::deque<std::shared_ptr<_State> > dropped;
+            {
+                std::unique_lock<std::mutex> lock(this->_mutex);
+                this->_closing=true;
+                this->_idle.wait(lock,[this](){
+                        return !this->_parsing && !this->_decoding;
+                    });
+                dropped.swap(this->_parse_queue);
+                dropped.insert(dropped.end(),
+                               this->_decode_queue.begin(),
+                               this->_decode_queue.end());
+                this->_decode_queue.clear();
+            }
+            for(size_t i=0;i<dropped.size();i++)
+                _cancel(dropped[i]);
+        }
+
+        ///
+        /// request a file
+        ///
+        /// @param path file path
+        /// @param with_pixels decode image or not
+        /// @param need_rescale rescale or not when image decoding
+        ///
+        /// @return request; errors are given by its futures
+        ///
+        Request load(const std::string &path,
+                     bool with_pixels=true,
+                     bool need_rescale=true)
+        {
+            return this->load([path](){
+                    std::unique_ptr<std::istream> ist(
+                        new std::ifstream(path.c_str(),std::ios::binary));
+                    if(!*ist)
+                        throw Dicom::StreamError("Could not open "+path);
+                    return ist;
+                },with_pixels,need_rescale);
+        }
+
+        ///
+        /// request a stream
+        ///
+        /// @param open opens the stream in the parse job
+        /// @param with_pixels decode image or not
+        /// @param need_rescale rescale or not when image decoding
+        ///
+        /// @return request
+        ///
+        Request load(Opener open,bool with_pixels=true,bool need_rescale=true)
+        {
+            std::shared_ptr<_State> s=std::make_shared<_State>();
+            s->open=open;
+            s->with_pixels=with_pixels;
+            s->need_rescale=need_rescale;
+
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                this->_parse_queue.push_back(s);
+            }
+            this->_pump();
+
+            return Request(s);
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return number of stages waiting for a slot
+        ///
+        size_t pending()
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+
+            return this->_parse_queue.size()+this->_decode_queue.size();
+        }
+
+    private:
+        struct _State
+        {
+            Opener open;
+            bool with_pixels;
+            bool need_rescale;
+            std::atomic<bool> cancelled;
+
+            std::promise<std::shared_ptr<const Dicom> > metadata_promise;
+            std::promise<cv::Mat> pixels_promise;
+            std::shared_future<std::shared_ptr<const Dicom> > metadata;
+            std::shared_future<cv::Mat> pixels;
+
+            // used by the jobs only
+            std::shared_ptr<Dicom> dicom;
+            std::unique_ptr<std::istream> ist;
+
+            std::mutex mutex;
+            bool done[2];
+            std::vector<std::function<void()> > callbacks[2];
+
+            _State()
+                :cancelled(false)
+            {
+                this->metadata=this->metadata_promise.get_future().share();
+                this->pixels=this->pixels_promise.get_future().share();
+                this->done[0]=this->done[1]=false;
+            }
+
+            //
+            // register f; false when the stage has resolved
+            //
+            bool then(bool pixels,std::function<void()> f)
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                if(this->done[pixels])
+                    return false;
+                this->callbacks[pixels].push_back(f);
+
+                return true;
+            }
+
+            void resolved(bool pixels)
+            {
+                std::vector<std::function<void()> > cbs;
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->done[pixels]=true;
+                    cbs.swap(this->callbacks[pixels]);
+                }
+                for(size_t i=0;i<cbs.size();i++)
+                    cbs[i]();
+            }
+        };
+
+        ThreadPool *_pool;
+        Executor _executor;
+        size_t _max_parse;
+        size_t _max_decode;
+
+        std::mutex _mutex;
+        std::condition_variable _idle;
+        std::deque<std::shared_ptr<_State> > _parse_queue;
+        std::deque<std::shared_ptr<_State> > _decode_queue;
+        size_t _parsing;
+        size_t _decoding;
+        bool _closing;
+
+        AsyncLoader(const AsyncLoader &);
+        AsyncLoader &operator=(const AsyncLoader &);
+
+        static void _fail_metadata(std::shared_ptr<_State> s,
+                                   std::exception_ptr e)
+        {
+            s->metadata_promise.set_exception(e);
+            s->resolved(false);
+            _fail_pixels(s,e);
+        }
+
+        static void _fail_pixels(std::shared_ptr<_State> s,
+                                 std::exception_ptr e)
+        {
+            s->dicom.reset();
+            s->ist.reset();
+            s->pixels_promise.set_exception(e);
+            s->resolved(true);
+        }
+
+        //
+        // resolve the stage not started yet with Cancelled
+        //
+        static void _cancel(std::shared_ptr<_State> s)
+        {
+            std::exception_ptr e=std::make_exception_ptr(Cancelled());
+            if(!s->dicom)
+                _fail_metadata(s,e);
+            else
+                _fail_pixels(s,e);
+        }
+
+        //
+        // take waiting stages within the limits, headers first;
+        // called with the lock
+        //
+        void _take(std::vector<std::function<void()> > &jobs,
+                   std::vector<std::shared_ptr<_State> > &cancelled)
+        {
+            if(this->_closing)
+                return;
+
+            while(this->_parsing<this->_max_parse &&
+                  !this->_parse_queue.empty()){
+                std::shared_ptr<_State> s=this->_parse_queue.front();
+                this->_parse_queue.pop_front();
+                if(s->cancelled){
+                    cancelled.push_back(s);
+                    continue;
+                }
+                this->_parsing++;
+                jobs.push_back([this,s](){ this->_parse(s); });
+            }
+            while(this->_decoding<this->_max_decode &&
+                  !this->_decode_queue.empty()){
+                std::shared_ptr<_State> s=this->_decode_queue.front();
+                this->_decode_queue.pop_front();
+                if(s->cancelled){
+                    cancelled.push_back(s);
+                    continue;
+                }
+                this->_decoding++;
+                jobs.push_back([this,s](){ this->_decode(s); });
+            }
+        }
+
+        //
+        // run taken stages out of the lock
+        //
+        void _run(std::vector<std::function<void()> > &jobs,
+                  std::vector<std::shared_ptr<_State> > &cancelled)
+        {
+            for(size_t i=0;i<cancelled.size();i++)
+                _cancel(cancelled[i]);
+            for(size_t i=0;i<jobs.size();i++)
+                this->_executor(jobs[i]);
+        }
+
+        void _pump()
+        {
+            std::vector<std::function<void()> > jobs;
+            std::vector<std::shared_ptr<_State> > cancelled;
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                this->_take(jobs,cancelled);
+            }
+            this->_run(jobs,cancelled);
+        }
+
+        //
+        // a job finished; dispatch next ones. While closing no job is
+        // taken, so the loader is not touched after the notification.
+        //
+        void _finished(bool decode)
+        {
+            std::vector<std::function<void()> > jobs;
+            std::vector<std::shared_ptr<_State> > cancelled;
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                if(decode)
+                    this->_decoding--;
+                else
+                    this->_parsing--;
+                this->_take(jobs,cancelled);
+                if(!this->_parsing && !this->_decoding)
+                    this->_idle.notify_all();
+            }
+            if(!jobs.empty() || !cancelled.empty())
+                this->_run(jobs,cancelled);
+        }
+
+        void _parse(std::shared_ptr<_State> s)
+        {
+            try{
+                s->ist=s->open();
+                std::shared_ptr<Dicom> d=std::make_shared<Dicom>();
+                d->parse_deferred(*s->ist);
+                if(d->frame_data_offset()<0 || !s->with_pixels)
+                    s->ist.reset();
+                s->dicom=d;
+            }
+            catch(...){
+                _fail_metadata(s,std::current_exception());
+                this->_finished(false);
+                return;
+            }
+
+            s->metadata_promise.set_value(s->dicom);
+            s->resolved(false);
+
+            if(!s->with_pixels){
+                s->dicom.reset();
+                s->pixels_promise.set_value(cv::Mat());
+                s->resolved(true);
+            }
+            else{
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                this->_decode_queue.push_back(s);
+            }
+
+            this->_finished(false);
+        }
+
+        void _decode(std::shared_ptr<_State> s)
+        {
+            cv::Mat image;
+            try{
+                Dicom &d=*s->dicom;
+                if(d.frame_data_offset()>=0){
+                    // Frame Data left on the stream
+                    std::vector<unsigned char> buf(d.frame_data_length());
+                    std::istream &ist=*s->ist;
+                    ist.clear();
+                    ist.seekg(d.frame_data_offset());
+                    if(!buf.empty())
+                        ist.read((char *)&buf[0],buf.size());
+                    if(ist.fail())
+                        throw Dicom::StreamError("Frame Data is too short");
+                    s->ist.reset();
+
+                    if(s->cancelled)
+                        throw Cancelled();
+                    image=d.decode_image(buf.empty() ? NULL : &buf[0],
+                                         buf.size(),
+                                         s->need_rescale);
+                }
+                else if(this->_pool)
+                    image=d.decode_image_parallel(*this->_pool,
+                                                  s->need_rescale);
+                else
+                    image=d.decode_image(s->need_rescale);
+            }
+            catch(...){
+                _fail_pixels(s,std::current_exception());
+                this->_finished(true);
+                return;
+            }
+
+            s->dicom.reset();
+            s->pixels_promise.set_value(image);
+            s->resolved(true);
+
+            this->_finished(true);
+        }
+    };
+}
+
+#endif // __VVV_DICOM_ASYNC_H__
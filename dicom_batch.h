@@ -0,0 +1,643 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_batch.h
+///
+/// @brief  normalized float batches of slices and volumes for training
+///
+
+#ifndef __VVV_DICOM_BATCH_H__
+
+#define __VVV_DICOM_BATCH_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+#include "dicom_series.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <fstream>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+#include <future>
+#include <random>
+
+namespace VVV
+{
+    ///
+    /// loader of float32 batches
+    ///
+    /// Stored pixels of a slice are rescaled, windowed, resized and
+    /// normalized in one pass straight into the batch buffer given by
+    /// the caller; slices of a batch are decoded in parallel. Only the
+    /// frame of a slice is read from a multi-frame file.
+    ///
+    /// prefetch() fills a buffer in background, so the next batch is
+    /// decoded while the current one is consumed:
+    ///
+    ///     loader.prefetch(buf[0]);
+    ///     loader.prefetch(buf[1]);
+    ///     float *p;
+    ///     while(size_t n=loader.wait(p)){
+    ///         train(p,n);
+    ///         loader.prefetch(p);
+    ///     }
+    ///
+    /// Methods must be called from one thread.
+    ///
+    class BatchLoader
+    {
+    public:
+        ///
+        /// batch layouts
+        ///
+        enum {
+            LAYOUT_NCHW=0,  ///< a slice per sample; channels are neighbours
+            LAYOUT_NDHWC=1  ///< a series per sample; channels last
+        };
+
+        ///
+        /// preprocessing
+        ///
+        /// A stored value v is rescaled by Rescale Slope/Intercept,
+        /// mapped to [0,1] by the window when width>0, resized by
+        /// bilinear interpolation and output as (v-mean)/stddev.
+        ///
+        struct Spec
+        {
+            int layout;     ///< LAYOUT_NCHW or LAYOUT_NDHWC
+            int rows;       ///< output rows; rows of the first slice if 0
+            int cols;       ///< output columns; as rows
+            int depth;      ///< slices of NDHWC sample; slices of the
+                            ///< first series if 0
+            int context;    ///< neighbouring slices on each side which
+                            ///< are stacked as channels (2.5D)
+            float center;   ///< window center in rescaled unit
+            float width;    ///< window width; not windowed if <=0
+            float mean;     ///< subtracted after windowing
+            float stddev;   ///< divides after subtraction
+
+            Spec()
+                :layout(LAYOUT_NCHW),
+                 rows(0),
+                 cols(0),
+                 depth(0),
+                 context(0),
+                 center(0.0f),
+                 width(0.0f),
+                 mean(0.0f),
+                 stddev(1.0f)
+            {}
+        };
+
+        ///
+        /// constructor
+        ///
+        /// @param pool thread pool to decode slices
+        /// @param series file paths of each series; a series may be
+        ///        a multi-frame file. Slices are ordered as
+        ///        SeriesLoader::order().
+        /// @param spec preprocessing
+        /// @param batch_size samples of a batch
+        ///
+        /// Headers of all files are parsed here in parallel.
+        ///
+        /// throw std::invalid_argument, std::runtime_error for color
+        ///       images, Dicom::StreamError, Dicom::ParseError
+        ///
+        BatchLoader(ThreadPool &pool,
+                    const std::vector<std::vector<std::string> > &series,
+                    const Spec &spec,
+                    size_t batch_size)
+            :_pool(pool),
+             _spec(spec),
+             _batch_size(batch_size),
+             _next(0)
+        {
+            if(!batch_size)
+                throw std::invalid_argument("Bad batch size");
+            if(spec.layout!=LAYOUT_NCHW && spec.layout!=LAYOUT_NDHWC)
+                throw std::invalid_argument("Bad layout");
+            if(spec.rows<0 || spec.cols<0 || spec.depth<0 ||
+               spec.context<0 || spec.stddev==0.0f)
+                throw std::invalid_argument("Bad preprocessing");
+
+            this->_index(series);
+            if(this->_samples.empty())
+                throw std::invalid_argument("No slice found");
+        }
+
+        ///
+        /// destructor; batches in flight are waited
+        ///
+        ~BatchLoader()
+        {
+            this->_drain();
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return samples of an epoch
+        ///
+        size_t samples() const { return this->_samples.size(); }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return floats of a sample; a batch buffer has
+        ///         batch size x sample_floats() floats
+        ///
+        size_t sample_floats() const
+        {
+            size_t n=(size_t)this->_spec.rows*this->_spec.cols*
+                this->_channels();
+            if(this->_spec.layout==LAYOUT_NDHWC)
+                n*=this->_spec.depth;
+
+            return n;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return {N,C,H,W} or {N,D,H,W,C} of a full batch
+        ///
+        std::vector<int> shape() const
+        {
+            std::vector<int> s;
+            s.push_back((int)this->_batch_size);
+            if(this->_spec.layout==LAYOUT_NCHW){
+                s.push_back(this->_channels());
+                s.push_back(this->_spec.rows);
+                s.push_back(this->_spec.cols);
+            }
+            else{
+                s.push_back(this->_spec.depth);
+                s.push_back(this->_spec.rows);
+                s.push_back(this->_spec.cols);
+                s.push_back(this->_channels());
+            }
+
+            return s;
+        }
+
+        ///
+        /// decode the next batch
+        ///
+        /// @param dst batch buffer
+        ///
+        /// @return samples written; less than batch size at the end of
+        ///         epoch, 0 after it
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError,
+        ///       std::runtime_error
+        ///
+        size_t next(float *dst)
+        {
+            size_t first=this->_next;
+            size_t n=this->_take();
+
+            return this->_fill(first,n,dst);
+        }
+
+        ///
+        /// start decoding the next batch in background
+        ///
+        /// @param dst batch buffer; it must not be touched until
+        ///        wait() returns it
+        ///
+        void prefetch(float *dst)
+        {
+            size_t first=this->_next;
+            size_t n=this->_take();
+
+            _Pending p;
+            p.dst=dst;
+            p.samples=this->_pool.submit([this,first,n,dst](){
+                    return this->_fill(first,n,dst);
+                });
+            this->_pending.push_back(std::move(p));
+        }
+
+        ///
+        /// wait for the oldest prefetched batch
+        ///
+        /// @param dst the batch buffer is set
+        ///
+        /// @return samples written as next(); 0 when nothing is
+        ///         prefetched
+        ///
+        /// Errors of decoding are thrown here.
+        ///
+        size_t wait(float *&dst)
+        {
+            if(this->_pending.empty()){
+                dst=NULL;
+                return 0;
+            }
+
+            _Pending p=std::move(this->_pending.front());
+            this->_pending.pop_front();
+            dst=p.dst;
+
+            return p.samples.get();
+        }
+
+        ///
+        /// start a new epoch in the same order
+        ///
+        /// Batches in flight are waited and dropped.
+        ///
+        void rewind()
+        {
+            this->_drain();
+            this->_next=0;
+        }
+
+        ///
+        /// start a new epoch in a random order
+        ///
+        /// @param seed random seed
+        ///
+        /// Batches in flight are waited and dropped.
+        ///
+        void shuffle(unsigned seed)
+        {
+            this->rewind();
+
+            std::mt19937 g(seed);
+            std::shuffle(this->_samples.begin(),this->_samples.end(),g);
+        }
+
+    private:
+        struct _Slice
+        {
+            std::string path;
+            int frame;
+        };
+
+        struct _Sample
+        {
+            size_t series;
+            int slice;      // NCHW only
+        };
+
+        struct _Pending
+        {
+            float *dst;
+            std::future<size_t> samples;
+        };
+
+        //
+        // a slice and the planes it is written to
+        //
+        struct _Job
+        {
+            const _Slice *slice;
+            std::vector<float *> dst;
+            size_t step;    // floats between pixels
+        };
+
+        ThreadPool &_pool;
+        Spec _spec;
+        size_t _batch_size;
+        std::vector<std::vector<_Slice> > _series;
+        std::vector<_Sample> _samples;
+        size_t _next;
+        std::deque<_Pending> _pending;
+
+        BatchLoader(const BatchLoader &);
+        BatchLoader &operator=(const BatchLoader &);
+
+        int _channels() const { return 2*this->_spec.context+1; }
+
+        size_t _take()
+        {
+            size_t n=std::min(this->_batch_size,
+                              this->_samples.size()-this->_next);
+            this->_next+=n;
+
+            return n;
+        }
+
+        void _drain()
+        {
+            while(!this->_pending.empty()){
+                try{
+                    this->_pending.front().samples.wait();
+                }
+                catch(...){
+                }
+                this->_pending.pop_front();
+            }
+        }
+
+        //
+        // parse headers, order slices and fix the output size
+        //
+        void _index(const std::vector<std::vector<std::string> > &series)
+        {
+            std::vector<std::vector<Dicom> > headers(series.size());
+            std::vector<std::pair<size_t,size_t> > files;
+            for(size_t s=0;s<series.size();s++){
+                headers[s].resize(series[s].size());
+                for(size_t f=0;f<series[s].size();f++)
+                    files.push_back(std::make_pair(s,f));
+            }
+
+            this->_pool.parallel_for(0,files.size(),[&](size_t i){
+                    const std::string &path=
+                        series[files[i].first][files[i].second];
+                    std::ifstream ifs(path.c_str(),std::ios::binary);
+                    if(!ifs)
+                        throw Dicom::StreamError("Could not open "+path);
+                    Dicom &d=headers[files[i].first][files[i].second];
+                    // geometry and order only; Frame Data stays on disk
+                    d.parse_deferred(ifs);
+                    if(d.channels()>1)
+                        throw std::runtime_error(
+                            "Color images have not been supported");
+                });
+
+            this->_series.resize(series.size());
+            for(size_t s=0;s<series.size();s++){
+                std::vector<size_t> order=SeriesLoader::order(headers[s]);
+                for(size_t i=0;i<order.size();i++){
+                    Dicom &d=headers[s][order[i]];
+                    for(int f=0;f<std::max(1,d.frames());f++){
+                        _Slice sl;
+                        sl.path=series[s][order[i]];
+                        sl.frame=f;
+                        this->_series[s].push_back(sl);
+                    }
+                    if(!this->_spec.rows)
+                        this->_spec.rows=d.rows();
+                    if(!this->_spec.cols)
+                        this->_spec.cols=d.cols();
+                }
+                if(this->_series[s].empty())
+                    continue;
+
+                if(this->_spec.layout==LAYOUT_NDHWC){
+                    if(!this->_spec.depth)
+                        this->_spec.depth=(int)this->_series[s].size();
+                    _Sample sample={s,0};
+                    this->_samples.push_back(sample);
+                }
+                else{
+                    for(size_t k=0;k<this->_series[s].size();k++){
+                        _Sample sample={s,(int)k};
+                        this->_samples.push_back(sample);
+                    }
+                }
+            }
+            if(this->_spec.rows<=0 || this->_spec.cols<=0)
+                throw Dicom::ParseError("Bad image size");
+        }
+
+        //
+        // slice of a series clamped at the ends
+        //
+        const _Slice *_slice(size_t series,int index) const
+        {
+            const std::vector<_Slice> &s=this->_series[series];
+            index=std::max(0,std::min(index,(int)s.size()-1));
+
+            return &s[index];
+        }
+
+        size_t _fill(size_t first,size_t n,float *dst)
+        {
+            const size_t plane=(size_t)this->_spec.rows*this->_spec.cols;
+            const int chs=this->_channels();
+
+            // slices shared by samples are decoded once
+            std::vector<_Job> jobs;
+            std::map<const _Slice *,size_t> found;
+            for(size_t i=0;i<n;i++){
+                const _Sample &sample=this->_samples[first+i];
+                float *base=dst+i*this->sample_floats();
+
+                int slices=this->_spec.layout==LAYOUT_NCHW ?
+                    1 : this->_spec.depth;
+                for(int z=0;z<slices;z++){
+                    int center=sample.slice;
+                    if(this->_spec.layout==LAYOUT_NDHWC){
+                        // nearest slice when depth differs
+                        int count=(int)this->_series[sample.series].size();
+                        center=(int)(((int64_t)2*z+1)*count/
+                                     (2*this->_spec.depth));
+                    }
+                    for(int c=0;c<chs;c++){
+                        const _Slice *sl=this->_slice(
+                            sample.series,center+c-this->_spec.context);
+                        float *p;
+                        size_t step;
+                        if(this->_spec.layout==LAYOUT_NCHW){
+                            p=base+c*plane;
+                            step=1;
+                        }
+                        else{
+                            p=base+z*plane*chs+c;
+                            step=chs;
+                        }
+
+                        std::map<const _Slice *,size_t>::iterator itr=
+                            found.find(sl);
+                        if(itr!=found.end()){
+                            jobs[itr->second].dst.push_back(p);
+                            continue;
+                        }
+                        found[sl]=jobs.size();
+                        _Job job;
+                        job.slice=sl;
+                        job.dst.push_back(p);
+                        job.step=step;
+                        jobs.push_back(job);
+                    }
+                }
+            }
+
+            this->_pool.parallel_for(0,jobs.size(),[&](size_t i){
+                    this->_render(jobs[i]);
+                });
+
+            return n;
+        }
+
+        //
+        // decode a slice and write it to the planes
+        //
+        void _render(const _Job &job) const
+        {
+            Dicom d;
+            cv::Mat m;
+            {
+                std::ifstream ifs(job.slice->path.c_str(),std::ios::binary);
+                if(!ifs)
+                    throw Dicom::StreamError("Could not open "+
+                                             job.slice->path);
+                d.parse_deferred(ifs);
+
+                if(d.frame_data_offset()>=0){
+                    // read only the frame
+                    size_t len=d.frame_bytes();
+                    std::vector<unsigned char> buf(len);
+                    ifs.clear();
+                    ifs.seekg(d.frame_data_offset()+
+                              (std::streamoff)len*job.slice->frame);
+                    if(len)
+                        ifs.read((char *)&buf[0],len);
+                    if(ifs.fail())
+                        throw Dicom::StreamError("Frame Data is too short");
+                    m=d.decode_frame(len ? &buf[0] : NULL,len,false);
+                }
+                else
+                    m=d.decode_frame(job.slice->frame,false);
+            }
+            if(m.channels()!=1)
+                throw std::runtime_error(
+                    "Color images have not been supported");
+
+            // stored value to rescaled or windowed [0,1]: a*v+b
+            float slope,interception;
+            d.rescale_params(slope,interception);
+            double a=slope;
+            double b=interception;
+            bool clamp=this->_spec.width>0.0f;
+            if(clamp){
+                double lo=this->_spec.center-this->_spec.width/2.0;
+                a/=this->_spec.width;
+                b=(b-lo)/this->_spec.width;
+            }
+
+            switch(m.depth()){
+            case CV_8U:
+                this->_resample<uint8_t>(m,a,b,clamp,job);
+                break;
+            case CV_8S:
+                this->_resample<int8_t>(m,a,b,clamp,job);
+                break;
+            case CV_16U:
+                this->_resample<uint16_t>(m,a,b,clamp,job);
+                break;
+            case CV_16S:
+                this->_resample<int16_t>(m,a,b,clamp,job);
+                break;
+            case CV_32S:
+                this->_resample<int32_t>(m,a,b,clamp,job);
+                break;
+            case CV_32F:
+                this->_resample<float>(m,a,b,clamp,job);
+                break;
+            default:
+                this->_resample<double>(m,a,b,clamp,job);
+                break;
+            }
+        }
+
+        //
+        // bilinear taps of an axis as cv::resize() INTER_LINEAR
+        //
+        static void _taps(int src,
+                          int dst,
+                          std::vector<int> &i0,
+                          std::vector<int> &i1,
+                          std::vector<float> &w)
+        {
+            i0.resize(dst);
+            i1.resize(dst);
+            w.resize(dst);
+            double scale=(double)src/dst;
+            for(int i=0;i<dst;i++){
+                double f=(i+0.5)*scale-0.5;
+                if(f<0.0)
+                    f=0.0;
+                int k=std::min((int)f,src-1);
+                i0[i]=k;
+                i1[i]=std::min(k+1,src-1);
+                w[i]=(float)(f-k);
+            }
+        }
+
+        //
+        // rescale, window, resize and normalize in one pass
+        //
+        template <class T>
+        void _resample(const cv::Mat &m,
+                       double a,
+                       double b,
+                       bool clamp,
+                       const _Job &job) const
+        {
+            const int rows=this->_spec.rows;
+            const int cols=this->_spec.cols;
+            const float fa=(float)a;
+            const float fb=(float)b;
+            const float mean=this->_spec.mean;
+            const float inv=1.0f/this->_spec.stddev;
+            const size_t step=job.step;
+
+            std::vector<int> x0,x1,y0,y1;
+            std::vector<float> wx,wy;
+            _taps(m.cols,cols,x0,x1,wx);
+            _taps(m.rows,rows,y0,y1,wy);
+
+            // two transformed source rows, reused by next output rows
+            std::vector<float> buf[2];
+            buf[0].resize(m.cols);
+            buf[1].resize(m.cols);
+            int held[2]={-1,-1};
+            auto source_row=[&](int k,int keep)->const float *{
+                for(int i=0;i<2;i++){
+                    if(held[i]==k)
+                        return &buf[i][0];
+                }
+                int i=held[0]==keep ? 1 : 0;
+                _transform<T>(m.ptr<T>(k),m.cols,fa,fb,clamp,&buf[i][0]);
+                held[i]=k;
+
+                return &buf[i][0];
+            };
+
+            for(int y=0;y<rows;y++){
+                const float *r0=source_row(y0[y],y1[y]);
+                const float *r1=source_row(y1[y],y0[y]);
+
+                const float w=wy[y];
+                for(size_t k=0;k<job.dst.size();k++){
+                    float *out=job.dst[k]+(size_t)y*cols*step;
+                    for(int x=0;x<cols;x++){
+                        float top=r0[x0[x]]+(r0[x1[x]]-r0[x0[x]])*wx[x];
+                        float bottom=r1[x0[x]]+(r1[x1[x]]-r1[x0[x]])*wx[x];
+                        out[x*step]=(top+(bottom-top)*w-mean)*inv;
+                    }
+                }
+            }
+        }
+
+        template <class T>
+        static void _transform(const T *src,
+                               int n,
+                               float a,
+                               float b,
+                               bool clamp,
+                               float *dst)
+        {
+            if(clamp){
+                for(int i=0;i<n;i++)
+                    dst[i]=std::min(1.0f,std::max(0.0f,(float)src[i]*a+b));
+            }
+            else{
+                for(int i=0;i<n;i++)
+                    dst[i]=(float)src[i]*a+b;
+            }
+        }
+    };
+}
+
+#endif // __VVV_DICOM_BATCH_H__
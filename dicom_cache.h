@@ -0,0 +1,427 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_cache.h
+///
+/// @brief  byte budgeted LRU cache of decoded images
+///
+
+#ifndef __VVV_DICOM_CACHE_H__
+
+#define __VVV_DICOM_CACHE_H__
+
+#include "dicom.h"
+#include "dicom_packed.h"
+
+#include <sys/stat.h>
+
+#include <fstream>
+#include <list>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+
+namespace VVV
+{
+    ///
+    /// thread-safe cache of decoded images
+    ///
+    /// Images are kept in LRU order under a byte budget. Keys are
+    /// hashed to shards, each of which has its own lock, LRU list and
+    /// an equal part of the budget. Concurrent requests for a missing
+    /// key are coalesced; one of them decodes and the others wait for
+    /// its result.
+    ///
+    /// Cached images share their buffers with callers and must not
+    /// be modified.
+    ///
+    /// In packed mode images are kept as PackedImage and the budget
+    /// counts compressed bytes, so more images stay in memory by the
+    /// compression ratio, which depends on the data (about 1.9 on
+    /// synthetic 16-bit CT); each hit decodes a new image the caller
+    /// owns.
+    ///
+    class ImageCache
+    {
+    public:
+        ///
+        /// cache counters
+        ///
+        struct Counters
+        {
+            uint64_t hits;       ///< found in cache
+            uint64_t misses;     ///< decoded by the caller
+            uint64_t coalesced;  ///< waited for another decode
+            uint64_t evictions;  ///< dropped by the budget
+            uint64_t bytes;      ///< bytes of cached images
+            uint64_t raw_bytes;  ///< decoded bytes of cached images
+            uint64_t entries;    ///< number of cached images
+        };
+
+        ///
+        /// constructor
+        ///
+        /// @param budget bytes of images to keep
+        /// @param shards number of shards
+        /// @param packed keep images losslessly compressed or not
+        ///
+        ImageCache(uint64_t budget,size_t shards=16,bool packed=false)
+            :_packed(packed),
+             _hits(0),
+             _misses(0),
+             _coalesced(0),
+             _evictions(0)
+        {
+            if(!shards)
+                throw std::invalid_argument("Bad number of shards");
+
+            for(size_t i=0;i<shards;i++){
+                this->_shards.push_back(
+                    std::unique_ptr<_Shard>(new _Shard()));
+                this->_shards.back()->budget=budget/shards;
+            }
+        }
+
+        ///
+        /// get an image, or decode and cache it
+        ///
+        /// @param key cache key
+        /// @param loader decodes the image on miss
+        ///
+        /// @return cached image
+        ///
+        /// Exceptions of loader are thrown to all waiting callers;
+        /// nothing is cached then.
+        ///
+        cv::Mat get(const std::string &key,
+                    const std::function<cv::Mat()> &loader)
+        {
+            _Shard &s=this->_shard(key);
+
+            std::promise<cv::Mat> promise;
+            {
+                std::unique_lock<std::mutex> lock(s.mutex);
+
+                cv::Mat m;
+                std::shared_ptr<const PackedImage> packed;
+                if(this->_lookup(s,key,m,packed)){
+                    lock.unlock();
+
+                    return packed ? packed->image() : m;
+                }
+
+                std::unordered_map<std::string,
+                                   std::shared_future<cv::Mat> >::iterator
+                    itr=s.loading.find(key);
+                if(itr!=s.loading.end()){
+                    std::shared_future<cv::Mat> f=itr->second;
+                    lock.unlock();
+                    this->_coalesced++;
+
+                    return f.get();
+                }
+
+                s.loading[key]=promise.get_future().share();
+            }
+            this->_misses++;
+
+            cv::Mat m;
+            try{
+                m=loader();
+            }
+            catch(...){
+                std::lock_guard<std::mutex> lock(s.mutex);
+                promise.set_exception(std::current_exception());
+                s.loading.erase(key);
+                throw;
+            }
+
+            std::shared_ptr<const PackedImage> packed;
+            if(this->_packed){
+                try{
+                    packed=std::make_shared<PackedImage>(m);
+                }
+                catch(...){
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    promise.set_exception(std::current_exception());
+                    s.loading.erase(key);
+                    throw;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(s.mutex);
+            this->_insert(s,key,m,packed);
+            promise.set_value(m);
+            s.loading.erase(key);
+
+            return m;
+        }
+
+        ///
+        /// image of a file keyed by file identity
+        ///
+        /// @param path file path
+        /// @param need_rescale rescale or not
+        ///
+        /// @return cached image
+        ///
+        /// A file replaced or modified in place gets a new key.
+        ///
+        cv::Mat image(const std::string &path,bool need_rescale=true)
+        {
+            std::string key=file_key(path)+(need_rescale ? "/r" : "/s");
+
+            return this->get(key,[&path,need_rescale](){
+                    std::ifstream ifs(path.c_str(),std::ios::binary);
+                    if(!ifs)
+                        throw Dicom::StreamError("Could not open file");
+                    Dicom d(ifs,false);
+
+                    return cv::Mat(d.image(need_rescale));
+                });
+        }
+
+        ///
+        /// image of a parsed object keyed by SOP Instance UID
+        ///
+        /// @param d parsed object
+        /// @param need_rescale rescale or not
+        ///
+        /// @return cached image
+        ///
+        /// throw Dicom::MissingTagError without SOP Instance UID
+        ///
+        cv::Mat image(Dicom &d,bool need_rescale=true)
+        {
+            std::string key=uid_key(d)+(need_rescale ? "/r" : "/s");
+
+            return this->get(key,[&d,need_rescale](){
+                    return cv::Mat(d.image(need_rescale));
+                });
+        }
+
+        ///
+        /// key by SOP Instance UID (0008,0018)
+        ///
+        /// @param d parsed object
+        ///
+        /// @return key
+        ///
+        /// throw Dicom::MissingTagError without SOP Instance UID
+        ///
+        static std::string uid_key(Dicom &d)
+        {
+            if(!d.has_element(0x0008,0x0018))
+                throw Dicom::MissingTagError(
+                    "Could not found SOP Instance UID");
+
+            std::string uid=d.element(0x0008,0x0018).as<std::string>();
+            size_t end=uid.find_last_not_of(std::string(" \0",2));
+
+            return "uid:"+uid.substr(0,end==std::string::npos ? 0 : end+1);
+        }
+
+        ///
+        /// key by file identity
+        ///
+        /// @param path file path
+        ///
+        /// @return key from device, inode, size and modification time
+        ///
+        /// throw Dicom::StreamError
+        ///
+        static std::string file_key(const std::string &path)
+        {
+            struct stat st;
+            if(stat(path.c_str(),&st)<0)
+                throw Dicom::StreamError("Could not stat file");
+
+#if defined(__APPLE__)
+            long long nsec=(long long)st.st_mtimespec.tv_nsec;
+#else
+            long long nsec=(long long)st.st_mtim.tv_nsec;
+#endif
+            std::ostringstream os;
+            os<<"file:"<<st.st_dev<<':'<<st.st_ino<<':'<<st.st_size<<':'
+              <<st.st_mtime<<'.'<<nsec;
+
+            return os.str();
+        }
+
+        ///
+        /// drop an image
+        ///
+        /// @param key cache key
+        ///
+        void erase(const std::string &key)
+        {
+            _Shard &s=this->_shard(key);
+            std::lock_guard<std::mutex> lock(s.mutex);
+
+            std::unordered_map<std::string,_Lru::iterator>::iterator itr=
+                s.index.find(key);
+            if(itr==s.index.end())
+                return;
+
+            s.bytes-=itr->second->bytes;
+            s.raw_bytes-=itr->second->raw_bytes;
+            s.lru.erase(itr->second);
+            s.index.erase(itr);
+        }
+
+        ///
+        /// drop all images
+        ///
+        void clear()
+        {
+            for(size_t i=0;i<this->_shards.size();i++){
+                _Shard &s=*this->_shards[i];
+                std::lock_guard<std::mutex> lock(s.mutex);
+                s.lru.clear();
+                s.index.clear();
+                s.bytes=0;
+                s.raw_bytes=0;
+            }
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return snapshot of counters
+        ///
+        Counters counters()
+        {
+            Counters c;
+            c.hits=this->_hits;
+            c.misses=this->_misses;
+            c.coalesced=this->_coalesced;
+            c.evictions=this->_evictions;
+            c.bytes=0;
+            c.raw_bytes=0;
+            c.entries=0;
+            for(size_t i=0;i<this->_shards.size();i++){
+                _Shard &s=*this->_shards[i];
+                std::lock_guard<std::mutex> lock(s.mutex);
+                c.bytes+=s.bytes;
+                c.raw_bytes+=s.raw_bytes;
+                c.entries+=s.index.size();
+            }
+
+            return c;
+        }
+
+    private:
+        struct _Entry
+        {
+            std::string key;
+            cv::Mat image;
+            std::shared_ptr<const PackedImage> packed;
+            uint64_t bytes;
+            uint64_t raw_bytes;
+        };
+        typedef std::list<_Entry> _Lru;
+
+        struct _Shard
+        {
+            _Shard()
+                :bytes(0),
+                 raw_bytes(0),
+                 budget(0)
+            {}
+
+            std::mutex mutex;
+            _Lru lru;  // most recently used first
+            std::unordered_map<std::string,_Lru::iterator> index;
+            std::unordered_map<std::string,
+                               std::shared_future<cv::Mat> > loading;
+            uint64_t bytes;
+            uint64_t raw_bytes;
+            uint64_t budget;
+        };
+
+        bool _packed;
+        std::vector<std::unique_ptr<_Shard> > _shards;
+
+        std::atomic<uint64_t> _hits;
+        std::atomic<uint64_t> _misses;
+        std::atomic<uint64_t> _coalesced;
+        std::atomic<uint64_t> _evictions;
+
+        _Shard &_shard(const std::string &key)
+        {
+            size_t h=std::hash<std::string>()(key);
+
+            return *this->_shards[h%this->_shards.size()];
+        }
+
+        //
+        // with shard lock
+        //
+        bool _lookup(_Shard &s,
+                     const std::string &key,
+                     cv::Mat &m,
+                     std::shared_ptr<const PackedImage> &packed)
+        {
+            std::unordered_map<std::string,_Lru::iterator>::iterator itr=
+                s.index.find(key);
+            if(itr==s.index.end())
+                return false;
+
+            s.lru.splice(s.lru.begin(),s.lru,itr->second);
+            m=itr->second->image;
+            packed=itr->second->packed;
+            this->_hits++;
+
+            return true;
+        }
+
+        void _insert(_Shard &s,
+                     const std::string &key,
+                     const cv::Mat &m,
+                     const std::shared_ptr<const PackedImage> &packed)
+        {
+            uint64_t raw_bytes=(uint64_t)m.total()*m.elemSize();
+            uint64_t bytes=packed ? packed->bytes() : raw_bytes;
+            if(bytes>s.budget)
+                return; // never fits
+
+            std::unordered_map<std::string,_Lru::iterator>::iterator itr=
+                s.index.find(key);
+            if(itr!=s.index.end()){
+                s.bytes-=itr->second->bytes;
+                s.raw_bytes-=itr->second->raw_bytes;
+                s.lru.erase(itr->second);
+                s.index.erase(itr);
+            }
+
+            while(!s.lru.empty() && s.bytes+bytes>s.budget){
+                _Entry &e=s.lru.back();
+                s.bytes-=e.bytes;
+                s.raw_bytes-=e.raw_bytes;
+                s.index.erase(e.key);
+                s.lru.pop_back();
+                this->_evictions++;
+            }
+
+            _Entry e;
+            e.key=key;
+            if(packed)
+                e.packed=packed;
+            else
+                e.image=m;
+            e.bytes=bytes;
+            e.raw_bytes=raw_bytes;
+            s.lru.push_front(e);
+            s.index[key]=s.lru.begin();
+            s.bytes+=bytes;
+            s.raw_bytes+=raw_bytes;
+        }
+    };
+}
+
+#endif // __VVV_DICOM_CACHE_H__
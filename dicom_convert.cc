@@ -0,0 +1,654 @@
+// -*- c++ -*-
+//
+// batch conversion of DICOM files
+//
+// usage: dicom_convert [-f png|tiff|raw|npy] [-o output_dir]
+//                      [-j workers] [-r readers] [-q queue]
+//                      [-w center,width] input_file_or_dir...
+//
+//   png  : windowed 8bit first frame (Window Center/Width of file
+//          unless -w is given)
+//   tiff : stored pixels of first frame (16bit for 16bit files)
+//   raw  : stored pixels of all frames without header
+//   npy  : stored pixels of all frames as NumPy array
+//          (frames, rows, cols[, channels])
+//
+// Files are written next to inputs unless -o is given; then the
+// directory structure of each input directory is kept under it.
+//
+// Reader threads load files into memory. Workers take encoding
+// jobs first and decoding jobs next, so that decoded images do not
+// pile up; a worker encodes its own job when encoding queue is
+// full. Number of files in memory is bounded by -q.
+//
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include "dicom.h"
+
+#include <opencv2/highgui/highgui.hpp>
+
+namespace
+{
+    enum Format
+    {
+        FORMAT_PNG,
+        FORMAT_TIFF,
+        FORMAT_RAW,
+        FORMAT_NPY
+    };
+
+    struct Options
+    {
+        Options()
+            :format(FORMAT_PNG),
+             workers(0),
+             readers(2),
+             queue(0),
+             window(false),
+             center(0.0f),
+             width(0.0f)
+        {}
+
+        Format format;
+        std::string output;
+        size_t workers;
+        size_t readers;
+        size_t queue;
+        bool window;
+        float center;
+        float width;
+    };
+
+    struct Job
+    {
+        std::string src;
+        std::string dst;
+        std::vector<unsigned char> data;
+        cv::Mat image;
+        int frames;
+    };
+
+    //
+    // counters of all threads
+    //
+    struct Counters
+    {
+        Counters()
+            :converted(0),
+             skipped(0),
+             failed(0),
+             bytes_in(0),
+             bytes_out(0),
+             read_ns(0),
+             decode_ns(0),
+             encode_ns(0)
+        {}
+
+        std::atomic<uint64_t> converted;
+        std::atomic<uint64_t> skipped;
+        std::atomic<uint64_t> failed;
+        std::atomic<uint64_t> bytes_in;
+        std::atomic<uint64_t> bytes_out;
+        std::atomic<uint64_t> read_ns;
+        std::atomic<uint64_t> decode_ns;
+        std::atomic<uint64_t> encode_ns;
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    uint64_t elapsed_ns(Clock::time_point from)
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now()-from).count();
+    }
+
+    //
+    // decoding and encoding queues with a bound of jobs in memory
+    //
+    class Stages
+    {
+    public:
+        Stages(size_t capacity)
+            :_capacity(capacity),
+             _decoding(0),
+             _reading(true)
+        {}
+
+        //
+        // by readers; blocks while capacity is used
+        //
+        void put(Job *job)
+        {
+            std::unique_lock<std::mutex> lock(this->_mutex);
+            while(this->_decode.size()+this->_decoding+
+                  this->_encode.size()>=this->_capacity)
+                this->_space.wait(lock);
+
+            this->_decode.push_back(job);
+            this->_work.notify_one();
+        }
+
+        void finish_reading()
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_reading=false;
+            this->_work.notify_all();
+        }
+
+        //
+        // by workers; encoding first. NULL when all done
+        //
+        Job *take(bool &encode)
+        {
+            std::unique_lock<std::mutex> lock(this->_mutex);
+            while(true){
+                if(!this->_encode.empty()){
+                    Job *job=this->_encode.front();
+                    this->_encode.pop_front();
+                    encode=true;
+                    this->_space.notify_one();
+                    return job;
+                }
+                if(!this->_decode.empty()){
+                    Job *job=this->_decode.front();
+                    this->_decode.pop_front();
+                    this->_decoding++;
+                    encode=false;
+                    return job;
+                }
+                if(!this->_reading && !this->_decoding)
+                    return NULL;
+
+                this->_work.wait(lock);
+            }
+        }
+
+        //
+        // decoded job to encoding queue; false when the queue is
+        // full and the caller should encode it
+        //
+        bool decoded(Job *job,size_t limit)
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_decoding--;
+
+            bool queued=false;
+            if(job && this->_encode.size()<limit){
+                this->_encode.push_back(job);
+                queued=true;
+            }
+            else{
+                this->_space.notify_one();
+            }
+            this->_work.notify_all();
+
+            return queued;
+        }
+
+    private:
+        std::mutex _mutex;
+        std::condition_variable _work;
+        std::condition_variable _space;
+        std::deque<Job *> _decode;
+        std::deque<Job *> _encode;
+        size_t _capacity;
+        size_t _decoding;
+        bool _reading;
+    };
+
+    void usage()
+    {
+        std::cerr<<
+            "usage: dicom_convert [-f png|tiff|raw|npy] [-o output_dir]\n"
+            "                     [-j workers] [-r readers] [-q queue]\n"
+            "                     [-w center,width] input_file_or_dir...\n";
+        exit(1);
+    }
+
+    bool is_directory(const std::string &path)
+    {
+        struct stat st;
+        return stat(path.c_str(),&st)==0 && S_ISDIR(st.st_mode);
+    }
+
+    //
+    // regular files under dir as paths relative to dir
+    //
+    void walk(const std::string &dir,
+              const std::string &rel,
+              std::vector<std::string> &dst)
+    {
+        DIR *d=opendir((dir+rel).c_str());
+        if(!d){
+            std::cerr<<"could not open "<<dir+rel<<": "
+                     <<strerror(errno)<<std::endl;
+            return;
+        }
+
+        std::vector<std::string> names;
+        struct dirent *e;
+        while((e=readdir(d))){
+            if(strcmp(e->d_name,".") && strcmp(e->d_name,".."))
+                names.push_back(e->d_name);
+        }
+        closedir(d);
+        std::sort(names.begin(),names.end());
+
+        for(size_t i=0;i<names.size();i++){
+            std::string r=rel+names[i];
+            struct stat st;
+            if(stat((dir+r).c_str(),&st)<0)
+                continue;
+            if(S_ISDIR(st.st_mode))
+                walk(dir,r+"/",dst);
+            else if(S_ISREG(st.st_mode))
+                dst.push_back(r);
+        }
+    }
+
+    void make_parents(const std::string &path)
+    {
+        for(size_t p=path.find('/',1);
+            p!=std::string::npos;
+            p=path.find('/',p+1))
+            mkdir(path.substr(0,p).c_str(),0777);
+    }
+
+    std::string extension(Format f)
+    {
+        switch(f){
+        case FORMAT_PNG:
+            return ".png";
+        case FORMAT_TIFF:
+            return ".tiff";
+        case FORMAT_RAW:
+            return ".raw";
+        default:
+            return ".npy";
+        }
+    }
+
+    bool read_file(const std::string &path,std::vector<unsigned char> &dst)
+    {
+        std::ifstream ifs(path.c_str(),std::ios::binary);
+        if(!ifs)
+            return false;
+
+        ifs.seekg(0,std::ios::end);
+        std::streamoff len=ifs.tellg();
+        ifs.seekg(0,std::ios::beg);
+        if(len<0)
+            return false;
+
+        dst.resize((size_t)len);
+        if(len)
+            ifs.read((char *)&dst[0],len);
+
+        return (bool)ifs;
+    }
+
+    //
+    // NumPy format 1.0 header
+    //
+    std::string npy_header(const cv::Mat &m,int frames)
+    {
+        uint16_t endian_test=1;
+        char order=(*(char *)&endian_test) ? '<' : '>';
+
+        std::ostringstream descr;
+        switch(m.depth()){
+        case CV_8U:
+            descr<<"|u1";
+            break;
+        case CV_8S:
+            descr<<"|i1";
+            break;
+        case CV_16U:
+            descr<<order<<"u2";
+            break;
+        case CV_16S:
+            descr<<order<<"i2";
+            break;
+        case CV_32S:
+            descr<<order<<"i4";
+            break;
+        case CV_32F:
+            descr<<order<<"f4";
+            break;
+        default:
+            descr<<order<<"f8";
+            break;
+        }
+
+        std::ostringstream dict;
+        dict<<"{'descr': '"<<descr.str()<<"', 'fortran_order': False, "
+            <<"'shape': ("<<frames<<", "<<m.rows/frames<<", "<<m.cols;
+        if(m.channels()>1)
+            dict<<", "<<m.channels();
+        dict<<"), }";
+
+        std::string h=dict.str();
+        size_t total=10+h.size()+1;
+        h.append((64-total%64)%64,' ');
+        h+='\n';
+
+        std::string r("\x93NUMPY\x01\x00",8);
+        r+=(char)(h.size()&0xff);
+        r+=(char)(h.size()>>8);
+
+        return r+h;
+    }
+
+    void decode(Job &job,const Options &opt)
+    {
+        VVV::Dicom::MemoryStreamBuf buf(&job.data[0],job.data.size());
+        std::istream ist(&buf);
+
+        VVV::Dicom d;
+        d.parse(ist,false);
+
+        switch(opt.format){
+        case FORMAT_PNG:
+            job.image=opt.window ?
+                d.display_image(opt.center,opt.width) : d.display_image();
+            job.frames=1;
+            break;
+        case FORMAT_TIFF:
+            job.image=d.frame(0,false);
+            job.frames=1;
+            break;
+        default:
+            job.image=d.image(false);
+            job.frames=std::max(1,d.frames());
+            break;
+        }
+        if(!job.image.isContinuous())
+            job.image=job.image.clone();
+
+        std::vector<unsigned char>().swap(job.data);
+    }
+
+    uint64_t encode(Job &job,const Options &opt)
+    {
+        make_parents(job.dst);
+
+        std::vector<unsigned char> encoded;
+        std::string header;
+        const char *p;
+        size_t len;
+        if(opt.format==FORMAT_PNG || opt.format==FORMAT_TIFF){
+            if(!cv::imencode(extension(opt.format),job.image,encoded))
+                throw std::runtime_error("Could not encode image");
+            p=encoded.empty() ? NULL : (const char *)&encoded[0];
+            len=encoded.size();
+        }
+        else{
+            if(opt.format==FORMAT_NPY)
+                header=npy_header(job.image,job.frames);
+            p=(const char *)job.image.data;
+            len=job.image.total()*job.image.elemSize();
+        }
+
+        std::ofstream ofs(job.dst.c_str(),std::ios::binary);
+        ofs.write(header.data(),header.size());
+        ofs.write(p,len);
+        if(!ofs)
+            throw std::runtime_error("Could not write "+job.dst);
+
+        return header.size()+len;
+    }
+
+    void reader(const std::vector<std::pair<std::string,std::string> > &files,
+                std::atomic<size_t> &next,
+                Stages &stages,
+                Counters &counters)
+    {
+        while(true){
+            size_t i=next++;
+            if(i>=files.size())
+                return;
+
+            Clock::time_point t=Clock::now();
+            Job *job=new Job();
+            job->src=files[i].first;
+            job->dst=files[i].second;
+            bool ok=read_file(job->src,job->data);
+            counters.read_ns+=elapsed_ns(t);
+
+            if(!ok){
+                std::cerr<<job->src<<": could not read"<<std::endl;
+                counters.failed++;
+                delete job;
+                continue;
+            }
+            counters.bytes_in+=job->data.size();
+
+            if(job->data.size()<132 ||
+               memcmp(&job->data[128],"DICM",4)!=0){
+                counters.skipped++;
+                delete job;
+                continue;
+            }
+
+            stages.put(job);
+        }
+    }
+
+    void worker(const Options &opt,
+                Stages &stages,
+                size_t encode_limit,
+                Counters &counters)
+    {
+        bool encoding;
+        while(Job *job=stages.take(encoding)){
+            if(!encoding){
+                Clock::time_point t=Clock::now();
+                try{
+                    decode(*job,opt);
+                }
+                catch(std::exception &e){
+                    std::cerr<<job->src<<": "<<e.what()<<std::endl;
+                    counters.failed++;
+                    delete job;
+                    job=NULL;
+                }
+                counters.decode_ns+=elapsed_ns(t);
+
+                if(stages.decoded(job,encode_limit) || !job)
+                    continue;
+            }
+
+            Clock::time_point t=Clock::now();
+            try{
+                counters.bytes_out+=encode(*job,opt);
+                counters.converted++;
+            }
+            catch(std::exception &e){
+                std::cerr<<job->src<<": "<<e.what()<<std::endl;
+                counters.failed++;
+            }
+            counters.encode_ns+=elapsed_ns(t);
+            delete job;
+        }
+    }
+
+    void report(const Counters &c,
+                uint64_t wall_ns,
+                size_t readers,
+                size_t workers)
+    {
+        double wall=wall_ns*1e-9;
+        double mb=c.bytes_in/1e6;
+        uint64_t files=c.converted+c.skipped+c.failed;
+
+        fprintf(stderr,"%llu converted, %llu skipped, %llu failed\n",
+                (unsigned long long)c.converted,
+                (unsigned long long)c.skipped,
+                (unsigned long long)c.failed);
+        fprintf(stderr,"%.1f MB in %.3f s: %.1f files/s, %.1f MB/s"
+                " (%.1f MB written)\n",
+                mb,wall,
+                wall>0 ? files/wall : 0.0,
+                wall>0 ? mb/wall : 0.0,
+                c.bytes_out/1e6);
+
+        fprintf(stderr,"stage   threads  busy[s]  per file[ms]\n");
+        const char *name[]={"read","decode","encode"};
+        uint64_t ns[]={c.read_ns,c.decode_ns,c.encode_ns};
+        size_t threads[]={readers,workers,workers};
+        for(int i=0;i<3;i++){
+            fprintf(stderr,"%-7s %7zu %8.3f %13.3f\n",
+                    name[i],
+                    threads[i],
+                    ns[i]*1e-9,
+                    files ? ns[i]*1e-6/files : 0.0);
+        }
+    }
+}
+
+int main(int argc,char *argv[])
+{
+    Options opt;
+    std::vector<std::string> inputs;
+
+    for(int i=1;i<argc;i++){
+        std::string a=argv[i];
+        if(a.size()==2 && a[0]=='-' && i+1<argc){
+            std::string v=argv[++i];
+            switch(a[1]){
+            case 'f':
+                if(v=="png")
+                    opt.format=FORMAT_PNG;
+                else if(v=="tiff" || v=="tif")
+                    opt.format=FORMAT_TIFF;
+                else if(v=="raw")
+                    opt.format=FORMAT_RAW;
+                else if(v=="npy")
+                    opt.format=FORMAT_NPY;
+                else
+                    usage();
+                break;
+            case 'o':
+                opt.output=v;
+                break;
+            case 'j':
+                opt.workers=strtoul(v.c_str(),NULL,10);
+                break;
+            case 'r':
+                opt.readers=std::max<size_t>(1,strtoul(v.c_str(),NULL,10));
+                break;
+            case 'q':
+                opt.queue=strtoul(v.c_str(),NULL,10);
+                break;
+            case 'w':
+                if(sscanf(v.c_str(),"%f,%f",&opt.center,&opt.width)!=2 ||
+                   opt.width<=0.0f)
+                    usage();
+                opt.window=true;
+                break;
+            default:
+                usage();
+            }
+        }
+        else if(a.size()>1 && a[0]=='-'){
+            usage();
+        }
+        else{
+            inputs.push_back(a);
+        }
+    }
+    if(inputs.empty())
+        usage();
+
+    if(!opt.workers)
+        opt.workers=std::max(1u,std::thread::hardware_concurrency());
+    if(!opt.queue)
+        opt.queue=4*opt.workers;
+
+    //
+    // input and output paths
+    //
+    std::vector<std::pair<std::string,std::string> > files;
+    std::string ext=extension(opt.format);
+    std::string out=opt.output;
+    if(!out.empty() && out[out.size()-1]!='/')
+        out+='/';
+    for(size_t i=0;i<inputs.size();i++){
+        std::string in=inputs[i];
+        if(is_directory(in)){
+            if(in[in.size()-1]!='/')
+                in+='/';
+            std::string name=in.substr(0,in.size()-1);
+            size_t slash=name.find_last_of('/');
+            if(slash!=std::string::npos)
+                name=name.substr(slash+1);
+
+            std::vector<std::string> rel;
+            walk(in,"",rel);
+            for(size_t k=0;k<rel.size();k++)
+                files.push_back(std::make_pair(
+                                    in+rel[k],
+                                    (out.empty() ? in : out+name+"/")+
+                                    rel[k]+ext));
+        }
+        else{
+            size_t slash=in.find_last_of('/');
+            std::string base=(slash==std::string::npos) ?
+                in : in.substr(slash+1);
+            files.push_back(std::make_pair(
+                                in,
+                                (out.empty() ? in : out+base)+ext));
+        }
+    }
+
+    Counters counters;
+    Stages stages(opt.queue);
+    std::atomic<size_t> next(0);
+
+    Clock::time_point start=Clock::now();
+
+    std::vector<std::thread> workers;
+    for(size_t i=0;i<opt.workers;i++)
+        workers.push_back(std::thread(worker,
+                                      std::cref(opt),
+                                      std::ref(stages),
+                                      std::max<size_t>(1,opt.queue/2),
+                                      std::ref(counters)));
+
+    std::vector<std::thread> readers;
+    for(size_t i=0;i<opt.readers;i++)
+        readers.push_back(std::thread(reader,
+                                      std::cref(files),
+                                      std::ref(next),
+                                      std::ref(stages),
+                                      std::ref(counters)));
+
+    for(size_t i=0;i<readers.size();i++)
+        readers[i].join();
+    stages.finish_reading();
+    for(size_t i=0;i<workers.size();i++)
+        workers[i].join();
+
+    report(counters,elapsed_ns(start),opt.readers,opt.workers);
+
+    return counters.failed ? 2 : 0;
+}
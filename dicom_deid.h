@@ -0,0 +1,1196 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_deid.h
+///
+/// @brief  streaming de-identification of DICOM files
+///
+
+#ifndef __VVV_DICOM_DEID_H__
+
+#define __VVV_DICOM_DEID_H__
+
+#include "dicom.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#include <map>
+#include <vector>
+#include <string>
+
+namespace VVV
+{
+    ///
+    /// rewrite DICOM files with identifying elements replaced,
+    /// hashed or removed
+    ///
+    /// Elements are walked with Dicom::parse_header() and written to
+    /// the new file as they are read. Pixel Data and other large
+    /// values are copied between file descriptors by the kernel
+    /// (copy_file_range(2) or sendfile(2)) and never loaded into
+    /// memory. Sequences are rewritten recursively and group lengths
+    /// are recomputed.
+    ///
+    /// VR rules of a Profile need explicit VR; implicit VR data sets
+    /// are handled by tag rules and the private group rule, and their
+    /// defined length values beginning with an Item are rewritten as
+    /// sequences. Items of UN with undefined length are rewritten in
+    /// Implicit VR Little Endian. Deflated Transfer Syntax is not
+    /// supported.
+    ///
+    class Deidentifier
+    {
+    public:
+        ///
+        /// what to do with an element
+        ///
+        enum Action{
+            ACTION_KEEP=0,    ///< write as is
+            ACTION_REMOVE=1,  ///< drop the element
+            ACTION_EMPTY=2,   ///< write with zero length value
+            ACTION_REPLACE=3, ///< write with a fixed value
+            ACTION_HASH=4,    ///< salted hash as 16 hex digits
+            ACTION_HASH_UID=5 ///< salted hash as 2.25 UID
+        };
+
+        ///
+        /// de-identification rules
+        ///
+        /// Rules are looked up in order of tag, private group and VR;
+        /// elements without rule are kept.
+        ///
+        class Profile
+        {
+        public:
+            Profile()
+                :_private_action(ACTION_KEEP)
+            {}
+
+            ///
+            /// set a rule for a tag
+            ///
+            /// @param group DICOM element tag group ID
+            /// @param id   DICOM element tag ID
+            /// @param action one of Action
+            /// @param value value for ACTION_REPLACE
+            ///
+            /// @return self
+            ///
+            Profile &tag(const uint16_t group,
+                         const uint16_t id,
+                         int action,
+                         const std::string &value="")
+            {
+                Dicom::TypeTag t={{group,id}};
+                this->_tags[t.number]=std::make_pair(action,value);
+
+                return *this;
+            }
+
+            ///
+            /// set a rule for a VR
+            ///
+            /// @param vr VR string (e.g. "PN")
+            /// @param action one of Action
+            /// @param value value for ACTION_REPLACE
+            ///
+            /// @return self
+            ///
+            Profile &vr(const char *vr,
+                        int action,
+                        const std::string &value="")
+            {
+                if(!vr || strlen(vr)!=2)
+                    throw std::invalid_argument("Bad VR");
+
+                uint16_t number=(uint16_t)((vr[0]<<8)|vr[1]);
+                this->_vrs[number]=std::make_pair(action,value);
+
+                return *this;
+            }
+
+            ///
+            /// set a rule for private (odd) groups
+            ///
+            /// @param action one of Action
+            ///
+            /// @return self
+            ///
+            Profile &private_groups(int action)
+            {
+                this->_private_action=action;
+
+                return *this;
+            }
+
+            ///
+            /// rule for an element
+            ///
+            /// @param h element header
+            /// @param value value for ACTION_REPLACE
+            ///
+            /// @return one of Action
+            ///
+            int action(const Dicom::ElementHeader &h,
+                       std::string &value) const
+            {
+                std::map<uint32_t,std::pair<int,std::string> >::
+                    const_iterator t=this->_tags.find(h.tag.number);
+                if(t!=this->_tags.end()){
+                    value=t->second.second;
+                    return t->second.first;
+                }
+
+                if(h.tag.id[0]&1)
+                    return this->_private_action;
+
+                std::map<uint16_t,std::pair<int,std::string> >::
+                    const_iterator v=this->_vrs.find(h.vr.number);
+                if(h.vr.number && v!=this->_vrs.end()){
+                    value=v->second.second;
+                    return v->second.first;
+                }
+
+                return ACTION_KEEP;
+            }
+
+            ///
+            /// basic profile
+            ///
+            /// @return profile which empties names and dates, hashes
+            ///         UIDs and IDs, and removes private groups and
+            ///         common identifying elements
+            ///
+            static Profile basic()
+            {
+                Profile p;
+
+                p.private_groups(ACTION_REMOVE);
+
+                p.vr("PN",ACTION_EMPTY);
+                p.vr("DA",ACTION_EMPTY);
+                p.vr("DT",ACTION_EMPTY);
+                p.vr("TM",ACTION_EMPTY);
+                p.vr("UI",ACTION_HASH_UID);
+
+                // UIDs which do not identify anything
+                p.tag(0x0002,0x0002,ACTION_KEEP); // Media Storage SOP Class
+                p.tag(0x0002,0x0010,ACTION_KEEP); // Transfer Syntax
+                p.tag(0x0002,0x0012,ACTION_KEEP); // Implementation Class
+                p.tag(0x0008,0x0016,ACTION_KEEP); // SOP Class
+                p.tag(0x0008,0x1150,ACTION_KEEP); // Referenced SOP Class
+
+                // for implicit VR
+                p.tag(0x0002,0x0003,ACTION_HASH_UID);
+                p.tag(0x0008,0x0014,ACTION_HASH_UID);
+                p.tag(0x0008,0x0018,ACTION_HASH_UID);
+                p.tag(0x0008,0x1155,ACTION_HASH_UID);
+                p.tag(0x0020,0x000D,ACTION_HASH_UID);
+                p.tag(0x0020,0x000E,ACTION_HASH_UID);
+                p.tag(0x0020,0x0052,ACTION_HASH_UID);
+                p.tag(0x0008,0x0020,ACTION_EMPTY); // Study Date
+                p.tag(0x0008,0x0021,ACTION_EMPTY); // Series Date
+                p.tag(0x0008,0x0022,ACTION_EMPTY); // Acquisition Date
+                p.tag(0x0008,0x0023,ACTION_EMPTY); // Content Date
+                p.tag(0x0008,0x0030,ACTION_EMPTY); // Study Time
+                p.tag(0x0008,0x0031,ACTION_EMPTY); // Series Time
+                p.tag(0x0008,0x0032,ACTION_EMPTY); // Acquisition Time
+                p.tag(0x0008,0x0033,ACTION_EMPTY); // Content Time
+                p.tag(0x0008,0x0090,ACTION_EMPTY); // Referring Physician
+                p.tag(0x0010,0x0010,ACTION_EMPTY); // Patient's Name
+                p.tag(0x0010,0x0030,ACTION_EMPTY); // Patient's Birth Date
+
+                p.tag(0x0008,0x0050,ACTION_HASH);  // Accession Number
+                p.tag(0x0010,0x0020,ACTION_HASH);  // Patient ID
+                p.tag(0x0020,0x0010,ACTION_EMPTY); // Study ID
+
+                p.tag(0x0008,0x0080,ACTION_REMOVE); // Institution Name
+                p.tag(0x0008,0x0081,ACTION_REMOVE); // Institution Address
+                p.tag(0x0008,0x1010,ACTION_REMOVE); // Station Name
+                p.tag(0x0008,0x1040,ACTION_REMOVE); // Department Name
+                p.tag(0x0008,0x1050,ACTION_REMOVE); // Performing Physician
+                p.tag(0x0008,0x1070,ACTION_REMOVE); // Operators' Name
+                p.tag(0x0010,0x1000,ACTION_REMOVE); // Other Patient IDs
+                p.tag(0x0010,0x1001,ACTION_REMOVE); // Other Patient Names
+                p.tag(0x0010,0x1040,ACTION_REMOVE); // Patient's Address
+                p.tag(0x0010,0x2154,ACTION_REMOVE); // Telephone Numbers
+                p.tag(0x0018,0x1000,ACTION_REMOVE); // Device Serial Number
+                p.tag(0x0032,0x1032,ACTION_REMOVE); // Requesting Physician
+
+                return p;
+            }
+
+        private:
+            std::map<uint32_t,std::pair<int,std::string> > _tags;
+            std::map<uint16_t,std::pair<int,std::string> > _vrs;
+            int _private_action;
+        };
+        //
+        // end of Deidentifier::Profile
+        //
+
+        ///
+        /// constructor
+        ///
+        /// @param profile de-identification rules
+        /// @param salt secret prefix of hashed values
+        /// @param bulk_threshold values of this size or larger are
+        ///                       copied without loading
+        ///
+        /// Without a secret salt, hashed UIDs and IDs can be
+        /// recovered by hashing candidates.
+        ///
+        Deidentifier(const Profile &profile=Profile::basic(),
+                     const std::string &salt="",
+                     size_t bulk_threshold=65536)
+            :_profile(profile),
+             _salt(salt),
+             _bulk_threshold(bulk_threshold)
+        {
+            // nop
+        }
+
+        ///
+        /// rewrite a file
+        ///
+        /// @param src source file path
+        /// @param dst destination file path
+        ///
+        /// @return bytes written
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError
+        ///
+        uint64_t rewrite(const std::string &src,const std::string &dst)
+        {
+            int in=open(src.c_str(),O_RDONLY);
+            if(in<0)
+                throw Dicom::StreamError("Could not open source file");
+
+            int out=open(dst.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+            if(out<0){
+                close(in);
+                throw Dicom::StreamError("Could not open destination file");
+            }
+
+            uint64_t r;
+            try{
+                r=this->rewrite(in,out);
+            }
+            catch(...){
+                close(in);
+                close(out);
+                unlink(dst.c_str());
+                throw;
+            }
+            close(in);
+            if(close(out)<0)
+                throw Dicom::StreamError("Could not write destination file");
+
+            return r;
+        }
+
+        ///
+        /// rewrite a file between file descriptors
+        ///
+        /// @param in source file descriptor (seekable)
+        /// @param out destination file descriptor
+        ///
+        /// @return bytes written
+        ///
+        /// Source is read with pread(2); the position of in is not
+        /// used. Destination is written from its current position.
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError
+        ///
+        uint64_t rewrite(int in,int out)
+        {
+            _FileSource src(in);
+            _FileSink sink(in,out);
+
+            //
+            // preamble may hold anything; write zeros
+            //
+            size_t avail;
+            const unsigned char *p=src.peek(132,avail);
+            if(avail<132 || memcmp(p+128,"DICM",4))
+                throw Dicom::ParseError("Not a DICOM file");
+
+            unsigned char head[132];
+            memset(head,0,128);
+            memcpy(head+128,"DICM",4);
+            sink.write(head,132);
+            src.seek(132);
+
+            //
+            // File Meta Information is always explicit VR little endian
+            //
+            uint64_t meta_end=132;
+            while(true){
+                Dicom::ElementHeader h;
+                p=src.peek(12,avail);
+                if(!Dicom::parse_header(p,avail,false,true,h) ||
+                   h.tag.id[0]!=Dicom::TAG_GROUP_META)
+                    break;
+                if(h.is_undefined())
+                    throw Dicom::ParseError("Bad File Meta Information");
+
+                meta_end+=h.header_size+h.length;
+                src.seek(meta_end);
+            }
+
+            std::vector<unsigned char> meta;
+            src.read(132,(size_t)(meta_end-132),meta);
+
+            bool swap,explicit_vr;
+            this->_transfer_syntax(meta,swap,explicit_vr);
+
+            if(!meta.empty()){
+                _MemorySource msrc(&meta[0],meta.size());
+                this->_rewrite_dataset(msrc,meta.size(),false,true,sink);
+            }
+
+            src.seek(meta_end);
+            this->_rewrite_dataset(src,src.size(),swap,explicit_vr,sink);
+
+            sink.flush();
+
+            return sink.written();
+        }
+
+        ///
+        /// salted hash of a value
+        ///
+        /// @param value value without padding
+        ///
+        /// @return 16 upper case hex digits (fits in SH)
+        ///
+        std::string hash(const std::string &value)
+        {
+            unsigned char d[32];
+            this->_digest(value,d);
+
+            static const char hex[]="0123456789ABCDEF";
+            std::string r;
+            for(int i=0;i<8;i++){
+                r+=hex[d[i]>>4];
+                r+=hex[d[i]&15];
+            }
+
+            return r;
+        }
+
+        ///
+        /// salted hash of a UID
+        ///
+        /// @param uid UID without padding
+        ///
+        /// @return UID under 2.25 from 128bit of the hash
+        ///
+        /// The same UID is always mapped to the same UID, so that
+        /// references between files are kept.
+        ///
+        std::string hash_uid(const std::string &uid)
+        {
+            unsigned char d[32];
+            this->_digest(uid,d);
+
+            return Dicom::uid_from_bytes(d);
+        }
+
+    private:
+        Profile _profile;
+        std::string _salt;
+        size_t _bulk_threshold;
+
+        //
+        // byte source over a file descriptor with read buffer
+        //
+        class _FileSource
+        {
+        public:
+            _FileSource(int fd)
+                :_fd(fd),
+                 _pos(0),
+                 _base(0),
+                 _len(0),
+                 _buf(1<<16)
+            {
+                struct stat st;
+                if(fstat(fd,&st)<0)
+                    throw Dicom::StreamError("Bad file descriptor");
+                this->_size=(uint64_t)st.st_size;
+            }
+
+            static const bool can_bulk=true;
+
+            uint64_t size() const { return this->_size; }
+            uint64_t offset() const { return this->_pos; }
+            void seek(uint64_t pos){ this->_pos=pos; }
+
+            //
+            // up to n bytes at current offset
+            //
+            const unsigned char *peek(size_t n,size_t &avail)
+            {
+                if(this->_pos<this->_base ||
+                   this->_pos+n>this->_base+this->_len){
+                    if(n>this->_buf.size())
+                        this->_buf.resize(n);
+                    this->_base=this->_pos;
+                    this->_len=0;
+                    while(this->_len<this->_buf.size()){
+                        ssize_t r=pread(this->_fd,
+                                        &this->_buf[this->_len],
+                                        this->_buf.size()-this->_len,
+                                        (off_t)(this->_base+this->_len));
+                        if(r<0 && errno==EINTR)
+                            continue;
+                        if(r<0)
+                            throw Dicom::StreamError("Could not read file");
+                        if(r==0)
+                            break;
+                        this->_len+=(size_t)r;
+                    }
+                }
+
+                size_t off=(size_t)(this->_pos-this->_base);
+                avail=std::min(n,this->_len-off);
+
+                return &this->_buf[0]+off;
+            }
+
+            void read(uint64_t pos,size_t n,std::vector<unsigned char> &dst)
+            {
+                dst.resize(n);
+                if(!n)
+                    return;
+
+                size_t done=0;
+                if(pos>=this->_base && pos<this->_base+this->_len){
+                    done=std::min(n,(size_t)(this->_base+this->_len-pos));
+                    memcpy(&dst[0],&this->_buf[(size_t)(pos-this->_base)],
+                           done);
+                }
+                while(done<n){
+                    ssize_t r=pread(this->_fd,&dst[done],n-done,
+                                    (off_t)(pos+done));
+                    if(r<0 && errno==EINTR)
+                        continue;
+                    if(r<=0)
+                        throw Dicom::StreamError("Unexpected end of file");
+                    done+=(size_t)r;
+                }
+            }
+
+        private:
+            int _fd;
+            uint64_t _pos;
+            uint64_t _base;
+            size_t _len;
+            uint64_t _size;
+            std::vector<unsigned char> _buf;
+        };
+
+        //
+        // byte source over memory
+        //
+        class _MemorySource
+        {
+        public:
+            _MemorySource(const unsigned char *data,size_t len)
+                :_data(data),
+                 _len(len),
+                 _pos(0)
+            {}
+
+            static const bool can_bulk=false;
+
+            uint64_t size() const { return this->_len; }
+            uint64_t offset() const { return this->_pos; }
+            void seek(uint64_t pos){ this->_pos=(size_t)pos; }
+
+            const unsigned char *peek(size_t n,size_t &avail)
+            {
+                avail=(this->_pos<this->_len) ?
+                    std::min(n,this->_len-this->_pos) : 0;
+
+                return this->_data+std::min(this->_pos,this->_len);
+            }
+
+            void read(uint64_t pos,size_t n,std::vector<unsigned char> &dst)
+            {
+                if(pos>this->_len || n>this->_len-pos)
+                    throw Dicom::ParseError("Value exceeds Item");
+                dst.assign(this->_data+pos,this->_data+pos+n);
+            }
+
+        private:
+            const unsigned char *_data;
+            size_t _len;
+            size_t _pos;
+        };
+
+        //
+        // write buffer over a file descriptor; bulk values are
+        // copied from the source file by the kernel
+        //
+        class _FileSink
+        {
+        public:
+            _FileSink(int in,int out)
+                :_in(in),
+                 _out(out),
+                 _written(0)
+            {
+                this->_buf.reserve(1<<18);
+            }
+
+            uint64_t written() const { return this->_written; }
+
+            void write(const unsigned char *p,size_t n)
+            {
+                if(this->_buf.size()+n>this->_buf.capacity())
+                    this->flush();
+                if(n>=this->_buf.capacity())
+                    this->_write_all(p,n);
+                else
+                    this->_buf.insert(this->_buf.end(),p,p+n);
+                this->_written+=n;
+            }
+
+            void copy(uint64_t pos,uint64_t n)
+            {
+                this->flush();
+
+                off_t off=(off_t)pos;
+                uint64_t rest=n;
+#if defined(__linux__) && defined(__GLIBC__) &&                         \
+    (__GLIBC__>2 || (__GLIBC__==2 && __GLIBC_MINOR__>=27))
+                while(rest){
+                    ssize_t r=copy_file_range(this->_in,&off,
+                                              this->_out,NULL,
+                                              (size_t)std::min(rest,
+                                                               (uint64_t)1<<30),
+                                              0);
+                    if(r<0 && errno==EINTR)
+                        continue;
+                    if(r<=0)
+                        break; // not supported; fall back
+                    rest-=(uint64_t)r;
+                }
+#endif
+#if defined(__linux__)
+                while(rest){
+                    ssize_t r=sendfile(this->_out,this->_in,&off,
+                                       (size_t)std::min(rest,
+                                                        (uint64_t)1<<30));
+                    if(r<0 && errno==EINTR)
+                        continue;
+                    if(r<=0)
+                        break;
+                    rest-=(uint64_t)r;
+                }
+#endif
+                //
+                // plain read and write
+                //
+                std::vector<unsigned char> buf(
+                    (size_t)std::min(rest,(uint64_t)1<<20));
+                while(rest){
+                    ssize_t r=pread(this->_in,&buf[0],
+                                    (size_t)std::min(rest,
+                                                     (uint64_t)buf.size()),
+                                    off);
+                    if(r<0 && errno==EINTR)
+                        continue;
+                    if(r<=0)
+                        throw Dicom::StreamError("Unexpected end of file");
+                    this->_write_all(&buf[0],(size_t)r);
+                    off+=r;
+                    rest-=(uint64_t)r;
+                }
+
+                this->_written+=n;
+            }
+
+            void flush()
+            {
+                if(!this->_buf.empty())
+                    this->_write_all(&this->_buf[0],this->_buf.size());
+                this->_buf.clear();
+            }
+
+        private:
+            int _in;
+            int _out;
+            uint64_t _written;
+            std::vector<unsigned char> _buf;
+
+            void _write_all(const unsigned char *p,size_t n)
+            {
+                while(n){
+                    ssize_t r=::write(this->_out,p,n);
+                    if(r<0 && errno==EINTR)
+                        continue;
+                    if(r<=0)
+                        throw Dicom::StreamError("Could not write file");
+                    p+=r;
+                    n-=(size_t)r;
+                }
+            }
+        };
+
+        //
+        // write into memory
+        //
+        class _VectorSink
+        {
+        public:
+            _VectorSink(std::vector<unsigned char> &v)
+                :_v(v)
+            {}
+
+            void write(const unsigned char *p,size_t n)
+            {
+                this->_v.insert(this->_v.end(),p,p+n);
+            }
+
+            void copy(uint64_t pos,uint64_t n)
+            {
+                throw std::logic_error("No bulk copy into memory");
+            }
+
+        private:
+            std::vector<unsigned char> &_v;
+        };
+
+        //
+        // output of a group: bytes in memory or a range of the
+        // source file
+        //
+        struct _Chunk
+        {
+            std::vector<unsigned char> bytes;
+            uint64_t offset;
+            uint64_t length; // 0 for bytes
+        };
+
+        struct _Group
+        {
+            uint16_t group;
+            bool has_length;
+            Dicom::ElementHeader length_header;
+            uint64_t size;
+            std::vector<_Chunk> chunks;
+        };
+
+        //
+        // element header in the byte order of the data set
+        //
+        static void _put_header(std::vector<unsigned char> &dst,
+                                const Dicom::ElementHeader &h,
+                                uint32_t length,
+                                bool swap,
+                                bool explicit_vr)
+        {
+            uint16_t g=h.tag.id[0],e=h.tag.id[1];
+            if(swap){
+                g=bswap_16(g);
+                e=bswap_16(e);
+                length=(h.header_size==8 && h.vr.number) ?
+                    length : bswap_32(length);
+            }
+
+            unsigned char b[12];
+            memcpy(b,&g,2);
+            memcpy(b+2,&e,2);
+            if(!explicit_vr || h.tag.id[0]==0xFFFE){
+                memcpy(b+4,&length,4);
+                dst.insert(dst.end(),b,b+8);
+                return;
+            }
+
+            b[4]=(unsigned char)(h.vr.number>>8);
+            b[5]=(unsigned char)(h.vr.number&0xFF);
+            if(Dicom::is_long_vr(h.vr.number)){
+                b[6]=b[7]=0;
+                memcpy(b+8,&length,4);
+                dst.insert(dst.end(),b,b+12);
+                return;
+            }
+
+            if(length>0xFFFF)
+                throw Dicom::ParseError("Value too long for VR");
+            uint16_t len16=(uint16_t)length;
+            if(swap)
+                len16=bswap_16(len16);
+            memcpy(b+6,&len16,2);
+            dst.insert(dst.end(),b,b+8);
+        }
+
+        static void _put_delimiter(std::vector<unsigned char> &dst,
+                                   uint16_t id,
+                                   bool swap)
+        {
+            Dicom::ElementHeader h;
+            h.tag.id[0]=0xFFFE;
+            h.tag.id[1]=id;
+            h.vr.number=0;
+            h.header_size=8;
+            _put_header(dst,h,0,swap,false);
+        }
+
+        //
+        // Transfer Syntax UID (0002,0010) in File Meta Information
+        //
+        void _transfer_syntax(const std::vector<unsigned char> &meta,
+                              bool &swap,
+                              bool &explicit_vr)
+        {
+            std::string uid;
+            size_t off=0;
+            Dicom::ElementHeader h;
+            while(!meta.empty() &&
+                  Dicom::parse_header(&meta[off],meta.size()-off,
+                                      false,true,h)){
+                size_t end=off+h.header_size+h.length;
+                if(end>meta.size())
+                    break;
+                if(h.tag.number==Dicom::TAG_TRANSFER_SYNTAX_UID.number){
+                    uid.assign((const char *)&meta[off+h.header_size],
+                               h.length);
+                    break;
+                }
+                off=end;
+                if(off>=meta.size())
+                    break;
+            }
+            uid=_trim(uid);
+
+            // architecture is little endian for most hosts
+            uint16_t endian_test=1;
+            bool host_le=(*(char *)&endian_test)!=0;
+
+            if(uid=="1.2.840.10008.1.2"){
+                explicit_vr=false;
+                swap=!host_le;
+            }
+            else if(uid=="1.2.840.10008.1.2.2"){
+                explicit_vr=true;
+                swap=host_le;
+            }
+            else if(uid=="1.2.840.10008.1.2.1.99")
+                throw Dicom::ParseError(
+                    "Deflated Transfer Syntax is not supported");
+            else{
+                explicit_vr=true;
+                swap=!host_le;
+            }
+        }
+
+        static std::string _trim(const std::string &s)
+        {
+            size_t end=s.size();
+            while(end && (s[end-1]==' ' || s[end-1]=='\0'))
+                end--;
+            size_t begin=0;
+            while(begin<end && s[begin]==' ')
+                begin++;
+
+            return s.substr(begin,end-begin);
+        }
+
+        //
+        // bytes of an undefined length value; only headers are read
+        //
+        template <class Source>
+        static uint64_t _extent(Source &src,bool swap,bool explicit_vr)
+        {
+            uint64_t begin=src.offset();
+            Dicom::ElementHeader h;
+            size_t avail;
+
+            while(true){
+                const unsigned char *p=src.peek(8,avail);
+                if(!Dicom::parse_header(p,avail,swap,explicit_vr,h) ||
+                   h.tag.id[0]!=0xFFFE)
+                    throw Dicom::ParseError("Broken Sequence");
+                src.seek(src.offset()+8);
+                if(h.tag.id[1]==0xE0DD)
+                    break;
+                if(h.tag.id[1]!=0xE000)
+                    throw Dicom::ParseError("Item expected in Sequence");
+                if(!h.is_undefined()){
+                    src.seek(src.offset()+h.length);
+                    continue;
+                }
+
+                // elements of undefined length Item
+                while(true){
+                    p=src.peek(12,avail);
+                    if(!Dicom::parse_header(p,avail,swap,explicit_vr,h))
+                        throw Dicom::ParseError("Broken Item");
+                    src.seek(src.offset()+h.header_size);
+                    if(h.tag.id[0]==0xFFFE && h.tag.id[1]==0xE00D)
+                        break;
+                    if(h.is_undefined()){
+                        bool nswap=swap,nexplicit=explicit_vr;
+                        Dicom::nested_syntax(h,nswap,nexplicit);
+                        src.seek(src.offset()+
+                                 _extent(src,nswap,nexplicit));
+                    }
+                    else
+                        src.seek(src.offset()+h.length);
+                }
+            }
+
+            uint64_t r=src.offset()-begin;
+            src.seek(begin);
+
+            return r;
+        }
+
+        //
+        // write a group with recomputed group length
+        //
+        template <class Sink>
+        static void _flush_group(_Group &g,
+                                 bool swap,
+                                 bool explicit_vr,
+                                 Sink &sink)
+        {
+            if(g.chunks.empty())
+                return;
+
+            if(g.has_length){
+                if(g.size>0xFFFFFFFF)
+                    throw Dicom::ParseError("Group is too large");
+
+                std::vector<unsigned char> b;
+                _put_header(b,g.length_header,4,swap,explicit_vr);
+                uint32_t len=(uint32_t)g.size;
+                if(swap)
+                    len=bswap_32(len);
+                const unsigned char *lp=(const unsigned char *)&len;
+                b.insert(b.end(),lp,lp+4);
+                sink.write(&b[0],b.size());
+            }
+
+            for(size_t i=0;i<g.chunks.size();i++){
+                _Chunk &c=g.chunks[i];
+                if(c.length)
+                    sink.copy(c.offset,c.length);
+                else if(!c.bytes.empty())
+                    sink.write(&c.bytes[0],c.bytes.size());
+            }
+
+            g.chunks.clear();
+            g.size=0;
+            g.has_length=false;
+        }
+
+        //
+        // rewrite elements in [src.offset(), end)
+        //
+        template <class Source,class Sink>
+        void _rewrite_dataset(Source &src,
+                              uint64_t end,
+                              bool swap,
+                              bool explicit_vr,
+                              Sink &sink)
+        {
+            _Group g;
+            g.group=0;
+            g.has_length=false;
+            g.size=0;
+
+            while(src.offset()<end){
+                size_t avail;
+                const unsigned char *p=src.peek(12,avail);
+                Dicom::ElementHeader h;
+                if(!Dicom::parse_header(p,avail,swap,explicit_vr,h))
+                    throw Dicom::ParseError("Broken element header");
+
+                if(h.tag.id[0]!=g.group){
+                    _flush_group(g,swap,explicit_vr,sink);
+                    g.group=h.tag.id[0];
+                }
+
+                uint64_t head=src.offset();
+                uint64_t value=head+h.header_size;
+                src.seek(value);
+
+                // Items of UN are in Implicit VR Little Endian
+                bool nswap=swap,nexplicit=explicit_vr;
+                Dicom::nested_syntax(h,nswap,nexplicit);
+
+                uint64_t len=h.is_undefined() ?
+                    _extent(src,nswap,nexplicit) : h.length;
+                if(value+len>src.size())
+                    throw Dicom::ParseError("Value exceeds data set");
+                bool is_sequence=_is_sequence(src,h,len,swap,explicit_vr);
+                src.seek(value+len);
+
+                //
+                // group length is written when the group ends
+                //
+                if(h.tag.id[1]==0x0000 && h.length==4){
+                    g.has_length=true;
+                    g.length_header=h;
+                    continue;
+                }
+
+                std::string replace;
+                int action=this->_profile.action(h,replace);
+                if(action==ACTION_REMOVE)
+                    continue;
+
+                _Chunk c;
+                c.offset=0;
+                c.length=0;
+                if(action==ACTION_KEEP && is_sequence){
+                    std::vector<unsigned char> v;
+                    src.read(value,(size_t)len,v);
+                    this->_rewrite_sequence(h,v,swap,explicit_vr,
+                                            nswap,nexplicit,c.bytes);
+                }
+                else if(action==ACTION_KEEP){
+                    bool bulk=Source::can_bulk &&
+                        (len>=this->_bulk_threshold ||
+                         h.tag.id[0]==0x7FE0 ||
+                         h.is_undefined());
+                    if(bulk){
+                        src.read(head,h.header_size,c.bytes);
+                        g.size+=c.bytes.size()+len;
+                        g.chunks.push_back(c);
+
+                        _Chunk b;
+                        b.offset=value;
+                        b.length=len;
+                        g.chunks.push_back(b);
+                        continue;
+                    }
+                    src.read(head,(size_t)(h.header_size+len),c.bytes);
+                }
+                else{
+                    std::string v;
+                    if(action==ACTION_REPLACE)
+                        v=replace;
+                    else if(action==ACTION_HASH ||
+                            action==ACTION_HASH_UID){
+                        std::vector<unsigned char> raw;
+                        src.read(value,(size_t)len,raw);
+                        std::string s=raw.empty() ? std::string() :
+                            std::string((const char *)&raw[0],raw.size());
+                        s=_trim(s);
+                        v=(action==ACTION_HASH) ?
+                            this->hash(s) : this->hash_uid(s);
+                    }
+
+                    // even length with padding
+                    if(v.size()&1)
+                        v+=(h.vr.number==0x5549 ||
+                            action==ACTION_HASH_UID) ? '\0' : ' ';
+                    _put_header(c.bytes,h,(uint32_t)v.size(),
+                                swap,explicit_vr);
+                    c.bytes.insert(c.bytes.end(),v.begin(),v.end());
+                }
+
+                g.size+=c.bytes.size();
+                g.chunks.push_back(c);
+            }
+
+            _flush_group(g,swap,explicit_vr,sink);
+        }
+
+        //
+        // query method that a value at src.offset() is a sequence;
+        // implicit VR has no SQ, so defined length values are tested
+        // for a leading Item
+        //
+        template <class Source>
+        static bool _is_sequence(Source &src,
+                                 const Dicom::ElementHeader &h,
+                                 uint64_t len,
+                                 bool swap,
+                                 bool explicit_vr)
+        {
+            if(h.tag.number==Dicom::TAG_FRAME_DATA.number)
+                return false;
+            if(explicit_vr)
+                return h.vr.number==0x5351 ||
+                    (h.vr.number==0x554e && h.is_undefined());
+            if(h.is_undefined())
+                return true;
+            if(len<8)
+                return false;
+
+            size_t avail;
+            const unsigned char *p=src.peek(8,avail);
+            Dicom::ElementHeader ih;
+
+            return Dicom::parse_header(p,avail,swap,false,ih) &&
+                ih.tag.id[0]==0xFFFE && ih.tag.id[1]==0xE000 &&
+                (ih.is_undefined() || ih.length<=len-8);
+        }
+
+        //
+        // rewrite each Item of a sequence; Items are encoded with
+        // item_swap and item_explicit_vr
+        //
+        void _rewrite_sequence(const Dicom::ElementHeader &h,
+                               const std::vector<unsigned char> &v,
+                               bool swap,
+                               bool explicit_vr,
+                               bool item_swap,
+                               bool item_explicit_vr,
+                               std::vector<unsigned char> &dst)
+        {
+            std::vector<unsigned char> items;
+            size_t off=0;
+            while(off<v.size()){
+                Dicom::ElementHeader ih;
+                if(!Dicom::parse_header(&v[off],v.size()-off,
+                                        item_swap,item_explicit_vr,ih))
+                    throw Dicom::ParseError("Broken Sequence");
+                if(ih.tag.id[0]==0xFFFE && ih.tag.id[1]==0xE0DD)
+                    break;
+                if(ih.tag.id[0]!=0xFFFE || ih.tag.id[1]!=0xE000)
+                    throw Dicom::ParseError("Item expected in Sequence");
+                off+=ih.header_size;
+
+                size_t content,consumed;
+                if(ih.is_undefined())
+                    consumed=Dicom::undefined_item_size(&v[off],
+                                                        v.size()-off,
+                                                        item_swap,
+                                                        item_explicit_vr,
+                                                        content);
+                else{
+                    if(ih.length>v.size()-off)
+                        throw Dicom::ParseError("Broken Sequence");
+                    content=consumed=ih.length;
+                }
+
+                std::vector<unsigned char> item;
+                if(content){
+                    _MemorySource isrc(&v[off],content);
+                    _VectorSink isink(item);
+                    this->_rewrite_dataset(isrc,content,
+                                           item_swap,item_explicit_vr,
+                                           isink);
+                }
+
+                _put_header(items,ih,
+                            ih.is_undefined() ?
+                            0xFFFFFFFF : (uint32_t)item.size(),
+                            item_swap,item_explicit_vr);
+                items.insert(items.end(),item.begin(),item.end());
+                if(ih.is_undefined())
+                    _put_delimiter(items,0xE00D,item_swap);
+
+                off+=consumed;
+            }
+
+            _put_header(dst,h,
+                        h.is_undefined() ? 0xFFFFFFFF : (uint32_t)items.size(),
+                        swap,explicit_vr);
+            dst.insert(dst.end(),items.begin(),items.end());
+            if(h.is_undefined())
+                _put_delimiter(dst,0xE0DD,item_swap);
+        }
+
+        //
+        // SHA-256 of salt and value
+        //
+        void _digest(const std::string &value,unsigned char *out)
+        {
+            static const uint32_t k[64]={
+                0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,
+                0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+                0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,
+                0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+                0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,
+                0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+                0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,
+                0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+                0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,
+                0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+                0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,
+                0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+                0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,
+                0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+                0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,
+                0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+            };
+            uint32_t hs[8]={
+                0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,
+                0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19
+            };
+
+            // salt, separator and value with padding
+            std::string m=this->_salt;
+            m+='\0';
+            m+=value;
+            uint64_t bits=(uint64_t)m.size()*8;
+            m+=(char)0x80;
+            while(m.size()%64!=56)
+                m+='\0';
+            for(int i=7;i>=0;i--)
+                m+=(char)((bits>>(i*8))&0xFF);
+
+#define __VVV_ROTR(x,n) (((x)>>(n))|((x)<<(32-(n))))
+            for(size_t blk=0;blk<m.size();blk+=64){
+                uint32_t w[64];
+                for(int i=0;i<16;i++){
+                    const unsigned char *b=
+                        (const unsigned char *)m.data()+blk+i*4;
+                    w[i]=((uint32_t)b[0]<<24)|((uint32_t)b[1]<<16)|
+                        ((uint32_t)b[2]<<8)|b[3];
+                }
+                for(int i=16;i<64;i++){
+                    uint32_t s0=__VVV_ROTR(w[i-15],7)^
+                        __VVV_ROTR(w[i-15],18)^(w[i-15]>>3);
+                    uint32_t s1=__VVV_ROTR(w[i-2],17)^
+                        __VVV_ROTR(w[i-2],19)^(w[i-2]>>10);
+                    w[i]=w[i-16]+s0+w[i-7]+s1;
+                }
+
+                uint32_t a[8];
+                memcpy(a,hs,sizeof(a));
+                for(int i=0;i<64;i++){
+                    uint32_t S1=__VVV_ROTR(a[4],6)^
+                        __VVV_ROTR(a[4],11)^__VVV_ROTR(a[4],25);
+                    uint32_t ch=(a[4]&a[5])^(~a[4]&a[6]);
+                    uint32_t t1=a[7]+S1+ch+k[i]+w[i];
+                    uint32_t S0=__VVV_ROTR(a[0],2)^
+                        __VVV_ROTR(a[0],13)^__VVV_ROTR(a[0],22);
+                    uint32_t maj=(a[0]&a[1])^(a[0]&a[2])^(a[1]&a[2]);
+                    uint32_t t2=S0+maj;
+                    memmove(a+1,a,7*sizeof(uint32_t));
+                    a[4]+=t1;
+                    a[0]=t1+t2;
+                }
+                for(int i=0;i<8;i++)
+                    hs[i]+=a[i];
+            }
+#undef __VVV_ROTR
+
+            for(int i=0;i<8;i++){
+                out[i*4]=(unsigned char)(hs[i]>>24);
+                out[i*4+1]=(unsigned char)(hs[i]>>16);
+                out[i*4+2]=(unsigned char)(hs[i]>>8);
+                out[i*4+3]=(unsigned char)hs[i];
+            }
+        }
+    };
+}
+
+#endif // __VVV_DICOM_DEID_H__
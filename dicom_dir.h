@@ -0,0 +1,487 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_dir.h
+///
+/// @brief  read DICOMDIR of DICOM media
+///
+
+#ifndef __VVV_DICOM_DIR_H__
+
+#define __VVV_DICOM_DIR_H__
+
+#include "dicom.h"
+#include "dicom_series.h"
+
+#include <sys/stat.h>
+
+#include <fstream>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+namespace VVV
+{
+    ///
+    /// reading DICOMDIR class
+    ///
+    /// Directory Record Sequence (0004,1220) is walked with the record
+    /// offsets (0004,1200, 0004,1400 and 0004,1420) to build the
+    /// patient - study - series - image hierarchy. Referenced files are
+    /// not opened. Records are taken in stored order by their types
+    /// when the offsets are broken.
+    ///
+    class DicomDir
+    {
+    public:
+        ///
+        /// a directory record
+        ///
+        struct Record
+        {
+            std::string type;     ///< Directory Record Type (e.g. SERIES)
+            std::string file_id;  ///< Referenced File ID with '/'
+            std::string sop_class_uid;       ///< (0004,1510)
+            std::string sop_instance_uid;    ///< (0004,1511)
+            std::string transfer_syntax_uid; ///< (0004,1512)
+
+            ///
+            /// values of the other elements as stored text, keyed
+            /// by (group<<16)|id
+            ///
+            std::map<uint32_t,std::string> attributes;
+
+            std::vector<Record> children;  ///< lower level records
+
+            ///
+            /// a reader accessor
+            ///
+            /// @param group DICOM element tag group ID
+            /// @param id   DICOM element tag ID
+            ///
+            /// @return value without padding, or empty string
+            ///
+            std::string attribute(uint16_t group,uint16_t id) const
+            {
+                std::map<uint32_t,std::string>::const_iterator itr=
+                    this->attributes.find(((uint32_t)group<<16)|id);
+
+                return (itr==this->attributes.end()) ?
+                    std::string() : itr->second;
+            }
+        };
+
+        ///
+        /// constructor with parse
+        ///
+        /// @param path path of DICOMDIR file
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError
+        ///
+        DicomDir(const std::string &path)
+        {
+            this->parse(path);
+        }
+
+        ///
+        /// parse DICOMDIR file
+        ///
+        /// @param path path of DICOMDIR file
+        ///
+        /// @return self
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError
+        ///
+        DicomDir &parse(const std::string &path)
+        {
+            size_t slash=path.find_last_of('/');
+            this->_base=(slash==std::string::npos) ?
+                std::string() : path.substr(0,slash+1);
+            this->_roots.clear();
+
+            std::ifstream ifs(path.c_str(),std::ios::binary);
+            if(!ifs)
+                throw Dicom::StreamError("Could not open DICOMDIR");
+            this->_data.assign(std::istreambuf_iterator<char>(ifs),
+                               std::istreambuf_iterator<char>());
+            if(this->_data.size()<132 ||
+               memcmp(&this->_data[128],"DICM",4)!=0)
+                throw Dicom::ParseError("not DICOM format");
+
+            uint16_t endian_test=1;
+            bool host_le=(*(char *)&endian_test)!=0;
+            this->_explicit=true;
+            this->_swap=!host_le;
+
+            //
+            // top level elements; File Meta Information (group 0x0002)
+            // gives transfer syntax of the others
+            //
+            uint32_t first=0;
+            const unsigned char *seq=NULL;
+            size_t seq_len=0;
+            size_t off=132;
+            while(off<this->_data.size()){
+                Dicom::ElementHeader h;
+                const unsigned char *p=&this->_data[off];
+                bool meta_group=(this->_data.size()-off>=2 &&
+                                 _u16(p,!host_le)==Dicom::TAG_GROUP_META);
+                if(!Dicom::parse_header(p,this->_data.size()-off,
+                                        meta_group ? !host_le : this->_swap,
+                                        meta_group ? true : this->_explicit,
+                                        h))
+                    break;
+                off+=h.header_size;
+                if(meta_group && h.tag.id[1]==0x0010 &&
+                   h.length<=this->_data.size()-off){
+                    std::string ts=_trim(std::string(
+                                             (const char *)&this->_data[off],
+                                             h.length));
+                    this->_explicit=(ts!="1.2.840.10008.1.2");
+                    this->_swap=(ts=="1.2.840.10008.1.2.2") ?
+                        host_le : !host_le;
+                }
+
+                size_t len;
+                if(h.is_undefined())
+                    len=Dicom::undefined_value_size(&this->_data[off],
+                                                    this->_data.size()-off,
+                                                    this->_swap,
+                                                    this->_explicit);
+                else if(h.length>this->_data.size()-off)
+                    throw Dicom::ParseError("Broken DICOMDIR");
+                else
+                    len=h.length;
+
+                if(h.tag.id[0]==Dicom::TAG_GROUP_DIRECTORY){
+                    if(h.tag.id[1]==0x1200 && len>=4)
+                        first=_u32(&this->_data[off],this->_swap);
+                    else if(h.tag.id[1]==0x1220){
+                        seq=&this->_data[off];
+                        seq_len=len;
+                    }
+                }
+                off+=len;
+            }
+            if(!seq)
+                throw Dicom::MissingTagError(
+                    "Could not found Directory Record Sequence");
+
+            //
+            // records keyed by offset of their Item tag
+            //
+            std::vector<std::pair<size_t,size_t> > items;
+            Dicom::scan_sequence(seq,seq_len,this->_swap,this->_explicit,
+                                 items);
+
+            std::map<uint32_t,size_t> by_offset;
+            std::vector<_Raw> raws(items.size());
+            for(size_t i=0;i<items.size();i++){
+                const unsigned char *p=seq+items[i].first;
+                uint32_t at=(uint32_t)(p-8-&this->_data[0]);
+                by_offset[at]=i;
+                this->_read_record(p,items[i].second,raws[i]);
+            }
+
+            std::set<uint32_t> visited;
+            if(first && by_offset.count(first) &&
+               this->_link(first,by_offset,raws,visited,this->_roots))
+                return *this;
+
+            // broken offsets
+            this->_roots.clear();
+            this->_by_order(raws);
+
+            return *this;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return root records (usually PATIENT)
+        ///
+        const std::vector<Record> &patients() const { return this->_roots; }
+
+        ///
+        /// all series records
+        ///
+        /// @return pointers to SERIES records
+        ///
+        std::vector<const Record *> series() const
+        {
+            std::vector<const Record *> r;
+            _collect(this->_roots,"SERIES",r);
+
+            return r;
+        }
+
+        ///
+        /// path of a referenced file
+        ///
+        /// @param r record
+        ///
+        /// @return path relative to DICOMDIR location, or empty
+        ///
+        /// Lower case path is tried when the stored one is missing.
+        ///
+        std::string path_of(const Record &r) const
+        {
+            if(r.file_id.empty())
+                return std::string();
+
+            std::string p=this->_base+r.file_id;
+            struct stat st;
+            if(stat(p.c_str(),&st)==0)
+                return p;
+
+            std::string lower=r.file_id;
+            std::transform(lower.begin(),lower.end(),lower.begin(),
+                           ::tolower);
+            std::string q=this->_base+lower;
+            if(stat(q.c_str(),&st)==0)
+                return q;
+
+            return p;
+        }
+
+        ///
+        /// files of a series
+        ///
+        /// @param series SERIES record
+        ///
+        /// @return paths in order of Instance Number
+        ///
+        std::vector<std::string> files(const Record &series) const
+        {
+            std::vector<std::pair<long,size_t> > order;
+            for(size_t i=0;i<series.children.size();i++){
+                const Record &c=series.children[i];
+                if(c.file_id.empty())
+                    continue;
+                std::string n=c.attribute(0x0020,0x0013);
+                long number=n.empty() ? (long)i : strtol(n.c_str(),NULL,10);
+                order.push_back(std::make_pair(number,i));
+            }
+            std::stable_sort(order.begin(),order.end());
+
+            std::vector<std::string> r;
+            for(size_t i=0;i<order.size();i++)
+                r.push_back(this->path_of(series.children[order[i].second]));
+
+            return r;
+        }
+
+        ///
+        /// load a series in parallel
+        ///
+        /// @param pool thread pool
+        /// @param series SERIES record
+        /// @param dst parsed objects in order of Instance Number
+        /// @param parse_all parse with image or only summary
+        ///
+        void load(ThreadPool &pool,
+                  const Record &series,
+                  std::vector<Dicom> &dst,
+                  bool parse_all=true) const
+        {
+            SeriesLoader::load(pool,this->files(series),dst,parse_all);
+        }
+
+    private:
+        std::string _base;
+        std::vector<unsigned char> _data;
+        bool _swap;
+        bool _explicit;
+        std::vector<Record> _roots;
+
+        //
+        // a record with its offsets
+        //
+        struct _Raw
+        {
+            Record record;
+            uint32_t next;
+            uint32_t lower;
+            bool in_use;
+        };
+
+        static uint16_t _u16(const unsigned char *p,bool swap)
+        {
+            uint16_t v;
+            memcpy(&v,p,2);
+
+            return swap ? bswap_16(v) : v;
+        }
+
+        static uint32_t _u32(const unsigned char *p,bool swap)
+        {
+            uint32_t v;
+            memcpy(&v,p,4);
+
+            return swap ? bswap_32(v) : v;
+        }
+
+        static std::string _trim(const std::string &s)
+        {
+            size_t end=s.find_last_not_of(std::string(" \0",2));
+            size_t begin=s.find_first_not_of(' ');
+            if(end==std::string::npos || begin>end)
+                return std::string();
+
+            return s.substr(begin,end-begin+1);
+        }
+
+        void _read_record(const unsigned char *p,size_t len,_Raw &raw)
+        {
+            raw.next=0;
+            raw.lower=0;
+            raw.in_use=true;
+
+            size_t off=0;
+            while(off<len){
+                Dicom::ElementHeader h;
+                if(!Dicom::parse_header(p+off,len-off,
+                                        this->_swap,this->_explicit,h))
+                    throw Dicom::ParseError("Broken directory record");
+                off+=h.header_size;
+
+                size_t vlen=h.is_undefined() ?
+                    Dicom::undefined_value_size(p+off,len-off,
+                                                this->_swap,
+                                                this->_explicit) :
+                    (size_t)h.length;
+                if(vlen>len-off)
+                    throw Dicom::ParseError("Broken directory record");
+
+                const unsigned char *v=p+off;
+                off+=vlen;
+
+                uint32_t key=((uint32_t)h.tag.id[0]<<16)|h.tag.id[1];
+                switch(key){
+                case 0x00041400:
+                    if(vlen>=4)
+                        raw.next=_u32(v,this->_swap);
+                    continue;
+                case 0x00041410:
+                    if(vlen>=2)
+                        raw.in_use=(_u16(v,this->_swap)!=0);
+                    continue;
+                case 0x00041420:
+                    if(vlen>=4)
+                        raw.lower=_u32(v,this->_swap);
+                    continue;
+                }
+
+                // sequences and long values are not kept
+                if(h.is_undefined() || h.vr.number==0x5351 || vlen>1024)
+                    continue;
+
+                std::string s=_trim(std::string((const char *)v,vlen));
+                switch(key){
+                case 0x00041430:
+                    raw.record.type=s;
+                    break;
+                case 0x00041500:
+                    std::replace(s.begin(),s.end(),'\\','/');
+                    raw.record.file_id=s;
+                    break;
+                case 0x00041510:
+                    raw.record.sop_class_uid=s;
+                    break;
+                case 0x00041511:
+                    raw.record.sop_instance_uid=s;
+                    break;
+                case 0x00041512:
+                    raw.record.transfer_syntax_uid=s;
+                    break;
+                default:
+                    raw.record.attributes[key]=s;
+                    break;
+                }
+            }
+        }
+
+        //
+        // follow next/lower offsets; false when an offset is broken
+        //
+        bool _link(uint32_t at,
+                   const std::map<uint32_t,size_t> &by_offset,
+                   std::vector<_Raw> &raws,
+                   std::set<uint32_t> &visited,
+                   std::vector<Record> &dst)
+        {
+            while(at){
+                std::map<uint32_t,size_t>::const_iterator itr=
+                    by_offset.find(at);
+                if(itr==by_offset.end() || !visited.insert(at).second)
+                    return false;
+
+                _Raw &raw=raws[itr->second];
+                if(raw.in_use){
+                    dst.push_back(raw.record);
+                    if(raw.lower &&
+                       !this->_link(raw.lower,by_offset,raws,visited,
+                                    dst.back().children))
+                        return false;
+                }
+                at=raw.next;
+            }
+
+            return true;
+        }
+
+        //
+        // hierarchy by record types in stored order
+        //
+        static int _level(const std::string &type)
+        {
+            if(type=="PATIENT")
+                return 0;
+            if(type=="STUDY")
+                return 1;
+            if(type=="SERIES")
+                return 2;
+
+            return 3;
+        }
+
+        void _by_order(std::vector<_Raw> &raws)
+        {
+            Record *parents[3]={NULL,NULL,NULL};
+            for(size_t i=0;i<raws.size();i++){
+                if(!raws[i].in_use)
+                    continue;
+
+                int level=_level(raws[i].record.type);
+                std::vector<Record> *dst=&this->_roots;
+                for(int l=level-1;l>=0;l--){
+                    if(parents[l]){
+                        dst=&parents[l]->children;
+                        break;
+                    }
+                }
+                dst->push_back(raws[i].record);
+                if(level<3){
+                    parents[level]=&dst->back();
+                    for(int l=level+1;l<3;l++)
+                        parents[l]=NULL;
+                }
+            }
+        }
+
+        static void _collect(const std::vector<Record> &records,
+                             const char *type,
+                             std::vector<const Record *> &dst)
+        {
+            for(size_t i=0;i<records.size();i++){
+                if(records[i].type==type)
+                    dst.push_back(&records[i]);
+                _collect(records[i].children,type,dst);
+            }
+        }
+    };
+}
+
+#endif // __VVV_DICOM_DIR_H__
@@ -0,0 +1,535 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_mpr.h
+///
+/// @brief  multi-planar reformatting of series volumes (POSIX)
+///
+
+#ifndef __VVV_DICOM_MPR_H__
+
+#define __VVV_DICOM_MPR_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+#include "dicom_series.h"
+#include "dicom_volume.h"
+
+#include <cmath>
+
+#include <vector>
+#include <algorithm>
+
+namespace VVV
+{
+    ///
+    /// reslicing of a volume along arbitrary planes
+    ///
+    /// Voxels are held as float in bricks of 8x8x8, so that the
+    /// voxels around a plane of any direction are in a few cache
+    /// lines. A plane is sampled by trilinear interpolation in tiles
+    /// of output pixels spread over the threads of a pool, and thick
+    /// slabs are projected by maximum, minimum or average of samples
+    /// along the plane normal.
+    ///
+    /// Coordinates are in mm of the patient coordinate system as
+    /// Image Position (Patient). Methods of a constructed object may
+    /// be called from threads at the same time.
+    ///
+    ///     Reslicer mpr(pool,series);
+    ///     Reslicer::Plane p=mpr.plane(Reslicer::AXIS_Y,mpr.info().rows/2);
+    ///     cv::Mat coronal,mip;
+    ///     mpr.reslice(p,coronal,-1024.0f);
+    ///     mpr.slab(p,20.0,Reslicer::SLAB_MIP,mip,-1024.0f);
+    ///
+    class Reslicer
+    {
+    public:
+        ///
+        /// axes of a volume
+        ///
+        enum {
+            AXIS_X=0,   ///< along a row; sagittal of axial series
+            AXIS_Y,     ///< along a column; coronal of axial series
+            AXIS_Z      ///< along the slice normal; axial of axial series
+        };
+
+        ///
+        /// projections of a slab
+        ///
+        enum {
+            SLAB_MIP=0, ///< maximum intensity projection
+            SLAB_MINIP, ///< minimum intensity projection
+            SLAB_AVERAGE ///< average
+        };
+
+        ///
+        /// output plane
+        ///
+        struct Plane
+        {
+            double origin[3];   ///< position of the top left pixel
+            double row[3];      ///< unit direction along a row
+            double col[3];      ///< unit direction along a column
+            double spacing[2];  ///< mm between columns, between rows
+            int cols;
+            int rows;
+        };
+
+        ///
+        /// constructor; a series is loaded into the volume
+        ///
+        /// @param pool thread pool
+        /// @param series parsed objects of a series in any order;
+        ///        images are decoded when not parsed yet
+        /// @param pixels Volume::PIXELS_STORED, PIXELS_RESCALED or
+        ///        PIXELS_WINDOWED
+        ///
+        /// Slices are ordered as SeriesLoader::order() and placed by
+        /// Volume::geometry(), so they are assumed to be parallel and
+        /// evenly spaced.
+        ///
+        /// throw std::invalid_argument when slices differ in size or
+        ///       are color, Dicom::ParseError, std::runtime_error
+        ///
+        Reslicer(ThreadPool &pool,
+                 std::vector<Dicom> &series,
+                 int pixels=Volume::PIXELS_RESCALED)
+            :_pool(pool)
+        {
+            if(series.empty())
+                throw std::invalid_argument("Empty series");
+
+            std::vector<size_t> order=SeriesLoader::order(series);
+            Volume::geometry(series,order,this->_info);
+            this->_info.pixels=pixels;
+            this->_info.center=0.0f;
+            this->_info.width=0.0f;
+
+            // first slice of each object
+            std::vector<int> first(order.size()+1,0);
+            for(size_t i=0;i<order.size();i++)
+                first[i+1]=first[i]+std::max(1,series[order[i]].frames());
+
+            this->_info.cols=series[order[0]].cols();
+            this->_info.rows=series[order[0]].rows();
+            this->_info.slices=first[order.size()];
+            this->_allocate();
+
+            pool.parallel_for(0,order.size(),[&](size_t i){
+                    Dicom &d=series[order[i]];
+                    for(int f=first[i];f<first[i+1];f++)
+                        this->_store(f,Volume::slice_pixels(d,f-first[i],
+                                                            pixels,
+                                                            0.0f,0.0f));
+                });
+        }
+
+        ///
+        /// constructor; a saved volume is copied into the volume
+        ///
+        /// @param pool thread pool
+        /// @param volume mapped volume
+        ///
+        /// throw std::invalid_argument when the volume is color or empty
+        ///
+        Reslicer(ThreadPool &pool,const Volume &volume)
+            :_pool(pool),
+             _info(volume.info())
+        {
+            if(this->_info.slices<=0)
+                throw std::invalid_argument("Empty series");
+
+            this->_allocate();
+            pool.parallel_for(0,this->_info.slices,[&](size_t k){
+                    this->_store((int)k,volume.slice((int)k));
+                });
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return geometry of the volume; type is CV_32F
+        ///
+        const Volume::Info &info() const { return this->_info; }
+
+        ///
+        /// plane of voxels perpendicular to an axis
+        ///
+        /// @param axis AXIS_X, AXIS_Y or AXIS_Z
+        /// @param index voxel index along the axis
+        ///
+        /// @return plane at the voxel centers; for AXIS_X and AXIS_Y,
+        ///         the last slice is at the top
+        ///
+        /// throw std::invalid_argument
+        ///
+        Plane plane(int axis,int index) const
+        {
+            const Volume::Info &v=this->_info;
+            const double *r=v.direction;
+            const double *c=v.direction+3;
+            const double *n=v.direction+6;
+
+            Plane p;
+            double top=(v.slices-1)*v.spacing[2];
+            for(int i=0;i<3;i++){
+                switch(axis){
+                case AXIS_X:
+                    p.origin[i]=v.origin[i]+index*v.spacing[0]*r[i]+top*n[i];
+                    p.row[i]=c[i];
+                    p.col[i]=-n[i];
+                    break;
+                case AXIS_Y:
+                    p.origin[i]=v.origin[i]+index*v.spacing[1]*c[i]+top*n[i];
+                    p.row[i]=r[i];
+                    p.col[i]=-n[i];
+                    break;
+                case AXIS_Z:
+                    p.origin[i]=v.origin[i]+index*v.spacing[2]*n[i];
+                    p.row[i]=r[i];
+                    p.col[i]=c[i];
+                    break;
+                default:
+                    throw std::invalid_argument("Bad axis");
+                }
+            }
+
+            switch(axis){
+            case AXIS_X:
+                p.spacing[0]=v.spacing[1];
+                p.spacing[1]=v.spacing[2];
+                p.cols=v.rows;
+                p.rows=v.slices;
+                break;
+            case AXIS_Y:
+                p.spacing[0]=v.spacing[0];
+                p.spacing[1]=v.spacing[2];
+                p.cols=v.cols;
+                p.rows=v.slices;
+                break;
+            default:
+                p.spacing[0]=v.spacing[0];
+                p.spacing[1]=v.spacing[1];
+                p.cols=v.cols;
+                p.rows=v.rows;
+                break;
+            }
+
+            return p;
+        }
+
+        ///
+        /// sample a plane
+        ///
+        /// @param plane output plane
+        /// @param dst plane.rows x plane.cols CV_32F image
+        /// @param background value of pixels outside the volume
+        ///
+        /// throw std::invalid_argument
+        ///
+        void reslice(const Plane &plane,cv::Mat &dst,float background=0.0f)
+        {
+            this->slab(plane,0.0,SLAB_AVERAGE,dst,background);
+        }
+
+        ///
+        /// project a slab centered on a plane
+        ///
+        /// @param plane center plane of the slab
+        /// @param thickness mm along the normal (row x col); a plane
+        ///        is sampled when 0
+        /// @param mode SLAB_MIP, SLAB_MINIP or SLAB_AVERAGE
+        /// @param dst plane.rows x plane.cols CV_32F image
+        /// @param background value of pixels whose samples are all
+        ///        outside the volume
+        ///
+        /// The slab is sampled at the smallest voxel spacing; samples
+        /// outside the volume are not projected.
+        ///
+        /// throw std::invalid_argument
+        ///
+        void slab(const Plane &plane,
+                  double thickness,
+                  int mode,
+                  cv::Mat &dst,
+                  float background=0.0f)
+        {
+            if(plane.rows<=0 || plane.cols<=0)
+                throw std::invalid_argument("Bad plane size");
+            if(mode<SLAB_MIP || mode>SLAB_AVERAGE)
+                throw std::invalid_argument("Bad slab mode");
+            if(!(thickness>=0.0))
+                throw std::invalid_argument("Bad slab thickness");
+
+            const Volume::Info &v=this->_info;
+            double normal[3]={
+                plane.row[1]*plane.col[2]-plane.row[2]*plane.col[1],
+                plane.row[2]*plane.col[0]-plane.row[0]*plane.col[2],
+                plane.row[0]*plane.col[1]-plane.row[1]*plane.col[0]
+            };
+            double step=std::min(v.spacing[0],
+                                 std::min(v.spacing[1],v.spacing[2]));
+            int samples=std::max(1,(int)std::ceil(thickness/step-1e-6));
+
+            // steps and origin in voxel index space
+            _Steps s;
+            double d[3];
+            for(int i=0;i<3;i++)
+                d[i]=plane.row[i]*plane.spacing[0];
+            this->_to_index(d,s.u,false);
+            for(int i=0;i<3;i++)
+                d[i]=plane.col[i]*plane.spacing[1];
+            this->_to_index(d,s.v,false);
+            for(int i=0;i<3;i++)
+                d[i]=normal[i]*thickness/samples;
+            this->_to_index(d,s.t,false);
+            for(int i=0;i<3;i++)
+                d[i]=plane.origin[i]-normal[i]*thickness*(samples-1)/
+                    (2.0*samples);
+            this->_to_index(d,s.o,true);
+
+            dst.create(plane.rows,plane.cols,CV_32F);
+            int tiles_x=(plane.cols+_TILE-1)/_TILE;
+            int tiles_y=(plane.rows+_TILE-1)/_TILE;
+            this->_pool.parallel_for(0,(size_t)tiles_x*tiles_y,[&](size_t i){
+                    int tx=(int)(i%tiles_x)*_TILE;
+                    int ty=(int)(i/tiles_x)*_TILE;
+                    this->_tile(s,samples,mode,background,
+                                tx,ty,
+                                std::min((int)_TILE,plane.cols-tx),
+                                std::min((int)_TILE,plane.rows-ty),
+                                dst);
+                });
+        }
+
+    private:
+        enum {
+            _BRICK=8,   // voxels along an edge of a brick
+            _TILE=32    // output pixels along an edge of a tile
+        };
+
+        //
+        // voxel index of the first sample and its steps
+        //
+        struct _Steps
+        {
+            double o[3];
+            double u[3];
+            double v[3];
+            double t[3];
+        };
+
+        ThreadPool &_pool;
+        Volume::Info _info;
+        double _inverse[9];         // patient mm to voxel index
+        std::vector<float> _voxels; // bricks in x, y, z order
+        std::vector<size_t> _x_offset; // offsets of a voxel index; the
+        std::vector<size_t> _y_offset; // one past the last repeats the
+        std::vector<size_t> _z_offset; // last for interpolation
+
+        Reslicer(const Reslicer &);
+        Reslicer &operator=(const Reslicer &);
+
+        void _allocate()
+        {
+            Volume::Info &v=this->_info;
+            if(v.cols<=0 || v.rows<=0)
+                throw std::invalid_argument("Empty series");
+            v.type=CV_32F;
+
+            size_t bx=(v.cols+_BRICK-1)/_BRICK;
+            size_t by=(v.rows+_BRICK-1)/_BRICK;
+            size_t bz=(v.slices+_BRICK-1)/_BRICK;
+            size_t brick=_BRICK*_BRICK*_BRICK;
+            this->_voxels.assign(bx*by*bz*brick,0.0f);
+
+            _offsets(this->_x_offset,v.cols,brick,1);
+            _offsets(this->_y_offset,v.rows,bx*brick,_BRICK);
+            _offsets(this->_z_offset,v.slices,bx*by*brick,_BRICK*_BRICK);
+
+            // columns of index to mm; row, column and slice steps
+            double m[9];
+            for(int i=0;i<3;i++){
+                m[i*3]=v.direction[i]*v.spacing[0];
+                m[i*3+1]=v.direction[3+i]*v.spacing[1];
+                m[i*3+2]=v.direction[6+i]*v.spacing[2];
+            }
+            double det=
+                m[0]*(m[4]*m[8]-m[5]*m[7])-
+                m[1]*(m[3]*m[8]-m[5]*m[6])+
+                m[2]*(m[3]*m[7]-m[4]*m[6]);
+            if(std::fabs(det)<1e-12)
+                throw std::invalid_argument("Degenerate volume geometry");
+
+            double *a=this->_inverse;
+            a[0]=(m[4]*m[8]-m[5]*m[7])/det;
+            a[1]=(m[2]*m[7]-m[1]*m[8])/det;
+            a[2]=(m[1]*m[5]-m[2]*m[4])/det;
+            a[3]=(m[5]*m[6]-m[3]*m[8])/det;
+            a[4]=(m[0]*m[8]-m[2]*m[6])/det;
+            a[5]=(m[2]*m[3]-m[0]*m[5])/det;
+            a[6]=(m[3]*m[7]-m[4]*m[6])/det;
+            a[7]=(m[1]*m[6]-m[0]*m[7])/det;
+            a[8]=(m[0]*m[4]-m[1]*m[3])/det;
+        }
+
+        static void _offsets(std::vector<size_t> &dst,
+                             int n,
+                             size_t brick_step,
+                             size_t voxel_step)
+        {
+            dst.resize(n+1);
+            for(int i=0;i<n;i++)
+                dst[i]=(i/_BRICK)*brick_step+(i%_BRICK)*voxel_step;
+            dst[n]=dst[n-1];
+        }
+
+        //
+        // position (or direction) in mm to voxel index
+        //
+        void _to_index(const double *p,double *dst,bool position) const
+        {
+            double d[3];
+            for(int i=0;i<3;i++)
+                d[i]=position ? p[i]-this->_info.origin[i] : p[i];
+
+            const double *a=this->_inverse;
+            for(int i=0;i<3;i++)
+                dst[i]=a[i*3]*d[0]+a[i*3+1]*d[1]+a[i*3+2]*d[2];
+        }
+
+        //
+        // slice k into the bricks
+        //
+        void _store(int k,const cv::Mat &slice)
+        {
+            const Volume::Info &v=this->_info;
+            if(slice.channels()!=1)
+                throw std::invalid_argument(
+                    "Color volume has not been supported");
+            if(slice.rows!=v.rows || slice.cols!=v.cols)
+                throw std::invalid_argument("Slices differ in size or type");
+
+            cv::Mat f;
+            slice.convertTo(f,CV_32F);
+            float *dst=&this->_voxels[0]+this->_z_offset[k];
+            for(int y=0;y<v.rows;y++){
+                const float *src=f.ptr<float>(y);
+                float *row=dst+this->_y_offset[y];
+                for(int x=0;x<v.cols;x++)
+                    row[this->_x_offset[x]]=src[x];
+            }
+        }
+
+        //
+        // project samples of a tile
+        //
+        void _tile(const _Steps &s,
+                   int samples,
+                   int mode,
+                   float background,
+                   int tx,
+                   int ty,
+                   int w,
+                   int h,
+                   cv::Mat &dst) const
+        {
+            const float *vox=&this->_voxels[0];
+            const size_t *xo=&this->_x_offset[0];
+            const size_t *yo=&this->_y_offset[0];
+            const size_t *zo=&this->_z_offset[0];
+            const float mx=(float)(this->_info.cols-1);
+            const float my=(float)(this->_info.rows-1);
+            const float mz=(float)(this->_info.slices-1);
+            const float eps=1e-3f;
+
+            float acc[_TILE*_TILE];
+            int count[_TILE*_TILE];
+            std::fill(acc,acc+_TILE*_TILE,0.0f);
+            std::fill(count,count+_TILE*_TILE,0);
+
+            float fx[_TILE],fy[_TILE],fz[_TILE];
+            float wx[_TILE],wy[_TILE],wz[_TILE];
+            int ix[_TILE],iy[_TILE],iz[_TILE];
+            unsigned char in[_TILE];
+
+            for(int t=0;t<samples;t++){
+                for(int y=0;y<h;y++){
+                    double b[3];
+                    for(int i=0;i<3;i++)
+                        b[i]=s.o[i]+s.t[i]*t+s.v[i]*(ty+y)+s.u[i]*tx;
+                    float ux=(float)s.u[0],uy=(float)s.u[1],uz=(float)s.u[2];
+
+                    // coordinates and weights; vectorizable
+                    for(int x=0;x<w;x++){
+                        fx[x]=(float)b[0]+ux*x;
+                        fy[x]=(float)b[1]+uy*x;
+                        fz[x]=(float)b[2]+uz*x;
+                    }
+                    for(int x=0;x<w;x++){
+                        // planes on voxel centers are inside
+                        in[x]=(fx[x]>=-eps) & (fx[x]<=mx+eps) &
+                            (fy[x]>=-eps) & (fy[x]<=my+eps) &
+                            (fz[x]>=-eps) & (fz[x]<=mz+eps);
+                        float cx=std::min(std::max(fx[x],0.0f),mx);
+                        float cy=std::min(std::max(fy[x],0.0f),my);
+                        float cz=std::min(std::max(fz[x],0.0f),mz);
+                        ix[x]=(int)cx;
+                        iy[x]=(int)cy;
+                        iz[x]=(int)cz;
+                        wx[x]=cx-ix[x];
+                        wy[x]=cy-iy[x];
+                        wz[x]=cz-iz[x];
+                    }
+
+                    float *a=acc+y*_TILE;
+                    int *c=count+y*_TILE;
+                    for(int x=0;x<w;x++){
+                        if(!in[x])
+                            continue;
+
+                        size_t x0=xo[ix[x]],x1=xo[ix[x]+1];
+                        size_t y0=yo[iy[x]],y1=yo[iy[x]+1];
+                        const float *z0=vox+zo[iz[x]];
+                        const float *z1=vox+zo[iz[x]+1];
+
+                        float v00=z0[x0+y0]+(z0[x1+y0]-z0[x0+y0])*wx[x];
+                        float v01=z0[x0+y1]+(z0[x1+y1]-z0[x0+y1])*wx[x];
+                        float v10=z1[x0+y0]+(z1[x1+y0]-z1[x0+y0])*wx[x];
+                        float v11=z1[x0+y1]+(z1[x1+y1]-z1[x0+y1])*wx[x];
+                        float v0=v00+(v01-v00)*wy[x];
+                        float v1=v10+(v11-v10)*wy[x];
+                        float val=v0+(v1-v0)*wz[x];
+
+                        if(!c[x])
+                            a[x]=val;
+                        else if(mode==SLAB_MIP)
+                            a[x]=std::max(a[x],val);
+                        else if(mode==SLAB_MINIP)
+                            a[x]=std::min(a[x],val);
+                        else
+                            a[x]+=val;
+                        c[x]++;
+                    }
+                }
+            }
+
+            for(int y=0;y<h;y++){
+                float *row=dst.ptr<float>(ty+y)+tx;
+                const float *a=acc+y*_TILE;
+                const int *c=count+y*_TILE;
+                for(int x=0;x<w;x++){
+                    if(!c[x])
+                        row[x]=background;
+                    else if(mode==SLAB_AVERAGE)
+                        row[x]=a[x]/c[x];
+                    else
+                        row[x]=a[x];
+                }
+            }
+        }
+    };
+}
+
+#endif // __VVV_DICOM_MPR_H__
@@ -0,0 +1,565 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_packed.h
+///
+/// @brief  losslessly compressed images decoded on access
+///
+
+#ifndef __VVV_DICOM_PACKED_H__
+
+#define __VVV_DICOM_PACKED_H__
+
+#include "dicom.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace VVV
+{
+    ///
+    /// decoded image kept losslessly compressed in memory
+    ///
+    /// Each frame is compressed separately: every sample is replaced
+    /// by its difference from the left sample of the same channel (the
+    /// upper one at the row head), the differences are zigzag mapped
+    /// to small unsigned values, their bytes are shuffled into planes
+    /// of low and high bytes and the planes are compressed with an
+    /// LZ77 coder. Noise of CT and MR mostly stays in the low bytes,
+    /// so 16-bit images shrink by a ratio depending on the data
+    /// (about 1.9 on synthetic CT). Frames which do not shrink are
+    /// stored as shuffled differences.
+    ///
+    /// Any depth and number of channels is accepted; floating point
+    /// samples are coded by their bit patterns, which shrink little.
+    ///
+    class PackedImage
+    {
+    public:
+        ///
+        /// default constructor; an empty image
+        ///
+        PackedImage()
+            :_type(0),
+             _frame_rows(0),
+             _frame_cols(0)
+        {}
+
+        ///
+        /// constructor
+        ///
+        /// @param image image to compress; 2 or 3 dimensional
+        /// @param frame_rows rows of a frame of 2D image; frames are
+        ///        stacked vertically as Dicom::image(). The whole
+        ///        image is a frame when 0. Planes of 3D image are
+        ///        frames.
+        ///
+        /// throw std::invalid_argument
+        ///
+        PackedImage(const cv::Mat &image,int frame_rows=0)
+        {
+            this->_init(image,frame_rows);
+        }
+
+        ///
+        /// constructor from a parsed object
+        ///
+        /// @param d parsed object
+        /// @param need_rescale rescale or not
+        ///
+        /// Frames of d.image(need_rescale) are compressed separately.
+        ///
+        PackedImage(Dicom &d,bool need_rescale=true)
+        {
+            cv::Mat image=d.image(need_rescale);
+            this->_init(image,d.frames()>1 ? d.rows() : 0);
+        }
+
+        ///
+        /// query method that the image is empty or not
+        ///
+        /// @return true or false
+        ///
+        bool empty() const { return this->_offsets.size()<2; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return number of frames
+        ///
+        int frames() const
+        {
+            return this->empty() ? 0 : (int)this->_offsets.size()-1;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return OpenCV type of the image
+        ///
+        int type() const { return this->_type; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return bytes of compressed data
+        ///
+        uint64_t bytes() const { return this->_data.size(); }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return bytes of the decoded image
+        ///
+        uint64_t raw_bytes() const
+        {
+            uint64_t n=CV_ELEM_SIZE(this->_type);
+            for(size_t i=0;i<this->_sizes.size();i++)
+                n*=this->_sizes[i];
+
+            return this->empty() ? 0 : n;
+        }
+
+        ///
+        /// decode the whole image
+        ///
+        /// @return newly allocated image of the original shape and type
+        ///
+        cv::Mat image() const
+        {
+            cv::Mat dst=this->_create();
+            for(int i=0;i<this->frames();i++)
+                this->_decode(i,this->_frame_ptr(dst,i));
+
+            return dst;
+        }
+
+        ///
+        /// decode the whole image in parallel
+        ///
+        /// @param pool thread pool which has parallel_for() such as
+        ///        ThreadPool of dicom_pool.h
+        ///
+        /// @return decoded image as image()
+        ///
+        template <class Pool>
+        cv::Mat image_parallel(Pool &pool) const
+        {
+            cv::Mat dst=this->_create();
+            pool.parallel_for(0,(size_t)this->frames(),[&](size_t i){
+                    this->_decode((int)i,this->_frame_ptr(dst,(int)i));
+                });
+
+            return dst;
+        }
+
+        ///
+        /// decode a frame
+        ///
+        /// @param index frame index
+        ///
+        /// @return 2D image of the frame
+        ///
+        /// throw std::out_of_range
+        ///
+        cv::Mat frame(int index) const
+        {
+            if(index<0 || index>=this->frames())
+                throw std::out_of_range("Bad frame index");
+
+            cv::Mat dst(this->_rows_of(index),
+                        this->_frame_cols,
+                        this->_type);
+            this->_decode(index,dst.data);
+
+            return dst;
+        }
+
+    private:
+        enum {
+            _MIN_MATCH=4,
+            _HASH_BITS=14,
+            _MAX_OFFSET=65535,
+            _SLACK=16           // bytes of wild copies past the end
+        };
+
+        int _type;
+        std::vector<int> _sizes;
+        int _frame_rows;
+        int _frame_cols;
+        std::vector<unsigned char> _data;
+        std::vector<uint64_t> _offsets;      // frames+1
+        std::vector<unsigned char> _stored;  // frame is not LZ coded
+
+        void _init(const cv::Mat &image,int frame_rows)
+        {
+            this->_type=image.type();
+            this->_frame_rows=0;
+            this->_frame_cols=0;
+            if(image.empty())
+                return;
+            if(image.dims!=2 && image.dims!=3)
+                throw std::invalid_argument("Bad image dimensions");
+            if(frame_rows<0)
+                throw std::invalid_argument("Bad frame rows");
+
+            cv::Mat src=image.isContinuous() ? image : image.clone();
+            int frames;
+            if(src.dims==3){
+                this->_sizes.assign(src.size.p,src.size.p+3);
+                this->_frame_rows=src.size[1];
+                this->_frame_cols=src.size[2];
+                frames=src.size[0];
+            }
+            else{
+                this->_sizes.push_back(src.rows);
+                this->_sizes.push_back(src.cols);
+                this->_frame_rows=frame_rows ? frame_rows : src.rows;
+                this->_frame_cols=src.cols;
+                frames=(src.rows+this->_frame_rows-1)/this->_frame_rows;
+            }
+
+            std::vector<unsigned char> buf;
+            std::vector<uint32_t> table;
+            this->_offsets.push_back(0);
+            for(int i=0;i<frames;i++){
+                this->_encode(i,this->_frame_ptr(src,i),buf,table);
+                this->_offsets.push_back(this->_data.size());
+            }
+        }
+
+        cv::Mat _create() const
+        {
+            if(this->empty())
+                return cv::Mat();
+
+            return cv::Mat((int)this->_sizes.size(),
+                           &this->_sizes[0],
+                           this->_type);
+        }
+
+        int _rows_of(int index) const
+        {
+            if(this->_sizes.size()==3)
+                return this->_frame_rows;
+
+            return std::min(this->_frame_rows,
+                            this->_sizes[0]-index*this->_frame_rows);
+        }
+
+        size_t _row_samples() const
+        {
+            return (size_t)this->_frame_cols*CV_MAT_CN(this->_type);
+        }
+
+        unsigned char *_frame_ptr(const cv::Mat &m,int index) const
+        {
+            return m.data+(size_t)index*this->_frame_rows*
+                this->_row_samples()*CV_ELEM_SIZE1(this->_type);
+        }
+
+        void _encode(int index,
+                     const unsigned char *src,
+                     std::vector<unsigned char> &buf,
+                     std::vector<uint32_t> &table)
+        {
+            size_t rows=this->_rows_of(index);
+            size_t n=rows*this->_row_samples();
+            size_t chs=CV_MAT_CN(this->_type);
+            buf.resize(n*CV_ELEM_SIZE1(this->_type));
+
+            switch(CV_ELEM_SIZE1(this->_type)){
+            case 1:
+                _shuffle<uint8_t>(src,rows,this->_row_samples(),chs,&buf[0]);
+                break;
+            case 2:
+                _shuffle<uint16_t>(src,rows,this->_row_samples(),chs,&buf[0]);
+                break;
+            case 4:
+                _shuffle<uint32_t>(src,rows,this->_row_samples(),chs,&buf[0]);
+                break;
+            default:
+                _shuffle<uint64_t>(src,rows,this->_row_samples(),chs,&buf[0]);
+                break;
+            }
+
+            size_t start=this->_data.size();
+            if(_lz_pack(&buf[0],buf.size(),this->_data,table)){
+                this->_stored.push_back(0);
+                return;
+            }
+
+            this->_data.resize(start);
+            this->_data.insert(this->_data.end(),buf.begin(),buf.end());
+            this->_stored.push_back(1);
+        }
+
+        void _decode(int index,unsigned char *dst) const
+        {
+            size_t rows=this->_rows_of(index);
+            size_t n=rows*this->_row_samples();
+            size_t len=n*CV_ELEM_SIZE1(this->_type);
+            size_t chs=CV_MAT_CN(this->_type);
+            if(!len)
+                return;
+
+            const unsigned char *src=&this->_data[0]+this->_offsets[index];
+            size_t src_len=this->_offsets[index+1]-this->_offsets[index];
+            std::vector<unsigned char> buf;
+            if(!this->_stored[index]){
+                buf.resize(len+_SLACK);
+                _lz_unpack(src,src_len,&buf[0],len);
+                src=&buf[0];
+            }
+
+            switch(CV_ELEM_SIZE1(this->_type)){
+            case 1:
+                _unshuffle<uint8_t>(src,rows,this->_row_samples(),chs,dst);
+                break;
+            case 2:
+                _unshuffle<uint16_t>(src,rows,this->_row_samples(),chs,dst);
+                break;
+            case 4:
+                _unshuffle<uint32_t>(src,rows,this->_row_samples(),chs,dst);
+                break;
+            default:
+                _unshuffle<uint64_t>(src,rows,this->_row_samples(),chs,dst);
+                break;
+            }
+        }
+
+        //
+        // predictor: left sample of the channel, upper at the row head
+        //
+        template <class T>
+        static void _shuffle(const unsigned char *src,
+                             size_t rows,
+                             size_t width,
+                             size_t chs,
+                             unsigned char *dst)
+        {
+            const size_t bytes=sizeof(T);
+            const size_t n=rows*width;
+            const T *s=(const T *)src;
+            for(size_t r=0;r<rows;r++){
+                const T *row=s+r*width;
+                for(size_t j=0;j<width;j++){
+                    T pred;
+                    if(j>=chs)
+                        pred=row[j-chs];
+                    else
+                        pred=r ? (row-width)[j] : 0;
+                    T d=(T)(row[j]-pred);
+                    T z=(T)((T)(d<<1)^(T)(0-(d>>(bytes*8-1))));
+                    for(size_t k=0;k<bytes;k++)
+                        dst[k*n+r*width+j]=(unsigned char)(z>>(k*8));
+                }
+            }
+        }
+
+        template <class T>
+        static void _unshuffle(const unsigned char *src,
+                               size_t rows,
+                               size_t width,
+                               size_t chs,
+                               unsigned char *dst)
+        {
+            const size_t bytes=sizeof(T);
+            const size_t n=rows*width;
+            for(size_t r=0;r<rows;r++){
+                T *row=(T *)dst+r*width;
+                const unsigned char *planes=src+r*width;
+                if(chs==1 && width){
+                    // prediction in a register
+                    T acc=r ? (row-width)[0] : 0;
+                    for(size_t j=0;j<width;j++){
+                        T z=0;
+                        for(size_t k=0;k<bytes;k++)
+                            z|=(T)((T)planes[k*n+j]<<(k*8));
+                        acc=(T)(acc+((z>>1)^(T)(0-(z&1))));
+                        row[j]=acc;
+                    }
+                    continue;
+                }
+
+                for(size_t j=0;j<width;j++){
+                    T z=0;
+                    for(size_t k=0;k<bytes;k++)
+                        z|=(T)((T)planes[k*n+j]<<(k*8));
+                    row[j]=(T)((z>>1)^(T)(0-(z&1)));
+                }
+
+                // row head from the upper row, others from the left
+                for(size_t j=0;j<chs && j<width;j++){
+                    if(r)
+                        row[j]=(T)(row[j]+(row-width)[j]);
+                }
+                for(size_t j=chs;j<width;j++)
+                    row[j]=(T)(row[j]+row[j-chs]);
+            }
+        }
+
+        static uint32_t _read32(const unsigned char *p)
+        {
+            uint32_t v;
+            memcpy(&v,p,sizeof(v));
+
+            return v;
+        }
+
+        static void _put_length(std::vector<unsigned char> &out,size_t len)
+        {
+            for(;len>=255;len-=255)
+                out.push_back(255);
+            out.push_back((unsigned char)len);
+        }
+
+        static void _put_sequence(std::vector<unsigned char> &out,
+                                  const unsigned char *literals,
+                                  size_t literal_len,
+                                  size_t offset,
+                                  size_t match_len)
+        {
+            size_t m=match_len ? match_len-_MIN_MATCH : 0;
+            out.push_back((unsigned char)
+                          ((std::min<size_t>(literal_len,15)<<4)|
+                           std::min<size_t>(m,15)));
+            if(literal_len>=15)
+                _put_length(out,literal_len-15);
+            out.insert(out.end(),literals,literals+literal_len);
+            if(!match_len)
+                return;
+
+            out.push_back((unsigned char)offset);
+            out.push_back((unsigned char)(offset>>8));
+            if(m>=15)
+                _put_length(out,m-15);
+        }
+
+        //
+        // LZ77 coder in sequences of
+        //   token (literal length:4, match length-4:4),
+        //   extra literal length, literals,
+        //   offset (2 bytes LE), extra match length
+        // with a literal only last sequence; false when out grows by
+        // len or more
+        //
+        static bool _lz_pack(const unsigned char *src,
+                             size_t len,
+                             std::vector<unsigned char> &out,
+                             std::vector<uint32_t> &table)
+        {
+            size_t start=out.size();
+            table.assign((size_t)1<<_HASH_BITS,0);  // position+1
+
+            size_t anchor=0;
+            size_t i=0;
+            while(len>=_MIN_MATCH && i<=len-_MIN_MATCH){
+                uint32_t v=_read32(src+i);
+                uint32_t h=(v*2654435761U)>>(32-_HASH_BITS);
+                size_t cand=table[h];
+                table[h]=(uint32_t)(i+1);
+                if(!cand || i-(cand-1)>_MAX_OFFSET ||
+                   _read32(src+cand-1)!=v){
+                    // skip faster in incompressible data
+                    i+=1+((i-anchor)>>6);
+                    continue;
+                }
+                cand--;
+
+                size_t m=_MIN_MATCH;
+                while(i+m<len && src[cand+m]==src[i+m])
+                    m++;
+                _put_sequence(out,src+anchor,i-anchor,i-cand,m);
+                i+=m;
+                anchor=i;
+
+                if(out.size()-start>=len)
+                    return false;
+            }
+            _put_sequence(out,src+anchor,len-anchor,0,0);
+
+            return out.size()-start<len;
+        }
+
+        static size_t _get_length(const unsigned char *&p,
+                                  const unsigned char *end)
+        {
+            size_t len=0;
+            unsigned char c;
+            do{
+                if(p>=end)
+                    throw Dicom::ParseError("Bad packed data");
+                c=*p++;
+                len+=c;
+            }while(c==255);
+
+            return len;
+        }
+
+        //
+        // dst has _SLACK bytes after dst_len
+        //
+        static void _lz_unpack(const unsigned char *src,
+                               size_t len,
+                               unsigned char *dst,
+                               size_t dst_len)
+        {
+            const unsigned char *p=src;
+            const unsigned char *end=src+len;
+            unsigned char *q=dst;
+            unsigned char *q_end=dst+dst_len;
+            while(p<end){
+                unsigned char token=*p++;
+                size_t literal_len=token>>4;
+                if(literal_len==15)
+                    literal_len+=_get_length(p,end);
+                if(literal_len>(size_t)(end-p) ||
+                   literal_len>(size_t)(q_end-q))
+                    throw Dicom::ParseError("Bad packed data");
+                if(literal_len<=_SLACK && end-p>=_SLACK)
+                    memcpy(q,p,_SLACK);
+                else
+                    memcpy(q,p,literal_len);
+                p+=literal_len;
+                q+=literal_len;
+                if(p==end)
+                    break;
+
+                if(end-p<2)
+                    throw Dicom::ParseError("Bad packed data");
+                size_t offset=p[0]|((size_t)p[1]<<8);
+                p+=2;
+                size_t m=token&15;
+                if(m==15)
+                    m+=_get_length(p,end);
+                m+=_MIN_MATCH;
+                if(!offset || offset>(size_t)(q-dst) ||
+                   m>(size_t)(q_end-q))
+                    throw Dicom::ParseError("Bad packed data");
+
+                const unsigned char *from=q-offset;
+                if(offset>=_SLACK){
+                    for(size_t i=0;i<m;i+=_SLACK)
+                        memcpy(q+i,from+i,_SLACK);
+                    q+=m;
+                    continue;
+                }
+
+                // overlapped copy doubles the repeated period
+                while(m){
+                    size_t chunk=std::min(m,(size_t)(q-from));
+                    memcpy(q,from,chunk);
+                    q+=chunk;
+                    m-=chunk;
+                }
+            }
+            if(q!=q_end)
+                throw Dicom::ParseError("Bad packed data");
+        }
+    };
+}
+
+#endif // __VVV_DICOM_PACKED_H__
@@ -0,0 +1,218 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_pool.h
+///
+/// @brief  fixed size thread pool shared by the optional headers
+///
+
+#ifndef __VVV_DICOM_POOL_H__
+
+#define __VVV_DICOM_POOL_H__
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <exception>
+
+namespace VVV
+{
+    ///
+    /// fixed size thread pool
+    ///
+    class ThreadPool
+    {
+    public:
+        ///
+        /// constructor
+        ///
+        /// @param threads number of workers; number of cores when 0
+        ///
+        ThreadPool(size_t threads=0)
+            :_stop(false)
+        {
+            if(!threads)
+                threads=std::thread::hardware_concurrency();
+            if(!threads)
+                threads=1;
+
+            for(size_t i=0;i<threads;i++)
+                this->_workers.push_back(
+                    std::thread(&ThreadPool::_run,this));
+        }
+
+        ///
+        /// destructor
+        ///
+        /// Queued jobs are run before workers are joined.
+        ///
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                this->_stop=true;
+            }
+            this->_cond.notify_all();
+
+            for(size_t i=0;i<this->_workers.size();i++)
+                this->_workers[i].join();
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return number of workers
+        ///
+        size_t size() const { return this->_workers.size(); }
+
+        ///
+        /// queue a job
+        ///
+        /// @param f callable without argument
+        ///
+        /// @return future of the result; exceptions are rethrown by get()
+        ///
+        template <class F>
+        auto submit(F f) -> std::future<decltype(f())>
+        {
+            typedef decltype(f()) R;
+
+            std::shared_ptr<std::packaged_task<R()> > task=
+                std::make_shared<std::packaged_task<R()> >(f);
+            std::future<R> r=task->get_future();
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                this->_jobs.push_back([task](){ (*task)(); });
+            }
+            this->_cond.notify_one();
+
+            return r;
+        }
+
+        ///
+        /// run f(i) for each i in [begin, end) and wait
+        ///
+        /// @param begin first index
+        /// @param end last index + 1
+        /// @param f callable with an index
+        ///
+        /// The calling thread takes indices too, so parallel_for()
+        /// may be nested in jobs of the same pool. The first
+        /// exception is rethrown after all indices are done.
+        ///
+        template <class F>
+        void parallel_for(size_t begin,size_t end,F f)
+        {
+            if(begin>=end)
+                return;
+
+            std::shared_ptr<_Range<F> > range=
+                std::make_shared<_Range<F> >(begin,end,f);
+
+            size_t helpers=std::min(this->size(),end-begin-1);
+            for(size_t i=0;i<helpers;i++){
+                {
+                    std::lock_guard<std::mutex> lock(this->_mutex);
+                    this->_jobs.push_back([range](){ range->run(); });
+                }
+                this->_cond.notify_one();
+            }
+
+            range->run();
+            range->wait();
+        }
+
+    private:
+        std::vector<std::thread> _workers;
+        std::deque<std::function<void()> > _jobs;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        bool _stop;
+
+        void _run()
+        {
+            while(true){
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(this->_mutex);
+                    while(!this->_stop && this->_jobs.empty())
+                        this->_cond.wait(lock);
+                    if(this->_jobs.empty())
+                        return;
+
+                    job=this->_jobs.front();
+                    this->_jobs.pop_front();
+                }
+                job();
+            }
+        }
+
+        //
+        // indices shared by the caller and helper jobs; helpers
+        // which start late find nothing to do
+        //
+        template <class F>
+        class _Range
+        {
+        public:
+            _Range(size_t begin,size_t end,F f)
+                :_next(begin),
+                 _end(end),
+                 _left(end-begin),
+                 _f(f)
+            {}
+
+            void run()
+            {
+                while(true){
+                    size_t i=this->_next++;
+                    if(i>=this->_end)
+                        return;
+
+                    try{
+                        this->_f(i);
+                    }
+                    catch(...){
+                        std::lock_guard<std::mutex> lock(this->_mutex);
+                        if(!this->_error)
+                            this->_error=std::current_exception();
+                    }
+
+                    if(--this->_left==0){
+                        std::lock_guard<std::mutex> lock(this->_mutex);
+                        this->_cond.notify_all();
+                    }
+                }
+            }
+
+            void wait()
+            {
+                std::unique_lock<std::mutex> lock(this->_mutex);
+                while(this->_left)
+                    this->_cond.wait(lock);
+                if(this->_error)
+                    std::rethrow_exception(this->_error);
+            }
+
+        private:
+            std::atomic<size_t> _next;
+            size_t _end;
+            std::atomic<size_t> _left;
+            F _f;
+            std::mutex _mutex;
+            std::condition_variable _cond;
+            std::exception_ptr _error;
+        };
+    };
+}
+
+#endif // __VVV_DICOM_POOL_H__
@@ -0,0 +1,484 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_prefetch.h
+///
+/// @brief  slice prefetch in the scroll direction for viewers (C++11)
+///
+
+#ifndef __VVV_DICOM_PREFETCH_H__
+
+#define __VVV_DICOM_PREFETCH_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+#include "dicom_async.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string.h>
+
+#include <cmath>
+
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <algorithm>
+
+namespace VVV
+{
+    ///
+    /// prefetcher of the slices of a series around the viewed one
+    ///
+    /// Each seek() or slice() moves the current slice and updates
+    /// the scroll velocity. Slices ahead in the scroll direction, and
+    /// a few behind, are queued by distance and decoded on a pool;
+    /// the lead grows with the velocity and the decode time. Queued
+    /// slices which leave the window are cancelled, and decoded ones
+    /// are dropped. Files beyond the lead get readahead hints
+    /// (posix_fadvise(2)), so their bytes come from storage before
+    /// they are decoded.
+    ///
+    /// slice() returns a decoded slice at once, waits for a running
+    /// decode, or decodes a still queued slice on the calling thread.
+    /// Returned images share their buffers with the prefetcher and
+    /// must not be modified.
+    ///
+    class SlicePrefetcher
+    {
+    public:
+        ///
+        /// prefetch counters
+        ///
+        struct Counters
+        {
+            uint64_t hits;       ///< slice() found the slice decoded
+            uint64_t waits;      ///< slice() waited for a running decode
+            uint64_t misses;     ///< slice() decoded by itself
+            uint64_t decoded;    ///< decoded on the pool
+            uint64_t cancelled;  ///< queued slices left the window
+            uint64_t hints;      ///< files given readahead hints
+        };
+
+        ///
+        /// constructor
+        ///
+        /// @param pool thread pool; it must outlive this object
+        /// @param paths files of slices in display order, e.g. by
+        ///        SeriesLoader::order()
+        /// @param need_rescale rescale or not
+        /// @param ahead slices kept ahead in the scroll direction at rest
+        /// @param behind slices kept behind
+        /// @param max_jobs decodes running on the pool at a time
+        ///
+        SlicePrefetcher(ThreadPool &pool,
+                        const std::vector<std::string> &paths,
+                        bool need_rescale=true,
+                        size_t ahead=8,
+                        size_t behind=2,
+                        size_t max_jobs=2)
+            :_pool(pool),
+             _paths(paths),
+             _need_rescale(need_rescale),
+             _ahead(ahead),
+             _behind(behind),
+             _max_jobs(std::max((size_t)1,max_jobs)),
+             _hinted(paths.size(),false),
+             _running(0),
+             _closing(false),
+             _current(-1),
+             _direction(1),
+             _velocity(0.0),
+             _decode_seconds(0.0)
+        {
+            memset(&this->_counters,0,sizeof(this->_counters));
+        }
+
+        ///
+        /// destructor; queued slices are cancelled and running
+        /// decodes are waited
+        ///
+        ~SlicePrefetcher()
+        {
+            std::vector<std::shared_ptr<std::promise<cv::Mat> > > cancelled;
+            {
+                std::unique_lock<std::mutex> lock(this->_mutex);
+                this->_closing=true;
+                this->_cancel_queue(cancelled);
+                this->_idle.wait(lock,[this](){ return !this->_running; });
+            }
+            _fail(cancelled);
+        }
+
+        ///
+        /// get a slice and make it current
+        ///
+        /// @param index slice index
+        ///
+        /// @return decoded image; read only
+        ///
+        /// throw std::out_of_range, exceptions of decoding the slice
+        ///
+        cv::Mat slice(int index)
+        {
+            this->_check(index);
+
+            std::shared_ptr<std::promise<cv::Mat> > promise;
+            std::shared_future<cv::Mat> future;
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                this->_seek(index);
+
+                _Entry &e=this->_entries[index];
+                future=e.future;
+                if(e.state==_READY)
+                    this->_counters.hits++;
+                else if(e.state==_LOADING)
+                    this->_counters.waits++;
+                else{
+                    // decode here rather than behind running jobs
+                    this->_queue.erase(std::find(this->_queue.begin(),
+                                                 this->_queue.end(),
+                                                 index));
+                    e.state=_LOADING;
+                    promise=e.promise;
+                    this->_counters.misses++;
+                }
+            }
+
+            if(promise)
+                this->_load(index,promise);
+
+            return future.get();
+        }
+
+        ///
+        /// move the current slice without waiting
+        ///
+        /// @param index slice index
+        ///
+        /// throw std::out_of_range
+        ///
+        void seek(int index)
+        {
+            this->_check(index);
+
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_seek(index);
+        }
+
+        ///
+        /// query method that a slice is decoded or not
+        ///
+        /// @param index slice index
+        ///
+        /// @return true when slice() returns without decoding
+        ///
+        bool is_ready(int index)
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            std::map<int,_Entry>::iterator itr=this->_entries.find(index);
+
+            return itr!=this->_entries.end() && itr->second.state==_READY;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return scroll velocity in slices per second; negative
+        ///         toward the first slice
+        ///
+        double velocity()
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+
+            return this->_velocity;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return number of slices
+        ///
+        size_t size() const { return this->_paths.size(); }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return counters
+        ///
+        Counters counters()
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+
+            return this->_counters;
+        }
+
+    private:
+        enum {
+            _QUEUED,
+            _LOADING,
+            _READY
+        };
+
+        struct _Entry
+        {
+            _Entry()
+                :state(_QUEUED),
+                 promise(std::make_shared<std::promise<cv::Mat> >()),
+                 future(promise->get_future().share())
+            {}
+
+            int state;
+            std::shared_ptr<std::promise<cv::Mat> > promise;
+            std::shared_future<cv::Mat> future;
+        };
+
+        typedef std::chrono::steady_clock _Clock;
+
+        ThreadPool &_pool;
+        std::vector<std::string> _paths;
+        bool _need_rescale;
+        size_t _ahead;
+        size_t _behind;
+        size_t _max_jobs;
+
+        std::mutex _mutex;
+        std::condition_variable _idle;
+        std::map<int,_Entry> _entries;  // window of slices
+        std::deque<int> _queue;         // queued slices by priority
+        std::vector<bool> _hinted;
+        size_t _running;
+        bool _closing;
+
+        int _current;
+        int _direction;
+        double _velocity;
+        double _decode_seconds;         // moving average of a decode
+        _Clock::time_point _last_seek;
+        Counters _counters;
+
+        SlicePrefetcher(const SlicePrefetcher &);
+        SlicePrefetcher &operator=(const SlicePrefetcher &);
+
+        void _check(int index) const
+        {
+            if(index<0 || (size_t)index>=this->_paths.size())
+                throw std::out_of_range("Bad slice index");
+        }
+
+        //
+        // update velocity and window; called with the lock
+        //
+        void _seek(int index)
+        {
+            _Clock::time_point now=_Clock::now();
+            if(this->_current>=0 && index!=this->_current){
+                double dt=std::chrono::duration<double>(
+                    now-this->_last_seek).count();
+                double v=(index-this->_current)/std::max(dt,1e-3);
+
+                // a pause restarts the estimate
+                this->_velocity=(dt>0.5) ? v : 0.5*this->_velocity+0.5*v;
+                this->_direction=(index>this->_current) ? 1 : -1;
+            }
+            else if(this->_current>=0 &&
+                    std::chrono::duration<double>(
+                        now-this->_last_seek).count()>0.5)
+                this->_velocity=0.0;
+
+            if(index!=this->_current)
+                this->_last_seek=now;
+            this->_current=index;
+
+            this->_schedule();
+        }
+
+        //
+        // rebuild the queue for the current slice; called with the lock
+        //
+        void _schedule()
+        {
+            int n=(int)this->_paths.size();
+
+            // slices passed while one is decoded, twice for margin
+            size_t lead=this->_ahead+(size_t)std::ceil(
+                std::fabs(this->_velocity)*this->_decode_seconds*2.0/
+                this->_max_jobs);
+            lead=std::min(lead,this->_ahead*4);
+
+            std::vector<int> wanted;
+            wanted.push_back(this->_current);
+            for(size_t k=1;k<=lead;k++){
+                int i=this->_current+this->_direction*(int)k;
+                if(i>=0 && i<n)
+                    wanted.push_back(i);
+            }
+            for(size_t k=1;k<=this->_behind;k++){
+                int i=this->_current-this->_direction*(int)k;
+                if(i>=0 && i<n)
+                    wanted.push_back(i);
+            }
+
+            // leave the window; running decodes stay until done
+            std::vector<int> sorted(wanted);
+            std::sort(sorted.begin(),sorted.end());
+            std::vector<std::shared_ptr<std::promise<cv::Mat> > > cancelled;
+            std::map<int,_Entry>::iterator itr=this->_entries.begin();
+            while(itr!=this->_entries.end()){
+                if(itr->second.state==_LOADING ||
+                   std::binary_search(sorted.begin(),sorted.end(),
+                                      itr->first)){
+                    ++itr;
+                    continue;
+                }
+                if(itr->second.state==_QUEUED){
+                    cancelled.push_back(itr->second.promise);
+                    this->_counters.cancelled++;
+                }
+                this->_entries.erase(itr++);
+            }
+            _fail(cancelled);
+
+            this->_queue.clear();
+            for(size_t i=0;i<wanted.size();i++){
+                _Entry &e=this->_entries[wanted[i]];
+                if(e.state==_QUEUED)
+                    this->_queue.push_back(wanted[i]);
+            }
+
+            this->_hint(lead);
+            while(this->_running<this->_max_jobs && !this->_queue.empty()){
+                this->_running++;
+                this->_pool.submit([this](){ this->_work(); });
+            }
+        }
+
+        //
+        // readahead hints for files beyond the lead
+        //
+        void _hint(size_t lead)
+        {
+            std::vector<std::string> paths;
+            int n=(int)this->_paths.size();
+            for(size_t k=lead+1;k<=lead*2;k++){
+                int i=this->_current+this->_direction*(int)k;
+                if(i<0 || i>=n || this->_hinted[i])
+                    continue;
+                this->_hinted[i]=true;
+                paths.push_back(this->_paths[i]);
+            }
+            if(paths.empty())
+                return;
+
+            this->_counters.hints+=paths.size();
+            this->_pool.submit([paths](){
+                    for(size_t i=0;i<paths.size();i++){
+                        int fd=::open(paths[i].c_str(),O_RDONLY);
+                        if(fd<0)
+                            continue;
+#ifdef POSIX_FADV_WILLNEED
+                        posix_fadvise(fd,0,0,POSIX_FADV_WILLNEED);
+#endif
+                        close(fd);
+                    }
+                });
+        }
+
+        //
+        // decode queued slices in order until none is left
+        //
+        void _work()
+        {
+            while(true){
+                int index;
+                std::shared_ptr<std::promise<cv::Mat> > promise;
+                {
+                    std::lock_guard<std::mutex> lock(this->_mutex);
+                    if(this->_closing || this->_queue.empty()){
+                        // the prefetcher is not touched after this
+                        this->_running--;
+                        this->_idle.notify_all();
+                        return;
+                    }
+                    index=this->_queue.front();
+                    this->_queue.pop_front();
+
+                    _Entry &e=this->_entries[index];
+                    e.state=_LOADING;
+                    promise=e.promise;
+                    this->_counters.decoded++;
+                }
+                this->_load(index,promise);
+            }
+        }
+
+        //
+        // decode a slice and resolve its entry
+        //
+        void _load(int index,std::shared_ptr<std::promise<cv::Mat> > promise)
+        {
+            _Clock::time_point begin=_Clock::now();
+            cv::Mat image;
+            std::exception_ptr error;
+            try{
+                std::ifstream ifs(this->_paths[index].c_str(),
+                                  std::ios::binary);
+                if(!ifs)
+                    throw Dicom::StreamError("Could not open file");
+                Dicom d(ifs,false);
+                image=d.image(this->_need_rescale);
+            }
+            catch(...){
+                error=std::current_exception();
+            }
+            double seconds=std::chrono::duration<double>(
+                _Clock::now()-begin).count();
+
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                this->_decode_seconds=(this->_decode_seconds>0.0) ?
+                    0.8*this->_decode_seconds+0.2*seconds : seconds;
+                std::map<int,_Entry>::iterator itr=
+                    this->_entries.find(index);
+                if(itr!=this->_entries.end())
+                    itr->second.state=_READY;
+            }
+
+            if(error)
+                promise->set_exception(error);
+            else
+                promise->set_value(image);
+        }
+
+        void _cancel_queue(std::vector<std::shared_ptr<std::promise<cv::Mat> > >
+                           &cancelled)
+        {
+            for(size_t i=0;i<this->_queue.size();i++){
+                _Entry &e=this->_entries[this->_queue[i]];
+                cancelled.push_back(e.promise);
+                this->_entries.erase(this->_queue[i]);
+                this->_counters.cancelled++;
+            }
+            this->_queue.clear();
+        }
+
+        static void _fail(std::vector<std::shared_ptr<std::promise<cv::Mat> > >
+                          &cancelled)
+        {
+            for(size_t i=0;i<cancelled.size();i++)
+                cancelled[i]->set_exception(
+                    std::make_exception_ptr(AsyncLoader::Cancelled()));
+        }
+    };
+}
+
+#endif // __VVV_DICOM_PREFETCH_H__
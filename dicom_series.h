@@ -0,0 +1,128 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_series.h
+///
+/// @brief  parallel loading of DICOM series
+///
+
+#ifndef __VVV_DICOM_SERIES_H__
+
+#define __VVV_DICOM_SERIES_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+namespace VVV
+{
+    ///
+    /// loading files of a series on a thread pool
+    ///
+    class SeriesLoader
+    {
+    public:
+        ///
+        /// parse files in parallel
+        ///
+        /// @param pool thread pool
+        /// @param paths file paths
+        /// @param dst parsed objects in order of paths
+        /// @param parse_all parse with image or only summary
+        ///
+        /// The first exception is rethrown after all files.
+        ///
+        static void load(ThreadPool &pool,
+                         const std::vector<std::string> &paths,
+                         std::vector<Dicom> &dst,
+                         bool parse_all=true)
+        {
+            dst.clear();
+            dst.resize(paths.size());
+
+            pool.parallel_for(0,paths.size(),[&](size_t i){
+                    std::ifstream ifs(paths[i].c_str(),std::ios::binary);
+                    if(!ifs)
+                        throw Dicom::StreamError("Could not open file");
+                    dst[i].parse(ifs,parse_all);
+                });
+        }
+
+        ///
+        /// order of slices
+        ///
+        /// @param series parsed objects
+        ///
+        /// @return indices sorted by Image Position (Patient) along
+        ///         the slice normal, or by Instance Number when the
+        ///         position is missing
+        ///
+        static std::vector<size_t> order(std::vector<Dicom> &series)
+        {
+            std::vector<double> key(series.size());
+            bool by_position=true;
+
+            double normal[3]={0.0,0.0,1.0};
+            if(!series.empty())
+                _normal(series[0],normal);
+
+            for(size_t i=0;i<series.size();i++){
+                double pos[3];
+                if(by_position && _floats(series[i],0x0020,0x0032,pos,3))
+                    key[i]=pos[0]*normal[0]+pos[1]*normal[1]+pos[2]*normal[2];
+                else
+                    by_position=false;
+            }
+            if(!by_position){
+                for(size_t i=0;i<series.size();i++){
+                    double n;
+                    key[i]=_floats(series[i],0x0020,0x0013,&n,1) ?
+                        n : (double)i;
+                }
+            }
+
+            std::vector<size_t> r(series.size());
+            for(size_t i=0;i<r.size();i++)
+                r[i]=i;
+            std::stable_sort(r.begin(),r.end(),[&key](size_t a,size_t b){
+                    return key[a]<key[b];
+                });
+
+            return r;
+        }
+
+    private:
+        //
+        // backslash separated numbers of a string element
+        //
+        static bool _floats(Dicom &d,
+                            uint16_t group,
+                            uint16_t id,
+                            double *v,
+                            size_t n)
+        {
+            return d.has_element(group,id) &&
+                d.element(group,id).as_doubles(v,n)==(int)n;
+        }
+
+        //
+        // slice normal from Image Orientation (Patient) (0020,0037)
+        //
+        static void _normal(Dicom &d,double *normal)
+        {
+            double o[6];
+            if(!_floats(d,0x0020,0x0037,o,6))
+                return;
+
+            normal[0]=o[1]*o[5]-o[2]*o[4];
+            normal[1]=o[2]*o[3]-o[0]*o[5];
+            normal[2]=o[0]*o[4]-o[1]*o[3];
+        }
+    };
+}
+
+#endif // __VVV_DICOM_SERIES_H__
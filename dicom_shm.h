@@ -0,0 +1,803 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_shm.h
+///
+/// @brief  decoded volumes shared between processes (POSIX)
+///
+
+#ifndef __VVV_DICOM_SHM_H__
+
+#define __VVV_DICOM_SHM_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+#include "dicom_series.h"
+#include "dicom_volume.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace VVV
+{
+    ///
+    /// volume mapped from a shared memory segment
+    ///
+    /// Voxels are not copied; every process attached to the same
+    /// segment reads the same pages. A volume holds a shared lock on
+    /// its segment while it lives, and the segment is never evicted
+    /// while any process holds it. The lock is released by the kernel
+    /// when a process exits, so crashed readers do not leak segments.
+    ///
+    class SharedVolume
+    {
+    public:
+        ///
+        /// destructor
+        ///
+        ~SharedVolume()
+        {
+            if(this->_map!=MAP_FAILED)
+                munmap(this->_map,this->_map_len);
+            if(this->_fd>=0)
+                close(this->_fd);
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return voxels as slices x rows x cols cv::Mat; read only,
+        ///         valid while this object lives
+        ///
+        const cv::Mat &mat() const { return this->_mat; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @param index slice index
+        ///
+        /// @return rows x cols view of a slice without copy
+        ///
+        cv::Mat slice(int index) const
+        {
+            if(index<0 || index>=this->_info.slices)
+                throw std::out_of_range("Bad slice index");
+
+            return cv::Mat(this->_info.rows,
+                           this->_info.cols,
+                           this->_info.type,
+                           this->_voxels+
+                           (size_t)index*this->_info.rows*this->_info.cols*
+                           CV_ELEM_SIZE(this->_info.type));
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return geometry and pixel format
+        ///
+        const Volume::Info &info() const { return this->_info; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @param index slice index
+        ///
+        /// @return Image Position (x,y,z) of the slice; NaN when missing
+        ///
+        const double *position(int index) const
+        {
+            if(index<0 || index>=this->_info.slices)
+                throw std::out_of_range("Bad slice index");
+
+            return this->_positions+index*3;
+        }
+
+        ///
+        /// query method that voxels are in shared memory or not
+        ///
+        /// @return false when the volume did not fit in the budget
+        ///         and was loaded into private memory
+        ///
+        bool is_shared() const { return this->_map!=MAP_FAILED; }
+
+    private:
+        friend class SharedVolumeStore;
+
+        Volume::Info _info;
+        void *_map;
+        size_t _map_len;
+        int _fd;
+        std::vector<unsigned char> _local;
+        const double *_positions;
+        unsigned char *_voxels;
+        cv::Mat _mat;
+
+        SharedVolume()
+            :_map(MAP_FAILED),
+             _map_len(0),
+             _fd(-1),
+             _positions(NULL),
+             _voxels(NULL)
+        {}
+        SharedVolume(const SharedVolume &);
+        SharedVolume &operator=(const SharedVolume &);
+    };
+
+    ///
+    /// host-wide store of decoded volumes in POSIX shared memory
+    ///
+    /// The first process which opens a series decodes it into a named
+    /// segment; the others wait for it and map the same segment. A
+    /// registry segment, shared by all stores of the same name, keeps
+    /// the segments and their total size under a byte budget. Unused
+    /// segments are evicted in least recently used order; a volume
+    /// larger than the budget is loaded into private memory.
+    ///
+    /// Processes must share a PID namespace, since a loader which
+    /// died is detected by its process ID.
+    ///
+    class SharedVolumeStore
+    {
+    public:
+        ///
+        /// registry statistics
+        ///
+        struct Counters
+        {
+            uint64_t budget;   ///< bytes allowed for segments
+            uint64_t bytes;    ///< bytes of segments
+            size_t entries;    ///< segments ready
+            size_t loading;    ///< segments being decoded
+        };
+
+        ///
+        /// constructor; creates or attaches the registry
+        ///
+        /// @param budget bytes allowed for all segments of the registry
+        /// @param name registry name, as shm_open(3)
+        /// @param capacity number of segments in the registry
+        ///
+        /// budget and capacity are used only by the process which
+        /// creates the registry.
+        ///
+        /// throw Dicom::StreamError
+        ///
+        SharedVolumeStore(uint64_t budget,
+                          const std::string &name="/vvv_dicom",
+                          size_t capacity=256)
+            :_name(name),
+             _map(MAP_FAILED),
+             _map_len(0)
+        {
+            std::string path=name+".registry";
+            int fd=shm_open(path.c_str(),O_RDWR|O_CREAT|O_EXCL,0600);
+            bool creator=(fd>=0);
+            if(!creator){
+                if(errno!=EEXIST ||
+                   (fd=shm_open(path.c_str(),O_RDWR,0))<0)
+                    throw Dicom::StreamError("Could not open registry");
+            }
+
+            try{
+                if(creator){
+                    capacity=std::max<size_t>(capacity,1);
+                    this->_map_len=sizeof(_Registry)+capacity*sizeof(_Slot);
+                    if(ftruncate(fd,this->_map_len)<0)
+                        throw Dicom::StreamError("Could not size registry");
+                }
+                else{
+                    // the creator sizes it before it is marked ready
+                    struct stat st;
+                    for(int i=0;;i++){
+                        if(fstat(fd,&st)<0)
+                            throw Dicom::StreamError("Could not stat registry");
+                        if((size_t)st.st_size>=sizeof(_Registry))
+                            break;
+                        if(i>=_WAIT_LIMIT)
+                            throw Dicom::StreamError("Registry is not ready");
+                        usleep(_WAIT_USEC);
+                    }
+                    this->_map_len=st.st_size;
+                }
+
+                this->_map=mmap(NULL,this->_map_len,PROT_READ|PROT_WRITE,
+                                MAP_SHARED,fd,0);
+                if(this->_map==MAP_FAILED)
+                    throw Dicom::StreamError("Could not map registry");
+            }
+            catch(...){
+                close(fd);
+                if(creator)
+                    shm_unlink(path.c_str());
+                throw;
+            }
+            close(fd);
+
+            _Registry *r=this->_registry();
+            if(creator){
+                pthread_mutexattr_t attr;
+                pthread_mutexattr_init(&attr);
+                pthread_mutexattr_setpshared(&attr,PTHREAD_PROCESS_SHARED);
+                pthread_mutexattr_setrobust(&attr,PTHREAD_MUTEX_ROBUST);
+                pthread_mutex_init(&r->mutex,&attr);
+                pthread_mutexattr_destroy(&attr);
+                r->capacity=capacity;
+                r->budget=budget;
+                r->bytes=0;
+                r->clock=0;
+                __atomic_store_n(&r->magic,_REGISTRY_MAGIC,__ATOMIC_RELEASE);
+            }
+            else{
+                for(int i=0;
+                    __atomic_load_n(&r->magic,__ATOMIC_ACQUIRE)!=
+                        _REGISTRY_MAGIC;
+                    i++){
+                    if(i>=_WAIT_LIMIT){
+                        munmap(this->_map,this->_map_len);
+                        throw Dicom::StreamError("Registry is not ready");
+                    }
+                    usleep(_WAIT_USEC);
+                }
+                if(this->_map_len<sizeof(_Registry)+
+                   r->capacity*sizeof(_Slot)){
+                    munmap(this->_map,this->_map_len);
+                    throw Dicom::StreamError("Broken registry");
+                }
+            }
+        }
+
+        ///
+        /// destructor; volumes already opened stay valid
+        ///
+        ~SharedVolumeStore()
+        {
+            if(this->_map!=MAP_FAILED)
+                munmap(this->_map,this->_map_len);
+        }
+
+        ///
+        /// attach the volume of a series, or decode it
+        ///
+        /// @param pool thread pool to load and decode series
+        /// @param sources source files of series
+        /// @param pixels Volume::PIXELS_STORED, PIXELS_RESCALED or
+        ///        PIXELS_WINDOWED
+        /// @param center window center of PIXELS_WINDOWED
+        /// @param width window width of PIXELS_WINDOWED
+        ///
+        /// @return volume; slices are ordered along the slice normal
+        ///
+        /// Segments are keyed by Volume::source_digest() of sources
+        /// and pixel values, so a modified series is decoded again.
+        /// When another process is decoding the same series, this
+        /// waits for it.
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError,
+        ///       std::invalid_argument when slices differ in size or type
+        ///
+        std::shared_ptr<SharedVolume> open(ThreadPool &pool,
+                                           const std::vector<std::string>
+                                           &sources,
+                                           int pixels=Volume::PIXELS_STORED,
+                                           float center=0.0f,
+                                           float width=0.0f)
+        {
+            if(sources.empty())
+                throw std::invalid_argument("Empty series");
+
+            char key[_KEY_LEN];
+            snprintf(key,sizeof(key),"%s:%d:%.9g:%.9g",
+                     Volume::source_digest(sources).c_str(),
+                     pixels,center,width);
+
+            _Slot *slot=NULL;
+            for(;;){
+                {
+                    _Lock lock(this);
+
+                    _Slot *s=this->_find(key);
+                    if(s && s->state==_READY){
+                        std::shared_ptr<SharedVolume> v=this->_attach(s);
+                        if(v){
+                            s->last_use=++this->_registry()->clock;
+                            return v;
+                        }
+                        this->_release(s); // unlinked by others
+                        s=NULL;
+                    }
+                    else if(s && kill(s->pid,0)<0 && errno==ESRCH){
+                        this->_release(s); // loader died
+                        s=NULL;
+                    }
+
+                    if(!s){
+                        slot=this->_claim(key);
+                        break;
+                    }
+                }
+                usleep(_WAIT_USEC);
+            }
+
+            // decode outside of the lock
+            try{
+                return this->_load(pool,sources,pixels,center,width,
+                                   key,slot);
+            }
+            catch(...){
+                if(slot){
+                    _Lock lock(this);
+                    this->_release(slot);
+                }
+                throw;
+            }
+        }
+
+        ///
+        /// evict unused segments
+        ///
+        /// @param bytes size of segments to keep at most
+        ///
+        /// @return size of segments after eviction
+        ///
+        uint64_t trim(uint64_t bytes=0)
+        {
+            _Lock lock(this);
+            this->_evict(bytes);
+
+            return this->_registry()->bytes;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return registry statistics
+        ///
+        Counters counters()
+        {
+            _Lock lock(this);
+
+            _Registry *r=this->_registry();
+            Counters c;
+            c.budget=r->budget;
+            c.bytes=r->bytes;
+            c.entries=0;
+            c.loading=0;
+            for(size_t i=0;i<r->capacity;i++){
+                if(this->_slot(i)->state==_READY)
+                    c.entries++;
+                else if(this->_slot(i)->state==_LOADING)
+                    c.loading++;
+            }
+
+            return c;
+        }
+
+        ///
+        /// remove a registry and all its segments
+        ///
+        /// @param name registry name
+        ///
+        /// Volumes already opened stay valid until they are destroyed.
+        ///
+        static void remove(const std::string &name="/vvv_dicom")
+        {
+            std::string path=name+".registry";
+            {
+                SharedVolumeStore store(0,name);
+                _Lock lock(&store);
+                _Registry *r=store._registry();
+                for(size_t i=0;i<r->capacity;i++){
+                    _Slot *s=store._slot(i);
+                    if(s->state!=_FREE)
+                        shm_unlink(s->segment);
+                }
+                shm_unlink(path.c_str());
+            }
+        }
+
+    private:
+        enum{
+            _FREE,
+            _LOADING,
+            _READY
+        };
+        enum{
+            _KEY_LEN=64,
+            _WAIT_USEC=10000,
+            _WAIT_LIMIT=500
+        };
+        static const uint32_t _REGISTRY_MAGIC=0x56565652;  // "VVVR"
+        static const uint32_t _SEGMENT_MAGIC=0x56565653;   // "VVVS"
+
+        struct _Registry
+        {
+            uint32_t magic;
+            uint32_t capacity;
+            uint64_t budget;
+            uint64_t bytes;
+            uint64_t clock;
+            pthread_mutex_t mutex;
+        };
+
+        struct _Slot
+        {
+            uint32_t state;
+            int32_t pid;          // loader
+            uint64_t bytes;       // reserved in budget
+            uint64_t last_use;
+            char key[_KEY_LEN];
+            char segment[_KEY_LEN];
+        };
+
+        struct _Segment
+        {
+            uint32_t magic;
+            uint32_t header_size;
+            char key[_KEY_LEN];
+            Volume::Info info;
+            uint64_t positions;   // offset of slices x 3 doubles
+            uint64_t voxels;      // offset of voxels
+        };
+
+        class _Lock
+        {
+        public:
+            _Lock(SharedVolumeStore *store)
+                :_mutex(&store->_registry()->mutex)
+            {
+                int r=pthread_mutex_lock(this->_mutex);
+                if(r==EOWNERDEAD){
+                    // the owner died while updating; recount
+                    pthread_mutex_consistent(this->_mutex);
+                    store->_recount();
+                }
+                else if(r)
+                    throw Dicom::StreamError("Could not lock registry");
+            }
+            ~_Lock() { pthread_mutex_unlock(this->_mutex); }
+        private:
+            pthread_mutex_t *_mutex;
+        };
+
+        std::string _name;
+        void *_map;
+        size_t _map_len;
+
+        SharedVolumeStore(const SharedVolumeStore &);
+        SharedVolumeStore &operator=(const SharedVolumeStore &);
+
+        _Registry *_registry()
+        {
+            return (_Registry *)this->_map;
+        }
+
+        _Slot *_slot(size_t i)
+        {
+            return (_Slot *)((unsigned char *)this->_map+sizeof(_Registry))+i;
+        }
+
+        void _recount()
+        {
+            _Registry *r=this->_registry();
+            r->bytes=0;
+            for(size_t i=0;i<r->capacity;i++){
+                if(this->_slot(i)->state!=_FREE)
+                    r->bytes+=this->_slot(i)->bytes;
+            }
+        }
+
+        _Slot *_find(const char *key)
+        {
+            _Registry *r=this->_registry();
+            for(size_t i=0;i<r->capacity;i++){
+                _Slot *s=this->_slot(i);
+                if(s->state!=_FREE && strcmp(s->key,key)==0)
+                    return s;
+            }
+
+            return NULL;
+        }
+
+        //
+        // a free slot marked as loading by this process, or NULL
+        // when all slots are busy
+        //
+        _Slot *_claim(const char *key)
+        {
+            _Registry *r=this->_registry();
+            _Slot *s=NULL;
+            for(size_t i=0;i<r->capacity && !s;i++){
+                if(this->_slot(i)->state==_FREE)
+                    s=this->_slot(i);
+            }
+            if(!s){
+                this->_evict_one();
+                for(size_t i=0;i<r->capacity && !s;i++){
+                    if(this->_slot(i)->state==_FREE)
+                        s=this->_slot(i);
+                }
+                if(!s)
+                    return NULL;
+            }
+
+            uint64_t h=14695981039346656037ULL; // FNV-1a
+            for(const char *c=key;*c;c++){
+                h^=(unsigned char)*c;
+                h*=1099511628211ULL;
+            }
+            snprintf(s->segment,sizeof(s->segment),"%.40s.%016llx",
+                     this->_name.c_str(),(unsigned long long)h);
+            snprintf(s->key,sizeof(s->key),"%s",key);
+            s->pid=getpid();
+            s->bytes=0;
+            s->last_use=++r->clock;
+            s->state=_LOADING;
+
+            return s;
+        }
+
+        void _release(_Slot *s)
+        {
+            shm_unlink(s->segment);
+            this->_registry()->bytes-=s->bytes;
+            s->bytes=0;
+            s->state=_FREE;
+        }
+
+        //
+        // unlink a ready segment unless a process holds it
+        //
+        bool _try_evict(_Slot *s)
+        {
+            int fd=shm_open(s->segment,O_RDONLY,0);
+            if(fd<0){
+                this->_release(s);
+                return true;
+            }
+            bool unused=(flock(fd,LOCK_EX|LOCK_NB)==0);
+            if(unused)
+                this->_release(s);
+            close(fd);
+
+            return unused;
+        }
+
+        //
+        // evict unused segments in LRU order until bytes <= limit
+        //
+        bool _evict(uint64_t limit)
+        {
+            _Registry *r=this->_registry();
+            if(r->bytes<=limit)
+                return true;
+
+            std::vector<_Slot *> ready;
+            for(size_t i=0;i<r->capacity;i++){
+                if(this->_slot(i)->state==_READY)
+                    ready.push_back(this->_slot(i));
+            }
+            std::sort(ready.begin(),ready.end(),_older);
+
+            for(size_t i=0;i<ready.size() && r->bytes>limit;i++)
+                this->_try_evict(ready[i]);
+
+            return r->bytes<=limit;
+        }
+
+        void _evict_one()
+        {
+            _Registry *r=this->_registry();
+            std::vector<_Slot *> ready;
+            for(size_t i=0;i<r->capacity;i++){
+                if(this->_slot(i)->state==_READY)
+                    ready.push_back(this->_slot(i));
+            }
+            std::sort(ready.begin(),ready.end(),_older);
+
+            for(size_t i=0;i<ready.size();i++){
+                if(this->_try_evict(ready[i]))
+                    return;
+            }
+        }
+
+        static bool _older(const _Slot *a,const _Slot *b)
+        {
+            return a->last_use<b->last_use;
+        }
+
+        //
+        // map a ready segment with a shared lock; NULL when missing
+        //
+        std::shared_ptr<SharedVolume> _attach(_Slot *s)
+        {
+            std::shared_ptr<SharedVolume> v(new SharedVolume());
+            v->_fd=shm_open(s->segment,O_RDONLY,0);
+            if(v->_fd<0)
+                return std::shared_ptr<SharedVolume>();
+
+            struct stat st;
+            if(flock(v->_fd,LOCK_SH|LOCK_NB)<0 ||
+               fstat(v->_fd,&st)<0 ||
+               (size_t)st.st_size<sizeof(_Segment))
+                return std::shared_ptr<SharedVolume>();
+
+            v->_map_len=st.st_size;
+            v->_map=mmap(NULL,v->_map_len,PROT_READ,MAP_SHARED,v->_fd,0);
+            if(v->_map==MAP_FAILED)
+                return std::shared_ptr<SharedVolume>();
+
+            const _Segment *h=(const _Segment *)v->_map;
+            if(h->magic!=_SEGMENT_MAGIC ||
+               h->header_size!=sizeof(_Segment) ||
+               strncmp(h->key,s->key,sizeof(h->key))!=0 ||
+               h->voxels+_voxel_bytes(h->info)>v->_map_len)
+                return std::shared_ptr<SharedVolume>();
+
+            this->_wrap(*v,h->info,(unsigned char *)v->_map,
+                        h->positions,h->voxels);
+
+            return v;
+        }
+
+        static size_t _voxel_bytes(const Volume::Info &info)
+        {
+            return (size_t)info.cols*info.rows*info.slices*
+                CV_ELEM_SIZE(info.type);
+        }
+
+        static void _wrap(SharedVolume &v,
+                          const Volume::Info &info,
+                          unsigned char *base,
+                          uint64_t positions,
+                          uint64_t voxels)
+        {
+            v._info=info;
+            v._positions=(const double *)(base+positions);
+            v._voxels=base+voxels;
+
+            int sizes[]={info.slices,info.rows,info.cols};
+            if(info.slices && info.rows && info.cols)
+                v._mat=cv::Mat(3,sizes,info.type,v._voxels);
+        }
+
+        //
+        // decode a series into a new segment, or into private memory
+        // when slot is NULL or the budget is short
+        //
+        std::shared_ptr<SharedVolume> _load(ThreadPool &pool,
+                                            const std::vector<std::string>
+                                            &sources,
+                                            int pixels,
+                                            float center,
+                                            float width,
+                                            const char *key,
+                                            _Slot *&slot)
+        {
+            std::vector<Dicom> series;
+            SeriesLoader::load(pool,sources,series,false);
+            std::vector<size_t> order=SeriesLoader::order(series);
+
+            Volume::Info info;
+            info.pixels=pixels;
+            info.center=center;
+            info.width=width;
+            Volume::geometry(series,order,info);
+
+            std::vector<int> first_slice(order.size()+1,0);
+            for(size_t i=0;i<order.size();i++)
+                first_slice[i+1]=first_slice[i]+
+                    std::max(1,series[order[i]].frames());
+            info.slices=first_slice[order.size()];
+
+            cv::Mat m=Volume::slice_pixels(series[order[0]],0,
+                                           pixels,center,width);
+            info.cols=m.cols;
+            info.rows=m.rows;
+            info.type=m.type();
+
+            uint64_t positions=(sizeof(_Segment)+63)&~(uint64_t)63;
+            uint64_t voxels=(positions+info.slices*3*sizeof(double)+63)&
+                ~(uint64_t)63;
+            uint64_t bytes=voxels+_voxel_bytes(info);
+
+            if(slot){
+                _Lock lock(this);
+                _Registry *r=this->_registry();
+                if(bytes<=r->budget && this->_evict(r->budget-bytes)){
+                    r->bytes+=bytes;
+                    slot->bytes=bytes;
+                }
+                else{
+                    this->_release(slot);
+                    slot=NULL;
+                }
+            }
+
+            std::shared_ptr<SharedVolume> v(new SharedVolume());
+            unsigned char *base;
+            if(slot){
+                v->_fd=shm_open(slot->segment,O_RDWR|O_CREAT|O_EXCL,0600);
+                if(v->_fd<0 && errno==EEXIST){
+                    // left by a loader which died
+                    shm_unlink(slot->segment);
+                    v->_fd=shm_open(slot->segment,
+                                    O_RDWR|O_CREAT|O_EXCL,0600);
+                }
+                if(v->_fd<0 ||
+                   flock(v->_fd,LOCK_SH)<0 ||
+                   ftruncate(v->_fd,bytes)<0)
+                    throw Dicom::StreamError("Could not create segment");
+                v->_map=mmap(NULL,bytes,PROT_READ|PROT_WRITE,
+                             MAP_SHARED,v->_fd,0);
+                if(v->_map==MAP_FAILED)
+                    throw Dicom::StreamError("Could not map segment");
+                v->_map_len=bytes;
+                base=(unsigned char *)v->_map;
+            }
+            else{
+                v->_local.resize(bytes);
+                base=&v->_local[0];
+            }
+
+            _Segment *h=(_Segment *)base;
+            h->header_size=sizeof(_Segment);
+            snprintf(h->key,sizeof(h->key),"%s",key);
+            h->info=info;
+            h->positions=positions;
+            h->voxels=voxels;
+            this->_wrap(*v,info,base,positions,voxels);
+
+            size_t slice_len=(size_t)info.rows*info.cols*
+                CV_ELEM_SIZE(info.type);
+            double *pos=(double *)(base+positions);
+            pool.parallel_for(0,order.size(),[&](size_t i){
+                    Dicom &d=series[order[i]];
+                    for(int s=first_slice[i];s<first_slice[i+1];s++){
+                        pos[s*3]=d.image_pos_x();
+                        pos[s*3+1]=d.image_pos_y();
+                        pos[s*3+2]=d.image_pos_z();
+
+                        cv::Mat m=Volume::slice_pixels(d,s-first_slice[i],
+                                                       pixels,center,width);
+                        if(m.cols!=info.cols ||
+                           m.rows!=info.rows ||
+                           m.type()!=info.type)
+                            throw std::invalid_argument(
+                                "Slices differ in size or type");
+                        cv::Mat dst(info.rows,info.cols,info.type,
+                                    base+voxels+s*slice_len);
+                        m.copyTo(dst);
+                    }
+                });
+
+            // published last; readers check the magic
+            __atomic_store_n(&h->magic,_SEGMENT_MAGIC,__ATOMIC_RELEASE);
+
+            if(slot){
+                _Lock lock(this);
+                slot->last_use=++this->_registry()->clock;
+                slot->state=_READY;
+                slot=NULL;
+            }
+
+            return v;
+        }
+    };
+}
+
+#endif // __VVV_DICOM_SHM_H__
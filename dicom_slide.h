@@ -0,0 +1,417 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_slide.h
+///
+/// @brief  tiled random access to Whole Slide Microscopy images (POSIX)
+///
+
+#ifndef __VVV_DICOM_SLIDE_H__
+
+#define __VVV_DICOM_SLIDE_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+#include "dicom_cache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <typeinfo>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace VVV
+{
+    ///
+    /// pyramid of VL Whole Slide Microscopy instances
+    ///
+    /// Each instance is a level of the pyramid; its frames are tiles
+    /// of the Total Pixel Matrix in TILED_FULL order. Frame Data is not
+    /// loaded, and of encapsulated one only Item headers are read at
+    /// open; a region reads only the frames (or fragments) of the
+    /// tiles it covers, decodes them in parallel and stitches them.
+    /// Decoded tiles are kept in an LRU cache.
+    ///
+    /// Only the first focal plane and optical path are read.
+    ///
+    class Slide
+    {
+    public:
+        ///
+        /// a pyramid level
+        ///
+        struct Level
+        {
+            std::string path;
+            int cols;           ///< Total Pixel Matrix Columns
+            int rows;           ///< Total Pixel Matrix Rows
+            int tile_cols;      ///< Columns of a frame
+            int tile_rows;      ///< Rows of a frame
+            int tiles_x;        ///< tiles in a row
+            int tiles_y;        ///< tiles in a column
+            double downsample;  ///< cols of level 0 / cols
+        };
+
+        ///
+        /// constructor
+        ///
+        /// @param pool thread pool to parse instances and decode tiles
+        /// @param paths instances of a slide in any order; LABEL,
+        ///        OVERVIEW and THUMBNAIL images and non-tiled files
+        ///        are ignored
+        /// @param cache_bytes bytes of decoded tiles to keep
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError,
+        ///       std::runtime_error when tiles are not TILED_FULL,
+        ///       std::invalid_argument when no level is found
+        ///
+        Slide(ThreadPool &pool,
+              const std::vector<std::string> &paths,
+              uint64_t cache_bytes=256ULL<<20)
+            :_pool(pool),
+             _cache(cache_bytes)
+        {
+            std::vector<std::unique_ptr<_Instance> > found(paths.size());
+            pool.parallel_for(0,paths.size(),[&](size_t i){
+                    found[i]=_open(paths[i]);
+                });
+
+            for(size_t i=0;i<found.size();i++){
+                if(found[i])
+                    this->_levels.push_back(std::move(found[i]));
+            }
+            if(this->_levels.empty())
+                throw std::invalid_argument("No tiled image found");
+
+            std::sort(this->_levels.begin(),this->_levels.end(),_larger);
+            for(size_t i=0;i<this->_levels.size();i++)
+                this->_levels[i]->level.downsample=
+                    (double)this->_levels[0]->level.cols/
+                    this->_levels[i]->level.cols;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return number of levels
+        ///
+        int levels() const { return (int)this->_levels.size(); }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @param index level index; 0 is the largest
+        ///
+        /// @return geometry of the level
+        ///
+        const Level &level(int index) const
+        {
+            return this->_instance(index).level;
+        }
+
+        ///
+        /// level to read for a zoom
+        ///
+        /// @param downsample level 0 pixels per output pixel
+        ///
+        /// @return the smallest level not coarser than downsample
+        ///
+        int best_level(double downsample) const
+        {
+            int best=0;
+            for(size_t i=1;i<this->_levels.size();i++){
+                if(this->_levels[i]->level.downsample<=downsample*1.001)
+                    best=(int)i;
+            }
+
+            return best;
+        }
+
+        ///
+        /// a tile
+        ///
+        /// @param index level index
+        /// @param tx tile column
+        /// @param ty tile row
+        /// @param need_rescale rescale or not
+        ///
+        /// @return decoded frame of the tile; cached, must not be
+        ///         modified
+        ///
+        /// throw std::out_of_range, Dicom::StreamError, Dicom::ParseError
+        ///
+        cv::Mat tile(int index,int tx,int ty,bool need_rescale=true)
+        {
+            _Instance &ins=this->_instance(index);
+            if(tx<0 || tx>=ins.level.tiles_x || ty<0 || ty>=ins.level.tiles_y)
+                throw std::out_of_range("Bad tile index");
+
+            char key[64];
+            snprintf(key,sizeof(key),"%d:%d:%d:%d",
+                     index,tx,ty,need_rescale ? 1 : 0);
+
+            return this->_cache.get(key,[&](){
+                    return this->_decode(ins,ty*ins.level.tiles_x+tx,
+                                         need_rescale);
+                });
+        }
+
+        ///
+        /// a region of a level
+        ///
+        /// @param index level index
+        /// @param x left of region in pixels of the level
+        /// @param y top of region in pixels of the level
+        /// @param width width of region
+        /// @param height height of region
+        /// @param need_rescale rescale or not
+        ///
+        /// @return width x height image; pixels out of the Total Pixel
+        ///         Matrix are 0
+        ///
+        /// throw std::out_of_range, std::invalid_argument,
+        ///       Dicom::StreamError, Dicom::ParseError
+        ///
+        cv::Mat region(int index,
+                       int x,
+                       int y,
+                       int width,
+                       int height,
+                       bool need_rescale=true)
+        {
+            const Level &l=this->_instance(index).level;
+            if(width<=0 || height<=0)
+                throw std::invalid_argument("Bad region size");
+
+            cv::Rect area=cv::Rect(x,y,width,height)&
+                cv::Rect(0,0,l.cols,l.rows);
+
+            std::vector<std::pair<int,int> > tiles;
+            if(area.width>0 && area.height>0){
+                int tx0=area.x/l.tile_cols;
+                int ty0=area.y/l.tile_rows;
+                int tx1=(area.x+area.width-1)/l.tile_cols;
+                int ty1=(area.y+area.height-1)/l.tile_rows;
+                for(int ty=ty0;ty<=ty1;ty++){
+                    for(int tx=tx0;tx<=tx1;tx++)
+                        tiles.push_back(std::make_pair(tx,ty));
+                }
+            }
+
+            std::vector<cv::Mat> decoded(tiles.size());
+            this->_pool.parallel_for(0,tiles.size(),[&](size_t i){
+                    decoded[i]=this->tile(index,tiles[i].first,
+                                          tiles[i].second,need_rescale);
+                });
+
+            cv::Mat dst;
+            if(decoded.empty())
+                dst.create(height,width,this->_tile_type(index,need_rescale));
+            else
+                dst.create(height,width,decoded[0].type());
+            dst=cv::Scalar::all(0);
+
+            for(size_t i=0;i<tiles.size();i++){
+                cv::Rect t(tiles[i].first*l.tile_cols,
+                           tiles[i].second*l.tile_rows,
+                           decoded[i].cols,
+                           decoded[i].rows);
+                cv::Rect r=t&area;
+                if(r.width<=0 || r.height<=0)
+                    continue;
+                decoded[i](cv::Rect(r.x-t.x,r.y-t.y,r.width,r.height)).
+                    copyTo(dst(cv::Rect(r.x-x,r.y-y,r.width,r.height)));
+            }
+
+            return dst;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return counters of the tile cache
+        ///
+        ImageCache::Counters counters() { return this->_cache.counters(); }
+
+    private:
+        struct _Instance
+        {
+            Level level;
+            Dicom dicom;
+            int fd;
+
+            _Instance()
+                :fd(-1)
+            {}
+            ~_Instance()
+            {
+                if(this->fd>=0)
+                    close(this->fd);
+            }
+        };
+
+        ThreadPool &_pool;
+        ImageCache _cache;
+        std::vector<std::unique_ptr<_Instance> > _levels;
+
+        Slide(const Slide &);
+        Slide &operator=(const Slide &);
+
+        _Instance &_instance(int index) const
+        {
+            if(index<0 || index>=(int)this->_levels.size())
+                throw std::out_of_range("Bad level index");
+
+            return *this->_levels[index];
+        }
+
+        static bool _larger(const std::unique_ptr<_Instance> &a,
+                            const std::unique_ptr<_Instance> &b)
+        {
+            return a->level.cols>b->level.cols;
+        }
+
+        //
+        // unsigned value of UL, US or IS element, or -1
+        //
+        static int64_t _unsigned(Dicom &d,uint16_t group,uint16_t id)
+        {
+            const Dicom::Element *e=d.find(group,id);
+            if(!e || e->empty())
+                return -1;
+            if(e->type()==typeid(uint32_t))
+                return e->as<uint32_t>();
+            if(e->type()==typeid(uint16_t))
+                return e->as<uint16_t>();
+
+            int v;
+            if(e->as_ints(&v,1)==1 && v>=0)
+                return v;
+
+            return -1;
+        }
+
+        static std::string _string(Dicom &d,uint16_t group,uint16_t id)
+        {
+            const Dicom::Element *e=d.find(group,id);
+            if(!e || e->type()!=typeid(std::string))
+                return std::string();
+
+            return e->as<std::string>();
+        }
+
+        //
+        // parse an instance; NULL when it is not a tiled level
+        //
+        static std::unique_ptr<_Instance> _open(const std::string &path)
+        {
+            std::unique_ptr<_Instance> ins(new _Instance());
+            {
+                std::ifstream ifs(path.c_str(),std::ios::binary);
+                if(!ifs)
+                    throw Dicom::StreamError("Could not open "+path);
+                ins->dicom.parse_deferred(ifs,true);
+            }
+
+            Dicom &d=ins->dicom;
+            std::string image_type=_string(d,0x0008,0x0008);
+            int64_t cols=_unsigned(d,0x0048,0x0006);
+            int64_t rows=_unsigned(d,0x0048,0x0007);
+            if(cols<=0 || rows<=0 ||
+               image_type.find("LABEL")!=std::string::npos ||
+               image_type.find("OVERVIEW")!=std::string::npos ||
+               image_type.find("THUMBNAIL")!=std::string::npos)
+                return std::unique_ptr<_Instance>();
+
+            // Dimension Organization Type
+            std::string organization=_string(d,0x0020,0x9311);
+            if(!organization.empty() &&
+               organization.find("TILED_FULL")==std::string::npos)
+                throw std::runtime_error(
+                    organization+" tiles have not been supported");
+
+            Level &l=ins->level;
+            l.path=path;
+            l.cols=(int)cols;
+            l.rows=(int)rows;
+            l.tile_cols=d.cols();
+            l.tile_rows=d.rows();
+            if(l.tile_cols<=0 || l.tile_rows<=0)
+                throw Dicom::ParseError("Bad tile size");
+            l.tiles_x=(l.cols+l.tile_cols-1)/l.tile_cols;
+            l.tiles_y=(l.rows+l.tile_rows-1)/l.tile_rows;
+            l.downsample=1.0;
+            if((int64_t)std::max(1,d.frames())<(int64_t)l.tiles_x*l.tiles_y)
+                throw Dicom::ParseError("Too few frames for tiles");
+
+            if(d.frame_data_offset()>=0){
+                ins->fd=open(path.c_str(),O_RDONLY);
+                if(ins->fd<0)
+                    throw Dicom::StreamError("Could not open "+path);
+            }
+
+            return ins;
+        }
+
+        //
+        // read and decode a frame
+        //
+        static cv::Mat _decode(_Instance &ins,int frame,bool need_rescale)
+        {
+            Dicom &d=ins.dicom;
+
+            // Frame Data has been loaded
+            if(ins.fd<0)
+                return d.decode_frame(frame,need_rescale);
+
+            std::vector<unsigned char> buf;
+            if(d.is_encapsulated()){
+                // fragments of the frame are joined
+                std::vector<std::pair<std::streamoff,size_t> > fragments;
+                d.frame_fragments(frame,fragments);
+                for(size_t i=0;i<fragments.size();i++){
+                    size_t done=buf.size();
+                    buf.resize(done+fragments[i].second);
+                    _read(ins.fd,&buf[0]+done,fragments[i].second,
+                          fragments[i].first);
+                }
+            }
+            else{
+                size_t len=d.frame_bytes();
+                buf.resize(len);
+                _read(ins.fd,&buf[0],len,
+                      d.frame_data_offset()+(off_t)len*frame);
+            }
+            if(buf.empty())
+                throw Dicom::StreamError("Frame Data is too short");
+
+            return d.decode_frame(&buf[0],buf.size(),need_rescale);
+        }
+
+        static void _read(int fd,unsigned char *dst,size_t len,off_t offset)
+        {
+            for(size_t done=0;done<len;){
+                ssize_t r=pread(fd,dst+done,len-done,offset+done);
+                if(r<=0)
+                    throw Dicom::StreamError("Frame Data is too short");
+                done+=r;
+            }
+        }
+
+        //
+        // image type of tiles, from the first tile
+        //
+        int _tile_type(int index,bool need_rescale)
+        {
+            return this->tile(index,0,0,need_rescale).type();
+        }
+    };
+}
+
+#endif // __VVV_DICOM_SLIDE_H__
@@ -0,0 +1,200 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_snapshot.h
+///
+/// @brief  immutable parsed object shared by threads
+///
+
+#ifndef __VVV_DICOM_SNAPSHOT_H__
+
+#define __VVV_DICOM_SNAPSHOT_H__
+
+#include "dicom.h"
+
+#include <vector>
+#include <memory>
+#include <typeinfo>
+
+namespace VVV
+{
+    ///
+    /// frozen copy of a parsed object
+    ///
+    /// Everything is decoded in the constructor: the image (when
+    /// with_image is given) and Items of sequence values. After
+    /// that nothing is modified, so any number of threads may read
+    /// a snapshot, or copies of it, without lock. Copies share the
+    /// same data.
+    ///
+    /// Images share their buffers with callers and must not be
+    /// modified.
+    ///
+    class DicomSnapshot
+    {
+    public:
+        ///
+        /// constructor from a parsed object
+        ///
+        /// @param d parsed object; its image is decoded if needed
+        /// @param with_image decode image or not
+        /// @param need_rescale rescale or not when image parsing
+        ///
+        DicomSnapshot(Dicom &d,bool with_image=true,bool need_rescale=true)
+        {
+            if(with_image)
+                d.image(need_rescale);
+
+            this->_freeze(std::shared_ptr<Dicom>(new Dicom(d)),with_image);
+        }
+
+        ///
+        /// constructor with parse
+        ///
+        /// @param ist input stream
+        /// @param with_image decode image or not
+        /// @param need_rescale rescale or not when image parsing
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError,
+        ///       Dicom::MissingTagError
+        ///
+        DicomSnapshot(std::istream &ist,
+                      bool with_image=true,
+                      bool need_rescale=true)
+        {
+            std::shared_ptr<Dicom> d(new Dicom());
+            d->parse(ist,with_image,need_rescale);
+
+            this->_freeze(d,with_image);
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return image as Dicom::image(); empty without image
+        ///
+        const cv::Mat &image() const { return this->_image; }
+
+        ///
+        /// a reader accessor for multi-frame image
+        ///
+        /// @param index frame index
+        ///
+        /// @return index-th frame of image() without copy
+        ///
+        cv::Mat frame(int index) const
+        {
+            if(this->_image.empty() || index<0 || index>=this->frames())
+                throw std::out_of_range("Bad frame index");
+
+            int rows=this->rows();
+
+            return this->_image.rowRange(index*rows,(index+1)*rows);
+        }
+
+        ///
+        /// query method that specify element exists or not
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        ///
+        /// @return true or false
+        ///
+        bool has_element(const uint16_t group,const uint16_t id) const
+        {
+            return this->_dicom->has_element(group,id);
+        }
+        bool has_element(const Dicom::TypeTag tag) const
+        {
+            return this->_dicom->has_element(tag);
+        }
+
+        ///
+        /// lookup of specify element
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        ///
+        /// @return Element object which has specified tag, or NULL
+        ///
+        const Dicom::Element *find(const uint16_t group,
+                                   const uint16_t id) const
+        {
+            return this->_dicom->find(group,id);
+        }
+        const Dicom::Element *find(const Dicom::TypeTag tag) const
+        {
+            return this->_dicom->find(tag);
+        }
+
+        ///
+        /// reader accessor for specify element
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        ///
+        /// @return Element object which has specified tag
+        ///
+        /// throw Dicom::MissingTagError
+        ///
+        const Dicom::Element &element(const uint16_t group,
+                                      const uint16_t id) const
+        {
+            Dicom::TypeTag tag={{group,id}};
+
+            return this->element(tag);
+        }
+        const Dicom::Element &element(const Dicom::TypeTag tag) const
+        {
+            const Dicom::Element *e=this->_dicom->find(tag);
+            if(!e)
+                throw Dicom::MissingTagError("Could not found tag");
+
+            return *e;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return tags of all elements in tag order
+        ///
+        std::vector<Dicom::TypeTag> tags() const
+        {
+            return this->_dicom->tags();
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return parsed object; must be used only by const methods
+        ///
+        const Dicom &dicom() const { return *this->_dicom; }
+
+        int frames() const { return this->_dicom->frames(); }
+        int rows() const { return this->_dicom->rows(); }
+        int cols() const { return this->_dicom->cols(); }
+        int bit_par_pixel() const { return this->_dicom->bit_par_pixel(); }
+        int channels() const { return this->_dicom->channels(); }
+        int photometric() const { return this->_dicom->photometric(); }
+        bool is_signed() const { return this->_dicom->is_signed(); }
+        float px_spacing_row() const { return this->_dicom->px_spacing_row(); }
+        float px_spacing_col() const { return this->_dicom->px_spacing_col(); }
+        float image_pos_x() const { return this->_dicom->image_pos_x(); }
+        float image_pos_y() const { return this->_dicom->image_pos_y(); }
+        float image_pos_z() const { return this->_dicom->image_pos_z(); }
+
+    private:
+        std::shared_ptr<const Dicom> _dicom;
+        cv::Mat _image;
+
+        void _freeze(std::shared_ptr<Dicom> d,bool with_image)
+        {
+            if(with_image)
+                this->_image=d->image();
+
+            this->_dicom=d;
+        }
+    };
+}
+
+#endif // __VVV_DICOM_SNAPSHOT_H__
@@ -0,0 +1,330 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_strip.h
+///
+/// @brief  decoding images in strips of rows with bounded memory
+///
+
+#ifndef __VVV_DICOM_STRIP_H__
+
+#define __VVV_DICOM_STRIP_H__
+
+#include "dicom.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <streambuf>
+#include <vector>
+#include <memory>
+
+namespace VVV
+{
+    ///
+    /// reader which decodes frames in strips of rows
+    ///
+    /// Native Frame Data is read from the stream a strip at a time
+    /// and unpadded and rescaled into a buffer of the strip size, so
+    /// memory does not depend on the image size. Strips do not cross
+    /// frames. Images whose rows can not be decoded separately
+    /// (planar color, rows not aligned to byte) are read a frame at a
+    /// time, and encapsulated frames are decoded whole.
+    ///
+    /// Non-seekable streams such as pipes are read forward only.
+    ///
+    ///     std::ifstream ifs(path,std::ios::binary);
+    ///     StripReader reader(ifs,256);
+    ///     cv::Mat strip;
+    ///     while(reader.next(strip))
+    ///         encode(strip,reader.frame(),reader.row());
+    ///
+    class StripReader
+    {
+    public:
+        ///
+        /// constructor; the header is parsed
+        ///
+        /// @param ist input stream at the head of a file; it must
+        ///        outlive this object
+        /// @param strip_rows rows of a strip
+        /// @param need_rescale rescale or not
+        ///
+        /// throw std::invalid_argument, Dicom::StreamError,
+        ///       Dicom::ParseError, Dicom::MissingTagError,
+        ///       std::runtime_error
+        ///
+        StripReader(std::istream &ist,int strip_rows=64,bool need_rescale=true)
+            :_ist(&ist),
+             _strip_rows(strip_rows),
+             _need_rescale(need_rescale),
+             _frames(0),
+             _frame(0),
+             _row(0),
+             _last_frame(-1),
+             _last_row(-1)
+        {
+            if(strip_rows<=0)
+                throw std::invalid_argument("Bad strip rows");
+
+            if(ist.tellg()==std::streampos(-1)){
+                this->_buf.reset(new _ForwardBuf(ist.rdbuf()));
+                this->_stream.reset(new std::istream(this->_buf.get()));
+                this->_ist=this->_stream.get();
+            }
+
+            this->_dicom.parse_until_frame_data(*this->_ist);
+            this->_frames=std::max(1,this->_dicom.frames());
+            if(this->_dicom.rows()<=0 || this->_dicom.cols()<=0)
+                throw Dicom::ParseError("Bad image size");
+            if(this->_dicom.is_frame_data_left() &&
+               this->_dicom.bit_par_pixel()==1 && this->_frames>1 &&
+               ((size_t)this->_dicom.rows()*this->_dicom.cols())%8)
+                throw std::runtime_error(
+                    "1bit multi-frame has not been supported");
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return parsed header; image() is not available
+        ///
+        Dicom &dicom() { return this->_dicom; }
+
+        ///
+        /// decode the next strip
+        ///
+        /// @param strip rows of a frame as Dicom::frame(); it refers
+        ///        to the buffer of this object until the next call
+        ///
+        /// @return false after the last strip
+        ///
+        /// throw Dicom::StreamError when Frame Data is too short,
+        ///       Dicom::ParseError, std::runtime_error
+        ///
+        bool next(cv::Mat &strip)
+        {
+            if(this->_frame>=this->_frames)
+                return false;
+
+            Dicom &d=this->_dicom;
+            int n=std::min(this->_strip_rows,d.rows()-this->_row);
+            size_t row_bytes=d.row_bytes();
+
+            if(d.is_frame_data_left() && row_bytes){
+                this->_raw.resize(row_bytes*this->_strip_rows);
+                this->_read(&this->_raw[0],row_bytes*n);
+
+                // the first strip of a frame is the largest, so it
+                // allocates the buffer and later strips reuse it
+                if(this->_out.empty())
+                    d.decode_rows(&this->_raw[0],n,
+                                  this->_need_rescale,this->_out);
+                else{
+                    cv::Mat part=this->_out.rowRange(0,n);
+                    d.decode_rows(&this->_raw[0],n,
+                                  this->_need_rescale,part);
+                }
+                strip=this->_out.rowRange(0,n);
+            }
+            else{
+                if(!this->_row)
+                    this->_load_frame();
+                strip=this->_whole.rowRange(this->_row,this->_row+n);
+            }
+
+            this->_last_frame=this->_frame;
+            this->_last_row=this->_row;
+            this->_row+=n;
+            if(this->_row>=d.rows()){
+                this->_row=0;
+                this->_frame++;
+            }
+
+            return true;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return frame index of the last strip, or -1
+        ///
+        int frame() const { return this->_last_frame; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return first row of the last strip in its frame, or -1
+        ///
+        int row() const { return this->_last_row; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return rows of a strip
+        ///
+        int strip_rows() const { return this->_strip_rows; }
+
+    private:
+        //
+        // read forward buffer over a non-seekable stream; seeks
+        // forward by reading and back within the last bytes read
+        //
+        class _ForwardBuf : public std::streambuf
+        {
+        public:
+            _ForwardBuf(std::streambuf *src)
+                :_src(src),
+                 _buf(_CHUNK),
+                 _base(0)
+            {
+                this->setg(&this->_buf[0],&this->_buf[0],&this->_buf[0]);
+            }
+
+        protected:
+            int_type underflow()
+            {
+                if(this->gptr()<this->egptr())
+                    return traits_type::to_int_type(*this->gptr());
+
+                // keep the tail for seeking back
+                size_t len=this->egptr()-this->eback();
+                size_t keep=std::min(len,(size_t)_KEEP);
+                memmove(&this->_buf[0],this->egptr()-keep,keep);
+                this->_base+=(std::streamoff)(len-keep);
+
+                std::streamsize r=this->_src->sgetn(&this->_buf[keep],
+                                                    this->_buf.size()-keep);
+                if(r<0)
+                    r=0;
+                this->setg(&this->_buf[0],
+                           &this->_buf[keep],
+                           &this->_buf[keep]+r);
+                if(!r)
+                    return traits_type::eof();
+
+                return traits_type::to_int_type(*this->gptr());
+            }
+
+            std::streamsize xsgetn(char *s,std::streamsize n)
+            {
+                std::streamsize done=0;
+                while(done<n){
+                    std::streamsize avail=this->egptr()-this->gptr();
+                    if(avail){
+                        std::streamsize k=std::min(avail,n-done);
+                        memcpy(s+done,this->gptr(),(size_t)k);
+                        this->gbump((int)k);
+                        done+=k;
+                        continue;
+                    }
+
+                    if(n-done<(std::streamsize)_CHUNK){
+                        if(this->underflow()==traits_type::eof())
+                            break;
+                        continue;
+                    }
+
+                    // large reads bypass the buffer
+                    std::streamsize r=this->_src->sgetn(s+done,n-done);
+                    if(r<=0)
+                        break;
+                    this->_base+=(std::streamoff)
+                        (this->egptr()-this->eback())+r;
+                    this->setg(&this->_buf[0],&this->_buf[0],&this->_buf[0]);
+                    done+=r;
+                }
+
+                return done;
+            }
+
+            pos_type seekoff(off_type off,
+                             std::ios_base::seekdir dir,
+                             std::ios_base::openmode which)
+            {
+                if(dir==std::ios_base::cur)
+                    off+=this->_base+(this->gptr()-this->eback());
+                else if(dir!=std::ios_base::beg)
+                    return pos_type(off_type(-1));
+
+                return this->seekpos(pos_type(off),which);
+            }
+
+            pos_type seekpos(pos_type pos,std::ios_base::openmode which)
+            {
+                off_type p=off_type(pos);
+                if(!(which&std::ios_base::in) || p<this->_base)
+                    return pos_type(off_type(-1));
+
+                while(p>this->_base+(this->egptr()-this->eback())){
+                    this->setg(this->eback(),this->egptr(),this->egptr());
+                    if(this->underflow()==traits_type::eof())
+                        return pos_type(off_type(-1));
+                }
+                this->setg(this->eback(),
+                           this->eback()+(p-this->_base),
+                           this->egptr());
+
+                return pos;
+            }
+
+        private:
+            enum {
+                _CHUNK=65536,
+                _KEEP=256
+            };
+
+            std::streambuf *_src;
+            std::vector<char> _buf;
+            std::streamoff _base;   // stream position of eback()
+        };
+
+        std::istream *_ist;
+        std::unique_ptr<_ForwardBuf> _buf;
+        std::unique_ptr<std::istream> _stream;
+        Dicom _dicom;
+        int _strip_rows;
+        bool _need_rescale;
+        int _frames;
+        int _frame;
+        int _row;
+        int _last_frame;
+        int _last_row;
+        std::vector<unsigned char> _raw;
+        cv::Mat _out;
+        cv::Mat _whole;
+
+        StripReader(const StripReader &);
+        StripReader &operator=(const StripReader &);
+
+        void _read(unsigned char *dst,size_t len)
+        {
+            if(!len)
+                return;
+
+            this->_ist->read((char *)dst,(std::streamsize)len);
+            if(this->_ist->eof() || !this->_ist->good())
+                throw Dicom::StreamError("Frame Data is too short");
+        }
+
+        //
+        // decode the current frame whole
+        //
+        void _load_frame()
+        {
+            Dicom &d=this->_dicom;
+            if(!d.is_frame_data_left()){
+                this->_whole=d.decode_frame(this->_frame,this->_need_rescale);
+                return;
+            }
+
+            this->_raw.resize(d.frame_bytes());
+            this->_read(&this->_raw[0],this->_raw.size());
+            this->_whole=d.decode_frame(&this->_raw[0],
+                                        this->_raw.size(),
+                                        this->_need_rescale);
+        }
+    };
+}
+
+#endif // __VVV_DICOM_STRIP_H__
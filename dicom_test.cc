@@ -20,9 +20,7 @@ int main(int argc,char *argv[])
     VVV::Dicom d(ifs);
     ifs.close();
 
-    cv::Mat src=d.image();
-    cv::Mat dst;
-    src.convertTo(dst,CV_8UC1);
+    cv::Mat dst=d.display_image();
 
     cv::namedWindow("img");
     cv::imshow("img",dst);
@@ -0,0 +1,894 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_validate.h
+///
+/// @brief  structural validation of DICOM files without decoding (POSIX)
+///
+
+#ifndef __VVV_DICOM_VALIDATE_H__
+
+#define __VVV_DICOM_VALIDATE_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+namespace VVV
+{
+    ///
+    /// validator of file structure
+    ///
+    /// Only element headers and a few small values are read; other
+    /// values are skipped by their lengths, so a file is checked at
+    /// the speed of reading its headers. The walker checks:
+    ///
+    /// + preamble, File Meta Information group length, Transfer
+    ///   Syntax UID and SOP Class/Instance UIDs against the data set
+    /// + element headers and values within the file and within
+    ///   their Sequences and Items
+    /// + explicit VRs, undefined lengths, Items and delimiters
+    /// + Pixel Data length against Rows, Columns, Samples per
+    ///   Pixel, Bits Allocated and Number of Frames, or fragments of
+    ///   encapsulated Pixel Data
+    ///
+    /// Problems are reported instead of thrown. Walking stops at the
+    /// first problem after which element boundaries are unknown.
+    ///
+    class Validator
+    {
+    public:
+        ///
+        /// kinds of issues
+        ///
+        enum {
+            ISSUE_IO=0,        ///< file could not be read
+            ISSUE_NOT_DICOM,   ///< no "DICM" after preamble
+            ISSUE_META,        ///< inconsistent File Meta Information
+            ISSUE_UNSUPPORTED, ///< data set can not be walked (deflated)
+            ISSUE_TRUNCATED,   ///< header or value beyond end of file
+            ISSUE_LENGTH,      ///< value beyond its Item, bad undefined length
+            ISSUE_VR,          ///< illegal VR
+            ISSUE_NESTING,     ///< misplaced or missing Items and delimiters
+            ISSUE_PIXEL_DATA,  ///< Pixel Data inconsistent with image attributes
+            ISSUE_ORDER,       ///< tags not ascending (warning)
+            ISSUE_ODD_LENGTH   ///< odd value length (warning)
+        };
+
+        ///
+        /// problem found in a file
+        ///
+        struct Issue
+        {
+            int code;           ///< ISSUE_IO, ...
+            bool error;         ///< false for warnings
+            uint64_t offset;    ///< file offset of the element
+            uint16_t group;     ///< tag of the element, or 0
+            uint16_t id;
+            std::string message;
+        };
+
+        ///
+        /// result of a file
+        ///
+        struct Report
+        {
+            std::string path;
+            bool valid;                 ///< no error
+            uint64_t size;              ///< bytes of the file
+            uint64_t elements;          ///< elements walked
+            std::string transfer_syntax;
+            std::vector<Issue> issues;  ///< up to max_issues()
+        };
+
+        ///
+        /// validate a file
+        ///
+        /// @param path file path
+        ///
+        /// @return report
+        ///
+        static Report validate(const std::string &path)
+        {
+            Report r;
+            int fd=::open(path.c_str(),O_RDONLY);
+            if(fd<0){
+                _init(r);
+                _add(r,ISSUE_IO,true,0,0,0,"Could not open file");
+            }
+            else{
+                r=validate(fd);
+                close(fd);
+            }
+            r.path=path;
+
+            return r;
+        }
+
+        ///
+        /// validate a file by a file descriptor
+        ///
+        /// @param fd file descriptor; read with pread(2)
+        ///
+        /// @return report without path
+        ///
+        static Report validate(int fd)
+        {
+            Report r;
+            _init(r);
+            try{
+                _Walker w(fd,r);
+                w.run();
+            }
+            catch(std::exception &e){
+                _add(r,ISSUE_IO,true,0,0,0,e.what());
+            }
+
+            return r;
+        }
+
+        ///
+        /// validate files in parallel
+        ///
+        /// @param pool thread pool
+        /// @param paths file paths
+        ///
+        /// @return reports in order of paths
+        ///
+        static std::vector<Report> validate(ThreadPool &pool,
+                                            const std::vector<std::string>
+                                            &paths)
+        {
+            std::vector<Report> r(paths.size());
+            pool.parallel_for(0,paths.size(),[&](size_t i){
+                    r[i]=validate(paths[i]);
+                });
+
+            return r;
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return issues kept in a report; validity counts all
+        ///
+        static size_t max_issues() { return 64; }
+
+    private:
+        static void _init(Report &r)
+        {
+            r.valid=true;
+            r.size=0;
+            r.elements=0;
+        }
+
+        static void _add(Report &r,
+                         int code,
+                         bool error,
+                         uint64_t offset,
+                         uint16_t group,
+                         uint16_t id,
+                         const std::string &message)
+        {
+            if(error)
+                r.valid=false;
+            if(r.issues.size()>=max_issues())
+                return;
+
+            Issue i;
+            i.code=code;
+            i.error=error;
+            i.offset=offset;
+            i.group=group;
+            i.id=id;
+            i.message=message;
+            r.issues.push_back(i);
+        }
+
+        //
+        // byte source over a file descriptor with read buffer
+        //
+        class _FileSource
+        {
+        public:
+            _FileSource(int fd)
+                :_fd(fd),
+                 _base(0),
+                 _len(0),
+                 _buf(1<<16)
+            {
+                struct stat st;
+                if(fstat(fd,&st)<0)
+                    throw Dicom::StreamError("Bad file descriptor");
+                this->_size=(uint64_t)st.st_size;
+            }
+
+            uint64_t size() const { return this->_size; }
+
+            //
+            // up to n bytes at pos
+            //
+            const unsigned char *peek(uint64_t pos,size_t n,size_t &avail)
+            {
+                if(pos<this->_base || pos+n>this->_base+this->_len){
+                    if(n>this->_buf.size())
+                        this->_buf.resize(n);
+                    this->_base=pos;
+                    this->_len=0;
+                    while(this->_len<this->_buf.size()){
+                        ssize_t r=pread(this->_fd,
+                                        &this->_buf[this->_len],
+                                        this->_buf.size()-this->_len,
+                                        (off_t)(this->_base+this->_len));
+                        if(r<0 && errno==EINTR)
+                            continue;
+                        if(r<0)
+                            throw Dicom::StreamError("Could not read file");
+                        if(r==0)
+                            break;
+                        this->_len+=(size_t)r;
+                    }
+                }
+
+                size_t off=(size_t)(pos-this->_base);
+                avail=(off<this->_len) ? std::min(n,this->_len-off) : 0;
+
+                return &this->_buf[0]+off;
+            }
+
+        private:
+            int _fd;
+            uint64_t _base;
+            size_t _len;
+            uint64_t _size;
+            std::vector<unsigned char> _buf;
+        };
+
+        //
+        // Sequence, Item or the data set being walked
+        //
+        struct _Level
+        {
+            int kind;
+            bool undefined;
+            bool fragments;     // encapsulated Pixel Data
+            uint64_t limit;     // end of the nearest defined length level
+            uint32_t last;      // last tag for order
+            int items;
+            bool swap;          // encoding of headers in this level
+            bool explicit_vr;
+        };
+
+        enum {
+            _DATASET,
+            _SEQUENCE,
+            _ITEM
+        };
+
+        class _Walker
+        {
+        public:
+            _Walker(int fd,Report &r)
+                :_src(fd),
+                 _r(r),
+                 _swap(false),
+                 _explicit(true),
+                 _encapsulated(false),
+                 _rows(-1),
+                 _cols(-1),
+                 _bits(-1),
+                 _samples(1),
+                 _frames(1),
+                 _pixel_offset(0),
+                 _pixel_length(0),
+                 _fragments(-1)
+            {
+                this->_r.size=this->_src.size();
+            }
+
+            void run()
+            {
+                uint64_t off;
+                if(!this->_meta(off) || !this->_dataset(off))
+                    return;
+
+                this->_check_uid(0x0002,this->_sop_class,"SOP Class UID");
+                this->_check_uid(0x0003,this->_sop_instance,
+                                 "SOP Instance UID");
+                this->_check_pixels();
+            }
+
+        private:
+            _FileSource _src;
+            Report &_r;
+            bool _swap;
+            bool _explicit;
+            bool _encapsulated;
+            std::string _meta_uid[2];       // (0002,0002), (0002,0003)
+            std::string _sop_class;         // (0008,0016)
+            std::string _sop_instance;      // (0008,0018)
+            bool _has_meta_uid[2];
+            int _rows;
+            int _cols;
+            int _bits;
+            int _samples;
+            int _frames;
+            std::string _photometric;
+            uint64_t _pixel_offset;
+            uint64_t _pixel_length;
+            int _fragments;                 // -1 for native Pixel Data
+
+            void _error(int code,
+                        uint64_t off,
+                        const Dicom::TypeTag *tag,
+                        const std::string &message)
+            {
+                _add(this->_r,code,true,off,
+                     tag ? tag->id[0] : 0,tag ? tag->id[1] : 0,message);
+            }
+
+            void _warning(int code,
+                          uint64_t off,
+                          const Dicom::TypeTag &tag,
+                          const std::string &message)
+            {
+                _add(this->_r,code,false,off,tag.id[0],tag.id[1],message);
+            }
+
+            //
+            // small value as a string without padding
+            //
+            std::string _string(uint64_t off,uint32_t len)
+            {
+                size_t avail;
+                const unsigned char *p=this->_src.peek(off,
+                                                       std::min(len,256U),
+                                                       avail);
+                std::string s((const char *)p,avail);
+                size_t end=s.size();
+                while(end && (s[end-1]==' ' || s[end-1]=='\0'))
+                    end--;
+                size_t begin=0;
+                while(begin<end && s[begin]==' ')
+                    begin++;
+
+                return s.substr(begin,end-begin);
+            }
+
+            int _us(uint64_t off,uint32_t len)
+            {
+                size_t avail;
+                const unsigned char *p=this->_src.peek(off,2,avail);
+                if(len<2 || avail<2)
+                    return -1;
+
+                uint16_t v;
+                memcpy(&v,p,2);
+
+                return this->_swap ? bswap_16(v) : v;
+            }
+
+            static bool _legal_vr(uint16_t vr)
+            {
+                static const char vrs[]=
+                    "AEASATCSDADSDTFLFDISLOLTOBODOFOLOVOWPNSHSLSQSSST"
+                    "SVTMUCUIULUNURUSUTUV";
+                for(size_t i=0;i+1<sizeof(vrs);i+=2){
+                    if(vr==(uint16_t)((vrs[i]<<8)|vrs[i+1]))
+                        return true;
+                }
+
+                return false;
+            }
+
+            static std::string _vr_string(uint16_t vr)
+            {
+                char b[16];
+                unsigned char c0=(unsigned char)(vr>>8);
+                unsigned char c1=(unsigned char)vr;
+                if(c0>=0x20 && c0<0x7f && c1>=0x20 && c1<0x7f)
+                    snprintf(b,sizeof(b),"%c%c",c0,c1);
+                else
+                    snprintf(b,sizeof(b),"0x%04x",vr);
+
+                return b;
+            }
+
+            //
+            // preamble and File Meta Information; off is set to the
+            // head of the data set
+            //
+            bool _meta(uint64_t &off)
+            {
+                size_t avail;
+                const unsigned char *p=this->_src.peek(0,132,avail);
+                if(avail<132 || memcmp(p+128,"DICM",4)){
+                    this->_error(ISSUE_NOT_DICOM,0,NULL,"not DICOM format");
+                    return false;
+                }
+
+                off=132;
+                uint64_t size=this->_src.size();
+                uint64_t group_end=0;
+                this->_has_meta_uid[0]=this->_has_meta_uid[1]=false;
+                bool has_ts=false;
+                while(off<size){
+                    Dicom::ElementHeader h;
+                    p=this->_src.peek(off,12,avail);
+                    if(!Dicom::parse_header(p,avail,false,true,h)){
+                        this->_error(ISSUE_TRUNCATED,off,NULL,
+                                     "Element header exceeds end of file");
+                        return false;
+                    }
+                    if(h.tag.id[0]!=Dicom::TAG_GROUP_META)
+                        break;
+                    if(!_legal_vr(h.vr.number)){
+                        this->_error(ISSUE_VR,off,&h.tag,
+                                     "Illegal VR "+_vr_string(h.vr.number));
+                        return false;
+                    }
+                    if(h.is_undefined()){
+                        this->_error(ISSUE_META,off,&h.tag,
+                                     "Undefined length in File Meta "
+                                     "Information");
+                        return false;
+                    }
+                    uint64_t value=off+h.header_size;
+                    if(h.length>size-std::min(size,value)){
+                        this->_error(ISSUE_TRUNCATED,off,&h.tag,
+                                     "Value exceeds end of file");
+                        return false;
+                    }
+                    this->_r.elements++;
+
+                    switch(h.tag.id[1]){
+                    case 0x0000:
+                        if(h.length==4){
+                            uint32_t v;
+                            memcpy(&v,this->_src.peek(value,4,avail),4);
+                            group_end=value+4+v;
+                        }
+                        break;
+                    case 0x0002:
+                    case 0x0003:
+                        this->_meta_uid[h.tag.id[1]-2]=
+                            this->_string(value,h.length);
+                        this->_has_meta_uid[h.tag.id[1]-2]=true;
+                        break;
+                    case 0x0010:
+                        this->_r.transfer_syntax=
+                            this->_string(value,h.length);
+                        has_ts=true;
+                        break;
+                    }
+                    off=value+h.length;
+                }
+
+                if(!group_end)
+                    this->_error(ISSUE_META,132,NULL,
+                                 "File Meta Information Group Length is "
+                                 "missing");
+                else if(group_end!=off)
+                    this->_error(ISSUE_META,132,NULL,
+                                 "File Meta Information Group Length "
+                                 "differs from the group");
+                if(!this->_has_meta_uid[0])
+                    this->_error(ISSUE_META,132,NULL,
+                                 "Media Storage SOP Class UID is missing");
+                if(!this->_has_meta_uid[1])
+                    this->_error(ISSUE_META,132,NULL,
+                                 "Media Storage SOP Instance UID is missing");
+                if(!has_ts)
+                    this->_error(ISSUE_META,132,NULL,
+                                 "Transfer Syntax UID is missing");
+
+                return this->_transfer_syntax(off);
+            }
+
+            //
+            // byte order and VR of the data set as Dicom::parse()
+            //
+            bool _transfer_syntax(uint64_t off)
+            {
+                const std::string &s=this->_r.transfer_syntax;
+
+                // architecture is little endian for most hosts
+                uint16_t endian_test=1;
+                bool host_le=(*(char *)&endian_test)!=0;
+
+                bool little=true;
+                if(s.empty() || s=="1.2.840.10008.1.2.1")
+                    ;
+                else if(s=="1.2.840.10008.1.2")
+                    this->_explicit=false;
+                else if(s=="1.2.840.10008.1.2.2")
+                    little=false;
+                else if(s=="1.2.840.10008.1.2.1.99"){
+                    this->_error(ISSUE_UNSUPPORTED,off,NULL,
+                                 "Deflated LEE has not been supported");
+                    return false;
+                }
+                else
+                    this->_encapsulated=true;
+                this->_swap=(little!=host_le);
+
+                return true;
+            }
+
+            //
+            // elements of the data set from off to the end of file
+            //
+            bool _dataset(uint64_t off)
+            {
+                const uint64_t size=this->_src.size();
+                std::vector<_Level> stack;
+                _push(stack,_DATASET,false,size,
+                      this->_swap,this->_explicit);
+
+                while(true){
+                    _Level &top=stack.back();
+                    if(!top.undefined && off>=top.limit){
+                        if(stack.size()==1)
+                            break;
+                        if(!this->_pop(stack,off))
+                            return false;
+                        continue;
+                    }
+                    if(off>=size){
+                        this->_error(ISSUE_NESTING,off,NULL,
+                                     top.kind==_ITEM ?
+                                     "Item Delimitation Item is missing" :
+                                     "Sequence Delimitation Item is missing");
+                        return false;
+                    }
+
+                    Dicom::ElementHeader h;
+                    size_t avail;
+                    const unsigned char *p=this->_src.peek(off,12,avail);
+                    bool ok=Dicom::parse_header(p,avail,top.swap,
+                                                top.explicit_vr,h);
+                    if(!ok || h.header_size>top.limit-off){
+                        this->_error(ok && top.limit<size ?
+                                     ISSUE_LENGTH : ISSUE_TRUNCATED,
+                                     off,ok ? &h.tag : NULL,
+                                     ok && top.limit<size ?
+                                     "Element header exceeds its Item" :
+                                     "Element header exceeds end of file");
+                        return false;
+                    }
+
+                    if(top.kind==_SEQUENCE){
+                        if(!this->_sequence_item(stack,h,off))
+                            return false;
+                        continue;
+                    }
+                    if(h.tag.id[0]==0xFFFE){
+                        if(h.tag.id[1]!=0xE00D ||
+                           top.kind!=_ITEM ||
+                           !top.undefined){
+                            this->_error(ISSUE_NESTING,off,&h.tag,
+                                         "Misplaced Item or delimiter");
+                            return false;
+                        }
+                        stack.pop_back();
+                        off+=h.header_size;
+                        continue;
+                    }
+
+                    if(!this->_element(stack,h,off))
+                        return false;
+                }
+
+                return true;
+            }
+
+            //
+            // enter a level encoded as its parent, or by swap and
+            // explicit_vr for the data set
+            //
+            static void _push(std::vector<_Level> &stack,
+                              int kind,
+                              bool undefined,
+                              uint64_t end,
+                              bool swap=false,
+                              bool explicit_vr=true)
+            {
+                _Level l;
+                l.kind=kind;
+                l.undefined=undefined;
+                l.fragments=false;
+                l.limit=stack.empty() ? end : stack.back().limit;
+                if(!undefined)
+                    l.limit=std::min(l.limit,end);
+                l.last=0;
+                l.items=0;
+                l.swap=stack.empty() ? swap : stack.back().swap;
+                l.explicit_vr=stack.empty() ?
+                    explicit_vr : stack.back().explicit_vr;
+                stack.push_back(l);
+            }
+
+            //
+            // leave a defined length level at off
+            //
+            bool _pop(std::vector<_Level> &stack,uint64_t off)
+            {
+                if(stack.back().fragments)
+                    this->_fragments=stack.back().items;
+                stack.pop_back();
+
+                // an enclosing undefined level ends by a delimiter;
+                // a defined one must end here or later
+                if(off>stack.back().limit){
+                    this->_error(ISSUE_LENGTH,off,NULL,
+                                 "Value exceeds its Item");
+                    return false;
+                }
+
+                return true;
+            }
+
+            //
+            // Item or Sequence Delimitation Item in a Sequence
+            //
+            bool _sequence_item(std::vector<_Level> &stack,
+                                const Dicom::ElementHeader &h,
+                                uint64_t &off)
+            {
+                _Level &top=stack.back();
+                uint64_t value=off+h.header_size;
+
+                if(h.tag.id[0]==0xFFFE && h.tag.id[1]==0xE0DD){
+                    if(!top.undefined){
+                        this->_error(ISSUE_NESTING,off,&h.tag,
+                                     "Sequence Delimitation Item in "
+                                     "defined length Sequence");
+                        return false;
+                    }
+                    if(h.length)
+                        this->_error(ISSUE_NESTING,off,&h.tag,
+                                     "Bad length of delimiter");
+                    if(top.fragments)
+                        this->_fragments=top.items;
+                    stack.pop_back();
+                    off=value;
+
+                    return true;
+                }
+                if(h.tag.id[0]!=0xFFFE || h.tag.id[1]!=0xE000){
+                    this->_error(ISSUE_NESTING,off,&h.tag,
+                                 "Item expected in Sequence");
+                    return false;
+                }
+
+                top.items++;
+                if(h.is_undefined()){
+                    if(top.fragments){
+                        this->_error(ISSUE_LENGTH,off,&h.tag,
+                                     "Fragment of undefined length");
+                        return false;
+                    }
+                    _push(stack,_ITEM,true,0);
+                    off=value;
+
+                    return true;
+                }
+
+                if(h.length>top.limit-value){
+                    this->_error(top.limit<this->_src.size() ?
+                                 ISSUE_LENGTH : ISSUE_TRUNCATED,
+                                 off,&h.tag,
+                                 top.limit<this->_src.size() ?
+                                 "Item exceeds its Sequence" :
+                                 "Item exceeds end of file");
+                    return false;
+                }
+                if(top.fragments)
+                    off=value+h.length;
+                else{
+                    _push(stack,_ITEM,false,value+h.length);
+                    off=value;
+                }
+
+                return true;
+            }
+
+            //
+            // an element in an Item or the data set
+            //
+            bool _element(std::vector<_Level> &stack,
+                          const Dicom::ElementHeader &h,
+                          uint64_t &off)
+            {
+                _Level &top=stack.back();
+                uint64_t value=off+h.header_size;
+                bool toplevel=stack.size()==1;
+                bool pixel=toplevel &&
+                    h.tag.number==Dicom::TAG_FRAME_DATA.number;
+                this->_r.elements++;
+
+                uint32_t tag=((uint32_t)h.tag.id[0]<<16)|h.tag.id[1];
+                if(tag<=top.last && top.last)
+                    this->_warning(ISSUE_ORDER,off,h.tag,
+                                   "Tags are not in ascending order");
+                top.last=tag;
+
+                if(top.explicit_vr && !_legal_vr(h.vr.number)){
+                    this->_error(ISSUE_VR,off,&h.tag,
+                                 "Illegal VR "+_vr_string(h.vr.number));
+                    return false;
+                }
+
+                if(h.is_undefined()){
+                    bool sq=!top.explicit_vr ||
+                        h.vr.number==0x5351 ||   // SQ
+                        h.vr.number==0x554e;     // UN
+                    if(pixel){
+                        if(!this->_encapsulated)
+                            this->_error(ISSUE_PIXEL_DATA,off,&h.tag,
+                                         "Encapsulated Pixel Data in "
+                                         "native Transfer Syntax");
+                        this->_pixel_offset=off;
+                        this->_fragments=0;
+                        _push(stack,_SEQUENCE,true,0);
+                        stack.back().fragments=true;
+                    }
+                    else if(sq){
+                        // Items of UN are in Implicit VR Little Endian
+                        bool swap=top.swap,explicit_vr=top.explicit_vr;
+                        Dicom::nested_syntax(h,swap,explicit_vr);
+                        _push(stack,_SEQUENCE,true,0);
+                        stack.back().swap=swap;
+                        stack.back().explicit_vr=explicit_vr;
+                    }
+                    else{
+                        this->_error(ISSUE_LENGTH,off,&h.tag,
+                                     "Undefined length of VR "+
+                                     _vr_string(h.vr.number));
+                        return false;
+                    }
+                    off=value;
+
+                    return true;
+                }
+
+                if(h.length>top.limit-value){
+                    bool eof=top.limit>=this->_src.size();
+                    this->_error(eof ? ISSUE_TRUNCATED : ISSUE_LENGTH,
+                                 off,&h.tag,
+                                 eof ? "Value exceeds end of file" :
+                                 "Value exceeds its Item");
+                    return false;
+                }
+                if(h.length%2)
+                    this->_warning(ISSUE_ODD_LENGTH,off,h.tag,
+                                   "Odd value length");
+
+                if(top.explicit_vr && h.vr.number==0x5351){
+                    _push(stack,_SEQUENCE,false,value+h.length);
+                    off=value;
+
+                    return true;
+                }
+
+                if(toplevel)
+                    this->_attribute(h,value,off);
+                off=value+h.length;
+
+                return true;
+            }
+
+            //
+            // attributes of the data set used for checks
+            //
+            void _attribute(const Dicom::ElementHeader &h,
+                            uint64_t value,
+                            uint64_t off)
+            {
+                const Dicom::TypeTag &t=h.tag;
+                if(t.number==Dicom::TAG_ROWS.number)
+                    this->_rows=this->_us(value,h.length);
+                else if(t.number==Dicom::TAG_COLS.number)
+                    this->_cols=this->_us(value,h.length);
+                else if(t.number==Dicom::TAG_BIT_ALLOC.number)
+                    this->_bits=this->_us(value,h.length);
+                else if(t.number==Dicom::TAG_SAMPLES_PER_PX.number)
+                    this->_samples=this->_us(value,h.length);
+                else if(t.number==Dicom::TAG_PHOTO_INTERPRET.number)
+                    this->_photometric=this->_string(value,h.length);
+                else if(t.number==Dicom::TAG_NUM_FRAMES.number)
+                    this->_frames=atoi(this->_string(value,h.length).c_str());
+                else if(t.id[0]==0x0008 && t.id[1]==0x0016)
+                    this->_sop_class=this->_string(value,h.length);
+                else if(t.id[0]==0x0008 && t.id[1]==0x0018)
+                    this->_sop_instance=this->_string(value,h.length);
+                else if(t.number==Dicom::TAG_FRAME_DATA.number){
+                    if(this->_encapsulated)
+                        this->_error(ISSUE_PIXEL_DATA,off,&t,
+                                     "Native Pixel Data in encapsulated "
+                                     "Transfer Syntax");
+                    this->_pixel_offset=off;
+                    this->_pixel_length=h.length;
+                    this->_fragments=-1;
+                }
+            }
+
+            void _check_uid(uint16_t id,
+                            const std::string &dataset,
+                            const char *name)
+            {
+                if(this->_has_meta_uid[id-2] && !dataset.empty() &&
+                   this->_meta_uid[id-2]!=dataset)
+                    this->_error(ISSUE_META,132,NULL,
+                                 std::string("Media Storage ")+name+
+                                 " differs from "+name);
+            }
+
+            //
+            // Pixel Data against image attributes
+            //
+            void _check_pixels()
+            {
+                if(!this->_pixel_offset)
+                    return;
+
+                const Dicom::TypeTag &t=Dicom::TAG_FRAME_DATA;
+                uint64_t off=this->_pixel_offset;
+                if(this->_rows<=0 || this->_cols<=0 || this->_bits<=0 ||
+                   this->_samples<=0 || this->_frames<=0){
+                    this->_error(ISSUE_PIXEL_DATA,off,&t,
+                                 "Image Pixel attributes are missing or bad");
+                    return;
+                }
+
+                char b[128];
+                if(this->_fragments>=0){
+                    // Basic Offset Table and a fragment per frame at least
+                    if(this->_fragments<2)
+                        this->_error(ISSUE_PIXEL_DATA,off,&t,
+                                     "Encapsulated Pixel Data has no "
+                                     "fragment");
+                    else if(this->_fragments-1<this->_frames &&
+                            this->_frames>1){
+                        snprintf(b,sizeof(b),
+                                 "%d fragments for %d frames",
+                                 this->_fragments-1,this->_frames);
+                        this->_error(ISSUE_PIXEL_DATA,off,&t,b);
+                    }
+                    return;
+                }
+
+                uint64_t n=(uint64_t)this->_rows*this->_cols*this->_frames;
+                if(this->_photometric=="YBR_FULL_422")
+                    n*=2; // Y Y Cb Cr for each 2 pixels
+                else
+                    n*=this->_samples;
+                uint64_t expected=(n*this->_bits+7)/8;
+
+                // padded to even length
+                if(this->_pixel_length!=expected &&
+                   this->_pixel_length!=expected+(expected%2)){
+                    snprintf(b,sizeof(b),
+                             "Pixel Data has %llu bytes for %llu",
+                             (unsigned long long)this->_pixel_length,
+                             (unsigned long long)expected);
+                    this->_error(ISSUE_PIXEL_DATA,off,&t,b);
+                }
+            }
+        };
+    };
+}
+
+#endif // __VVV_DICOM_VALIDATE_H__
@@ -0,0 +1,611 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_volume.h
+///
+/// @brief  series volume saved as MetaImage and reloaded by mmap (POSIX)
+///
+
+#ifndef __VVV_DICOM_VOLUME_H__
+
+#define __VVV_DICOM_VOLUME_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+#include "dicom_cache.h"
+#include "dicom_series.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+
+#include <cmath>
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace VVV
+{
+    ///
+    /// volume of a series in MetaImage (.mhd + .raw) files
+    ///
+    /// save() writes slices in order along the slice normal into a
+    /// contiguous raw file and its header, with spacing, origin,
+    /// direction and a digest of source file identities (device,
+    /// inode, size and modification time). Opening a volume maps the
+    /// raw file into a slices x rows x cols cv::Mat without parsing
+    /// any DICOM file; the header is checked against the sources
+    /// first, so a modified series is detected.
+    ///
+    class Volume
+    {
+    public:
+        ///
+        /// pixel values saved
+        ///
+        enum{
+            PIXELS_STORED,    ///< image(false)
+            PIXELS_RESCALED,  ///< image(true)
+            PIXELS_WINDOWED   ///< display_image() as 8bit
+        };
+
+        ///
+        /// geometry and pixel format of a volume
+        ///
+        struct Info
+        {
+            int cols;
+            int rows;
+            int slices;
+            int type;             ///< cv::Mat type of voxels
+            int pixels;           ///< PIXELS_STORED, ...
+            float center;         ///< window center of PIXELS_WINDOWED
+            float width;          ///< window width of PIXELS_WINDOWED
+            double spacing[3];    ///< x (column), y (row), slice
+            double origin[3];     ///< Image Position of first slice
+            double direction[9];  ///< row direction, column direction, normal
+        };
+
+        ///
+        /// constructor; maps a saved volume
+        ///
+        /// @param header path of .mhd file
+        /// @param sources source files of the volume; not checked when empty
+        ///
+        /// throw Dicom::StreamError, Dicom::ParseError,
+        ///       std::runtime_error when sources were changed
+        ///
+        Volume(const std::string &header,
+               const std::vector<std::string> &sources=
+               std::vector<std::string>())
+            :_map(MAP_FAILED),
+             _map_len(0)
+        {
+            std::string raw,digest;
+            _read_header(header,this->_info,raw,digest);
+            if(!sources.empty() && digest!=source_digest(sources))
+                throw std::runtime_error("Volume is older than sources");
+
+            size_t len=(size_t)this->_info.cols*this->_info.rows*
+                this->_info.slices*CV_ELEM_SIZE(this->_info.type);
+
+            int fd=::open(raw.c_str(),O_RDONLY);
+            if(fd<0)
+                throw Dicom::StreamError("Could not open raw volume");
+            struct stat st;
+            if(fstat(fd,&st)<0 || (uint64_t)st.st_size!=len){
+                close(fd);
+                throw Dicom::ParseError("Bad size of raw volume");
+            }
+            if(len){
+                this->_map=mmap(NULL,len,PROT_READ,MAP_SHARED,fd,0);
+                if(this->_map==MAP_FAILED){
+                    close(fd);
+                    throw Dicom::StreamError("Could not map raw volume");
+                }
+                this->_map_len=len;
+            }
+            close(fd);
+
+            int sizes[]={
+                this->_info.slices,
+                this->_info.rows,
+                this->_info.cols
+            };
+            if(len)
+                this->_mat=cv::Mat(3,sizes,this->_info.type,this->_map);
+        }
+
+        ///
+        /// destructor
+        ///
+        ~Volume()
+        {
+            if(this->_map!=MAP_FAILED)
+                munmap(this->_map,this->_map_len);
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return voxels as slices x rows x cols cv::Mat; read only,
+        ///         valid while this object lives
+        ///
+        const cv::Mat &mat() const { return this->_mat; }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @param index slice index
+        ///
+        /// @return rows x cols view of a slice without copy
+        ///
+        cv::Mat slice(int index) const
+        {
+            if(index<0 || index>=this->_info.slices)
+                throw std::out_of_range("Bad slice index");
+
+            return cv::Mat(this->_info.rows,
+                           this->_info.cols,
+                           this->_info.type,
+                           (unsigned char *)this->_map+
+                           (size_t)index*this->_info.rows*this->_info.cols*
+                           CV_ELEM_SIZE(this->_info.type));
+        }
+
+        ///
+        /// a reader accessor
+        ///
+        /// @return geometry and pixel format
+        ///
+        const Info &info() const { return this->_info; }
+
+        ///
+        /// save a series
+        ///
+        /// @param header path of .mhd file; raw file is .raw beside it
+        /// @param series parsed objects of a series in any order
+        /// @param sources source files of series for later checks
+        /// @param pixels PIXELS_STORED, PIXELS_RESCALED or PIXELS_WINDOWED
+        /// @param center window center of PIXELS_WINDOWED
+        /// @param width window width of PIXELS_WINDOWED; window of each
+        ///        file when 0
+        ///
+        /// Images already decoded in series are used as they are.
+        /// Files are written under temporary names and renamed, raw
+        /// file first, so readers never see a partial volume.
+        ///
+        /// throw std::invalid_argument when slices differ in size or
+        ///       type, Dicom::StreamError
+        ///
+        static void save(const std::string &header,
+                         std::vector<Dicom> &series,
+                         const std::vector<std::string> &sources,
+                         int pixels=PIXELS_STORED,
+                         float center=0.0f,
+                         float width=0.0f)
+        {
+            if(series.empty())
+                throw std::invalid_argument("Empty series");
+
+            std::vector<size_t> order=SeriesLoader::order(series);
+
+            Info info;
+            info.pixels=pixels;
+            info.center=center;
+            info.width=width;
+            geometry(series,order,info);
+
+            std::string raw=_raw_path(header);
+            std::string raw_tmp=raw+".tmp";
+            std::ofstream ofs(raw_tmp.c_str(),std::ios::binary);
+            if(!ofs)
+                throw Dicom::StreamError("Could not create raw volume");
+
+            info.slices=0;
+            for(size_t i=0;i<order.size();i++){
+                Dicom &d=series[order[i]];
+                int frames=std::max(1,d.frames());
+                for(int f=0;f<frames;f++){
+                    cv::Mat m=slice_pixels(d,f,pixels,center,width);
+                    if(i==0 && f==0){
+                        info.cols=m.cols;
+                        info.rows=m.rows;
+                        info.type=m.type();
+                    }
+                    else if(m.cols!=info.cols ||
+                            m.rows!=info.rows ||
+                            m.type()!=info.type){
+                        ofs.close();
+                        unlink(raw_tmp.c_str());
+                        throw std::invalid_argument(
+                            "Slices differ in size or type");
+                    }
+                    if(!m.isContinuous())
+                        m=m.clone();
+                    ofs.write((const char *)m.data,m.total()*m.elemSize());
+                    info.slices++;
+                }
+            }
+            ofs.close();
+            if(!ofs){
+                unlink(raw_tmp.c_str());
+                throw Dicom::StreamError("Could not write raw volume");
+            }
+
+            std::string header_tmp=header+".tmp";
+            _write_header(header_tmp,info,raw,source_digest(sources));
+
+            if(rename(raw_tmp.c_str(),raw.c_str())<0 ||
+               rename(header_tmp.c_str(),header.c_str())<0)
+                throw Dicom::StreamError("Could not rename volume");
+        }
+
+        ///
+        /// map a saved volume, or load the series and save it
+        ///
+        /// @param pool thread pool to load series
+        /// @param header path of .mhd file
+        /// @param sources source files of series
+        /// @param pixels PIXELS_STORED, PIXELS_RESCALED or PIXELS_WINDOWED
+        /// @param center window center of PIXELS_WINDOWED
+        /// @param width window width of PIXELS_WINDOWED
+        ///
+        /// @return mapped volume
+        ///
+        /// The volume is rebuilt when missing, older than sources, or
+        /// saved with other pixel values.
+        ///
+        static std::shared_ptr<Volume> open(ThreadPool &pool,
+                                            const std::string &header,
+                                            const std::vector<std::string>
+                                            &sources,
+                                            int pixels=PIXELS_STORED,
+                                            float center=0.0f,
+                                            float width=0.0f)
+        {
+            if(is_current(header,sources,pixels,center,width))
+                return std::shared_ptr<Volume>(new Volume(header));
+
+            std::vector<Dicom> series;
+            SeriesLoader::load(pool,sources,series,false);
+            save(header,series,sources,pixels,center,width);
+
+            return std::shared_ptr<Volume>(new Volume(header));
+        }
+
+        ///
+        /// query method that a saved volume matches sources or not
+        ///
+        /// @param header path of .mhd file
+        /// @param sources source files of series
+        /// @param pixels PIXELS_STORED, PIXELS_RESCALED or PIXELS_WINDOWED
+        /// @param center window center of PIXELS_WINDOWED
+        /// @param width window width of PIXELS_WINDOWED
+        ///
+        /// @return true or false
+        ///
+        static bool is_current(const std::string &header,
+                               const std::vector<std::string> &sources,
+                               int pixels=PIXELS_STORED,
+                               float center=0.0f,
+                               float width=0.0f)
+        {
+            Info info;
+            std::string raw,digest;
+            try{
+                _read_header(header,info,raw,digest);
+                if(digest!=source_digest(sources))
+                    return false;
+            }
+            catch(std::exception &e){
+                return false;
+            }
+
+            return info.pixels==pixels &&
+                (pixels!=PIXELS_WINDOWED ||
+                 (info.center==center && info.width==width));
+        }
+
+        ///
+        /// digest of source file identities
+        ///
+        /// @param sources source files
+        ///
+        /// @return hex string; changes when any file is replaced or
+        ///         modified
+        ///
+        static std::string source_digest(const std::vector<std::string> &sources)
+        {
+            uint64_t h=14695981039346656037ULL; // FNV-1a
+            for(size_t i=0;i<sources.size();i++){
+                std::string k;
+                try{
+                    k=ImageCache::file_key(sources[i]);
+                }
+                catch(Dicom::StreamError &e){
+                    k="missing";
+                }
+                k+='\n';
+                for(size_t c=0;c<k.size();c++){
+                    h^=(unsigned char)k[c];
+                    h*=1099511628211ULL;
+                }
+            }
+
+            char buf[17];
+            snprintf(buf,sizeof(buf),"%016llx",(unsigned long long)h);
+
+            return buf;
+        }
+
+        ///
+        /// voxels of a slice
+        ///
+        /// @param d parsed object
+        /// @param frame frame index
+        /// @param pixels PIXELS_STORED, PIXELS_RESCALED or PIXELS_WINDOWED
+        /// @param center window center of PIXELS_WINDOWED
+        /// @param width window width of PIXELS_WINDOWED
+        ///
+        /// @return frame as saved in a volume
+        ///
+        static cv::Mat slice_pixels(Dicom &d,int frame,int pixels,
+                                    float center,float width)
+        {
+            if(pixels==PIXELS_WINDOWED){
+                if(frame)
+                    throw std::invalid_argument(
+                        "Windowed multi-frame volume has not been supported");
+                return width>0.0f ?
+                    d.display_image(center,width) : d.display_image();
+            }
+
+            return d.frame(frame,pixels==PIXELS_RESCALED);
+        }
+
+        ///
+        /// spacing, origin and direction from the ordered slices
+        ///
+        /// @param series parsed objects of a series
+        /// @param order indices of series as SeriesLoader::order()
+        /// @param info spacing, origin and direction are set
+        ///
+        static void geometry(std::vector<Dicom> &series,
+                             const std::vector<size_t> &order,
+                             Info &info)
+        {
+            Dicom &first=series[order[0]];
+
+            double o[6]={1.0,0.0,0.0,0.0,1.0,0.0};
+            if(first.has_element(0x0020,0x0037) &&
+               first.element(0x0020,0x0037).as_doubles(o,6)!=6){
+                o[0]=1.0; o[1]=0.0; o[2]=0.0;
+                o[3]=0.0; o[4]=1.0; o[5]=0.0;
+            }
+            double n[3]={
+                o[1]*o[5]-o[2]*o[4],
+                o[2]*o[3]-o[0]*o[5],
+                o[0]*o[4]-o[1]*o[3]
+            };
+            for(int i=0;i<3;i++){
+                info.direction[i]=o[i];
+                info.direction[3+i]=o[3+i];
+                info.direction[6+i]=n[i];
+            }
+
+            info.spacing[0]=first.px_spacing_col()>0 ?
+                first.px_spacing_col() : 1.0;
+            info.spacing[1]=first.px_spacing_row()>0 ?
+                first.px_spacing_row() : 1.0;
+
+            info.origin[0]=std::isnan(first.image_pos_x()) ?
+                0.0 : first.image_pos_x();
+            info.origin[1]=std::isnan(first.image_pos_y()) ?
+                0.0 : first.image_pos_y();
+            info.origin[2]=std::isnan(first.image_pos_z()) ?
+                0.0 : first.image_pos_z();
+
+            info.spacing[2]=0.0;
+            if(order.size()>1){
+                Dicom &last=series[order[order.size()-1]];
+                double d=
+                    (last.image_pos_x()-first.image_pos_x())*n[0]+
+                    (last.image_pos_y()-first.image_pos_y())*n[1]+
+                    (last.image_pos_z()-first.image_pos_z())*n[2];
+                if(!std::isnan(d) && d>0.0)
+                    info.spacing[2]=d/(order.size()-1);
+            }
+            if(info.spacing[2]<=0.0){
+                // Spacing Between Slices, then Slice Thickness
+                double v;
+                if(first.has_element(0x0018,0x0088) &&
+                   first.element(0x0018,0x0088).as_doubles(&v,1)==1 &&
+                   v>0.0)
+                    info.spacing[2]=v;
+                else if(first.has_element(0x0018,0x0050) &&
+                        first.element(0x0018,0x0050).as_doubles(&v,1)==1 &&
+                        v>0.0)
+                    info.spacing[2]=v;
+                else
+                    info.spacing[2]=1.0;
+            }
+        }
+
+    private:
+        Info _info;
+        void *_map;
+        size_t _map_len;
+        cv::Mat _mat;
+
+        Volume(const Volume &);
+        Volume &operator=(const Volume &);
+
+        static std::string _raw_path(const std::string &header)
+        {
+            size_t dot=header.find_last_of('.');
+            size_t slash=header.find_last_of('/');
+            if(dot==std::string::npos ||
+               (slash!=std::string::npos && dot<slash))
+                return header+".raw";
+
+            return header.substr(0,dot)+".raw";
+        }
+
+        static const char *_element_type(int depth)
+        {
+            switch(depth){
+            case CV_8U:
+                return "MET_UCHAR";
+            case CV_8S:
+                return "MET_CHAR";
+            case CV_16U:
+                return "MET_USHORT";
+            case CV_16S:
+                return "MET_SHORT";
+            case CV_32S:
+                return "MET_INT";
+            case CV_32F:
+                return "MET_FLOAT";
+            default:
+                return "MET_DOUBLE";
+            }
+        }
+
+        static int _depth(const std::string &type)
+        {
+            const int depth[]={
+                CV_8U,CV_8S,CV_16U,CV_16S,CV_32S,CV_32F,CV_64F
+            };
+            for(size_t i=0;i<sizeof(depth)/sizeof(depth[0]);i++){
+                if(type==_element_type(depth[i]))
+                    return depth[i];
+            }
+
+            throw Dicom::ParseError("Unsupported ElementType");
+        }
+
+        static void _write_header(const std::string &path,
+                                  const Info &info,
+                                  const std::string &raw,
+                                  const std::string &digest)
+        {
+            uint16_t endian_test=1;
+            bool msb=(*(char *)&endian_test)==0;
+
+            size_t slash=raw.find_last_of('/');
+            std::string raw_name=(slash==std::string::npos) ?
+                raw : raw.substr(slash+1);
+
+            std::ofstream ofs(path.c_str());
+            ofs.precision(17);
+            ofs<<"ObjectType = Image\n"
+               <<"NDims = 3\n"
+               <<"BinaryData = True\n"
+               <<"BinaryDataByteOrderMSB = "<<(msb ? "True" : "False")<<"\n"
+               <<"CompressedData = False\n"
+               <<"TransformMatrix =";
+            for(int i=0;i<9;i++)
+                ofs<<' '<<info.direction[i];
+            ofs<<"\nOffset = "<<info.origin[0]<<' '<<info.origin[1]<<' '
+               <<info.origin[2]<<"\n"
+               <<"ElementSpacing = "<<info.spacing[0]<<' '<<info.spacing[1]
+               <<' '<<info.spacing[2]<<"\n"
+               <<"DimSize = "<<info.cols<<' '<<info.rows<<' '<<info.slices
+               <<"\n";
+            if(CV_MAT_CN(info.type)>1)
+                ofs<<"ElementNumberOfChannels = "<<CV_MAT_CN(info.type)<<"\n";
+            ofs<<"ElementType = "<<_element_type(CV_MAT_DEPTH(info.type))<<"\n"
+               <<"VVVPixels = "<<info.pixels<<' '<<info.center<<' '
+               <<info.width<<"\n"
+               <<"VVVSourceDigest = "<<digest<<"\n"
+               <<"ElementDataFile = "<<raw_name<<"\n";
+
+            ofs.close();
+            if(!ofs)
+                throw Dicom::StreamError("Could not write volume header");
+        }
+
+        static void _read_header(const std::string &path,
+                                 Info &info,
+                                 std::string &raw,
+                                 std::string &digest)
+        {
+            std::ifstream ifs(path.c_str());
+            if(!ifs)
+                throw Dicom::StreamError("Could not open volume header");
+
+            uint16_t endian_test=1;
+            bool host_msb=(*(char *)&endian_test)==0;
+
+            std::string element_type;
+            int channels=1;
+            bool dims=false,msb=false;
+            info.pixels=-1;
+            info.center=0.0f;
+            info.width=0.0f;
+            raw.clear();
+            digest.clear();
+
+            std::string line;
+            while(std::getline(ifs,line)){
+                size_t eq=line.find(" = ");
+                if(eq==std::string::npos)
+                    continue;
+                std::string key=line.substr(0,eq);
+                std::istringstream v(line.substr(eq+3));
+
+                if(key=="NDims"){
+                    int n=0;
+                    v>>n;
+                    if(n!=3)
+                        throw Dicom::ParseError("Volume is not 3D");
+                }
+                else if(key=="BinaryDataByteOrderMSB")
+                    msb=(line.substr(eq+3,4)=="True");
+                else if(key=="CompressedData" &&
+                        line.substr(eq+3,4)=="True")
+                    throw Dicom::ParseError("Compressed volume");
+                else if(key=="TransformMatrix")
+                    for(int i=0;i<9;i++)
+                        v>>info.direction[i];
+                else if(key=="Offset")
+                    v>>info.origin[0]>>info.origin[1]>>info.origin[2];
+                else if(key=="ElementSpacing")
+                    v>>info.spacing[0]>>info.spacing[1]>>info.spacing[2];
+                else if(key=="DimSize")
+                    dims=(bool)(v>>info.cols>>info.rows>>info.slices);
+                else if(key=="ElementNumberOfChannels")
+                    v>>channels;
+                else if(key=="ElementType")
+                    v>>element_type;
+                else if(key=="VVVPixels")
+                    v>>info.pixels>>info.center>>info.width;
+                else if(key=="VVVSourceDigest")
+                    v>>digest;
+                else if(key=="ElementDataFile")
+                    raw=line.substr(eq+3);
+            }
+
+            if(!dims || raw.empty() || info.cols<0 || info.rows<0 ||
+               info.slices<0 || channels<1 || channels>CV_CN_MAX)
+                throw Dicom::ParseError("Broken volume header");
+            if(msb!=host_msb)
+                throw Dicom::ParseError("Byte order of volume differs");
+            info.type=CV_MAKETYPE(_depth(element_type),channels);
+
+            size_t slash=path.find_last_of('/');
+            if(raw[0]!='/' && slash!=std::string::npos)
+                raw=path.substr(0,slash+1)+raw;
+        }
+    };
+}
+
+#endif // __VVV_DICOM_VOLUME_H__
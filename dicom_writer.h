@@ -0,0 +1,665 @@
+// -*- c++ -*-
+//
+///
+/// @file   dicom_writer.h
+///
+/// @brief  write cv::Mat as DICOM Part 10 file
+///
+
+#ifndef __VVV_DICOM_WRITER_H__
+
+#define __VVV_DICOM_WRITER_H__
+
+#include "dicom.h"
+#include "dicom_pool.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <map>
+#include <vector>
+#include <string>
+#include <random>
+#include <mutex>
+
+namespace VVV
+{
+    ///
+    /// writing DICOM file class
+    ///
+    /// An image is written in Explicit VR Little Endian with a tag
+    /// set. Image Pixel attributes are derived from cv::Mat; the other
+    /// attributes are taken from the tag set, and missing UIDs are
+    /// generated. Pixel Data is passed to writev(2) straight from the
+    /// cv::Mat buffer on little endian hosts, except for color images
+    /// which are reordered from BGR to RGB.
+    ///
+    class DicomWriter
+    {
+    public:
+        ///
+        /// default constructor
+        ///
+        DicomWriter()
+        {
+            // nop
+        }
+
+        ///
+        /// set a string value
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        /// @param vr VR string (e.g. "LO")
+        /// @param value value without padding; multiple values are
+        ///              separated by backslash
+        ///
+        /// @return self
+        ///
+        DicomWriter &set(const uint16_t group,
+                         const uint16_t id,
+                         const char *vr,
+                         const std::string &value)
+        {
+            return this->set(group,id,vr,value.data(),value.size());
+        }
+
+        ///
+        /// set a binary value
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        /// @param vr VR string (e.g. "OB")
+        /// @param data value in little endian
+        /// @param len bytes of the value
+        ///
+        /// @return self
+        ///
+        DicomWriter &set(const uint16_t group,
+                         const uint16_t id,
+                         const char *vr,
+                         const void *data,
+                         size_t len)
+        {
+            if(!vr || strlen(vr)!=2)
+                throw std::invalid_argument("Bad VR");
+
+            _Value &v=this->_tags[_key(group,id)];
+            v.vr=(uint16_t)((vr[0]<<8)|vr[1]);
+            v.bytes.assign((const unsigned char *)data,
+                           (const unsigned char *)data+len);
+
+            // even length with padding
+            if(v.bytes.size()&1)
+                v.bytes.push_back((v.vr==_VR_UI || v.vr==_VR_OB) ?
+                                  '\0' : ' ');
+            if(!Dicom::is_long_vr(v.vr) && v.bytes.size()>0xFFFF)
+                throw std::invalid_argument("Value too long for VR");
+
+            return *this;
+        }
+
+        ///
+        /// set an unsigned short value
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        /// @param value value
+        ///
+        /// @return self
+        ///
+        DicomWriter &set_us(const uint16_t group,
+                            const uint16_t id,
+                            uint16_t value)
+        {
+            unsigned char b[2]={(unsigned char)(value&0xFF),
+                                (unsigned char)(value>>8)};
+
+            return this->set(group,id,"US",b,2);
+        }
+
+        ///
+        /// set decimal strings
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        /// @param values values
+        /// @param n number of values
+        ///
+        /// @return self
+        ///
+        /// e.g. Pixel Spacing (0028,0030), Image Position (0020,0032)
+        ///
+        DicomWriter &set_ds(const uint16_t group,
+                            const uint16_t id,
+                            const double *values,
+                            size_t n)
+        {
+            std::string s;
+            for(size_t i=0;i<n;i++){
+                char buf[32];
+                // DS is up to 16 characters
+                snprintf(buf,sizeof(buf),"%.10g",values[i]);
+                if(strlen(buf)>16)
+                    snprintf(buf,sizeof(buf),"%.8g",values[i]);
+                if(i)
+                    s+='\\';
+                s+=buf;
+            }
+
+            return this->set(group,id,"DS",s);
+        }
+
+        ///
+        /// remove a value
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        ///
+        /// @return self
+        ///
+        DicomWriter &remove(const uint16_t group,const uint16_t id)
+        {
+            this->_tags.erase(_key(group,id));
+
+            return *this;
+        }
+
+        ///
+        /// query method that specify value exists or not
+        ///
+        /// @param group DICOM element tag group ID
+        /// @param id   DICOM element tag ID
+        ///
+        /// @return true or false
+        ///
+        bool has(const uint16_t group,const uint16_t id) const
+        {
+            return this->_tags.count(_key(group,id))>0;
+        }
+
+        ///
+        /// write an image to a file
+        ///
+        /// @param path file path
+        /// @param image 1ch or BGR 3ch image; 3D Mat (frames x rows x
+        ///              cols) is written as multi-frame
+        /// @param frames number of frames stacked vertically in 2D image
+        ///               (as Dicom::image())
+        ///
+        /// @return bytes written
+        ///
+        /// throw Dicom::StreamError, std::invalid_argument
+        ///
+        uint64_t write(const std::string &path,
+                       const cv::Mat &image,
+                       int frames=1) const
+        {
+            int fd=open(path.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+            if(fd<0)
+                throw Dicom::StreamError("Could not open file");
+
+            uint64_t r;
+            try{
+                r=this->write(fd,image,frames);
+            }
+            catch(...){
+                close(fd);
+                unlink(path.c_str());
+                throw;
+            }
+            if(close(fd)<0)
+                throw Dicom::StreamError("Could not write file");
+
+            return r;
+        }
+
+        ///
+        /// write an image to a file descriptor
+        ///
+        /// @param fd file descriptor
+        /// @param image 1ch or BGR 3ch image, or 3D Mat
+        /// @param frames number of frames stacked vertically in 2D image
+        ///
+        /// @return bytes written
+        ///
+        /// throw Dicom::StreamError, std::invalid_argument
+        ///
+        uint64_t write(int fd,const cv::Mat &image,int frames=1) const
+        {
+            int rows,cols;
+            if(image.dims==3){
+                frames=image.size[0];
+                rows=image.size[1];
+                cols=image.size[2];
+            }
+            else if(image.dims==2){
+                if(frames<1 || image.rows%frames)
+                    throw std::invalid_argument("Bad number of frames");
+                rows=image.rows/frames;
+                cols=image.cols;
+            }
+            else
+                throw std::invalid_argument("Unsupported Mat dimensions");
+
+            if(image.empty())
+                throw std::invalid_argument("Empty image");
+            if(rows>0xFFFF || cols>0xFFFF)
+                throw std::invalid_argument("Image is too large");
+            if(image.channels()!=1 && image.channels()!=3)
+                throw std::invalid_argument("Unsupported channels");
+
+            //
+            // tag set with derived attributes
+            //
+            DicomWriter w(*this);
+            w._image_pixel(image,rows,cols,frames);
+            w._identification();
+
+            int depth=image.depth();
+            uint16_t px_group=0x7FE0,px_id=0x0010;
+            const char *px_vr=(depth==CV_8U || depth==CV_8S) ? "OB" : "OW";
+            if(depth==CV_32F){
+                px_id=0x0008;
+                px_vr="OF";
+            }
+            else if(depth==CV_64F){
+                px_id=0x0009;
+                px_vr="OD";
+            }
+
+            //
+            // preamble, File Meta Information and data set
+            //
+            std::vector<unsigned char> head(128,0);
+            head.insert(head.end(),"DICM","DICM"+4);
+            w._put_meta(head);
+            w._put_dataset(head);
+
+            uint64_t px_len=(uint64_t)image.total()*image.elemSize();
+            bool pad=(px_len&1)!=0;
+            if(px_len+(pad ? 1 : 0)>0xFFFFFFFE)
+                throw std::invalid_argument("Pixel Data is too large");
+            _put_header(head,px_group,px_id,
+                        (uint16_t)((px_vr[0]<<8)|px_vr[1]),
+                        (uint32_t)(px_len+(pad ? 1 : 0)));
+
+            //
+            // pixels straight from the buffer when the layout matches
+            //
+            cv::Mat px=image;
+            uint16_t endian_test=1;
+            bool host_le=(*(char *)&endian_test)!=0;
+            if(image.channels()==3)
+                px=_to_rgb(image);
+            else if(!host_le && image.elemSize()>1)
+                px=_to_little_endian(image);
+            else if(image.dims==3 && !image.isContinuous())
+                px=image.clone();
+
+            std::vector<struct iovec> iov;
+            _push(iov,&head[0],head.size());
+            if(px.isContinuous())
+                _push(iov,px.data,(size_t)px_len);
+            else{
+                size_t row_bytes=(size_t)px.cols*px.elemSize();
+                for(int y=0;y<px.rows;y++)
+                    _push(iov,px.ptr(y),row_bytes);
+            }
+            static const unsigned char zero=0;
+            if(pad)
+                _push(iov,&zero,1);
+
+            return _writev_all(fd,iov);
+        }
+
+        ///
+        /// write images of a series in parallel
+        ///
+        /// @param pool thread pool
+        /// @param base tag set common to the series
+        /// @param images images in order of Instance Number
+        /// @param paths file paths for each image
+        ///
+        /// Study and Series Instance UIDs are shared by the series;
+        /// SOP Instance UID and Instance Number are set for each
+        /// image. The first exception is rethrown after all images.
+        ///
+        static void write_series(ThreadPool &pool,
+                                 const DicomWriter &base,
+                                 const std::vector<cv::Mat> &images,
+                                 const std::vector<std::string> &paths)
+        {
+            if(images.size()!=paths.size())
+                throw std::invalid_argument("Number of paths mismatch");
+
+            DicomWriter common(base);
+            common._identification();
+
+            pool.parallel_for(0,images.size(),[&](size_t i){
+                    DicomWriter w(common);
+                    w.set(0x0008,0x0018,"UI",new_uid());
+                    w.set(0x0020,0x0013,"IS",
+                          boost::lexical_cast<std::string>(i+1));
+                    w.write(paths[i],images[i]);
+                });
+        }
+
+        ///
+        /// generate a new UID
+        ///
+        /// @return UID under 2.25 from a random UUID
+        ///
+        static std::string new_uid()
+        {
+            static std::mutex mutex;
+            static std::random_device rd;
+
+            unsigned char b[16];
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for(int i=0;i<16;i+=4){
+                    uint32_t r=rd();
+                    memcpy(b+i,&r,4);
+                }
+            }
+            // UUID version 4, variant 1
+            b[6]=(unsigned char)((b[6]&0x0F)|0x40);
+            b[8]=(unsigned char)((b[8]&0x3F)|0x80);
+
+            return Dicom::uid_from_bytes(b);
+        }
+
+    private:
+        struct _Value
+        {
+            uint16_t vr;
+            std::vector<unsigned char> bytes;
+        };
+
+        // (group<<16)|id to keep the order of tags
+        std::map<uint32_t,_Value> _tags;
+
+        static const uint16_t _VR_OB=0x4f42;
+        static const uint16_t _VR_UI=0x5549;
+
+        static inline uint32_t _key(uint16_t group,uint16_t id)
+        {
+            return ((uint32_t)group<<16)|id;
+        }
+
+        const _Value *_find(uint16_t group,uint16_t id) const
+        {
+            std::map<uint32_t,_Value>::const_iterator itr=
+                this->_tags.find(_key(group,id));
+
+            return (itr==this->_tags.end()) ? NULL : &itr->second;
+        }
+
+        //
+        // Image Pixel Module from cv::Mat
+        //
+        void _image_pixel(const cv::Mat &image,int rows,int cols,int frames)
+        {
+            int bits;
+            bool is_signed=false,is_float=false;
+            switch(image.depth()){
+            case CV_8U:
+                bits=8;
+                break;
+            case CV_8S:
+                bits=8;
+                is_signed=true;
+                break;
+            case CV_16U:
+                bits=16;
+                break;
+            case CV_16S:
+                bits=16;
+                is_signed=true;
+                break;
+            case CV_32S:
+                bits=32;
+                is_signed=true;
+                break;
+            case CV_32F:
+                bits=32;
+                is_float=true;
+                break;
+            case CV_64F:
+                bits=64;
+                is_float=true;
+                break;
+            default:
+                throw std::invalid_argument("Unsupported Mat depth");
+            }
+            if(is_float && image.channels()!=1)
+                throw std::invalid_argument(
+                    "Float Pixel Data must be 1ch");
+
+            this->set_us(0x0028,0x0002,(uint16_t)image.channels());
+            if(image.channels()==3){
+                this->set(0x0028,0x0004,"CS","RGB");
+                this->set_us(0x0028,0x0006,0);
+            }
+            else{
+                const _Value *p=this->_find(0x0028,0x0004);
+                std::string photo=p ?
+                    std::string(p->bytes.begin(),p->bytes.end()) : "";
+                if(photo.compare(0,11,"MONOCHROME1"))
+                    this->set(0x0028,0x0004,"CS","MONOCHROME2");
+                this->remove(0x0028,0x0006);
+            }
+
+            if(image.dims==3 || frames>1)
+                this->set(0x0028,0x0008,"IS",
+                          boost::lexical_cast<std::string>(frames));
+            else
+                this->remove(0x0028,0x0008);
+
+            this->set_us(0x0028,0x0010,(uint16_t)rows);
+            this->set_us(0x0028,0x0011,(uint16_t)cols);
+            this->set_us(0x0028,0x0100,(uint16_t)bits);
+            if(is_float){
+                // not used with Float Pixel Data
+                this->remove(0x0028,0x0101);
+                this->remove(0x0028,0x0102);
+                this->remove(0x0028,0x0103);
+            }
+            else{
+                this->set_us(0x0028,0x0101,(uint16_t)bits);
+                this->set_us(0x0028,0x0102,(uint16_t)(bits-1));
+                this->set_us(0x0028,0x0103,is_signed ? 1 : 0);
+            }
+        }
+
+        //
+        // SOP Common, General Study/Series with defaults
+        //
+        void _identification()
+        {
+            if(!this->has(0x0008,0x0016))   // Secondary Capture
+                this->set(0x0008,0x0016,"UI","1.2.840.10008.5.1.4.1.1.7");
+            if(!this->has(0x0008,0x0018))
+                this->set(0x0008,0x0018,"UI",new_uid());
+            if(!this->has(0x0008,0x0060))
+                this->set(0x0008,0x0060,"CS","OT");
+            if(!this->has(0x0020,0x000D))
+                this->set(0x0020,0x000D,"UI",new_uid());
+            if(!this->has(0x0020,0x000E))
+                this->set(0x0020,0x000E,"UI",new_uid());
+        }
+
+        static void _put_header(std::vector<unsigned char> &dst,
+                                uint16_t group,
+                                uint16_t id,
+                                uint16_t vr,
+                                uint32_t length)
+        {
+            unsigned char b[12]={
+                (unsigned char)(group&0xFF),(unsigned char)(group>>8),
+                (unsigned char)(id&0xFF),(unsigned char)(id>>8),
+                (unsigned char)(vr>>8),(unsigned char)(vr&0xFF)
+            };
+            if(Dicom::is_long_vr(vr)){
+                b[6]=b[7]=0;
+                for(int i=0;i<4;i++)
+                    b[8+i]=(unsigned char)(length>>(i*8));
+                dst.insert(dst.end(),b,b+12);
+            }
+            else{
+                b[6]=(unsigned char)(length&0xFF);
+                b[7]=(unsigned char)(length>>8);
+                dst.insert(dst.end(),b,b+8);
+            }
+        }
+
+        static void _put_element(std::vector<unsigned char> &dst,
+                                 uint32_t key,
+                                 const _Value &v)
+        {
+            _put_header(dst,(uint16_t)(key>>16),(uint16_t)(key&0xFFFF),
+                        v.vr,(uint32_t)v.bytes.size());
+            dst.insert(dst.end(),v.bytes.begin(),v.bytes.end());
+        }
+
+        //
+        // File Meta Information with group length
+        //
+        void _put_meta(std::vector<unsigned char> &dst) const
+        {
+            DicomWriter meta;
+            static const unsigned char version[2]={0,1};
+            meta.set(0x0002,0x0001,"OB",version,2);
+            meta._tags[_key(0x0002,0x0002)]=*this->_find(0x0008,0x0016);
+            meta._tags[_key(0x0002,0x0003)]=*this->_find(0x0008,0x0018);
+            meta.set(0x0002,0x0010,"UI","1.2.840.10008.1.2.1");
+            meta.set(0x0002,0x0012,"UI",
+                     "2.25.229282876446307440516093826133441523787");
+            meta.set(0x0002,0x0013,"SH","VVV_DICOM");
+
+            // optional elements given by the tag set
+            std::map<uint32_t,_Value>::const_iterator itr=
+                this->_tags.lower_bound(_key(0x0002,0x0014));
+            for(;itr!=this->_tags.end() && (itr->first>>16)==0x0002;itr++)
+                meta._tags[itr->first]=itr->second;
+
+            std::vector<unsigned char> body;
+            for(itr=meta._tags.begin();itr!=meta._tags.end();itr++)
+                _put_element(body,itr->first,itr->second);
+
+            uint32_t len=(uint32_t)body.size();
+            unsigned char b[4]={(unsigned char)(len&0xFF),
+                                (unsigned char)((len>>8)&0xFF),
+                                (unsigned char)((len>>16)&0xFF),
+                                (unsigned char)(len>>24)};
+            _put_header(dst,0x0002,0x0000,0x554c,4); // UL
+            dst.insert(dst.end(),b,b+4);
+            dst.insert(dst.end(),body.begin(),body.end());
+        }
+
+        //
+        // data set except File Meta Information and Pixel Data
+        //
+        void _put_dataset(std::vector<unsigned char> &dst) const
+        {
+            std::map<uint32_t,_Value>::const_iterator itr=
+                this->_tags.begin();
+            for(;itr!=this->_tags.end();itr++){
+                uint16_t group=(uint16_t)(itr->first>>16);
+                if(group==Dicom::TAG_GROUP_META || group>=0x7FE0)
+                    continue;
+                // group lengths are not written
+                if((itr->first&0xFFFF)==0x0000)
+                    continue;
+                _put_element(dst,itr->first,itr->second);
+            }
+        }
+
+        static cv::Mat _to_rgb(const cv::Mat &image)
+        {
+            cv::Mat src=image.isContinuous() ? image : image.clone();
+            cv::Mat dst(src.dims,src.size.p,src.type());
+            size_t n=src.total();
+            size_t es=src.elemSize1();
+            const unsigned char *s=src.data;
+            unsigned char *d=dst.data;
+            for(size_t i=0;i<n;i++,s+=es*3,d+=es*3){
+                memcpy(d,s+es*2,es);
+                memcpy(d+es,s+es,es);
+                memcpy(d+es*2,s,es);
+            }
+
+            uint16_t endian_test=1;
+            if(!(*(char *)&endian_test) && es>1)
+                return _to_little_endian(dst);
+
+            return dst;
+        }
+
+        static cv::Mat _to_little_endian(const cv::Mat &image)
+        {
+            cv::Mat dst=image.clone();
+            size_t n=dst.total()*dst.channels();
+            size_t es=dst.elemSize1();
+            unsigned char *p=dst.data;
+            for(size_t i=0;i<n;i++,p+=es)
+                std::reverse(p,p+es);
+
+            return dst;
+        }
+
+        static void _push(std::vector<struct iovec> &iov,
+                          const void *p,
+                          size_t n)
+        {
+            struct iovec v;
+            v.iov_base=const_cast<void *>(p);
+            v.iov_len=n;
+            iov.push_back(v);
+        }
+
+        //
+        // writev(2) in batches of IOV_MAX with partial writes
+        //
+        static uint64_t _writev_all(int fd,std::vector<struct iovec> &iov)
+        {
+#ifdef IOV_MAX
+            const size_t iov_max=IOV_MAX;
+#else
+            const size_t iov_max=1024;
+#endif
+            uint64_t total=0;
+            size_t i=0;
+            while(i<iov.size()){
+                size_t n=std::min(iov.size()-i,iov_max);
+                ssize_t r=writev(fd,&iov[i],(int)n);
+                if(r<0 && errno==EINTR)
+                    continue;
+                if(r<=0)
+                    throw Dicom::StreamError("Could not write file");
+                total+=(uint64_t)r;
+
+                // skip written vectors
+                size_t done=(size_t)r;
+                while(i<iov.size() && done>=iov[i].iov_len){
+                    done-=iov[i].iov_len;
+                    i++;
+                }
+                if(done){
+                    iov[i].iov_base=(char *)iov[i].iov_base+done;
+                    iov[i].iov_len-=done;
+                }
+            }
+
+            return total;
+        }
+    };
+}
+
+#endif // __VVV_DICOM_WRITER_H__